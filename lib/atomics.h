@@ -3,68 +3,177 @@
 
 #include <stdint.h>
 
+#include <atomic>
+
 namespace tachyon {
 
-// TODO(danielp): Switch to std::atomic for possibly better performance and
-// increased portability.
+// Every operation here takes an optional memory order, using the same
+// constants as std::atomic. They default to sequential consistency, which is
+// always correct, but callers should pass the weakest ordering that is still
+// correct for what they are doing, since full barriers are quite expensive on
+// weakly-ordered architectures like ARM.
+//
+// These are all defined inline, because the memory order has to be a
+// compile-time constant in order for the compiler to actually emit the weaker
+// instructions. Otherwise, it will just fall back on SEQ_CST.
+//
+// We use the GCC builtins instead of std::atomic itself so that the same
+// functions work on plain integers that live in shared memory.
 
 // Performs an atomic compare-and-swap operation on a 32-bit int.
 // Args:
 //  value: The value to check.
 //  old_val: The expected value.
 //  new_val: The value we want to change the value to.
+//  order: The memory order to use if the operation succeeds. If it fails, the
+//  strongest ordering that is valid for a load is used instead.
 // Returns:
 //  True if the operation succeeded and the value was modified, false if it did
 //  not have the expected value and the operation failed.
-bool CompareExchange(volatile uint32_t *value, uint32_t old_val,
-                     uint32_t new_val);
+inline bool CompareExchange(
+    volatile uint32_t *value, uint32_t old_val, uint32_t new_val,
+    ::std::memory_order order = ::std::memory_order_seq_cst);
 
 // Exchanges the source and destination, and then loads the sum of the two into
 // the destination. It does this atomically.
 // Args:
 //  dest: The destination value.
 //  source: The source value.
+//  order: The memory order to use.
 // Returns:
 //  The original value of dest before anything was added to it.
-uint32_t ExchangeAdd(volatile uint32_t *dest, volatile int32_t source);
+inline uint32_t ExchangeAdd(
+    volatile uint32_t *dest, int32_t source,
+    ::std::memory_order order = ::std::memory_order_seq_cst);
 
 // Same thing as the function above, but it operates on a word instead of a
 // long.
-uint16_t ExchangeAddWord(volatile uint16_t *dest, volatile int16_t source);
+inline uint16_t ExchangeAddWord(
+    volatile uint16_t *dest, int16_t source,
+    ::std::memory_order order = ::std::memory_order_seq_cst);
 
 // Exchanges the two arguments without doing any comparison.
 // Args:
 //  dest: The destination value.
 //  source: The value to change it to.
+//  order: The memory order to use.
 // Returns: The old value of the destination.
-uint32_t Exchange(volatile uint32_t *dest, volatile uint32_t source);
+inline uint32_t Exchange(
+    volatile uint32_t *dest, uint32_t source,
+    ::std::memory_order order = ::std::memory_order_seq_cst);
 
 // Performs an atomic bitwise AND operation on two 32-bit integers.
 // Args:
 //  dest: The first value to AND. This will be overwritten with the result of
 //  the operation.
 //  mask: The second value to AND.
-void BitwiseAnd(volatile uint32_t *dest, uint32_t mask);
+//  order: The memory order to use.
+inline void BitwiseAnd(volatile uint32_t *dest, uint32_t mask,
+                       ::std::memory_order order = ::std::memory_order_seq_cst);
 
 // Perform an atomic decrement operation.
 // Args:
 //  value: The number to decrement.
-void Decrement(volatile uint32_t *value);
+//  order: The memory order to use.
+inline void Decrement(volatile uint32_t *value,
+                      ::std::memory_order order = ::std::memory_order_seq_cst);
 
 // Perform an atomic increment operation.
 // Args:
 //  value: The value to increment.
-void Increment(volatile uint32_t *value);
+//  order: The memory order to use.
+inline void Increment(volatile uint32_t *value,
+                      ::std::memory_order order = ::std::memory_order_seq_cst);
 
 // Same thing as the function above, but it operates on a word instead of a
 // long.
-void IncrementWord(volatile uint16_t *value);
+inline void IncrementWord(
+    volatile uint16_t *value,
+    ::std::memory_order order = ::std::memory_order_seq_cst);
+
+// Atomically reads a value. This should be used instead of reading volatile
+// variables directly wherever the ordering matters.
+// Args:
+//  value: The value to read.
+//  order: The memory order to use. Only relaxed, acquire and seq_cst make
+//  sense here.
+// Returns:
+//  The value that was read.
+inline uint32_t AtomicLoad(
+    const volatile uint32_t *value,
+    ::std::memory_order order = ::std::memory_order_seq_cst);
+
+// Atomically writes a value.
+// Args:
+//  dest: The value to write to.
+//  source: The new value.
+//  order: The memory order to use. Only relaxed, release and seq_cst make
+//  sense here.
+inline void AtomicStore(
+    volatile uint32_t *dest, uint32_t source,
+    ::std::memory_order order = ::std::memory_order_seq_cst);
+
+// 64-bit ("quad word") versions of the above operations. These are mostly
+// useful for counters that can't be allowed to wrap.
+inline bool CompareExchangeQuad(
+    volatile uint64_t *value, uint64_t old_val, uint64_t new_val,
+    ::std::memory_order order = ::std::memory_order_seq_cst);
+inline uint64_t ExchangeAddQuad(
+    volatile uint64_t *dest, int64_t source,
+    ::std::memory_order order = ::std::memory_order_seq_cst);
+inline uint64_t ExchangeQuad(
+    volatile uint64_t *dest, uint64_t source,
+    ::std::memory_order order = ::std::memory_order_seq_cst);
+inline uint64_t AtomicLoadQuad(
+    const volatile uint64_t *value,
+    ::std::memory_order order = ::std::memory_order_seq_cst);
+inline void AtomicStoreQuad(
+    volatile uint64_t *dest, uint64_t source,
+    ::std::memory_order order = ::std::memory_order_seq_cst);
+// These return the old value, and are mostly useful for bitmasks.
+inline uint64_t BitwiseOrQuad(
+    volatile uint64_t *dest, uint64_t mask,
+    ::std::memory_order order = ::std::memory_order_seq_cst);
+inline uint64_t BitwiseAndQuad(
+    volatile uint64_t *dest, uint64_t mask,
+    ::std::memory_order order = ::std::memory_order_seq_cst);
+
+// A 128-bit value that can be operated on atomically. The usual use for this
+// is to pair a pointer or offset with a tag that gets incremented on every
+// modification, which avoids the ABA problem in lock-free structures.
+struct DoubleQuad {
+  uint64_t low;
+  uint64_t high;
+} __attribute__((aligned(16)));
+
+// Performs an atomic compare-and-swap operation on a 128-bit value. This uses
+// cmpxchg16b on x86_64, and casp (or an exclusive load/store pair on older
+// cores) on AArch64. Unlike the other versions, if the operation fails, it
+// also gives us the actual value, since there's no other way to read a 128-bit
+// value atomically.
+// Args:
+//  value: The value to check. It must be 16-byte aligned.
+//  old_val: The expected value. If the operation fails, it will be set to the
+//  value that was actually there.
+//  new_val: The value we want to change the value to.
+// Returns:
+//  True if the operation succeeded and the value was modified, false if it did
+//  not have the expected value and the operation failed.
+// NOTE: The hardware makes this a full barrier on x86, and we always use
+// acquire-release semantics on ARM, so it doesn't take a memory order.
+inline bool CompareExchangeDoubleQuad(volatile DoubleQuad *value,
+                                      DoubleQuad *old_val,
+                                      const DoubleQuad &new_val);
 
 // Forces all loads/stores that are before this call to complete before the
 // call, and all the ones that are after the call to complete after the call.
 // Used to stop the CPU from spontaneouly reordering memory operations in a way
 // that breaks lock-free code.
-void Fence();
+// Args:
+//  order: The memory order to use. The default is a full barrier.
+inline void Fence(::std::memory_order order = ::std::memory_order_seq_cst);
+
+#include "atomics_impl.h"
 
 }  // namespace tachyon
 
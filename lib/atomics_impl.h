@@ -0,0 +1,182 @@
+// NOTE: This file is not meant to be #included directly. Use atomics.h
+// instead.
+
+namespace atomics {
+
+// Gets the memory order to use for the failure case of a compare-and-swap. A
+// failed CAS is only a load, so it can't have release semantics, and it can't
+// be stronger than the success order.
+// Args:
+//  order: The memory order for the success case.
+// Returns:
+//  The corresponding order for the failure case.
+constexpr int FailureOrder(::std::memory_order order) {
+  return order == ::std::memory_order_release
+             ? __ATOMIC_RELAXED
+             : (order == ::std::memory_order_acq_rel
+                    ? __ATOMIC_ACQUIRE
+                    : static_cast<int>(order));
+}
+
+}  // namespace atomics
+
+inline bool CompareExchange(volatile uint32_t *value, uint32_t old_val,
+                            uint32_t new_val, ::std::memory_order order) {
+  return __atomic_compare_exchange_n(value, &old_val, new_val, false,
+                                     static_cast<int>(order),
+                                     atomics::FailureOrder(order));
+}
+
+inline uint32_t ExchangeAdd(volatile uint32_t *dest, int32_t source,
+                            ::std::memory_order order) {
+  return __atomic_fetch_add(dest, source, static_cast<int>(order));
+}
+
+inline uint16_t ExchangeAddWord(volatile uint16_t *dest, int16_t source,
+                                ::std::memory_order order) {
+  return __atomic_fetch_add(dest, source, static_cast<int>(order));
+}
+
+inline uint32_t Exchange(volatile uint32_t *dest, uint32_t source,
+                         ::std::memory_order order) {
+  return __atomic_exchange_n(dest, source, static_cast<int>(order));
+}
+
+inline void BitwiseAnd(volatile uint32_t *dest, uint32_t mask,
+                       ::std::memory_order order) {
+  __atomic_fetch_and(dest, mask, static_cast<int>(order));
+}
+
+inline void Decrement(volatile uint32_t *value, ::std::memory_order order) {
+  __atomic_fetch_sub(value, 1, static_cast<int>(order));
+}
+
+inline void Increment(volatile uint32_t *value, ::std::memory_order order) {
+  __atomic_fetch_add(value, 1, static_cast<int>(order));
+}
+
+inline void IncrementWord(volatile uint16_t *value,
+                          ::std::memory_order order) {
+  __atomic_fetch_add(value, 1, static_cast<int>(order));
+}
+
+inline uint32_t AtomicLoad(const volatile uint32_t *value,
+                           ::std::memory_order order) {
+  return __atomic_load_n(value, static_cast<int>(order));
+}
+
+inline void AtomicStore(volatile uint32_t *dest, uint32_t source,
+                        ::std::memory_order order) {
+  __atomic_store_n(dest, source, static_cast<int>(order));
+}
+
+inline bool CompareExchangeQuad(volatile uint64_t *value, uint64_t old_val,
+                                uint64_t new_val, ::std::memory_order order) {
+  return __atomic_compare_exchange_n(value, &old_val, new_val, false,
+                                     static_cast<int>(order),
+                                     atomics::FailureOrder(order));
+}
+
+inline uint64_t ExchangeAddQuad(volatile uint64_t *dest, int64_t source,
+                                ::std::memory_order order) {
+  return __atomic_fetch_add(dest, source, static_cast<int>(order));
+}
+
+inline uint64_t ExchangeQuad(volatile uint64_t *dest, uint64_t source,
+                             ::std::memory_order order) {
+  return __atomic_exchange_n(dest, source, static_cast<int>(order));
+}
+
+inline uint64_t AtomicLoadQuad(const volatile uint64_t *value,
+                               ::std::memory_order order) {
+  return __atomic_load_n(value, static_cast<int>(order));
+}
+
+inline void AtomicStoreQuad(volatile uint64_t *dest, uint64_t source,
+                            ::std::memory_order order) {
+  __atomic_store_n(dest, source, static_cast<int>(order));
+}
+
+inline uint64_t BitwiseOrQuad(volatile uint64_t *dest, uint64_t mask,
+                              ::std::memory_order order) {
+  return __atomic_fetch_or(dest, mask, static_cast<int>(order));
+}
+
+inline uint64_t BitwiseAndQuad(volatile uint64_t *dest, uint64_t mask,
+                               ::std::memory_order order) {
+  return __atomic_fetch_and(dest, mask, static_cast<int>(order));
+}
+
+// GCC won't inline the 128-bit __atomic builtins, (it calls into libatomic
+// instead, which might use a lock,) so we do this one by hand.
+inline bool CompareExchangeDoubleQuad(volatile DoubleQuad *value,
+                                      DoubleQuad *old_val,
+                                      const DoubleQuad &new_val) {
+  DoubleQuad *target = const_cast<DoubleQuad *>(value);
+
+#if defined(__x86_64__)
+  bool succeeded;
+  __asm__ __volatile__("lock cmpxchg16b %1"
+                       : "=@ccz"(succeeded), "+m"(*target),
+                         "+a"(old_val->low), "+d"(old_val->high)
+                       : "b"(new_val.low), "c"(new_val.high)
+                       : "memory");
+  return succeeded;
+
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_ATOMICS)
+  // ARMv8.1 has a proper instruction for this. It needs its operands in
+  // consecutive even/odd register pairs.
+  register uint64_t old_low __asm__("x0") = old_val->low;
+  register uint64_t old_high __asm__("x1") = old_val->high;
+  register uint64_t new_low __asm__("x2") = new_val.low;
+  register uint64_t new_high __asm__("x3") = new_val.high;
+  const uint64_t expected_low = old_low;
+  const uint64_t expected_high = old_high;
+  __asm__ __volatile__("caspal %0, %1, %3, %4, %2"
+                       : "+r"(old_low), "+r"(old_high), "+Q"(*target)
+                       : "r"(new_low), "r"(new_high)
+                       : "memory");
+  // CASP always loads the value that was there.
+  old_val->low = old_low;
+  old_val->high = old_high;
+  return old_low == expected_low && old_high == expected_high;
+
+#elif defined(__aarch64__)
+  // On ARMv8.0, we have to use an exclusive load/store pair.
+  uint64_t actual_low, actual_high;
+  uint32_t store_failed;
+  do {
+    __asm__ __volatile__("ldaxp %0, %1, %2"
+                         : "=&r"(actual_low), "=&r"(actual_high)
+                         : "Q"(*target)
+                         : "memory");
+    if (actual_low != old_val->low || actual_high != old_val->high) {
+      // The value isn't what we expect. We still have to clear the exclusive
+      // monitor, which we can do by storing back what we read.
+      __asm__ __volatile__("stlxp %w0, %2, %3, %1"
+                           : "=&r"(store_failed), "+Q"(*target)
+                           : "r"(actual_low), "r"(actual_high)
+                           : "memory");
+      if (!store_failed) {
+        old_val->low = actual_low;
+        old_val->high = actual_high;
+        return false;
+      }
+      continue;
+    }
+
+    __asm__ __volatile__("stlxp %w0, %2, %3, %1"
+                         : "=&r"(store_failed), "+Q"(*target)
+                         : "r"(new_val.low), "r"(new_val.high)
+                         : "memory");
+  } while (store_failed);
+  return true;
+
+#else
+#error "128-bit compare-and-swap is not implemented for this architecture."
+#endif
+}
+
+inline void Fence(::std::memory_order order) {
+  __atomic_thread_fence(static_cast<int>(order));
+}
@@ -80,5 +80,72 @@ TEST_F(AtomicsTest, DecrementTest) {
   EXPECT_EQ(1u, value);
 }
 
+// Make sure that the variants with weaker memory orders work properly.
+TEST_F(AtomicsTest, MemoryOrderTest) {
+  uint32_t value = 1;
+  EXPECT_TRUE(CompareExchange(&value, 1, 2, ::std::memory_order_acquire));
+  EXPECT_FALSE(CompareExchange(&value, 1, 3, ::std::memory_order_release));
+  EXPECT_TRUE(CompareExchange(&value, 2, 3, ::std::memory_order_acq_rel));
+  EXPECT_EQ(3u, value);
+
+  EXPECT_EQ(3u, ExchangeAdd(&value, 1, ::std::memory_order_relaxed));
+  EXPECT_EQ(4u, Exchange(&value, 5, ::std::memory_order_release));
+  EXPECT_EQ(5u, value);
+}
+
+// Make sure AtomicLoad and AtomicStore work properly.
+TEST_F(AtomicsTest, LoadStoreTest) {
+  uint32_t value = 0;
+  AtomicStore(&value, 42, ::std::memory_order_release);
+  EXPECT_EQ(42u, value);
+  EXPECT_EQ(42u, AtomicLoad(&value, ::std::memory_order_acquire));
+  EXPECT_EQ(42u, AtomicLoad(&value));
+}
+
+// Make sure the 64-bit operations work properly.
+TEST_F(AtomicsTest, QuadTest) {
+  // Use something that doesn't fit in 32 bits, to make sure nothing gets
+  // truncated.
+  uint64_t value = 0xFFFFFFFFull;
+  EXPECT_EQ(0xFFFFFFFFull, ExchangeAddQuad(&value, 1));
+  EXPECT_EQ(0x100000000ull, value);
+  EXPECT_EQ(0x100000000ull, ExchangeAddQuad(&value, -2));
+  EXPECT_EQ(0xFFFFFFFEull, AtomicLoadQuad(&value));
+
+  EXPECT_TRUE(CompareExchangeQuad(&value, 0xFFFFFFFEull, 0x200000000ull));
+  EXPECT_FALSE(CompareExchangeQuad(&value, 0xFFFFFFFEull, 0));
+  EXPECT_EQ(0x200000000ull, value);
+
+  EXPECT_EQ(0x200000000ull, ExchangeQuad(&value, 1));
+  AtomicStoreQuad(&value, 0x300000000ull, ::std::memory_order_release);
+  EXPECT_EQ(0x300000000ull, value);
+
+  EXPECT_EQ(0x300000000ull, BitwiseOrQuad(&value, 0x8000000000000001ull));
+  EXPECT_EQ(0x8000000300000001ull, value);
+  EXPECT_EQ(0x8000000300000001ull,
+            BitwiseAndQuad(&value, ~0x100000000ull));
+  EXPECT_EQ(0x8000000200000001ull, value);
+}
+
+// Make sure the 128-bit compare-and-swap works properly.
+TEST_F(AtomicsTest, DoubleQuadTest) {
+  DoubleQuad value = {1, 2};
+
+  // Do one where it equals the expected value.
+  DoubleQuad expected = {1, 2};
+  EXPECT_TRUE(CompareExchangeDoubleQuad(&value, &expected, {3, 4}));
+  EXPECT_EQ(3u, value.low);
+  EXPECT_EQ(4u, value.high);
+
+  // Do one where only one half matches. It should fail, and tell us the actual
+  // value.
+  expected = {3, 5};
+  EXPECT_FALSE(CompareExchangeDoubleQuad(&value, &expected, {6, 7}));
+  EXPECT_EQ(3u, value.low);
+  EXPECT_EQ(4u, value.high);
+  EXPECT_EQ(3u, expected.low);
+  EXPECT_EQ(4u, expected.high);
+}
+
 }  // namespace testing
 }  // namespace tachyon
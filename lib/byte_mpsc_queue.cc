@@ -0,0 +1,299 @@
+#include "byte_mpsc_queue.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include "mpsc_queue_internal.h"
+#include "mutex.h"
+
+namespace tachyon {
+
+::std::unique_ptr<ByteMpscQueue> ByteMpscQueue::Create(uint32_t size) {
+  // Create a new queue object.
+  auto queue = ::std::unique_ptr<ByteMpscQueue>(new ByteMpscQueue());
+
+  if (!queue->DoCreate(size)) {
+    // Creation failed.
+    queue.reset();
+  }
+
+  return queue;
+}
+
+::std::unique_ptr<ByteMpscQueue> ByteMpscQueue::Load(uintptr_t offset) {
+  // Create a new queue object.
+  auto queue = ::std::unique_ptr<ByteMpscQueue>(new ByteMpscQueue());
+
+  queue->DoLoad(offset);
+
+  return queue;
+}
+
+ByteMpscQueue::ByteMpscQueue() : pool_(Pool::GetPool()) {}
+
+bool ByteMpscQueue::DoCreate(uint32_t size) {
+  uint8_t size_shifts;
+  const bool is_power_2 = mpsc_queue::IntLog2(size, &size_shifts);
+  assert(is_power_2 && "Queue size should be a power of 2.");
+  if (!is_power_2) {
+    return false;
+  }
+
+  // Allocate the shared memory we need.
+  queue_ = pool_->AllocateForType<RawQueue>();
+  assert(queue_ != nullptr && "Out of shared memory?");
+  if (!queue_) {
+    return false;
+  }
+
+  queue_->head.low = 0;
+  queue_->head.high = 0;
+  queue_->tail_position = 0;
+  queue_->consumer_waiting = 0;
+
+  // Most messages are going to be bigger than the minimum size, so one record
+  // for every 32 bytes of data is usually plenty. If we run out of records
+  // first, the queue is just full a little early.
+  uint32_t num_records = size / 32;
+  if (!num_records) {
+    num_records = 1;
+  }
+
+  Record *records = pool_->AllocateForArray<Record>(num_records);
+  assert(records != nullptr && "Out of shared memory?");
+  if (!records) {
+    pool_->FreeType<RawQueue>(queue_);
+    return false;
+  }
+  uint8_t *data = pool_->AllocateForArray<uint8_t>(size);
+  assert(data != nullptr && "Out of shared memory?");
+  if (!data) {
+    pool_->FreeArray<Record>(records, num_records);
+    pool_->FreeType<RawQueue>(queue_);
+    return false;
+  }
+
+  queue_->records_offset = pool_->GetOffset(records);
+  queue_->num_records = num_records;
+  queue_->data_offset = pool_->GetOffset(data);
+  queue_->data_size = size;
+
+  InitCommon();
+
+  // Each record starts out free for the producer that gets the ticket with the
+  // same index.
+  for (uint32_t i = 0; i < num_records; ++i) {
+    records_[i].sequence = FreeSequence(i);
+    records_[i].cancelled = 0;
+  }
+
+  return true;
+}
+
+void ByteMpscQueue::DoLoad(uintptr_t offset) {
+  // Initialize queue with an existing one.
+  queue_ = pool_->AtOffset<RawQueue>(offset);
+
+  InitCommon();
+}
+
+void ByteMpscQueue::InitCommon() {
+  // Find everything in our address space.
+  records_ = pool_->AtOffset<Record>(queue_->records_offset);
+  data_ = pool_->AtOffset<uint8_t>(queue_->data_offset);
+
+  record_mask_ = queue_->num_records - 1;
+  data_mask_ = queue_->data_size - 1;
+}
+
+uint8_t *ByteMpscQueue::Reserve(uint32_t size) {
+  assert(size <= GetMaxMessageSize() && "Message is too big for the queue.");
+  if (size > GetMaxMessageSize()) {
+    return nullptr;
+  }
+
+  // Round the size up so that every message stays 8-byte aligned.
+  const uint64_t footprint = (static_cast<uint64_t>(size) + 7) & ~7ull;
+  const uint64_t data_size = data_mask_ + 1;
+
+  DoubleQuad head = head_guess_;
+  while (true) {
+    const uint64_t ticket = head.low;
+    uint64_t start = head.high;
+    const uint64_t offset = start & data_mask_;
+    if (offset + footprint > data_size) {
+      // It won't fit before the end of the ring, so we have to skip to the
+      // beginning. Since messages can be at most half of the ring, this will
+      // always fit once the queue is empty.
+      start += data_size - offset;
+    }
+    const uint64_t end = start + footprint;
+
+    // The acquire synchronizes with the release in Release(), so that the
+    // consumer is guaranteed to be done with the record before we write over
+    // it. It also guarantees that we see a tail position that is at least as
+    // new as the one that was stored along with it.
+    volatile Record *record = RecordFor(ticket);
+    const uint32_t sequence =
+        AtomicLoad(&(record->sequence), ::std::memory_order_acquire);
+    const uint64_t tail =
+        AtomicLoadQuad(&(queue_->tail_position), ::std::memory_order_acquire);
+    // If our guess at the head is out of date, this could be wrong, but the
+    // compare-and-swap below will catch that.
+    const bool full =
+        sequence != FreeSequence(ticket) || end - tail > data_size;
+
+    // If the queue looks full, we still have to make sure that the head we
+    // checked was current, so we do that by "swapping" it with itself.
+    const DoubleQuad new_head = full ? head : DoubleQuad{ticket + 1, end};
+    if (CompareExchangeDoubleQuad(&(queue_->head), &head, new_head)) {
+      head_guess_ = new_head;
+      if (full) {
+        return nullptr;
+      }
+
+      // Nobody else will touch the record until we publish it.
+      record->size = size;
+      record->offset = start & data_mask_;
+      record->end_position = end;
+      reserved_ticket_ = ticket;
+
+      return const_cast<uint8_t *>(data_ + (start & data_mask_));
+    }
+
+    // Someone else got there first, and head now has the real value. Try
+    // again.
+  }
+}
+
+void ByteMpscQueue::Publish() {
+  // This works the same way as MpscQueue::Publish(). The store has to be
+  // sequentially consistent so that it doesn't get reordered with the read of
+  // consumer_waiting.
+  volatile Record *record = RecordFor(reserved_ticket_);
+  AtomicStore(&(record->sequence), FullSequence(reserved_ticket_));
+
+  if (AtomicLoad(&(queue_->consumer_waiting))) {
+    // Only the consumer ever waits on a record.
+    FutexWake(&(record->sequence), 1);
+  }
+}
+
+void ByteMpscQueue::Commit() { Publish(); }
+
+void ByteMpscQueue::CancelReservation() {
+  // The space in the ring can't be given back, because producers after us
+  // might have already claimed the space after it. The consumer will skip it
+  // instead. Publish() takes care of the ordering.
+  AtomicStore(&(RecordFor(reserved_ticket_)->cancelled), 1,
+              ::std::memory_order_relaxed);
+  Publish();
+}
+
+bool ByteMpscQueue::Enqueue(const void *message, uint32_t size) {
+  uint8_t *space = Reserve(size);
+  if (!space) {
+    return false;
+  }
+
+  memcpy(space, message, size);
+  Commit();
+
+  return true;
+}
+
+bool ByteMpscQueue::SkipCancelled() {
+  while (true) {
+    // The acquire synchronizes with the store in Publish(), so we're guaranteed
+    // to see the whole message.
+    volatile Record *record = RecordFor(tail_ticket_);
+    if (AtomicLoad(&(record->sequence), ::std::memory_order_acquire) !=
+        FullSequence(tail_ticket_)) {
+      // We have nothing left to read.
+      return false;
+    }
+
+    if (!AtomicLoad(&(record->cancelled), ::std::memory_order_relaxed)) {
+      return true;
+    }
+    AtomicStore(&(record->cancelled), 0, ::std::memory_order_relaxed);
+    Release();
+  }
+}
+
+const uint8_t *ByteMpscQueue::ReadView(uint32_t *size) {
+  if (!SkipCancelled()) {
+    return nullptr;
+  }
+
+  // Producers won't touch this message until we release it, so it's safe to
+  // cast away the volatile.
+  volatile Record *record = RecordFor(tail_ticket_);
+  *size = record->size;
+  return const_cast<const uint8_t *>(data_ + record->offset);
+}
+
+void ByteMpscQueue::Release() {
+  volatile Record *record = RecordFor(tail_ticket_);
+
+  // Both of these have to be releases, so that we're done reading the message
+  // before anyone can write over it. The tail has to go first, so that
+  // producers who see the freed record also see the freed space.
+  AtomicStoreQuad(&(queue_->tail_position), record->end_position,
+                  ::std::memory_order_release);
+  AtomicStore(&(record->sequence),
+              FreeSequence(tail_ticket_ + record_mask_ + 1),
+              ::std::memory_order_release);
+  ++tail_ticket_;
+}
+
+bool ByteMpscQueue::DequeueNext(void *buffer, uint32_t buffer_size,
+                                uint32_t *size) {
+  const uint8_t *message = ReadView(size);
+  if (!message || *size > buffer_size) {
+    return false;
+  }
+
+  memcpy(buffer, message, *size);
+  Release();
+
+  return true;
+}
+
+bool ByteMpscQueue::DequeueNextBlocking(void *buffer, uint32_t buffer_size,
+                                        uint32_t *size) {
+  while (!SkipCancelled()) {
+    // Wait for the next record to be published. This uses the same protocol
+    // as MpscQueue::WaitForSequence(), so everything here has to stay
+    // sequentially consistent.
+    volatile Record *record = RecordFor(tail_ticket_);
+    const uint32_t sequence = FullSequence(tail_ticket_);
+
+    Increment(&(queue_->consumer_waiting));
+    uint32_t current;
+    while ((current = AtomicLoad(&(record->sequence))) != sequence) {
+      FutexWait(&(record->sequence), current);
+    }
+    Decrement(&(queue_->consumer_waiting), ::std::memory_order_relaxed);
+  }
+
+  return DequeueNext(buffer, buffer_size, size);
+}
+
+uint32_t ByteMpscQueue::GetMaxMessageSize() const {
+  return (data_mask_ + 1) / 2;
+}
+
+int ByteMpscQueue::GetOffset() const { return pool_->GetOffset(queue_); }
+
+void ByteMpscQueue::FreeQueue() {
+  // We just do pointer arithmetic with the freed blocks, so it's okay to cast
+  // away the volatile.
+  pool_->FreeArray<Record>(const_cast<Record *>(records_),
+                           queue_->num_records);
+  pool_->FreeArray<uint8_t>(const_cast<uint8_t *>(data_), queue_->data_size);
+  // Now free the rest of the queue data.
+  pool_->FreeType<RawQueue>(queue_);
+}
+
+}  // namespace tachyon
@@ -0,0 +1,230 @@
+#ifndef TACHYON_LIB_BYTE_MPSC_QUEUE_H_
+#define TACHYON_LIB_BYTE_MPSC_QUEUE_H_
+
+#include <stdint.h>
+
+#include <memory>
+
+#include "atomics.h"
+#include "constants.h"
+#include "pool.h"
+
+namespace tachyon {
+
+// An MPSC queue for messages whose size isn't known at compile time. Instead of
+// an array of fixed-size nodes, it has a ring of bytes, and every message takes
+// up only as much of it as it actually needs. Like MpscQueue, this is meant as
+// a building block for ByteQueue, and shouldn't really be used directly.
+//
+// Every message is stored contiguously, so that users can always build and
+// read them in place. If a message doesn't fit in the space that's left before
+// the end of the ring, the producer skips that space and starts at the
+// beginning again.
+//
+// Internally, it works a lot like MpscQueue, except that the nodes, which we
+// call "records" here, only describe where the message data is in the ring.
+// Producers claim a record and a chunk of the ring together, with a single
+// 128-bit compare-and-swap, so the messages in the ring are always in the same
+// order as the records.
+//
+// Non-blocking operations on this queue are lock free and suitable for realtime
+// applications.
+class ByteMpscQueue {
+ public:
+  // Creates a brand-new queue.
+  // Args:
+  //  size: The number of bytes of message data that the queue should be able
+  //        to hold. Must be a power of 2.
+  // Returns:
+  //  The queue it created, or nullptr if queue creation failed.
+  static ::std::unique_ptr<ByteMpscQueue> Create(uint32_t size);
+  // Loads an existing queue from SHM.
+  // Args:
+  //  offset: The SHM offset of the queue.
+  // Returns:
+  //  The queue it loaded.
+  static ::std::unique_ptr<ByteMpscQueue> Load(uintptr_t offset);
+
+  // Reserves space for a message in the queue, without blocking. The user can
+  // then write the message into the space and call Commit(), or give it up
+  // with CancelReservation().
+  // IMPORTANT: If this method succeeds, you MUST call either Commit() or
+  // CancelReservation() afterwards! The reservation is stored in this
+  // instance, so a single instance can't be used to make reservations from
+  // multiple threads at once.
+  // Args:
+  //  size: The size of the message, in bytes. It can't be more than
+  //        GetMaxMessageSize().
+  // Returns:
+  //  A pointer to the reserved space, or nullptr if there is not enough space.
+  //  It is always aligned to 8 bytes.
+  uint8_t *Reserve(uint32_t size);
+  // Makes the message written into the space returned by Reserve() visible to
+  // the consumer.
+  // IMPORTANT: The user MUST have successfully reserved a space with Reserve(),
+  // otherwise the behavior of this method is undefined.
+  void Commit();
+  // Cancels a reservation previously made with Reserve().
+  // IMPORTANT: The user MUST have successfully reserved a space with Reserve(),
+  // otherwise the behavior of this method is undefined.
+  void CancelReservation();
+
+  // Adds a new message to the queue, without blocking.
+  // Args:
+  //  message: The message to add.
+  //  size: The size of the message, in bytes.
+  // Returns:
+  //  True if it succeeded in adding the message, false if the queue was full.
+  bool Enqueue(const void *message, uint32_t size);
+
+  // Gets the next message in the queue, without copying it out of the queue.
+  // It does not block, is lock-free, and stays in userspace. The message stays
+  // valid until Release() is called.
+  // Args:
+  //  size: Set to the size of the message.
+  // Returns:
+  //  A pointer to the message, or nullptr if the queue is empty.
+  const uint8_t *ReadView(uint32_t *size);
+  // Removes the message returned by ReadView() from the queue.
+  // IMPORTANT: The user MUST have gotten a message with ReadView(), otherwise
+  // the behavior of this method is undefined.
+  void Release();
+
+  // Removes a message from the queue, without blocking.
+  // Args:
+  //  buffer: A place to copy the message.
+  //  buffer_size: The size of the buffer.
+  //  size: Set to the size of the message.
+  // Returns:
+  //  True if it succeeded in getting a message, false if the queue was empty,
+  //  or if the message didn't fit in the buffer. In the latter case, size is
+  //  still set, and the message is left in the queue.
+  bool DequeueNext(void *buffer, uint32_t buffer_size, uint32_t *size);
+  // Same as DequeueNext(), but blocks if the queue is empty.
+  // Returns:
+  //  True if it succeeded in getting a message, false if the message didn't
+  //  fit in the buffer.
+  bool DequeueNextBlocking(void *buffer, uint32_t buffer_size, uint32_t *size);
+
+  // Returns:
+  //  The size of the largest message that this queue can hold.
+  uint32_t GetMaxMessageSize() const;
+
+  // Gets the offset of the shared part of the queue in the shared memory pool.
+  // Returns:
+  //  The offset.
+  int GetOffset() const;
+
+  // Frees the underlying shared memory that the queue uses. Only call it when
+  // you're sure that this queue will no longer be used.
+  void FreeQueue();
+
+ private:
+  // The default constructor is private to force users to use the static
+  // creation methods.
+  ByteMpscQueue();
+
+  // Describes a single message in the ring.
+  struct Record {
+    // The sequence number of this record. This works exactly the same way as
+    // the one in MpscQueue::Node.
+    volatile uint32_t sequence __attribute__((aligned(4)));
+    // Set if the producer that owned this record gave up its reservation.
+    volatile uint32_t cancelled;
+    // The size of the message.
+    volatile uint32_t size;
+    // The offset of the message in the ring.
+    volatile uint32_t offset;
+    // The absolute position in the ring just past the end of the message,
+    // (counting the bytes that every previous lap used,) which is where the
+    // tail ends up once the consumer releases it.
+    volatile uint64_t end_position;
+  };
+
+  // This is the underlying structure that will be located in shared memory.
+  struct RawQueue {
+    // Offset of the record array in the SHM segment.
+    uintptr_t records_offset;
+    // The number of records. Always a power of 2.
+    uint32_t num_records;
+    // Offset of the data ring in the SHM segment.
+    uintptr_t data_offset;
+    // The size of the data ring. Always a power of 2.
+    uint32_t data_size;
+
+    // The low half is the next ticket to be handed out to a producer, exactly
+    // like MpscQueue::RawQueue::head_index. The high half is the absolute
+    // position in the ring where the message for that ticket will start.
+    // Producers update both at once.
+    volatile DoubleQuad head __attribute__((aligned(kCacheLineSize)));
+
+    // The absolute position in the ring up to which the consumer is done with
+    // everything. Only the consumer writes this.
+    volatile uint64_t tail_position __attribute__((aligned(kCacheLineSize)));
+
+    // Set while the consumer is blocked waiting for a record to become
+    // readable.
+    volatile uint32_t consumer_waiting
+        __attribute__((aligned(kCacheLineSize)));
+  };
+
+  // Same as the ones in MpscQueue.
+  static uint32_t FreeSequence(uint64_t ticket) {
+    return static_cast<uint32_t>(ticket << 1);
+  }
+  static uint32_t FullSequence(uint64_t ticket) {
+    return FreeSequence(ticket) + 1;
+  }
+
+  // Gets the record that a particular ticket refers to.
+  // Args:
+  //  ticket: The ticket.
+  // Returns:
+  //  The record.
+  volatile Record *RecordFor(uint64_t ticket) const {
+    return records_ + (ticket & record_mask_);
+  }
+  // Hands the record that a producer reserved off to the consumer.
+  void Publish();
+  // Skips over any cancelled records at the tail of the queue.
+  // Returns:
+  //  True if there is a valid message at the tail of the queue now, false if
+  //  it is empty.
+  bool SkipCancelled();
+  // Creates a new queue.
+  // Args:
+  //  size: The size of the data ring.
+  // Returns:
+  //  True if creating the queue succeeded, false otherwise.
+  bool DoCreate(uint32_t size);
+  // Loads an existing queue.
+  // Args:
+  //  offset: The offset of the shared portion of the queue in SHM.
+  void DoLoad(uintptr_t offset);
+  // Encapsulates initialization that is common to both queue creation and
+  // loading.
+  void InitCommon();
+
+  // The consumer's next ticket. Like the head, this never wraps.
+  uint64_t tail_ticket_ = 0;
+  // The ticket we got from the last successful call to Reserve().
+  uint64_t reserved_ticket_ = 0;
+  // Our best guess at the current head. Compare-and-swap on the head gives us
+  // the real value if we're wrong, so this saves us from having to read it
+  // separately every time.
+  DoubleQuad head_guess_ = {0, 0};
+  // Masks to use for wrapping tickets and ring positions.
+  uint64_t record_mask_;
+  uint64_t data_mask_;
+  // The record array and data ring, in our address space.
+  volatile Record *records_;
+  volatile uint8_t *data_;
+
+  RawQueue *queue_;
+  // This is the shared memory pool that we will use to construct queue objects.
+  Pool *pool_;
+};
+
+}  // namespace tachyon
+
+#endif  // TACHYON_LIB_BYTE_MPSC_QUEUE_H_
@@ -0,0 +1,243 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "byte_mpsc_queue.h"
+#include "constants.h"
+#include "pool.h"
+
+namespace tachyon {
+namespace testing {
+namespace {
+
+// The ring size we use for testing.
+constexpr uint32_t kRingSize = 1024;
+// How many messages each producer thread sends.
+constexpr int kNumMessages = 3000;
+
+// Args:
+//  sequence: The sequence number of a message.
+// Returns:
+//  The size of the message that MakeMessage() makes for that sequence number.
+uint32_t MessageSize(int sequence) {
+  return sizeof(sequence) + 1 + sequence % 61;
+}
+
+// Builds a message of a length that varies with the sequence number, so that
+// messages end up in all sorts of places in the ring.
+// Args:
+//  producer: The number of the producer sending the message.
+//  sequence: The sequence number of the message.
+//  message: Where to write the message. It must be at least
+//           MessageSize(sequence) bytes.
+void MakeMessage(uint8_t producer, int sequence, uint8_t *message) {
+  memcpy(message, &sequence, sizeof(sequence));
+  message[sizeof(sequence)] = producer;
+  for (uint32_t i = sizeof(sequence) + 1; i < MessageSize(sequence); ++i) {
+    message[i] = static_cast<uint8_t>(sequence + i);
+  }
+}
+
+// Checks a message made with MakeMessage().
+// Args:
+//  message: The message.
+//  size: The size of the message.
+//  next_sequences: The next sequence number we expect from each producer.
+//                  The one for the producer that sent the message is
+//                  incremented.
+void CheckMessage(const uint8_t *message, uint32_t size,
+                  ::std::vector<int> *next_sequences) {
+  int sequence;
+  memcpy(&sequence, message, sizeof(sequence));
+  const uint8_t producer = message[sizeof(sequence)];
+  ASSERT_LT(producer, next_sequences->size());
+  EXPECT_EQ((*next_sequences)[producer]++, sequence);
+  ASSERT_EQ(MessageSize(sequence), size);
+  for (uint32_t i = sizeof(sequence) + 1; i < size; ++i) {
+    EXPECT_EQ(static_cast<uint8_t>(sequence + i), message[i]);
+  }
+}
+
+// A producer thread that sends messages on a ByteMpscQueue. It yields when the
+// queue is full, so that tests don't take forever on machines without many
+// cores.
+// Args:
+//  queue: The queue to use.
+//  producer: The number of this producer.
+void MpscProducerThread(ByteMpscQueue *queue, uint8_t producer) {
+  uint8_t message[128];
+  for (int i = 0; i < kNumMessages; ++i) {
+    MakeMessage(producer, i, message);
+    while (!queue->Enqueue(message, MessageSize(i))) {
+      ::std::this_thread::yield();
+    }
+  }
+}
+
+}  // namespace
+
+// Tests for the underlying byte ring.
+class ByteMpscQueueTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    // Clear the pool for this process, so that tests don't affect each-other.
+    Pool::GetPool()->Clear();
+
+    queue_ = ByteMpscQueue::Create(kRingSize);
+    ASSERT_NE(nullptr, queue_);
+  }
+
+  static void TearDownTestCase() {
+    // Unlink SHM.
+    ASSERT_TRUE(Pool::Unlink());
+  }
+
+  // The queue we are testing with.
+  ::std::unique_ptr<ByteMpscQueue> queue_;
+};
+
+// Test that messages come out the same way they went in.
+TEST_F(ByteMpscQueueTest, EnqueueDequeueTest) {
+  ASSERT_TRUE(queue_->Enqueue("correct", 8));
+  ASSERT_TRUE(queue_->Enqueue("horse battery staple", 21));
+  // Empty messages are allowed too.
+  ASSERT_TRUE(queue_->Enqueue(nullptr, 0));
+
+  char message[32];
+  uint32_t size;
+  ASSERT_TRUE(queue_->DequeueNext(message, sizeof(message), &size));
+  EXPECT_EQ(8u, size);
+  EXPECT_STREQ("correct", message);
+  ASSERT_TRUE(queue_->DequeueNext(message, sizeof(message), &size));
+  EXPECT_EQ(21u, size);
+  EXPECT_STREQ("horse battery staple", message);
+  ASSERT_TRUE(queue_->DequeueNext(message, sizeof(message), &size));
+  EXPECT_EQ(0u, size);
+
+  EXPECT_FALSE(queue_->DequeueNext(message, sizeof(message), &size));
+}
+
+// Test that the queue fills up based on how big the messages are.
+TEST_F(ByteMpscQueueTest, FullTest) {
+  EXPECT_EQ(kRingSize / 2, queue_->GetMaxMessageSize());
+
+  // Each of these takes up 104 bytes in the ring.
+  uint8_t message[100] = {0};
+  for (uint32_t i = 0; i < kRingSize / 104; ++i) {
+    EXPECT_TRUE(queue_->Enqueue(message, sizeof(message)));
+  }
+  EXPECT_FALSE(queue_->Enqueue(message, sizeof(message)));
+  // Smaller ones can still fit.
+  EXPECT_TRUE(queue_->Enqueue(message, kRingSize % 104));
+  EXPECT_FALSE(queue_->Enqueue(message, 1));
+
+  // Once we take one off, there should be room again, though it has to wrap
+  // around to the beginning.
+  uint32_t size;
+  ASSERT_TRUE(queue_->DequeueNext(message, sizeof(message), &size));
+  EXPECT_TRUE(queue_->Enqueue(message, sizeof(message)));
+  EXPECT_FALSE(queue_->Enqueue(message, sizeof(message)));
+}
+
+// Test that lots of small messages are limited by the number of records.
+TEST_F(ByteMpscQueueTest, RecordLimitTest) {
+  uint32_t num_enqueued = 0;
+  while (queue_->Enqueue(&num_enqueued, sizeof(num_enqueued))) {
+    ++num_enqueued;
+  }
+  // There is one record for every 32 bytes.
+  EXPECT_EQ(kRingSize / 32, num_enqueued);
+
+  uint32_t message;
+  uint32_t size;
+  for (uint32_t i = 0; i < num_enqueued; ++i) {
+    ASSERT_TRUE(queue_->DequeueNext(&message, sizeof(message), &size));
+    EXPECT_EQ(i, message);
+  }
+}
+
+// Test that messages which don't fit in the buffer are left on the queue.
+TEST_F(ByteMpscQueueTest, SmallBufferTest) {
+  ASSERT_TRUE(queue_->Enqueue("correct horse", 14));
+
+  char message[32];
+  uint32_t size;
+  EXPECT_FALSE(queue_->DequeueNext(message, 8, &size));
+  EXPECT_EQ(14u, size);
+  ASSERT_TRUE(queue_->DequeueNext(message, sizeof(message), &size));
+  EXPECT_STREQ("correct horse", message);
+}
+
+// Test that cancelled reservations get skipped by the consumer.
+TEST_F(ByteMpscQueueTest, CancelReservationTest) {
+  ASSERT_NE(nullptr, queue_->Reserve(100));
+  queue_->CancelReservation();
+  ASSERT_TRUE(queue_->Enqueue("correct", 8));
+  ASSERT_NE(nullptr, queue_->Reserve(10));
+  queue_->CancelReservation();
+
+  char message[32];
+  uint32_t size;
+  ASSERT_TRUE(queue_->DequeueNextBlocking(message, sizeof(message), &size));
+  EXPECT_STREQ("correct", message);
+  EXPECT_FALSE(queue_->DequeueNext(message, sizeof(message), &size));
+
+  // The space that the cancelled messages used should be free again.
+  uint8_t big[512] = {0};
+  EXPECT_TRUE(queue_->Enqueue(big, sizeof(big)));
+}
+
+// Test that we can build and read messages in place, including when they wrap
+// around the end of the ring.
+TEST_F(ByteMpscQueueTest, ZeroCopyTest) {
+  ::std::vector<int> next_sequences(1, 0);
+  for (int i = 0; i < kNumMessages; ++i) {
+    // Keep a couple of messages in the queue, so that they end up straddling
+    // the end of the ring.
+    uint8_t *space = queue_->Reserve(MessageSize(i));
+    ASSERT_NE(nullptr, space);
+    // Everything should stay aligned.
+    EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(space) % 8);
+    MakeMessage(0, i, space);
+    queue_->Commit();
+
+    if (i < 2) {
+      continue;
+    }
+    uint32_t size;
+    const uint8_t *message = queue_->ReadView(&size);
+    ASSERT_NE(nullptr, message);
+    CheckMessage(message, size, &next_sequences);
+    queue_->Release();
+  }
+}
+
+// Test that it works with multiple producers.
+TEST_F(ByteMpscQueueTest, MpscTest) {
+  constexpr int kNumProducers = 4;
+  ::std::vector<::std::thread> producers;
+  for (int i = 0; i < kNumProducers; ++i) {
+    producers.emplace_back(MpscProducerThread, queue_.get(), i);
+  }
+
+  ::std::vector<int> next_sequences(kNumProducers, 0);
+  uint8_t message[128];
+  uint32_t size;
+  for (int i = 0; i < kNumMessages * kNumProducers; ++i) {
+    ASSERT_TRUE(queue_->DequeueNextBlocking(message, sizeof(message), &size));
+    CheckMessage(message, size, &next_sequences);
+  }
+
+  for (auto &producer : producers) {
+    producer.join();
+  }
+  EXPECT_FALSE(queue_->DequeueNext(message, sizeof(message), &size));
+}
+
+}  // namespace testing
+}  // namespace tachyon
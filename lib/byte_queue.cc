@@ -0,0 +1,167 @@
+#include "byte_queue.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include "constants.h"
+
+namespace tachyon {
+
+bool ByteQueue::ReserveAll(uint32_t size) {
+  // First, add any new subqueues that might have been created since we last ran
+  // this.
+  IncorporateNewSubqueues();
+
+  writable_subqueues_.ClearAll();
+
+  // If we have no consumers, we'd basically just be sending this message out
+  // into the void.
+  if (subqueue_mask_.Empty()) {
+    return false;
+  }
+  // Make room for any subqueues that we just found.
+  reserved_spaces_.resize(subqueues_.size());
+
+  for (uint32_t i = subqueue_mask_.First(); i != SubqueueMask::kEnd;
+       i = subqueue_mask_.Next(i)) {
+    uint8_t *space = subqueues_[i]->Reserve(size);
+    if (!space) {
+      // If they're not all going to work, we're going to cancel all our
+      // reservations, and not enqueue anything.
+      for (uint32_t j = writable_subqueues_.First(); j != SubqueueMask::kEnd;
+           j = writable_subqueues_.Next(j)) {
+        subqueues_[j]->CancelReservation();
+      }
+      writable_subqueues_.ClearAll();
+      return false;
+    }
+
+    writable_subqueues_.Set(i);
+    reserved_spaces_[i] = space;
+  }
+
+  first_reserved_ = writable_subqueues_.First();
+  reserved_size_ = size;
+  return true;
+}
+
+bool ByteQueue::Enqueue(const void *message, uint32_t size) {
+  if (!ReserveAll(size)) {
+    return false;
+  }
+
+  // If we get to here, we managed to reserve everything, so we're clear to
+  // actually enqueue stuff.
+  for (uint32_t i = writable_subqueues_.First(); i != SubqueueMask::kEnd;
+       i = writable_subqueues_.Next(i)) {
+    memcpy(reserved_spaces_[i], message, size);
+    subqueues_[i]->Commit();
+  }
+  writable_subqueues_.ClearAll();
+
+  return true;
+}
+
+uint8_t *ByteQueue::Reserve(uint32_t size) {
+  if (!ReserveAll(size)) {
+    return nullptr;
+  }
+
+  return reserved_spaces_[first_reserved_];
+}
+
+void ByteQueue::Commit() {
+  assert(!writable_subqueues_.Empty() && "No space reserved.");
+
+  // The message was built in the first subqueue. We have to copy it into the
+  // rest of them before we commit that one, because once we do, its consumer
+  // is free to release the space.
+  const uint8_t *message = reserved_spaces_[first_reserved_];
+  writable_subqueues_.Clear(first_reserved_);
+  for (uint32_t i = writable_subqueues_.First(); i != SubqueueMask::kEnd;
+       i = writable_subqueues_.Next(i)) {
+    memcpy(reserved_spaces_[i], message, reserved_size_);
+    subqueues_[i]->Commit();
+  }
+  subqueues_[first_reserved_]->Commit();
+
+  writable_subqueues_.ClearAll();
+}
+
+void ByteQueue::CancelReservation() {
+  assert(!writable_subqueues_.Empty() && "No space reserved.");
+
+  for (uint32_t i = writable_subqueues_.First(); i != SubqueueMask::kEnd;
+       i = writable_subqueues_.Next(i)) {
+    subqueues_[i]->CancelReservation();
+  }
+
+  writable_subqueues_.ClearAll();
+}
+
+bool ByteQueue::DequeueNext(void *buffer, uint32_t buffer_size,
+                            uint32_t *size) {
+  // Now, read from our designated subqueue.
+  assert(my_subqueue_ && "This queue is not configured as a consumer!");
+  return my_subqueue_->DequeueNext(buffer, buffer_size, size);
+}
+
+bool ByteQueue::DequeueNextBlocking(void *buffer, uint32_t buffer_size,
+                                    uint32_t *size) {
+  assert(my_subqueue_ && "This queue is not configured as a consumer!");
+  return my_subqueue_->DequeueNextBlocking(buffer, buffer_size, size);
+}
+
+const uint8_t *ByteQueue::ReadView(uint32_t *size) {
+  assert(my_subqueue_ && "This queue is not configured as a consumer!");
+  return my_subqueue_->ReadView(size);
+}
+
+void ByteQueue::Release() {
+  assert(my_subqueue_ && "This queue is not configured as a consumer!");
+  my_subqueue_->Release();
+}
+
+uint32_t ByteQueue::GetMaxMessageSize() const {
+  // This is the same for every subqueue.
+  return queue_->subqueue_size / 2;
+}
+
+::std::unique_ptr<ByteQueue> ByteQueue::Create(bool consumer, uint32_t size) {
+  // Create new queue.
+  auto queue = ::std::unique_ptr<ByteQueue>(new ByteQueue());
+
+  queue->DoCreate(consumer, size);
+
+  return queue;
+}
+
+::std::unique_ptr<ByteQueue> ByteQueue::Load(bool consumer, uintptr_t offset) {
+  // Create new queue.
+  auto queue = ::std::unique_ptr<ByteQueue>(new ByteQueue());
+
+  queue->DoLoad(consumer, offset);
+
+  return queue;
+}
+
+::std::unique_ptr<ByteQueue> ByteQueue::FetchQueue(const char *name) {
+  // Use default size.
+  return DoFetchQueue<ByteQueue>(name, true, kByteQueueCapacity);
+}
+
+::std::unique_ptr<ByteQueue> ByteQueue::FetchProducerQueue(const char *name) {
+  return DoFetchQueue<ByteQueue>(name, false, kByteQueueCapacity);
+}
+
+::std::unique_ptr<ByteQueue> ByteQueue::FetchSizedQueue(const char *name,
+                                                        uint32_t size) {
+  return DoFetchQueue<ByteQueue>(name, true, size);
+}
+
+::std::unique_ptr<ByteQueue> ByteQueue::FetchSizedProducerQueue(
+    const char *name, uint32_t size) {
+  return DoFetchQueue<ByteQueue>(name, false, size);
+}
+
+}  // namespace tachyon
@@ -0,0 +1,127 @@
+#ifndef TACHYON_LIB_BYTE_QUEUE_H_
+#define TACHYON_LIB_BYTE_QUEUE_H_
+
+#include <stdint.h>
+
+#include <memory>
+#include <vector>
+
+#include "byte_mpsc_queue.h"
+#include "queue_base.h"
+
+namespace tachyon {
+
+// A queue for variable-length messages. It works just like Queue, (every
+// consumer reads every message,) except that messages are just runs of bytes,
+// and each one only takes up as much space in the queue as it needs. This makes
+// it a much better fit for things like serialized data than a Queue of
+// worst-case-sized buffers.
+//
+// The same tips as for Queue apply here. In particular, two different threads
+// should never touch the same queue instance.
+class ByteQueue : public QueueBase<ByteMpscQueue> {
+ public:
+  // Adds a new message to the queue, without blocking.
+  // Args:
+  //  message: The message to add.
+  //  size: The size of the message, in bytes. It can't be more than
+  //        GetMaxMessageSize().
+  // Returns:
+  //  True if it succeeded in adding the message, false if the queue was full,
+  //  or if it has no consumers.
+  bool Enqueue(const void *message, uint32_t size);
+  // Reserves space for a message, so that it can be built in place, without
+  // blocking. If it succeeds, Commit() or CancelReservation() MUST be called
+  // afterwards.
+  // NOTE: Every consumer has its own copy of each message, so if there is more
+  // than one consumer, Commit() still has to copy the message for all but one
+  // of them.
+  // Args:
+  //  size: The size of the message, in bytes.
+  // Returns:
+  //  A pointer to the reserved space, or nullptr if there is not enough space.
+  uint8_t *Reserve(uint32_t size);
+  // Enqueues the message that was written into the space returned by
+  // Reserve().
+  void Commit();
+  // Cancels a reservation that was made with Reserve().
+  void CancelReservation();
+
+  // Removes a message from the queue, without blocking.
+  // Args:
+  //  buffer: A place to copy the message.
+  //  buffer_size: The size of the buffer.
+  //  size: Set to the size of the message.
+  // Returns:
+  //  True if it succeeded in getting a message, false if the queue was empty,
+  //  or if the message didn't fit in the buffer. In the latter case, size is
+  //  still set, and the message is left in the queue.
+  bool DequeueNext(void *buffer, uint32_t buffer_size, uint32_t *size);
+  // Same as DequeueNext(), but blocks if the queue is empty.
+  // Returns:
+  //  True if it succeeded in getting a message, false if the message didn't
+  //  fit in the buffer.
+  bool DequeueNextBlocking(void *buffer, uint32_t buffer_size, uint32_t *size);
+  // Gets the next message without copying it out of the queue. It stays valid
+  // until Release() is called.
+  // Args:
+  //  size: Set to the size of the message.
+  // Returns:
+  //  A pointer to the message, or nullptr if the queue is empty.
+  const uint8_t *ReadView(uint32_t *size);
+  // Removes the message returned by ReadView() from the queue.
+  void Release();
+
+  // Returns:
+  //  The size of the largest message that this queue can hold.
+  uint32_t GetMaxMessageSize() const;
+
+  // Manually creates a brand new queue. Normally, FetchQueue() should be used
+  // as it handles queue creation automatically.
+  // Args:
+  //  consumer: Whether this queue allows messages to be consumed.
+  //  size: The number of bytes of message data that the queue will be able to
+  //        hold. Must be a power of 2.
+  static ::std::unique_ptr<ByteQueue> Create(bool consumer, uint32_t size);
+  // Manually loads an existing queue. Normally, FetchQueue() should be used as
+  // it handles queue loading automatically.
+  // Args:
+  //  consumer: Whether this queue allows messages to be consumed.
+  //  offset: The offset of the queue in SHM.
+  static ::std::unique_ptr<ByteQueue> Load(bool consumer, uintptr_t offset);
+
+  // These work just like the ones in Queue. Note that byte queues share the
+  // same namespace as other queues.
+  static ::std::unique_ptr<ByteQueue> FetchQueue(const char *name);
+  static ::std::unique_ptr<ByteQueue> FetchProducerQueue(const char *name);
+  static ::std::unique_ptr<ByteQueue> FetchSizedQueue(const char *name,
+                                                      uint32_t size);
+  static ::std::unique_ptr<ByteQueue> FetchSizedProducerQueue(const char *name,
+                                                              uint32_t size);
+
+ private:
+  // Default constructor is private because it shouldn't be used. Use Create(),
+  // Load(), or one of the Fetch() methods instead.
+  ByteQueue() = default;
+
+  // Reserves space in every subqueue, and adds the ones it reserved in to
+  // writable_subqueues_. It's all or nothing, so if any reservation fails, it
+  // cancels all the others.
+  // Args:
+  //  size: The size of the message.
+  // Returns:
+  //  True if it succeeded, false otherwise.
+  bool ReserveAll(uint32_t size);
+
+  // The spaces that ReserveAll() reserved, indexed by subqueue. Only the ones
+  // in writable_subqueues_ are valid.
+  ::std::vector<uint8_t *> reserved_spaces_;
+  // The index of the first subqueue that ReserveAll() reserved space in.
+  uint32_t first_reserved_ = 0;
+  // The size of the message that they were reserved for.
+  uint32_t reserved_size_ = 0;
+};
+
+}  // namespace tachyon
+
+#endif  // TACHYON_LIB_BYTE_QUEUE_H_
@@ -0,0 +1,211 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "byte_queue.h"
+#include "constants.h"
+#include "pool.h"
+
+namespace tachyon {
+namespace testing {
+namespace {
+
+// The ring size we use for testing.
+constexpr uint32_t kRingSize = 1024;
+// How many messages each producer thread sends.
+constexpr int kNumMessages = 3000;
+
+// Args:
+//  sequence: The sequence number of a message.
+// Returns:
+//  The size of the message that MakeMessage() makes for that sequence number.
+uint32_t MessageSize(int sequence) {
+  return sizeof(sequence) + 1 + sequence % 61;
+}
+
+// Builds a message of a length that varies with the sequence number, so that
+// messages end up in all sorts of places in the ring.
+// Args:
+//  producer: The number of the producer sending the message.
+//  sequence: The sequence number of the message.
+//  message: Where to write the message. It must be at least
+//           MessageSize(sequence) bytes.
+void MakeMessage(uint8_t producer, int sequence, uint8_t *message) {
+  memcpy(message, &sequence, sizeof(sequence));
+  message[sizeof(sequence)] = producer;
+  for (uint32_t i = sizeof(sequence) + 1; i < MessageSize(sequence); ++i) {
+    message[i] = static_cast<uint8_t>(sequence + i);
+  }
+}
+
+// Checks a message made with MakeMessage().
+// Args:
+//  message: The message.
+//  size: The size of the message.
+//  next_sequences: The next sequence number we expect from each producer.
+//                  The one for the producer that sent the message is
+//                  incremented.
+void CheckMessage(const uint8_t *message, uint32_t size,
+                  ::std::vector<int> *next_sequences) {
+  int sequence;
+  memcpy(&sequence, message, sizeof(sequence));
+  const uint8_t producer = message[sizeof(sequence)];
+  ASSERT_LT(producer, next_sequences->size());
+  EXPECT_EQ((*next_sequences)[producer]++, sequence);
+  ASSERT_EQ(MessageSize(sequence), size);
+  for (uint32_t i = sizeof(sequence) + 1; i < size; ++i) {
+    EXPECT_EQ(static_cast<uint8_t>(sequence + i), message[i]);
+  }
+}
+
+// A producer thread that sends messages on a ByteQueue. It yields when the
+// queue is full, so that tests don't take forever on machines without many
+// cores.
+// Args:
+//  offset: The SHM offset of the queue to use.
+//  producer: The number of this producer.
+void ProducerThread(int offset, uint8_t producer) {
+  auto queue = ByteQueue::Load(false, offset);
+
+  for (int i = 0; i < kNumMessages; ++i) {
+    // Build the messages in place this time.
+    uint8_t *space;
+    while (!(space = queue->Reserve(MessageSize(i)))) {
+      ::std::this_thread::yield();
+    }
+    MakeMessage(producer, i, space);
+    queue->Commit();
+  }
+}
+
+// A consumer thread for a ByteQueue. It reads everything that the producers
+// send, and checks it.
+// Args:
+//  queue: The queue to read from.
+//  num_producers: How many producers there are.
+void ConsumerThread(ByteQueue *queue, int num_producers) {
+  ::std::vector<int> next_sequences(num_producers, 0);
+  uint8_t message[128];
+  uint32_t size;
+  for (int i = 0; i < kNumMessages * num_producers; ++i) {
+    ASSERT_TRUE(queue->DequeueNextBlocking(message, sizeof(message), &size));
+    CheckMessage(message, size, &next_sequences);
+  }
+}
+
+}  // namespace
+
+// Tests for the full queue.
+class ByteQueueTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    queue_ = ByteQueue::Create(true, kRingSize);
+  }
+
+  virtual void TearDown() {
+    // Free queue SHM.
+    queue_->FreeQueue();
+  }
+
+  static void TearDownTestCase() {
+    // Unlink SHM.
+    ASSERT_TRUE(Pool::Unlink());
+  }
+
+  // The queue we are testing with.
+  ::std::unique_ptr<ByteQueue> queue_;
+};
+
+// Test that every consumer gets every message.
+TEST_F(ByteQueueTest, BroadcastTest) {
+  auto consumer = ByteQueue::Load(true, queue_->GetOffset());
+  ASSERT_EQ(2u, queue_->GetNumConsumers());
+
+  ASSERT_TRUE(queue_->Enqueue("correct", 8));
+  uint8_t *space = queue_->Reserve(6);
+  ASSERT_NE(nullptr, space);
+  memcpy(space, "horse", 6);
+  queue_->Commit();
+
+  char message[32];
+  uint32_t size;
+  ASSERT_TRUE(queue_->DequeueNext(message, sizeof(message), &size));
+  EXPECT_STREQ("correct", message);
+  const uint8_t *view = queue_->ReadView(&size);
+  ASSERT_NE(nullptr, view);
+  EXPECT_EQ(6u, size);
+  EXPECT_STREQ("horse", reinterpret_cast<const char *>(view));
+  queue_->Release();
+  EXPECT_FALSE(queue_->DequeueNext(message, sizeof(message), &size));
+
+  ASSERT_TRUE(consumer->DequeueNext(message, sizeof(message), &size));
+  EXPECT_STREQ("correct", message);
+  ASSERT_TRUE(consumer->DequeueNext(message, sizeof(message), &size));
+  EXPECT_STREQ("horse", message);
+  EXPECT_FALSE(consumer->DequeueNext(message, sizeof(message), &size));
+}
+
+// Test that a full consumer stops everyone from getting new messages.
+TEST_F(ByteQueueTest, FullTest) {
+  auto consumer = ByteQueue::Load(true, queue_->GetOffset());
+
+  uint8_t message[kRingSize / 2] = {0};
+  ASSERT_TRUE(queue_->Enqueue(message, sizeof(message)));
+  ASSERT_TRUE(queue_->Enqueue(message, sizeof(message)));
+  uint32_t size;
+  ASSERT_TRUE(queue_->DequeueNext(message, sizeof(message), &size));
+  ASSERT_TRUE(queue_->DequeueNext(message, sizeof(message), &size));
+
+  // The other consumer is still full, so it shouldn't let us do anything.
+  EXPECT_FALSE(queue_->Enqueue(message, sizeof(message)));
+  EXPECT_EQ(nullptr, queue_->Reserve(8));
+
+  // The failed attempts still left cancelled reservations in our subqueue,
+  // which we have to skip over before they're freed.
+  ASSERT_TRUE(consumer->DequeueNext(message, sizeof(message), &size));
+  EXPECT_FALSE(queue_->DequeueNext(message, sizeof(message), &size));
+  EXPECT_TRUE(queue_->Enqueue(message, sizeof(message)));
+}
+
+// Test that we can fetch byte queues by name.
+TEST_F(ByteQueueTest, FetchQueueTest) {
+  auto queue1 = ByteQueue::FetchQueue("byte_queue");
+  auto queue2 = ByteQueue::FetchProducerQueue("byte_queue");
+  EXPECT_EQ(queue1->GetOffset(), queue2->GetOffset());
+  EXPECT_EQ(static_cast<uint32_t>(kByteQueueCapacity / 2),
+            queue1->GetMaxMessageSize());
+
+  ASSERT_TRUE(queue2->Enqueue("correct", 8));
+  char message[32];
+  uint32_t size;
+  ASSERT_TRUE(queue1->DequeueNext(message, sizeof(message), &size));
+  EXPECT_STREQ("correct", message);
+
+  queue1->FreeQueue();
+}
+
+// Test that it works with multiple producers and consumers.
+TEST_F(ByteQueueTest, MpmcTest) {
+  constexpr int kNumProducers = 3;
+  auto consumer = ByteQueue::Load(true, queue_->GetOffset());
+
+  ::std::vector<::std::thread> producers;
+  for (int i = 0; i < kNumProducers; ++i) {
+    producers.emplace_back(ProducerThread, queue_->GetOffset(), i);
+  }
+  ::std::thread consumer_thread(ConsumerThread, consumer.get(), kNumProducers);
+  ConsumerThread(queue_.get(), kNumProducers);
+
+  consumer_thread.join();
+  for (auto &producer : producers) {
+    producer.join();
+  }
+}
+
+}  // namespace testing
+}  // namespace tachyon
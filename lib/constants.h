@@ -15,14 +15,37 @@ extern const char *kShmName;
 // an integer multiple of this number.
 constexpr uint32_t kBlockSize = 128;
 
+// The size of a cache line on the machines we care about. Data that is written
+// frequently by different threads should be kept on separate cache lines.
+constexpr uint32_t kCacheLineSize = 64;
 // How many items we want our queues to be able to hold.
 static constexpr int kQueueCapacity = 64;
+// How many bytes of message data we want our byte queues to be able to hold.
+static constexpr int kByteQueueCapacity = 4096;
 // Size to use when initializing the underlying pool.
 // TODO (danielp): This will have to be increased eventually for actual tachyon
 // stuff.
 static constexpr int kPoolSize = 64000;
-// The maximum number of consumers a queue can have.
+// Copies into or out of queues that are at least this many bytes use
+// non-temporal stores, which bypass the cache. Payloads this big wouldn't fit in
+// L2 anyway, so caching them just evicts everything else.
+static constexpr uint32_t kNonTemporalCopyThreshold = 1 << 20;
+// The maximum number of consumers a ring queue can have.
 static constexpr int kMaxConsumers = 64;
+// Queues keep track of their consumers in a table that starts out with room
+// for this many of them, and grows in chunks as more consumers show up. Each
+// new chunk is as big as everything before it, so the table doubles in size.
+static constexpr int kFirstSubqueueChunkSize = 16;
+// The maximum number of chunks in that table.
+static constexpr int kNumSubqueueChunks = 7;
+// The maximum number of consumers a Queue or ByteQueue can have.
+static constexpr int kMaxQueueConsumers = kFirstSubqueueChunkSize
+                                          << (kNumSubqueueChunks - 1);
+// How often, in microseconds, a producer that is waiting for a durable
+// consumer checks whether that consumer's process died.
+static constexpr int kDurablePollPeriodUs = 100;
+// The maximum number of consumer groups a ring queue can have.
+static constexpr int kMaxConsumerGroups = 16;
 
 // Number of buckets in the hashmap that stores queue names.
 static constexpr int kNameMapSize = 128;
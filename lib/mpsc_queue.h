@@ -2,10 +2,14 @@
 #define TACHYON_LIB_IPC_MPSC_QUEUE_H_
 
 #include <assert.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
+#include <algorithm>
 #include <limits>
 #include <memory>
+#include <type_traits>
 
 #include "atomics.h"
 #include "constants.h"
@@ -30,6 +34,14 @@ namespace tachyon {
 //
 // Non-blocking operations on this queue are, of course, lock free and suitable
 // for realtime applications.
+//
+// Internally, it is a bounded ring buffer where every node carries a sequence
+// number, similar to the one described by Dmitry Vyukov. Producers are handed
+// monotonically increasing "tickets" from a single 64-bit head counter, and the
+// sequence number of a node tells a producer whether the consumer is done with
+// it yet, and the consumer whether the producer is done writing it. This means
+// that claiming a space is a single atomic operation on the head, and that no
+// other shared counters need to be touched.
 template <class T>
 class MpscQueue {
  public:
@@ -37,9 +49,14 @@ class MpscQueue {
   // Args:
   //  size: The number of elements that the queue should be able to hold. Must
   //        be a power of 2.
+  //  pad_nodes: If true, every node will be padded out to a multiple of the
+  //             cache line size, so that producers writing to adjacent nodes
+  //             don't fight over the same cache line. This is mainly useful
+  //             for small items, and it costs a lot of extra memory.
   // Returns:
   //  The queue it created, or nullptr if queue creation failed.
-  static ::std::unique_ptr<MpscQueue<T>> Create(uint32_t size);
+  static ::std::unique_ptr<MpscQueue<T>> Create(uint32_t size,
+                                                bool pad_nodes = false);
   // Loads an existing queue from SHM.
   // Args:
   //  offset: The SHM offset of the queue.
@@ -49,15 +66,24 @@ class MpscQueue {
 
   // Allows a user to "reserve" a place in the queue. Using this method will
   // save a space in the queue that nobody can write over, but which also can't
-  // be read. If it succeeds, the next call to EnqueueAt() (from this thread)
-  // will add an item in this spot. Otherwise, CancelReservation() can be used
-  // to remove the reservation if you don't want to use it. This method does not
-  // block.
-  // IMPORTANT: If this method returns true, you MUST either call
-  // CancelReservation or EnqueueAt afterwards!
-  // Returns:
-  //  True if it succeeds in reserving a spot, false if there is not space.
-  bool Reserve();
+  // be read. If it succeeds, the user can either construct an item directly in
+  // the space and call Commit(), or call EnqueueAt() to copy an item into it.
+  // Otherwise, CancelReservation() can be used to remove the reservation if you
+  // don't want to use it. This method does not block.
+  // IMPORTANT: If this method succeeds, you MUST call one of Commit(),
+  // EnqueueAt() or CancelReservation() afterwards! The reservation is stored in
+  // this instance, so a single instance can't be used to make reservations
+  // from multiple threads at once.
+  // Returns:
+  //  A pointer to the reserved space, or nullptr if there is not space. This
+  //  points into shared memory, so nothing written here should contain
+  //  pointers to anything that isn't also in shared memory.
+  T *Reserve();
+  // Makes whatever was written into the space returned by Reserve() visible to
+  // the consumer. This avoids the copy that EnqueueAt() does.
+  // IMPORTANT: The user MUST have successfully reserved a spot with Reserve(),
+  // otherwise the behavior of this method is undefined.
+  void Commit();
   // Allows a user to enqueue and element at the spot they previously reserved.
   // IMPORTANT: The user MUST have successfully reserved a spot with Reserve(),
   // otherwise the behavior of this method is undefined.
@@ -70,6 +96,62 @@ class MpscQueue {
   // the queue.
   void CancelReservation();
 
+  // Like Reserve(), but reserves a number of consecutive spaces at once, using
+  // a single atomic operation. The next call to EnqueueBatchAt() (on this
+  // instance) will add items to these spaces.
+  // IMPORTANT: If this method returns anything other than zero, you MUST call
+  // EnqueueBatchAt() afterwards!
+  // Args:
+  //  num_items: The maximum number of spaces to reserve.
+  // Returns:
+  //  The number of spaces that were actually reserved, which can be less than
+  //  num_items if the queue doesn't have enough room.
+  uint32_t ReserveBatch(uint32_t num_items);
+  // Enqueues items in the spaces that were previously reserved with
+  // ReserveBatch(). If there are fewer items than reserved spaces, the
+  // remaining reservations are cancelled.
+  // IMPORTANT: The user MUST have successfully reserved at least num_items
+  // spaces with ReserveBatch(), otherwise the behavior of this method is
+  // undefined.
+  // Args:
+  //  items: The items to add to the queue.
+  //  num_items: The number of items to add.
+  void EnqueueBatchAt(const T *items, uint32_t num_items);
+
+  // Like Reserve(), but if the queue is full, it drops the oldest item in the
+  // queue to make room for the new one. This only works if the consumer has
+  // called SetOverwritable() first. Otherwise, it does exactly what Reserve()
+  // does. It can still fail if the consumer is in the middle of reading the
+  // oldest item, or if the producer that is supposed to write it hasn't yet.
+  // Args:
+  //  num_dropped: Set to the number of items that it dropped.
+  // Returns:
+  //  A pointer to the reserved space, or nullptr if there is not space.
+  T *ReserveOverwriting(uint32_t *num_dropped);
+  // Allows producers to use ReserveOverwriting() on this queue. This must be
+  // called on the consumer's instance, because it makes the consumer claim
+  // each item before it reads it, so that producers can't write over it in the
+  // meantime. That costs an extra atomic operation for every item read, even
+  // after producers stop overwriting, so it can't be turned off again.
+  void SetOverwritable();
+  // Works out where the consumer left off by looking at which nodes it freed.
+  // This is for when a new handle takes over reading from a queue whose old
+  // consumer is gone. Anything that the old consumer was in the middle of
+  // reading will be read again. (Except that if it crashed while it had an item
+  // claimed after SetOverwritable(), that node looks like a producer is still
+  // writing it, and the queue won't get past it.)
+  // IMPORTANT: Nobody else can be consuming from the queue while this runs.
+  void FindTail();
+  // Same as Enqueue(), but it uses ReserveOverwriting(), so producers never
+  // have to wait for the consumer.
+  // Args:
+  //  item: The item to add to the queue.
+  //  num_dropped: Set to the number of items that it dropped.
+  // Returns:
+  //  True if it succeeded in adding the item, false if it had to drop it
+  //  instead.
+  bool EnqueueOverwriting(const T &item, uint32_t *num_dropped);
+
   // Adds a new element to the queue, without blocking. It is lock-free, and
   // stays in userspace.
   // Args:
@@ -78,6 +160,17 @@ class MpscQueue {
   //  True if it succeeded in adding the item, false if the queue was
   //  full already.
   bool Enqueue(const T &item);
+  // Adds as many elements to the queue as will fit, without blocking. This is
+  // considerably cheaper than enqueueing them one at a time, because all the
+  // synchronization with other producers and the consumer happens once for the
+  // whole batch.
+  // Args:
+  //  items: The items to add to the queue.
+  //  num_items: The number of items to add.
+  // Returns:
+  //  The number of items that were actually added. These are always the first
+  //  ones in items.
+  uint32_t EnqueueBatch(const T *items, uint32_t num_items);
   // Removes an element from the queue, without blocking. It is lock-free, and
   // stays in userspace.
   // Args:
@@ -86,6 +179,15 @@ class MpscQueue {
   //  True if it succeeded in getting an item, false if the queue was empty
   //  already.
   bool DequeueNext(T *item);
+  // Removes as many elements from the queue as are available, up to a maximum,
+  // without blocking. Like EnqueueBatch(), this is cheaper than dequeueing
+  // them one at a time.
+  // Args:
+  //  items: A place to copy the items.
+  //  max_items: The maximum number of items to remove.
+  // Returns:
+  //  The number of items that were actually removed.
+  uint32_t DequeueBatch(T *items, uint32_t max_items);
   // Gets the next element that would be removed from the queue, but does not
   // remove it. It does not block, is lock-free, and stays in userspace.
   // Args:
@@ -94,6 +196,17 @@ class MpscQueue {
   //  True if it succeeded in reading an item, false if the queue was empty
   //  already.
   bool PeekNext(T *item);
+  // Gets the next element that would be removed from the queue, without copying
+  // it out of the queue. It does not block, is lock-free, and stays in
+  // userspace. The element stays valid until Release() is called.
+  // Returns:
+  //  A pointer to the element, or nullptr if the queue is empty.
+  const T *ReadView();
+  // Removes the element returned by ReadView() from the queue. After this, the
+  // pointer returned by ReadView() can no longer be used.
+  // IMPORTANT: The user MUST have gotten an element with ReadView(), otherwise
+  // the behavior of this method is undefined.
+  void Release();
 
   // Adds a new element to the queue, and blocks if the queue is full.
   // Args:
@@ -109,6 +222,15 @@ class MpscQueue {
   //  item: A place to copy the item.
   void PeekNextBlocking(T *item);
 
+  // Gets the sequence number of the item that was most recently read from the
+  // queue. Every reservation that a producer makes gets the next number, so if
+  // this jumps by more than one between reads, the items in between were
+  // overwritten, (see ReserveOverwriting(),) or were reservations that got
+  // cancelled.
+  // Returns:
+  //  The sequence number.
+  uint64_t GetSequence() const { return last_sequence_; }
+
   // Gets the offset of the shared part of the queue in the shared memory pool.
   // Returns:
   //  The offset.
@@ -126,38 +248,51 @@ class MpscQueue {
   // technically, this constructor creates an object that isn't valid.
   MpscQueue();
 
+  // Small items can be written to a node together with its sequence number,
+  // using a single atomic store, instead of copying the item and then
+  // publishing it separately. These tags select how WriteNode() does it.
+  //
+  // This is only done for items of up to 4 bytes. Anything bigger, along with
+  // the sequence number, needs 128 bits, and the only way to write that
+  // atomically is CompareExchangeDoubleQuad(). That turned out to be a little
+  // slower than just copying an 8-byte item, and it doesn't save any cache line
+  // traffic either, since nodes that small never straddle a cache line anyway.
+  // Items of more than 8 bytes don't fit at all.
+  //
+  // The item and the sequence number fit in 64 bits.
+  struct QuadNodeTag {};
+  // The item has to be copied separately.
+  struct CopyNodeTag {};
+  typedef typename ::std::conditional<
+      ::std::is_trivially_copyable<T>::value && sizeof(T) <= 4 &&
+          alignof(T) <= 4,
+      QuadNodeTag, CopyNodeTag>::type NodeTag;
+
+  // Nodes that are written with a single 64-bit store have to be aligned to 8
+  // bytes, so that the store never straddles a cache line.
+  static constexpr size_t kNodeAlignment =
+      ::std::is_same<NodeTag, QuadNodeTag>::value
+          ? 8
+          : (alignof(T) > 4 ? alignof(T) : 4);
+
   // Represents an item in the queue.
-  struct Node {
+  struct alignas(kNodeAlignment) Node {
     // The actual item we want to store.
     volatile T value;
-    // A flag denoting whether this node contains valid data. It is aligned
-    // specially so that we can basically use it as a futex to implement
-    // blocking reads.
-    volatile uint32_t valid __attribute__((aligned(4)));
-    // This is used to implement blocking writes. Bits 0 through 14 are a
-    // counter of the number of people waiting for this location to become
-    // writeable. Bits 16 through 30 are a counter of the number of people that
-    // have been woken up. Both counters are only incremented and eventually
-    // wrap. Normally, for any given waiter, if the latter counter is >= to the
-    // value that the former counter was when we first incremented it, we know
-    // that we are done waiting and can proceed. Because the counters wrap,
-    // however, this metric is not always reliable. Bits 15 and 31 are compared,
-    // therefore, and used to determine when to invert this logic. (The counters
-    // are incremented like they are 16 bits, but only the first 15 bits are
-    // read normally.)
-    //
-    // As long as you don't have more than 2^15 people waiting on the same
-    // location at once, this system should work reliably. Also note that
-    // because we have to wake everyone waiting on a particular space up every
-    // time, having a massive number of writers blocked at once significantly
-    // decreases the overall efficiency of the queue.
-    //
-    // TODO (danielp): Use the bitmask futex operations to increase the
-    // efficiency with a large number of writers.
-    // TODO (danielp): Use a 64-bit type here instead, which I think could make
-    // some of our futex operations more efficient, since we can wait only on
-    // the half that we care about.
-    volatile uint32_t write_waiters __attribute__((aligned(4)));
+    // The sequence number of this node. This is how producers and the consumer
+    // know whose turn it is to use it. For a producer with ticket t, (see
+    // RawQueue::head_index,) the node is free to write when this is
+    // FreeSequence(t), and becomes readable by the consumer once the producer
+    // sets it to FullSequence(t). Once the consumer is done with it, it sets it
+    // to FreeSequence(t + array_length), which hands it to the producer that
+    // has the same slot on the next lap around. Only the lower 32 bits are
+    // stored, which is fine, since we only ever compare nearby values. It is
+    // aligned specially so that we can also use it as a futex to implement
+    // blocking.
+    volatile uint32_t sequence __attribute__((aligned(4)));
+    // Set if the producer that owned this node gave up its reservation
+    // instead of writing anything. The consumer just skips over these nodes.
+    volatile uint32_t cancelled;
   };
 
   // This is the underlying structure that will be located in shared memory, and
@@ -165,54 +300,137 @@ class MpscQueue {
   // classes can share one of these, and they will be different "handles" into
   // the same queue.
   struct RawQueue {
-    // The underlying array.
-    volatile Node *array;
     // Offset of array in the SHM segment.
     uintptr_t array_offset;
     // The length of the array.
     uint32_t array_length;
     // Log base 2 of array_length.
     uint8_t array_length_shifts;
+    // The number of bytes between the starts of adjacent nodes in the array.
+    uint32_t node_stride;
 
-    // Total length of the queue visible to writers.
-    volatile uint32_t write_length;
-    // Current index of the head.
-    volatile uint32_t head_index;
+    // Everything below here is modified after the queue is created, so it is
+    // split up onto separate cache lines according to who writes it, so that
+    // writes from one side don't keep invalidating the other's cache. (The
+    // consumer doesn't need much of its own in here, since it keeps its tail
+    // locally.)
 
+    // The next "ticket" to be handed out to a producer. This only ever
+    // increases, (64 bits is more than enough to keep it from wrapping,) and a
+    // producer's ticket determines both which node it writes to and which lap
+    // around the array it is on. Every producer writes this.
+    volatile uint64_t head_index __attribute__((aligned(kCacheLineSize)));
+
+    // These are only written by threads that are about to block, so they are
+    // almost always just read, which doesn't cause any contention.
+    //
     // Rough counter of the number of threads currently waiting to write to this
     // queue. It is not guaranteed to be accurate, but it is guaranteed to be 0
     // if no blocking enqueues were ever performed.
-    volatile uint32_t blocked_threads;
+    volatile uint32_t blocked_threads __attribute__((aligned(kCacheLineSize)));
+    // Set while the consumer is blocked waiting for a node to become readable.
+    volatile uint32_t consumer_waiting;
+    // Set once the consumer calls SetOverwritable(). Producers can only
+    // overwrite items after they see this.
+    volatile uint32_t overwritable;
   };
 
-  // Handles the implementation of blocking writes. It will block until the
-  // requested node is available.
-  // Args:
-  //  write_at: A pointer to the node that we're trying to write to.
-  //  my_wait_number: The value that we are waiting for the woken counter to
-  //  reach before we continue.
-  void DoWriteBlocking(volatile Node *write_at, uint16_t my_wait_number);
-  // Actually writes an element to the queue. It assumes that a space was
-  // already reserved by incrementing queue_->write_length.
-  // Args:
-  //  item: The item to write to the queue.
-  //  can_block: Whether this write could block. This is mainly used as an
-  //  optimization flag so we can forgo unnecessary computations for
-  //  non-blocking writes.
-  void DoEnqueue(const T &item, bool can_block);
-  // Actually reads an element from the queue. It assumes that the space has
-  // already been checked for validity. It also does not decrement write_length,
-  // assuming that will be done afterwards.
-  // Args:
-  //  item: Where to write the item that was read from the queue.
-  //  read_at: Node that we are reading from.
-  void DoDequeue(T *item, volatile Node *read_at);
+  // Computes the sequence number a node has when it is free for a particular
+  // producer to write.
+  // Args:
+  //  ticket: The ticket of the producer.
+  // Returns:
+  //  The sequence number.
+  static uint32_t FreeSequence(uint64_t ticket) {
+    return static_cast<uint32_t>(ticket << 1);
+  }
+  // Computes the sequence number a node has when a particular producer has
+  // finished writing to it.
+  // Args:
+  //  ticket: The ticket of the producer.
+  // Returns:
+  //  The sequence number.
+  static uint32_t FullSequence(uint64_t ticket) {
+    return FreeSequence(ticket) + 1;
+  }
+
+  // Gets the node that a particular ticket refers to.
+  // Args:
+  //  ticket: The ticket.
+  // Returns:
+  //  The node.
+  volatile Node *NodeFor(uint64_t ticket) const {
+    return reinterpret_cast<volatile Node *>(array_ +
+                                             (ticket & wrapping_mask_) *
+                                                 node_stride_);
+  }
+  // Waits until a node has a particular sequence number.
+  // Args:
+  //  node: The node to wait on.
+  //  sequence: The sequence number to wait for.
+  //  waiting: The counter to use to tell the other side that we're waiting.
+  void WaitForSequence(volatile Node *node, uint32_t sequence,
+                       volatile uint32_t *waiting);
+  // Hands nodes off to the consumer, after a producer is done with them.
+  // Args:
+  //  first_ticket: The ticket of the first node.
+  //  num_tickets: The number of consecutive nodes to hand off.
+  void Publish(uint64_t first_ticket, uint32_t num_tickets);
+  // Wakes up the consumer if it is waiting on any nodes that were just
+  // published.
+  // Args:
+  //  first_ticket: The ticket of the first node.
+  //  num_tickets: The number of consecutive nodes that were published.
+  void WakeConsumer(uint64_t first_ticket, uint32_t num_tickets);
+
+  // Writes an item to a node, and hands it off to the consumer.
+  // Args:
+  //  ticket: The ticket of the node to write to.
+  //  item: The item to write.
+  void WriteAndPublish(uint64_t ticket, const T &item);
+  // Does the actual writing for WriteAndPublish(). The store that sets the
+  // sequence number is always sequentially consistent.
+  // Args:
+  //  node: The node to write.
+  //  item: The item to write.
+  //  sequence: The sequence number to give the node.
+  static void WriteNode(volatile Node *node, const T &item, uint32_t sequence,
+                        QuadNodeTag);
+  static void WriteNode(volatile Node *node, const T &item, uint32_t sequence,
+                        CopyNodeTag);
+  // Hands the node at the tail back to the producers, after the consumer is
+  // done with it, and advances the tail. It does not wake anyone up, so it
+  // must be followed by a call to WakeProducers().
+  // Args:
+  //  order: The memory order to use when updating the node.
+  void FreeTail(::std::memory_order order);
+  // Wakes up any producers that are blocked on nodes that FreeTail() freed.
+  // Args:
+  //  first_ticket: The ticket of the first node that was freed.
+  //  num_tickets: The number of consecutive nodes that were freed.
+  void WakeProducers(uint64_t first_ticket, uint32_t num_tickets);
+  // Skips over any cancelled nodes at the tail of the queue.
+  // Returns:
+  //  True if there is a valid item at the tail of the queue now, false if it
+  //  is empty.
+  bool SkipCancelled();
+  // Same as SkipCancelled(), but for overwritable queues. It also skips over
+  // nodes that producers overwrote, and it claims the tail node, so that
+  // producers can't overwrite it while we read it.
+  // Returns:
+  //  True if there is a valid item at the tail of the queue now, false if it
+  //  is empty.
+  bool ClaimTail();
+  // For overwritable queues, blocks until there is something at the tail of
+  // the queue. ClaimTail() will then succeed, unless it was overwritten.
+  void WaitForTail();
   // Creates a new queue.
   // Args:
   //  size: The number of elements that the queue should be able to hold.
+  //  pad_nodes: Whether to pad nodes out to the cache line size.
   // Returns:
   //  True if creating the queue succeeded, false otherwise.
-  bool DoCreate(uint32_t size);
+  bool DoCreate(uint32_t size, bool pad_nodes);
   // Loads an existing queue.
   // Args:
   //  offset: The offset of the shared portion of the queue in SHM.
@@ -222,11 +440,28 @@ class MpscQueue {
   void InitCommon();
 
   // For consumers, we can get away with storing the tail index locally since we
-  // only have one.
-  uint32_t tail_index_ = 0;
+  // only have one. Like the head, this never wraps.
+  uint64_t tail_index_ = 0;
+  // The first ticket that we got from the last successful call to
+  // ReserveBatch().
+  uint64_t reserved_ticket_ = 0;
+  // The number of tickets that we got from that call.
+  uint32_t reserved_count_ = 0;
+  // Our copy of overwritable in the RawQueue, so that the consumer doesn't
+  // have to check it for every item.
+  bool overwritable_ = false;
+  // Whether we have claimed the tail node with ClaimTail().
+  bool claimed_tail_ = false;
+  // The ticket of the item that the consumer read most recently.
+  uint64_t last_sequence_ = 0;
   // The bitmask to use for wrapping indices. This never changes, so it's safe
   // to set it just once.
-  uint32_t wrapping_mask_;
+  uint64_t wrapping_mask_;
+  // The underlying array, in our address space. Since nodes might be padded,
+  // this has to be indexed with NodeFor().
+  volatile uint8_t *array_;
+  // Local copy of the node stride, so we don't have to go to SHM for it.
+  uint32_t node_stride_;
 
   RawQueue *queue_;
   // This is the shared memory pool that we will use to construct queue objects.
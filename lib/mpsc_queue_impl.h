@@ -2,12 +2,13 @@
 // instead.
 
 template <class T>
-::std::unique_ptr<MpscQueue<T>> MpscQueue<T>::Create(uint32_t size) {
+::std::unique_ptr<MpscQueue<T>> MpscQueue<T>::Create(uint32_t size,
+                                                     bool pad_nodes) {
   // Create a new queue object.
   MpscQueue<T> *raw_queue = new MpscQueue<T>();
   auto queue = ::std::unique_ptr<MpscQueue<T>>(raw_queue);
 
-  if (!queue->DoCreate(size)) {
+  if (!queue->DoCreate(size, pad_nodes)) {
     // Creation failed.
     queue.reset();
   }
@@ -30,7 +31,7 @@ template <class T>
 MpscQueue<T>::MpscQueue() : pool_(Pool::GetPool()) {}
 
 template <class T>
-bool MpscQueue<T>::DoCreate(uint32_t size) {
+bool MpscQueue<T>::DoCreate(uint32_t size, bool pad_nodes) {
   // Allocate the shared memory we need.
   queue_ = pool_->AllocateForType<RawQueue>();
   assert(queue_ != nullptr && "Out of shared memory?");
@@ -38,19 +39,29 @@ bool MpscQueue<T>::DoCreate(uint32_t size) {
     return false;
   }
 
-  queue_->write_length = 0;
   queue_->head_index = 0;
+  queue_->blocked_threads = 0;
+  queue_->consumer_waiting = 0;
+  queue_->overwritable = 0;
+
+  // Figure out how big each node needs to be.
+  uint32_t node_stride = sizeof(Node);
+  if (pad_nodes) {
+    // Round up to the next cache line.
+    node_stride = (node_stride + kCacheLineSize - 1) / kCacheLineSize *
+                  kCacheLineSize;
+  }
 
   // Allocate the array.
-  Node *array = pool_->AllocateForArray<Node>(size);
+  uint8_t *array = pool_->AllocateForArray<uint8_t>(size * node_stride);
   assert(array != nullptr && "Out of shared memory?");
   if (!array) {
     return false;
   }
 
-  queue_->array = array;
   queue_->array_offset = pool_->GetOffset(array);
   queue_->array_length = size;
+  queue_->node_stride = node_stride;
 
   // Calculate the number of shifts.
   const bool is_power_2 =
@@ -60,14 +71,16 @@ bool MpscQueue<T>::DoCreate(uint32_t size) {
     return false;
   }
 
-  // Initialize the nodes.
+  InitCommon();
+
+  // Initialize the nodes. Each one starts out free for the producer that gets
+  // the ticket with the same index.
   for (uint32_t i = 0; i < size; ++i) {
-    queue_->array[i].valid = 0;
-    queue_->array[i].write_waiters = 0;
+    volatile Node *node = NodeFor(i);
+    node->sequence = FreeSequence(i);
+    node->cancelled = 0;
   }
 
-  InitCommon();
-
   return true;
 }
 
@@ -75,132 +88,226 @@ template <class T>
 void MpscQueue<T>::DoLoad(uintptr_t offset) {
   // Initialize queue with an existing one.
   queue_ = pool_->AtOffset<RawQueue>(offset);
-  // Find the array too.
-  queue_->array = pool_->AtOffset<Node>(queue_->array_offset);
+  overwritable_ =
+      AtomicLoad(&(queue_->overwritable), ::std::memory_order_relaxed);
 
   InitCommon();
 }
 
 template <class T>
 void MpscQueue<T>::InitCommon() {
-  // Generate the index mask value. We can AND this with our indices as an easy
+  // Find the array in our address space.
+  array_ = pool_->AtOffset<uint8_t>(queue_->array_offset);
+  node_stride_ = queue_->node_stride;
+
+  // Generate the index mask value. We can AND this with our tickets as an easy
   // way to make them wrap when they reach the end of the physical array.
-  if (queue_->array_length_shifts == 0) {
-    // Technically, shifting by 32 bits is undefined in C++, so we have to
-    // handle this case manually.
-    wrapping_mask_ = 0;
-  } else {
-    wrapping_mask_ = ::std::numeric_limits<uint32_t>::max() >>
-                     (32 - queue_->array_length_shifts);
-  }
+  wrapping_mask_ = queue_->array_length - 1;
 }
 
 template <class T>
-bool MpscQueue<T>::Reserve() {
-  // Increment the write length now, to keep other writers from writing off the
-  // end.
-  const uint32_t old_length = ExchangeAdd(&(queue_->write_length), 1);
-  Fence();
-  if (old_length >= queue_->array_length) {
-    // The queue is full. Decrement again and return without doing anything.
-    Decrement(&(queue_->write_length));
-    return false;
+T *MpscQueue<T>::Reserve() {
+  if (!ReserveBatch(1)) {
+    return nullptr;
   }
 
-  return true;
+  // Nobody else is touching this space until we publish it, so it's safe to
+  // cast away the volatile.
+  return const_cast<T *>(&(NodeFor(reserved_ticket_)->value));
+}
+
+template <class T>
+void MpscQueue<T>::Commit() {
+  assert(reserved_count_ == 1 && "No space reserved.");
+
+  Publish(reserved_ticket_, 1);
+  reserved_count_ = 0;
 }
 
 template <class T>
 void MpscQueue<T>::EnqueueAt(const T &item) {
-  DoEnqueue(item, false);
-}
-
-template <class T>
-void MpscQueue<T>::DoEnqueue(const T &item, bool can_block) {
-  // Increment the write head to keep other writers from writing over this
-  // space.
-  int32_t old_head = ExchangeAdd(&(queue_->head_index), 1);
-  Fence();
-  // Wrap the index.
-  BitwiseAnd(&(queue_->head_index), wrapping_mask_);
-  // Technically, we need to do this for the index we're going to write to as
-  // well, in case a bunch of increments got run before their respective
-  // ANDings.
-  old_head &= wrapping_mask_;
-
-  volatile Node *write_at = queue_->array + old_head;
-
-  // Increment the number of people waiting. (This operates on only the first
-  // 2 bytes.) We need to do this even if we're not blocking.
-  volatile uint16_t *write_counter_ptr =
-      reinterpret_cast<volatile uint16_t *>(&(write_at->write_waiters));
-  const uint16_t my_wait_number = ExchangeAddWord(write_counter_ptr, 1);
-
-  // Implement blocking if we need to.
-  if (can_block) {
-    DoWriteBlocking(write_at, my_wait_number);
-  }
-
-  mpsc_queue::VolatileCopy(&write_at->value, &item, sizeof(item));
-
-  // Only now is it safe to alert readers that we have a new element.
-  Fence();
-  const uint32_t old_valid = Exchange(&(write_at->valid), 1);
-  assert(old_valid != 1 && "Attempt to overwrite existing space!");
-  if (old_valid == 2) {
-    // If there was someone waiting for this to be valid, we need to wake them
-    // up.
-    const int woke_up = FutexWake(&(write_at->valid), 1);
-    assert(woke_up <= 1 && "Woke up the wrong number of waiters?");
-    _UNUSED(woke_up);
-  }
-}
-
-template <class T>
-void MpscQueue<T>::DoWriteBlocking(volatile Node *write_at,
-                                   uint16_t my_wait_number) {
-  // Ignore the MSB.
-  my_wait_number &= 0x7FFF;
-
-  // We're sort of implementing the deli algorithm here. We wait for
-  // the wait counter to be equal to the woken counter.
-
-  uint32_t write_waiters = write_at->write_waiters;
-  uint16_t woken_counter = (write_waiters >> 16) & 0x7FFF;
-  // If the MSBs of the two counters are the same, then we know that they have
-  // both wrapped the same number of times, and we can use the standard logic
-  // below. If, however, they are different, then one has wrapped once more
-  // than the other, so we need to use the inverted logic instead.
-  bool inverted = (write_waiters & (1 << 15)) != (write_waiters & (1 << 31));
-  bool incremented_wait_counter = false;
-  while ((!inverted && woken_counter < my_wait_number) ||
-         (inverted && woken_counter > my_wait_number)) {
-    // Before we wait, mark that this thread is waiting.
-    if (!incremented_wait_counter) {
-      Increment(&(queue_->blocked_threads));
-      Fence();
-      incremented_wait_counter = true;
+  EnqueueBatchAt(&item, 1);
+}
+
+template <class T>
+void MpscQueue<T>::CancelReservation() {
+  EnqueueBatchAt(nullptr, 0);
+}
+
+template <class T>
+uint32_t MpscQueue<T>::ReserveBatch(uint32_t num_items) {
+  reserved_count_ = 0;
+  if (!num_items) {
+    return 0;
+  }
+
+  uint64_t head =
+      AtomicLoadQuad(&(queue_->head_index), ::std::memory_order_relaxed);
+  while (true) {
+    // Count how many consecutive spaces are free, starting at the head. This
+    // has to be an acquire, because it synchronizes with the release in
+    // FreeTail(), so that the consumer is guaranteed to be done reading a space
+    // before we write over it. (The consumer frees spaces in order, so we only
+    // really need this for the last one.)
+    uint32_t num_free = 0;
+    int32_t difference = 0;
+    while (num_free < num_items) {
+      volatile Node *write_at = NodeFor(head + num_free);
+      const uint32_t sequence =
+          AtomicLoad(&(write_at->sequence), ::std::memory_order_acquire);
+      difference =
+          static_cast<int32_t>(sequence - FreeSequence(head + num_free));
+      if (difference != 0) {
+        break;
+      }
+      ++num_free;
     }
 
-    FutexWait(&(write_at->write_waiters), write_waiters);
+    if (num_free) {
+      // Now we just have to claim the spaces before another producer does. We
+      // can't just blindly increment the head here, because we're not allowed
+      // to claim spaces that we can't use. The head only hands out spaces, and
+      // doesn't publish any data, so this can be relaxed.
+      if (CompareExchangeQuad(&(queue_->head_index), head, head + num_free,
+                              ::std::memory_order_relaxed)) {
+        reserved_ticket_ = head;
+        reserved_count_ = num_free;
+        return num_free;
+      }
+    } else if (difference < 0) {
+      // The consumer hasn't gotten to this space on the last lap yet, so the
+      // queue is full.
+      return 0;
+    }
 
-    write_waiters = write_at->write_waiters;
-    woken_counter = (write_waiters >> 16) & 0x7FFF;
-    inverted = (write_waiters & (1 << 15)) != (write_waiters & (1 << 31));
+    // Someone else got there first. Try again with the new head.
+    head = AtomicLoadQuad(&(queue_->head_index), ::std::memory_order_relaxed);
   }
+}
 
-  // If the thread waited, we have to mark that it is no longer waiting.
-  if (incremented_wait_counter) {
-    // Mark that this thread is no longer waiting.
-    Fence();
-    Decrement(&(queue_->blocked_threads));
+template <class T>
+void MpscQueue<T>::EnqueueBatchAt(const T *items, uint32_t num_items) {
+  assert(num_items <= reserved_count_ && "Not enough spaces reserved.");
+
+  if (reserved_count_ == 1 && num_items == 1) {
+    // This is the common case, and small items have a faster way of doing it.
+    WriteAndPublish(reserved_ticket_, *items);
+    reserved_count_ = 0;
+    return;
+  }
+
+  for (uint32_t i = 0; i < num_items; ++i) {
+    volatile Node *write_at = NodeFor(reserved_ticket_ + i);
+    mpsc_queue::VolatileCopy(&write_at->value, items + i, sizeof(T));
+  }
+  // We can't give any unused spaces back, because producers after us might
+  // have already claimed the ones after them. Instead, we mark them so that the
+  // consumer knows to skip them. Publish() takes care of the ordering.
+  for (uint32_t i = num_items; i < reserved_count_; ++i) {
+    volatile Node *write_at = NodeFor(reserved_ticket_ + i);
+    AtomicStore(&(write_at->cancelled), 1, ::std::memory_order_relaxed);
   }
+
+  Publish(reserved_ticket_, reserved_count_);
+  reserved_count_ = 0;
 }
 
 template <class T>
-void MpscQueue<T>::CancelReservation() {
-  // Decrementing write_length lets other people write over this space again.
-  Decrement(&(queue_->write_length));
+T *MpscQueue<T>::ReserveOverwriting(uint32_t *num_dropped) {
+  *num_dropped = 0;
+  // The acquire synchronizes with the release in SetOverwritable(), so if we
+  // see it, the consumer is already claiming everything that it reads.
+  if (!AtomicLoad(&(queue_->overwritable), ::std::memory_order_acquire)) {
+    return Reserve();
+  }
+  reserved_count_ = 0;
+
+  uint64_t head =
+      AtomicLoadQuad(&(queue_->head_index), ::std::memory_order_relaxed);
+  while (true) {
+    volatile Node *write_at = NodeFor(head);
+    // Same as in ReserveBatch().
+    const uint32_t sequence =
+        AtomicLoad(&(write_at->sequence), ::std::memory_order_acquire);
+
+    if (sequence == FreeSequence(head)) {
+      if (CompareExchangeQuad(&(queue_->head_index), head, head + 1,
+                              ::std::memory_order_relaxed)) {
+        reserved_ticket_ = head;
+        reserved_count_ = 1;
+
+        // Nobody else is touching this space until we publish it, so it's safe
+        // to cast away the volatile.
+        return const_cast<T *>(&(write_at->value));
+      }
+    } else if (sequence == FullSequence(head - wrapping_mask_ - 1)) {
+      // The queue is full, and the consumer hasn't touched the oldest item yet,
+      // so we can take it. We just free the node ourselves, the same way that
+      // the consumer would have, and then claim it the normal way. The consumer
+      // notices that it's gone when it tries to claim it. (See ClaimTail().)
+      if (CompareExchange(&(write_at->sequence), sequence, FreeSequence(head),
+                          ::std::memory_order_acquire)) {
+        if (AtomicLoad(&(write_at->cancelled), ::std::memory_order_relaxed)) {
+          // There wasn't actually anything here.
+          AtomicStore(&(write_at->cancelled), 0, ::std::memory_order_relaxed);
+        } else {
+          ++*num_dropped;
+        }
+
+        // A blocking producer might have claimed this ticket already, and be
+        // waiting for it.
+        Fence();
+        WakeProducers(head, 1);
+      }
+      // Either way, the node has changed, so look at it again.
+      continue;
+    } else if (static_cast<int32_t>(sequence - FreeSequence(head)) < 0) {
+      // Either the consumer is reading the oldest item right now, or its
+      // producer isn't done with it yet, so there's nothing we can do.
+      return nullptr;
+    }
+
+    // Someone else got there first. Try again with the new head.
+    head = AtomicLoadQuad(&(queue_->head_index), ::std::memory_order_relaxed);
+  }
+}
+
+template <class T>
+void MpscQueue<T>::SetOverwritable() {
+  overwritable_ = true;
+  AtomicStore(&(queue_->overwritable), 1, ::std::memory_order_release);
+}
+
+template <class T>
+void MpscQueue<T>::FindTail() {
+  // Every node is waiting for a particular ticket, either for its producer to
+  // write it or for the consumer to read it. The consumer frees nodes in order,
+  // so the tail is the oldest of those tickets. (Blocking producers claim
+  // tickets without waiting for space, so the head can be more than one lap
+  // ahead of it.)
+  const uint64_t head =
+      AtomicLoadQuad(&(queue_->head_index), ::std::memory_order_acquire);
+  tail_index_ = head;
+  for (uint64_t i = 0; i <= wrapping_mask_; ++i) {
+    const uint32_t sequence =
+        AtomicLoad(&(NodeFor(i)->sequence), ::std::memory_order_acquire);
+    // Only the lower bits of the ticket are stored, but it's always close to
+    // the head.
+    const int32_t difference =
+        static_cast<int32_t>((sequence & ~1u) - FreeSequence(head));
+    tail_index_ = ::std::min(tail_index_, head + difference / 2);
+  }
+  claimed_tail_ = false;
+}
+
+template <class T>
+bool MpscQueue<T>::EnqueueOverwriting(const T &item, uint32_t *num_dropped) {
+  if (!ReserveOverwriting(num_dropped)) {
+    return false;
+  }
+  EnqueueAt(item);
+
+  return true;
 }
 
 template <class T>
@@ -214,121 +321,356 @@ bool MpscQueue<T>::Enqueue(const T &item) {
 }
 
 template <class T>
-bool MpscQueue<T>::DequeueNext(T *item) {
-  // Check that the space we want to read is actually valid.
-  volatile Node *read_at = queue_->array + tail_index_;
-  if (!CompareExchange(&(read_at->valid), 1, 0)) {
-    // This means the space was not valid to begin with, and we have nothing
-    // left to read.
-    return false;
+uint32_t MpscQueue<T>::EnqueueBatch(const T *items, uint32_t num_items) {
+  const uint32_t num_reserved = ReserveBatch(num_items);
+  if (num_reserved) {
+    EnqueueBatchAt(items, num_reserved);
   }
 
-  DoDequeue(item, read_at);
+  return num_reserved;
+}
 
-  return true;
+template <class T>
+void MpscQueue<T>::WaitForSequence(volatile Node *node, uint32_t sequence,
+                                   volatile uint32_t *waiting) {
+  // The acquire synchronizes with whoever set the sequence number, so we're
+  // guaranteed to see everything they did to the node beforehand.
+  uint32_t current = AtomicLoad(&(node->sequence), ::std::memory_order_acquire);
+  if (current == sequence) {
+    // Fast path: No waiting required.
+    return;
+  }
+
+  // Before we wait, mark that this thread is waiting. This, and the subsequent
+  // loads, have to stay sequentially consistent: they pair with the update of
+  // the sequence number and the subsequent read of the waiting counter in
+  // Publish() and WakeProducers(), and we need to guarantee that
+  // either the other side sees us waiting, or the futex sees the updated
+  // sequence number.
+  Increment(waiting);
+  while ((current = AtomicLoad(&(node->sequence))) != sequence) {
+    FutexWait(&(node->sequence), current);
+  }
+  Decrement(waiting, ::std::memory_order_relaxed);
 }
 
 template <class T>
-bool MpscQueue<T>::PeekNext(T *item) {
-  // Check that the space we want to read is actually valid.
-  volatile Node *read_at = queue_->array + tail_index_;
-  // Adding zero gives us a way to read the value atomically.
-  const uint32_t valid = ExchangeAdd(&(read_at->valid), 0);
-  if (!valid) {
-    // This means that the space was not valid to begin with, and we have
-    // nothing left to read.
-    return false;
+void MpscQueue<T>::Publish(uint64_t first_ticket, uint32_t num_tickets) {
+  // Only now is it safe to alert the reader that we have new elements. This
+  // has to be a release, so that the items are visible to the consumer by the
+  // time it sees the sequence numbers, but it also can't be reordered with the
+  // read of consumer_waiting below. (See WaitForSequence().) For a single
+  // node, a sequentially consistent store is the cheapest way to do that, but
+  // for multiple nodes, we'd rather pay for a single fence.
+  if (num_tickets == 1) {
+    AtomicStore(&(NodeFor(first_ticket)->sequence),
+                FullSequence(first_ticket));
+  } else {
+    for (uint32_t i = 0; i < num_tickets; ++i) {
+      AtomicStore(&(NodeFor(first_ticket + i)->sequence),
+                  FullSequence(first_ticket + i), ::std::memory_order_release);
+    }
+    Fence();
   }
 
-  *item = const_cast<T &>(read_at->value);
+  WakeConsumer(first_ticket, num_tickets);
+}
 
-  return true;
+template <class T>
+void MpscQueue<T>::WakeConsumer(uint64_t first_ticket, uint32_t num_tickets) {
+  if (AtomicLoad(&(queue_->consumer_waiting))) {
+    // The consumer might be waiting on any of these nodes. Producers from later
+    // laps could be too, so we have to wake everyone, and let them sort it
+    // out.
+    for (uint32_t i = 0; i < num_tickets; ++i) {
+      FutexWake(&(NodeFor(first_ticket + i)->sequence),
+                ::std::numeric_limits<int>::max());
+    }
+  }
 }
 
 template <class T>
-void MpscQueue<T>::DoDequeue(T *item, volatile Node *read_at) {
-  // Cast away the volatile, as it's going back into non-shared memory.
-  *item = const_cast<T &>(read_at->value);
+void MpscQueue<T>::WriteAndPublish(uint64_t ticket, const T &item) {
+  // Like in Publish(), the sequence number has to be written with a
+  // sequentially-consistent store, so that it doesn't get reordered with the
+  // read of consumer_waiting.
+  WriteNode(NodeFor(ticket), item, FullSequence(ticket), NodeTag());
+  WakeConsumer(ticket, 1);
+}
 
+template <class T>
+void MpscQueue<T>::WriteNode(volatile Node *node, const T &item,
+                             uint32_t sequence, QuadNodeTag) {
+  // The item is at the beginning of the node, and the sequence number is
+  // right after it, so we can build both of them in a local word, and then
+  // write them all at once.
+  static_assert(offsetof(Node, sequence) == 4, "Unexpected node layout.");
+  uint8_t bytes[8] = {0};
+  memcpy(bytes, &item, sizeof(item));
+  memcpy(bytes + 4, &sequence, sizeof(sequence));
+  uint64_t word;
+  memcpy(&word, bytes, sizeof(word));
+
+  AtomicStoreQuad(reinterpret_cast<volatile uint64_t *>(node), word);
+}
+
+template <class T>
+void MpscQueue<T>::WriteNode(volatile Node *node, const T &item,
+                             uint32_t sequence, CopyNodeTag) {
+  mpsc_queue::VolatileCopy(&node->value, &item, sizeof(item));
+  AtomicStore(&(node->sequence), sequence);
+}
+
+template <class T>
+void MpscQueue<T>::FreeTail(::std::memory_order order) {
+  // Hand the node to the producer on the next lap. This has to be at least a
+  // release, so that we're done reading the item before anyone can write over
+  // it.
+  AtomicStore(&(NodeFor(tail_index_)->sequence),
+              FreeSequence(tail_index_ + wrapping_mask_ + 1), order);
   ++tail_index_;
-  // Wrap the index.
-  tail_index_ &= wrapping_mask_;
-
-  // Increment the woken counter.
-  volatile uint16_t *woken_counter =
-      reinterpret_cast<volatile uint16_t *>(&(read_at->write_waiters)) + 1;
-  IncrementWord(woken_counter);
-
-  Fence();
-  // Only now is it safe to decrement the write length and alert writers that
-  // there is a space.
-  Decrement(&(queue_->write_length));
+}
+
+template <class T>
+void MpscQueue<T>::WakeProducers(uint64_t first_ticket, uint32_t num_tickets) {
   // Check if anyone needs to be woken.
-  const uint32_t blocked_threads = ExchangeAdd(&(queue_->blocked_threads), 0);
-  if (blocked_threads) {
+  if (AtomicLoad(&(queue_->blocked_threads))) {
     // Wake all of them up. (One of them will actually continue.)
-    FutexWake(&(read_at->write_waiters),
-              ::std::numeric_limits<uint32_t>::max());
+    for (uint32_t i = 0; i < num_tickets; ++i) {
+      FutexWake(&(NodeFor(first_ticket + i)->sequence),
+                ::std::numeric_limits<int>::max());
+    }
   }
 }
 
 template <class T>
-void MpscQueue<T>::EnqueueBlocking(const T &item) {
-  // Increment the write length now, to keep other writers from writing off the
-  // end.
-  Increment(&(queue_->write_length));
-  Fence();
+void MpscQueue<T>::Release() {
+  // Like in Publish(), freeing the node can't be reordered with the read of
+  // blocked_threads in WakeProducers().
+  const uint64_t ticket = tail_index_;
+  FreeTail(::std::memory_order_seq_cst);
+  claimed_tail_ = false;
+  WakeProducers(ticket, 1);
+}
+
+template <class T>
+bool MpscQueue<T>::SkipCancelled() {
+  if (overwritable_) {
+    return ClaimTail();
+  }
+
+  while (true) {
+    // The acquire synchronizes with the release in Publish(), so we're
+    // guaranteed to see the whole item.
+    volatile Node *read_at = NodeFor(tail_index_);
+    if (AtomicLoad(&(read_at->sequence), ::std::memory_order_acquire) !=
+        FullSequence(tail_index_)) {
+      // The producer isn't done with this space, and we have nothing left to
+      // read.
+      return false;
+    }
 
-  // Now that we have a spot, we can just be lazy and let DoEnqueue() do the
-  // work for us. If the queue is already full, we'll have it block for us too.
-  DoEnqueue(item, true);
+    if (!AtomicLoad(&(read_at->cancelled), ::std::memory_order_relaxed)) {
+      return true;
+    }
+    AtomicStore(&(read_at->cancelled), 0, ::std::memory_order_relaxed);
+    Release();
+  }
 }
 
 template <class T>
-void MpscQueue<T>::DequeueNextBlocking(T *item) {
-  // Check that the space we want to read is actually valid.
-  volatile Node *read_at = queue_->array + tail_index_;
-  if (!CompareExchange(&(read_at->valid), 1, 0)) {
-    // This means the space was not valid to begin with, and we have nothing
-    // left to read. We indicate that we are waiting for something in this spot
-    // by setting its value to 2.
-    if (CompareExchange(&(read_at->valid), 0, 2)) {
-      while (read_at->valid == 2) {
-        // Wait for it to become valid.
-        FutexWait(&(read_at->valid), 2);
+bool MpscQueue<T>::ClaimTail() {
+  if (claimed_tail_) {
+    // We already have it.
+    return true;
+  }
+
+  while (true) {
+    volatile Node *read_at = NodeFor(tail_index_);
+    // Same as in SkipCancelled().
+    const uint32_t sequence =
+        AtomicLoad(&(read_at->sequence), ::std::memory_order_acquire);
+    const int32_t difference =
+        static_cast<int32_t>(sequence - FullSequence(tail_index_));
+    if (difference < 0) {
+      // The producer isn't done with this space, and we have nothing left to
+      // read.
+      return false;
+    }
+    if (difference > 0) {
+      // A producer overwrote this item, and the node now belongs to a later
+      // lap, so we just skip it without freeing it.
+      ++tail_index_;
+      continue;
+    }
+
+    // Claim the node by setting it back to the state it had before its
+    // producer wrote it. Producers will see that as full, but not as something
+    // that they can overwrite. If this fails, a producer just overwrote it.
+    if (!CompareExchange(&(read_at->sequence), sequence,
+                         FreeSequence(tail_index_),
+                         ::std::memory_order_acquire)) {
+      continue;
+    }
+    claimed_tail_ = true;
+
+    if (!AtomicLoad(&(read_at->cancelled), ::std::memory_order_relaxed)) {
+      return true;
+    }
+    // Skip cancelled spaces.
+    AtomicStore(&(read_at->cancelled), 0, ::std::memory_order_relaxed);
+    Release();
+  }
+}
+
+template <class T>
+void MpscQueue<T>::WaitForTail() {
+  volatile Node *read_at = NodeFor(tail_index_);
+
+  // Same as in WaitForSequence(), except that anything at or past the sequence
+  // number we want will do.
+  Increment(&(queue_->consumer_waiting));
+  uint32_t current;
+  while (static_cast<int32_t>((current = AtomicLoad(&(read_at->sequence))) -
+                              FullSequence(tail_index_)) < 0) {
+    FutexWait(&(read_at->sequence), current);
+  }
+  Decrement(&(queue_->consumer_waiting), ::std::memory_order_relaxed);
+}
+
+template <class T>
+bool MpscQueue<T>::DequeueNext(T *item) {
+  if (!SkipCancelled()) {
+    return false;
+  }
+
+  mpsc_queue::ReadItem(item, &(NodeFor(tail_index_)->value));
+  last_sequence_ = tail_index_;
+  Release();
+
+  return true;
+}
+
+template <class T>
+uint32_t MpscQueue<T>::DequeueBatch(T *items, uint32_t max_items) {
+  const uint64_t first_ticket = tail_index_;
+
+  uint32_t num_read = 0;
+  while (num_read < max_items) {
+    if (overwritable_) {
+      // Every node has to be claimed first, but other than that, it's the
+      // same.
+      if (!ClaimTail()) {
+        break;
       }
+      mpsc_queue::ReadItem(items + num_read++, &(NodeFor(tail_index_)->value));
+      last_sequence_ = tail_index_;
+      FreeTail(::std::memory_order_release);
+      claimed_tail_ = false;
+      continue;
+    }
+
+    // The acquire synchronizes with the release in Publish(), so we're
+    // guaranteed to see the whole item.
+    volatile Node *read_at = NodeFor(tail_index_);
+    if (AtomicLoad(&(read_at->sequence), ::std::memory_order_acquire) !=
+        FullSequence(tail_index_)) {
+      // We've read everything that's available.
+      break;
+    }
+
+    if (AtomicLoad(&(read_at->cancelled), ::std::memory_order_relaxed)) {
+      // Skip cancelled spaces.
+      AtomicStore(&(read_at->cancelled), 0, ::std::memory_order_relaxed);
+    } else {
+      mpsc_queue::ReadItem(items + num_read++, &(read_at->value));
+      last_sequence_ = tail_index_;
     }
-    // Since we only have one consumer, if we get here, we can be confident
-    // that it's now valid. We now have to mark it as invalid before continuing,
-    // though.
-    Exchange(&(read_at->valid), 0);
+    FreeTail(::std::memory_order_release);
+  }
+
+  // Now we can wake up any blocked producers all at once. The fence does the
+  // same thing as the sequentially-consistent store in Release().
+  if (tail_index_ != first_ticket) {
+    Fence();
+    WakeProducers(first_ticket, tail_index_ - first_ticket);
+  }
+
+  return num_read;
+}
+
+template <class T>
+bool MpscQueue<T>::PeekNext(T *item) {
+  if (!SkipCancelled()) {
+    return false;
   }
-  assert(read_at->valid == 0 && "Reading from node not marked as invalid.");
 
-  DoDequeue(item, read_at);
+  mpsc_queue::ReadItem(item, &(NodeFor(tail_index_)->value));
+  last_sequence_ = tail_index_;
+
+  return true;
+}
+
+template <class T>
+const T *MpscQueue<T>::ReadView() {
+  if (!SkipCancelled()) {
+    return nullptr;
+  }
+
+  last_sequence_ = tail_index_;
+  // Producers won't touch this space until we release it, so it's safe to cast
+  // away the volatile.
+  return const_cast<const T *>(&(NodeFor(tail_index_)->value));
+}
+
+template <class T>
+void MpscQueue<T>::EnqueueBlocking(const T &item) {
+  // Since we're willing to wait for our space, we can claim it
+  // unconditionally.
+  const uint64_t ticket =
+      ExchangeAddQuad(&(queue_->head_index), 1, ::std::memory_order_relaxed);
+
+  // If the queue is already full, wait for the consumer to free our space.
+  volatile Node *write_at = NodeFor(ticket);
+  WaitForSequence(write_at, FreeSequence(ticket), &(queue_->blocked_threads));
+
+  WriteAndPublish(ticket, item);
+}
+
+template <class T>
+void MpscQueue<T>::DequeueNextBlocking(T *item) {
+  PeekNextBlocking(item);
+  Release();
 }
 
 template <class T>
 void MpscQueue<T>::PeekNextBlocking(T *item) {
-  // Check that the space we want to read is actually valid.
-  volatile Node *read_at = queue_->array + tail_index_;
-  const uint32_t valid = ExchangeAdd(&(read_at->valid), 0);
-  if (!valid) {
-    // The space was not valid to begin with, and we have nothing left to read.
-    // We indicate that we are waiting for something in this spot by setting its
-    // valid to 2.
-    if (CompareExchange(&(read_at->valid), 0, 2)) {
-      while (read_at->valid == 2) {
-        // Wait for it to become valid.
-        FutexWait(&(read_at->valid), 2);
-      }
+  if (overwritable_) {
+    // The node we're waiting for could get overwritten while we wait, so we
+    // can't wait for a specific sequence number.
+    while (!ClaimTail()) {
+      WaitForTail();
     }
-    // Since we only have one consumer, if we get here, we can be confident that
-    // it's now valid.
+    mpsc_queue::ReadItem(item, &(NodeFor(tail_index_)->value));
+    last_sequence_ = tail_index_;
+    return;
   }
-  assert(read_at->valid == 1 && "Peeking from node not marked as valid.");
 
-  *item = const_cast<T &>(read_at->value);
+  while (true) {
+    volatile Node *read_at = NodeFor(tail_index_);
+    WaitForSequence(read_at, FullSequence(tail_index_),
+                    &(queue_->consumer_waiting));
+
+    if (!AtomicLoad(&(read_at->cancelled), ::std::memory_order_relaxed)) {
+      mpsc_queue::ReadItem(item, &(read_at->value));
+      last_sequence_ = tail_index_;
+      return;
+    }
+
+    // Skip cancelled spaces.
+    AtomicStore(&(read_at->cancelled), 0, ::std::memory_order_relaxed);
+    Release();
+  }
 }
 
 template <class T>
@@ -340,10 +682,10 @@ template <class T>
 void MpscQueue<T>::FreeQueue() {
   // We just do pointer arithmetic with the freed blocks, so it's okay to cast
   // away the volatile.
-  Node *array = const_cast<Node *>(queue_->array);
+  uint8_t *array = const_cast<uint8_t *>(array_);
 
   // Free the array first.
-  pool_->FreeArray<Node>(array, queue_->array_length);
+  pool_->FreeArray<uint8_t>(array, queue_->array_length * node_stride_);
   // Now free the rest of the queue data.
   pool_->FreeType<RawQueue>(queue_);
 }
@@ -1,10 +1,197 @@
 #include "mpsc_queue_internal.h"
 
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "constants.h"
+
 namespace tachyon {
 namespace mpsc_queue {
 
+namespace {
+
+// A vectorized copy kernel. These are only ever called with at least
+// kVectorCopyMinSize bytes, and the buffers never overlap.
+// Args:
+//  dest: The destination buffer.
+//  src: The source buffer.
+//  length: How many bytes to copy.
+typedef void (*CopyKernel)(uint8_t *__restrict__ dest,
+                           const uint8_t *__restrict__ src, uint32_t length);
+
+#if defined(__x86_64__)
+
+// SSE2 is part of the x86-64 baseline, so this one is always available.
+void Sse2Copy(uint8_t *__restrict__ dest, const uint8_t *__restrict__ src,
+              uint32_t length) {
+  // The last 16 bytes are always copied with an unaligned store at the end,
+  // which might overlap with what the loops copy.
+  const __m128i last = _mm_loadu_si128(
+      reinterpret_cast<const __m128i *>(src + length - 16));
+  uint8_t *last_dest = dest + length - 16;
+
+  if (length >= kNonTemporalCopyThreshold) {
+    // Streaming stores have to be aligned, so copy the first few bytes
+    // normally, and then start at the next aligned address.
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dest),
+                     _mm_loadu_si128(reinterpret_cast<const __m128i *>(src)));
+    const uint32_t skip = 16 - (reinterpret_cast<uintptr_t>(dest) & 15);
+    dest += skip;
+    src += skip;
+    length -= skip;
+
+    for (; length >= 16; length -= 16, dest += 16, src += 16) {
+      _mm_stream_si128(reinterpret_cast<__m128i *>(dest),
+                       _mm_loadu_si128(reinterpret_cast<const __m128i *>(src)));
+    }
+  } else {
+    for (; length >= 64; length -= 64, dest += 64, src += 64) {
+      const __m128i *src_vec = reinterpret_cast<const __m128i *>(src);
+      __m128i *dest_vec = reinterpret_cast<__m128i *>(dest);
+      const __m128i a = _mm_loadu_si128(src_vec);
+      const __m128i b = _mm_loadu_si128(src_vec + 1);
+      const __m128i c = _mm_loadu_si128(src_vec + 2);
+      const __m128i d = _mm_loadu_si128(src_vec + 3);
+      _mm_storeu_si128(dest_vec, a);
+      _mm_storeu_si128(dest_vec + 1, b);
+      _mm_storeu_si128(dest_vec + 2, c);
+      _mm_storeu_si128(dest_vec + 3, d);
+    }
+    for (; length >= 16; length -= 16, dest += 16, src += 16) {
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(dest),
+                       _mm_loadu_si128(reinterpret_cast<const __m128i *>(src)));
+    }
+  }
+
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(last_dest), last);
+  // Streaming stores are weakly-ordered, so they have to be fenced before
+  // anyone publishes the buffer. For normal stores, this is cheap.
+  _mm_sfence();
+}
+
+// Same as above, but uses 32-byte AVX2 registers.
+__attribute__((target("avx2"))) void Avx2Copy(uint8_t *__restrict__ dest,
+                                              const uint8_t *__restrict__ src,
+                                              uint32_t length) {
+  const __m256i last = _mm256_loadu_si256(
+      reinterpret_cast<const __m256i *>(src + length - 32));
+  uint8_t *last_dest = dest + length - 32;
+
+  if (length >= kNonTemporalCopyThreshold) {
+    _mm256_storeu_si256(
+        reinterpret_cast<__m256i *>(dest),
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src)));
+    const uint32_t skip = 32 - (reinterpret_cast<uintptr_t>(dest) & 31);
+    dest += skip;
+    src += skip;
+    length -= skip;
+
+    for (; length >= 32; length -= 32, dest += 32, src += 32) {
+      _mm256_stream_si256(
+          reinterpret_cast<__m256i *>(dest),
+          _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src)));
+    }
+  } else {
+    for (; length >= 128; length -= 128, dest += 128, src += 128) {
+      const __m256i *src_vec = reinterpret_cast<const __m256i *>(src);
+      __m256i *dest_vec = reinterpret_cast<__m256i *>(dest);
+      const __m256i a = _mm256_loadu_si256(src_vec);
+      const __m256i b = _mm256_loadu_si256(src_vec + 1);
+      const __m256i c = _mm256_loadu_si256(src_vec + 2);
+      const __m256i d = _mm256_loadu_si256(src_vec + 3);
+      _mm256_storeu_si256(dest_vec, a);
+      _mm256_storeu_si256(dest_vec + 1, b);
+      _mm256_storeu_si256(dest_vec + 2, c);
+      _mm256_storeu_si256(dest_vec + 3, d);
+    }
+    for (; length >= 32; length -= 32, dest += 32, src += 32) {
+      _mm256_storeu_si256(
+          reinterpret_cast<__m256i *>(dest),
+          _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src)));
+    }
+  }
+
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(last_dest), last);
+  _mm_sfence();
+}
+
+#elif defined(__ARM_NEON)
+
+// NEON is part of the AArch64 baseline. ARM has non-temporal load and store
+// pairs, but they are only hints, and don't do much on common cores, so we
+// always use normal stores.
+void NeonCopy(uint8_t *__restrict__ dest, const uint8_t *__restrict__ src,
+              uint32_t length) {
+  const uint8x16_t last = vld1q_u8(src + length - 16);
+  uint8_t *last_dest = dest + length - 16;
+
+  for (; length >= 64; length -= 64, dest += 64, src += 64) {
+    const uint8x16x4_t block = vld1q_u8_x4(src);
+    vst1q_u8_x4(dest, block);
+  }
+  for (; length >= 16; length -= 16, dest += 16, src += 16) {
+    vst1q_u8(dest, vld1q_u8(src));
+  }
+
+  vst1q_u8(last_dest, last);
+  // Other threads will see these stores by the time they see the release
+  // store that publishes the buffer.
+}
+
+#else
+
+// We don't have a vector kernel for this architecture, so let the compiler do
+// what it thinks is best.
+void GenericCopy(uint8_t *__restrict__ dest, const uint8_t *__restrict__ src,
+                 uint32_t length) {
+  memcpy(dest, src, length);
+}
+
+#endif
+
+// Figures out which copy kernel to use on this CPU.
+// Returns:
+//  The fastest supported kernel.
+CopyKernel SelectCopyKernel() {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return Avx2Copy;
+  }
+  return Sse2Copy;
+#elif defined(__ARM_NEON)
+  return NeonCopy;
+#else
+  return GenericCopy;
+#endif
+}
+
+// Returns:
+//  The copy kernel to use. It is only selected once.
+CopyKernel GetCopyKernel() {
+  static const CopyKernel kKernel = SelectCopyKernel();
+  return kKernel;
+}
+
+}  // namespace
+
 volatile void *VolatileCopy(volatile void *__restrict__ dest,
                             const void *__restrict__ src, uint32_t length) {
+  if (length >= kVectorCopyMinSize) {
+    // The vector kernels write every byte exactly the way a volatile copy
+    // would, and they fence their stores, so it's safe to cast away the
+    // volatile.
+    GetCopyKernel()(const_cast<uint8_t *>(
+                        reinterpret_cast<volatile uint8_t *>(dest)),
+                    reinterpret_cast<const uint8_t *>(src), length);
+    return dest;
+  }
+
   const uintptr_t dest_int = reinterpret_cast<const uintptr_t>(dest);
   const uintptr_t src_int = reinterpret_cast<const uintptr_t>(src);
 
@@ -12,8 +199,6 @@ volatile void *VolatileCopy(volatile void *__restrict__ dest,
   if (!(dest_int & 0x3) && !(src_int & 0x3)) {
     // Copy in 64-bit increments. Even on 32-bit architectures, the generated
     // code should still be as efficient as copying in 32-bit increments.
-    // TODO (danielp): Look into using SSE to accelerate. Right now, the
-    // marginal speedup is not worth the extra effort.
     volatile uint64_t *dest_long = reinterpret_cast<volatile uint64_t *>(dest);
     const uint64_t *src_long = reinterpret_cast<const uint64_t *>(src);
 
@@ -34,6 +219,42 @@ volatile void *VolatileCopy(volatile void *__restrict__ dest,
   return dest;
 }
 
+void *VolatileRead(void *__restrict__ dest,
+                   const volatile void *__restrict__ src, uint32_t length) {
+  if (length >= kVectorCopyMinSize) {
+    GetCopyKernel()(reinterpret_cast<uint8_t *>(dest),
+                    const_cast<const uint8_t *>(
+                        reinterpret_cast<const volatile uint8_t *>(src)),
+                    length);
+    return dest;
+  }
+
+  const uintptr_t dest_int = reinterpret_cast<const uintptr_t>(dest);
+  const uintptr_t src_int = reinterpret_cast<const uintptr_t>(src);
+
+  // Same as above.
+  if (!(dest_int & 0x3) && !(src_int & 0x3)) {
+    uint64_t *dest_long = reinterpret_cast<uint64_t *>(dest);
+    const volatile uint64_t *src_long =
+        reinterpret_cast<const volatile uint64_t *>(src);
+
+    while (length >= 8) {
+      *dest_long++ = *src_long++;
+      length -= 8;
+    }
+  }
+
+  uint8_t *dest_byte = reinterpret_cast<uint8_t *>(dest);
+  const volatile uint8_t *src_byte =
+      reinterpret_cast<const volatile uint8_t *>(src);
+
+  while (length--) {
+    *dest_byte++ = *src_byte++;
+  }
+
+  return dest;
+}
+
 bool IntLog2(uint32_t input, uint8_t *log) {
   for (*log = 0; *log < 32; ++(*log)) {
     if (input & 0x1) {
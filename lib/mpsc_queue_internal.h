@@ -9,7 +9,15 @@ namespace mpsc_queue {
 // Defines functions that are not part of the MpscQueue template, but are used
 // internally therein. We do it this way to avoid linker errors.
 
-// Memcpy-like function that handles a volatile destination buffer.
+// Copies that are smaller than this are done with plain 64-bit moves, since
+// they aren't worth the overhead of picking a vector kernel.
+constexpr uint32_t kVectorCopyMinSize = 64;
+
+// Memcpy-like function that handles a volatile destination buffer. Big copies
+// use the widest vector instructions that the CPU supports, which is detected
+// at runtime, and copies of at least kNonTemporalCopyThreshold bytes bypass the
+// cache. All stores are visible to other threads by the time it returns, so it
+// is safe to publish the buffer right afterwards.
 // Args:
 //  dest: The destination volatile buffer.
 //  src: The source buffer. (Non-volatile).
@@ -18,6 +26,30 @@ namespace mpsc_queue {
 //  The destination address.
 volatile void *VolatileCopy(volatile void *__restrict__ dest,
                             const void *__restrict__ src, uint32_t length);
+// Same as VolatileCopy(), but for copying out of a volatile buffer.
+// Args:
+//  dest: The destination buffer. (Non-volatile).
+//  src: The source volatile buffer.
+//  length: How many bytes to copy.
+// Returns:
+//  The destination address.
+void *VolatileRead(void *__restrict__ dest,
+                   const volatile void *__restrict__ src, uint32_t length);
+
+// Copies an item out of a queue. Small items are just assigned, so that the
+// compiler can inline the copy, and bigger ones go through VolatileRead().
+// Args:
+//  dest: Where to copy the item.
+//  src: The item in the queue.
+template <class T>
+inline void ReadItem(T *dest, const volatile T *src) {
+  if (sizeof(T) < kVectorCopyMinSize) {
+    // Cast away the volatile, as it's going back into non-shared memory.
+    *dest = const_cast<const T &>(*src);
+  } else {
+    VolatileRead(dest, src, sizeof(T));
+  }
+}
 
 // Calculates the integral base-2 log of an integer.
 // Args:
@@ -1,5 +1,11 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
 #include <future>
 #include <thread>
+#include <vector>
 
 #include <gtest/gtest.h>
 
@@ -131,6 +137,35 @@ int AlternatingConsumerThread(MpscQueue<int> *queue, int num_producers) {
   return total;
 }
 
+// Pushes a few laps worth of items through a queue of a particular type,
+// alternating between normal and blocking enqueues.
+// Args:
+//  pad_nodes: Whether to pad the queue nodes.
+template <class T>
+void CheckItemType(bool pad_nodes) {
+  auto queue = MpscQueue<T>::Create(8, pad_nodes);
+  ASSERT_NE(nullptr, queue);
+
+  T on_queue;
+  for (int i = 0; i < 40; ++i) {
+    const T item = static_cast<T>(i * 7 + 1);
+    if (i % 2) {
+      ASSERT_TRUE(queue->Enqueue(item));
+    } else {
+      queue->EnqueueBlocking(item);
+    }
+    ASSERT_TRUE(queue->Enqueue(item));
+
+    ASSERT_TRUE(queue->DequeueNext(&on_queue));
+    EXPECT_EQ(item, on_queue);
+    queue->DequeueNextBlocking(&on_queue);
+    EXPECT_EQ(item, on_queue);
+  }
+  EXPECT_FALSE(queue->DequeueNext(&on_queue));
+
+  queue->FreeQueue();
+}
+
 }  // namespace
 
 // Tests for the queue.
@@ -184,6 +219,238 @@ TEST_F(MpscQueueTest, DequeueTest) {
   EXPECT_FALSE(queue_->DequeueNext(&on_queue));
 }
 
+// Test that cancelled reservations get skipped by the consumer.
+TEST_F(MpscQueueTest, CancelReservationTest) {
+  ASSERT_TRUE(queue_->Enqueue(0));
+  ASSERT_TRUE(queue_->Reserve());
+  queue_->CancelReservation();
+  ASSERT_TRUE(queue_->Reserve());
+  queue_->EnqueueAt(1);
+  ASSERT_TRUE(queue_->Reserve());
+  queue_->CancelReservation();
+
+  int on_queue;
+  EXPECT_TRUE(queue_->DequeueNext(&on_queue));
+  EXPECT_EQ(0, on_queue);
+  EXPECT_TRUE(queue_->PeekNext(&on_queue));
+  EXPECT_EQ(1, on_queue);
+  queue_->DequeueNextBlocking(&on_queue);
+  EXPECT_EQ(1, on_queue);
+
+  // The cancelled space at the end should not be visible either.
+  EXPECT_FALSE(queue_->PeekNext(&on_queue));
+  EXPECT_FALSE(queue_->DequeueNext(&on_queue));
+
+  // Once they've been skipped, the cancelled spaces should be usable again.
+  for (int i = 0; i < kQueueCapacity; ++i) {
+    EXPECT_TRUE(queue_->Enqueue(i));
+  }
+  EXPECT_FALSE(queue_->Enqueue(kQueueCapacity));
+}
+
+// Test that producers can overwrite the oldest items.
+TEST_F(MpscQueueTest, OverwriteTest) {
+  auto producer = MpscQueue<int>::Load(queue_->GetOffset());
+
+  // Overwriting a cancelled space shouldn't count as dropping anything.
+  ASSERT_TRUE(producer->Reserve());
+  producer->CancelReservation();
+  for (int i = 1; i < kQueueCapacity; ++i) {
+    ASSERT_TRUE(producer->Enqueue(i));
+  }
+  ASSERT_FALSE(producer->Enqueue(kQueueCapacity));
+
+  // Nothing can be overwritten until the consumer allows it.
+  uint32_t num_dropped;
+  EXPECT_EQ(nullptr, producer->ReserveOverwriting(&num_dropped));
+  EXPECT_EQ(0u, num_dropped);
+  queue_->SetOverwritable();
+
+  int *space = producer->ReserveOverwriting(&num_dropped);
+  ASSERT_NE(nullptr, space);
+  EXPECT_EQ(0u, num_dropped);
+  *space = kQueueCapacity;
+  producer->Commit();
+
+  // Now it should drop the oldest item.
+  space = producer->ReserveOverwriting(&num_dropped);
+  ASSERT_NE(nullptr, space);
+  EXPECT_EQ(1u, num_dropped);
+  *space = kQueueCapacity + 1;
+  producer->Commit();
+
+  // The item that we're reading can't be overwritten.
+  const int *item = queue_->ReadView();
+  ASSERT_NE(nullptr, item);
+  EXPECT_EQ(2, *item);
+  EXPECT_EQ(2u, queue_->GetSequence());
+  EXPECT_EQ(nullptr, producer->ReserveOverwriting(&num_dropped));
+  EXPECT_EQ(0u, num_dropped);
+  queue_->Release();
+
+  int on_queue;
+  // Every item's sequence number is the same as its value here.
+  for (int i = 3; i <= kQueueCapacity + 1; ++i) {
+    ASSERT_TRUE(queue_->DequeueNext(&on_queue));
+    EXPECT_EQ(i, on_queue);
+    EXPECT_EQ(static_cast<uint64_t>(i), queue_->GetSequence());
+  }
+  EXPECT_FALSE(queue_->DequeueNext(&on_queue));
+}
+
+// Test that a new handle can pick up where an old consumer left off.
+TEST_F(MpscQueueTest, FindTailTest) {
+  for (int i = 0; i < kQueueCapacity; ++i) {
+    ASSERT_TRUE(queue_->Enqueue(i));
+  }
+  int on_queue;
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_TRUE(queue_->DequeueNext(&on_queue));
+  }
+  for (int i = kQueueCapacity; i < kQueueCapacity + 3; ++i) {
+    ASSERT_TRUE(queue_->Enqueue(i));
+  }
+
+  // A blocking producer claims its ticket even though the queue is full, which
+  // puts the head more than a lap ahead of the tail.
+  ::std::thread producer(
+      [&]() { queue_->EnqueueBlocking(kQueueCapacity + 3); });
+  ::std::this_thread::sleep_for(::std::chrono::milliseconds(50));
+
+  auto consumer = MpscQueue<int>::Load(queue_->GetOffset());
+  consumer->FindTail();
+  for (int i = 3; i <= kQueueCapacity + 3; ++i) {
+    consumer->DequeueNextBlocking(&on_queue);
+    EXPECT_EQ(i, on_queue);
+  }
+  producer.join();
+  EXPECT_FALSE(consumer->DequeueNext(&on_queue));
+
+  // Once everything has been read, it should start at the head.
+  auto consumer2 = MpscQueue<int>::Load(queue_->GetOffset());
+  consumer2->FindTail();
+  ASSERT_TRUE(queue_->Enqueue(42));
+  ASSERT_TRUE(consumer2->DequeueNext(&on_queue));
+  EXPECT_EQ(42, on_queue);
+}
+
+// Test that batch operations work.
+TEST_F(MpscQueueTest, BatchTest) {
+  int items[kQueueCapacity * 2];
+  for (int i = 0; i < kQueueCapacity * 2; ++i) {
+    items[i] = i;
+  }
+
+  // It should only add as many as will fit.
+  ASSERT_TRUE(queue_->Enqueue(-1));
+  EXPECT_EQ(static_cast<uint32_t>(kQueueCapacity - 1),
+            queue_->EnqueueBatch(items, kQueueCapacity * 2));
+  EXPECT_EQ(0u, queue_->EnqueueBatch(items, 1));
+
+  int on_queue[kQueueCapacity * 2];
+  EXPECT_EQ(1u, queue_->DequeueBatch(on_queue, 1));
+  EXPECT_EQ(-1, on_queue[0]);
+  EXPECT_EQ(static_cast<uint32_t>(kQueueCapacity - 1),
+            queue_->DequeueBatch(on_queue, kQueueCapacity * 2));
+  for (int i = 0; i < kQueueCapacity - 1; ++i) {
+    EXPECT_EQ(i, on_queue[i]);
+  }
+  EXPECT_EQ(0u, queue_->DequeueBatch(on_queue, kQueueCapacity));
+
+  // It should skip over cancelled spaces, and leave ones it didn't ask for.
+  ASSERT_EQ(3u, queue_->ReserveBatch(3));
+  queue_->EnqueueBatchAt(items, 1);
+  ASSERT_EQ(2u, queue_->EnqueueBatch(items + 1, 2));
+  EXPECT_EQ(2u, queue_->DequeueBatch(on_queue, 2));
+  EXPECT_EQ(0, on_queue[0]);
+  EXPECT_EQ(1, on_queue[1]);
+  int last;
+  EXPECT_TRUE(queue_->DequeueNext(&last));
+  EXPECT_EQ(2, last);
+}
+
+// Test that we can use batch operations with multiple threads.
+TEST_F(MpscQueueTest, BatchSpscTest) {
+  ::std::thread producer([this]() {
+    int items[10];
+    for (int i = -3000; i <= 3000;) {
+      const int num_items = ::std::min(10, 3001 - i);
+      for (int j = 0; j < num_items; ++j) {
+        items[j] = i + j;
+      }
+      i += queue_->EnqueueBatch(items, num_items);
+    }
+  });
+
+  int total = 0;
+  int num_read = 0;
+  int items[7];
+  while (num_read < 6001) {
+    const uint32_t batch_size = queue_->DequeueBatch(items, 7);
+    for (uint32_t i = 0; i < batch_size; ++i) {
+      total += items[i];
+    }
+    num_read += batch_size;
+  }
+
+  producer.join();
+  EXPECT_EQ(0, total);
+  EXPECT_EQ(6001, num_read);
+}
+
+// Test that we can write and read items in place.
+TEST_F(MpscQueueTest, ZeroCopyTest) {
+  for (int i = 0; i < kQueueCapacity; ++i) {
+    int *space = queue_->Reserve();
+    ASSERT_NE(nullptr, space);
+    *space = i;
+    queue_->Commit();
+  }
+  // It should be full now.
+  EXPECT_EQ(nullptr, queue_->Reserve());
+
+  for (int i = 0; i < kQueueCapacity; ++i) {
+    const int *item = queue_->ReadView();
+    ASSERT_NE(nullptr, item);
+    EXPECT_EQ(i, *item);
+    // Reading it again should give us the same thing.
+    EXPECT_EQ(item, queue_->ReadView());
+    queue_->Release();
+  }
+  EXPECT_EQ(nullptr, queue_->ReadView());
+
+  // It should work with cancelled reservations too.
+  ASSERT_NE(nullptr, queue_->Reserve());
+  queue_->CancelReservation();
+  ASSERT_TRUE(queue_->Enqueue(42));
+  const int *item = queue_->ReadView();
+  ASSERT_NE(nullptr, item);
+  EXPECT_EQ(42, *item);
+  queue_->Release();
+  EXPECT_EQ(nullptr, queue_->ReadView());
+}
+
+// Test that the queue keeps working after wrapping around many times.
+TEST_F(MpscQueueTest, WrapTest) {
+  int on_queue;
+  for (int i = 0; i < kQueueCapacity * 10; ++i) {
+    ASSERT_TRUE(queue_->Enqueue(i));
+    if (i % 2) {
+      queue_->EnqueueBlocking(-i);
+    } else {
+      ASSERT_TRUE(queue_->Enqueue(-i));
+    }
+
+    EXPECT_TRUE(queue_->DequeueNext(&on_queue));
+    EXPECT_EQ(i, on_queue);
+    queue_->DequeueNextBlocking(&on_queue);
+    EXPECT_EQ(-i, on_queue);
+  }
+
+  // There should be nothing left.
+  EXPECT_FALSE(queue_->DequeueNext(&on_queue));
+}
+
 // Test that we can use the queue normally in a single-threaded case.
 TEST_F(MpscQueueTest, SingleThreadTest) {
   int dequeue_counter = 0;
@@ -263,6 +530,77 @@ TEST_F(MpscQueueTest, StructTest) {
   queue->FreeQueue();
 }
 
+// Test that small items, which are written together with the node's sequence
+// number, come out intact.
+TEST_F(MpscQueueTest, SmallItemTest) {
+  CheckItemType<uint8_t>(false);
+  CheckItemType<uint16_t>(false);
+  CheckItemType<float>(false);
+  CheckItemType<int64_t>(false);
+  CheckItemType<double>(false);
+  CheckItemType<double>(true);
+}
+
+// Test that copies into and out of volatile buffers work for all sizes and
+// alignments, including the ones that use vector and non-temporal stores.
+TEST_F(MpscQueueTest, VolatileCopyTest) {
+  const uint32_t kSizes[] = {0,   1,    7,    8,    63,
+                             64,  65,   100,  1000, 4099,
+                             kNonTemporalCopyThreshold + 77};
+  const uint32_t kMaxSize = kNonTemporalCopyThreshold + 77;
+
+  ::std::vector<uint8_t> source(kMaxSize + 64);
+  for (uint32_t i = 0; i < source.size(); ++i) {
+    source[i] = static_cast<uint8_t>(i * 13 + 5);
+  }
+  ::std::vector<uint8_t> shared(kMaxSize + 64);
+  ::std::vector<uint8_t> dest(kMaxSize + 64);
+
+  for (uint32_t size : kSizes) {
+    for (uint32_t offset : {0, 1, 4, 8, 13, 32}) {
+      ::std::fill(shared.begin(), shared.end(), 0);
+      ::std::fill(dest.begin(), dest.end(), 0);
+
+      // Use different offsets on each side, so that the buffers are misaligned
+      // with respect to each-other.
+      mpsc_queue::VolatileCopy(shared.data() + offset, source.data() + 3,
+                               size);
+      mpsc_queue::VolatileRead(dest.data() + (offset + 5) % 16,
+                               shared.data() + offset, size);
+
+      for (uint32_t i = 0; i < size; ++i) {
+        ASSERT_EQ(source[i + 3], dest[i + (offset + 5) % 16])
+            << "size " << size << ", offset " << offset << ", byte " << i;
+      }
+      // Nothing outside the buffers should have been touched.
+      EXPECT_EQ(0, shared[offset + size]);
+      EXPECT_EQ(0, dest[(offset + 5) % 16 + size]);
+    }
+  }
+}
+
+// Test that big items, which use the vector copy kernels, come out intact.
+TEST_F(MpscQueueTest, LargeItemTest) {
+  struct LargeItem {
+    uint8_t data[1000];
+  };
+  // The pool isn't big enough for much more than this.
+  auto queue = MpscQueue<LargeItem>::Create(8);
+  ASSERT_NE(nullptr, queue);
+
+  LargeItem item, on_queue;
+  for (int i = 0; i < 20; ++i) {
+    for (uint32_t j = 0; j < sizeof(item.data); ++j) {
+      item.data[j] = static_cast<uint8_t>(i + j);
+    }
+    ASSERT_TRUE(queue->Enqueue(item));
+    ASSERT_TRUE(queue->DequeueNext(&on_queue));
+    EXPECT_EQ(0, memcmp(item.data, on_queue.data, sizeof(item.data)));
+  }
+
+  queue->FreeQueue();
+}
+
 // Test that we can use the queue normally with two threads.
 TEST_F(MpscQueueTest, SpscTest) {
   ::std::thread producer(ProducerThread, queue_.get());
@@ -430,6 +768,37 @@ TEST_F(MpscQueueTest, SmallQueueSpscBlockingTest) {
   producer.join();
 }
 
+// Test that a queue with padded nodes works normally.
+TEST_F(MpscQueueTest, PaddedNodesTest) {
+  auto queue = MpscQueue<int>::Create(kQueueCapacity, true);
+  ASSERT_NE(nullptr, queue);
+
+  // Fill up the entire queue.
+  for (int i = 0; i < kQueueCapacity; ++i) {
+    EXPECT_TRUE(queue->Enqueue(i));
+  }
+  EXPECT_FALSE(queue->Enqueue(kQueueCapacity));
+
+  // Another handle to the same queue should see the same layout.
+  auto loaded = MpscQueue<int>::Load(queue->GetOffset());
+  int on_queue;
+  for (int i = 0; i < kQueueCapacity; ++i) {
+    EXPECT_TRUE(loaded->DequeueNext(&on_queue));
+    EXPECT_EQ(i, on_queue);
+  }
+  EXPECT_FALSE(loaded->DequeueNext(&on_queue));
+
+  // Try it with multiple threads.
+  ::std::thread producer(BlockingProducerThread, queue.get());
+  ::std::future<int> consumer_ret =
+      ::std::async(&ConsumerThread, loaded.get(), 1);
+
+  EXPECT_EQ(0, consumer_ret.get());
+  producer.join();
+
+  queue->FreeQueue();
+}
+
 // Tests that Peek() operations work under the most basic of circumstances.
 TEST_F(MpscQueueTest, SingleThreadPeekTest) {
   int on_queue;
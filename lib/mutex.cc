@@ -47,17 +47,21 @@ void MutexInit(Mutex *mutex) {
 void MutexGrab(Mutex *mutex) {
   Futex *state = &(mutex->state);
 
-  if (!CompareExchange(state, 0, 1)) {
+  // Grabbing the lock only needs acquire semantics, so nothing from the
+  // critical section can be moved before it.
+  if (!CompareExchange(state, 0, 1, ::std::memory_order_acquire)) {
     // It wasn't zero, which means there's contention and we have to call into
     // the kernel.
     do {
       // We'll assume that the lock is still taken here, and try to set the
-      // futex to 2 to indicate contention.
-      if (*state == 2 || CompareExchange(state, 1, 2)) {
+      // futex to 2 to indicate contention. This doesn't actually grab the lock,
+      // so it doesn't need any ordering.
+      if (AtomicLoad(state, ::std::memory_order_relaxed) == 2 ||
+          CompareExchange(state, 1, 2, ::std::memory_order_relaxed)) {
         // There's still contention. Wait in the kernel.
         FutexWait(state, 2);
       }
-    } while (!CompareExchange(state, 0, 2));
+    } while (!CompareExchange(state, 0, 2, ::std::memory_order_acquire));
     // Someone unlocking it sets it to zero, so we should only get here if we
     // successfully waited until someone unlocked the mutex and then grabbed
     // it.
@@ -68,11 +72,13 @@ void MutexRelease(Mutex *mutex) {
   Futex *state = &(mutex->state);
 
   // If the lock is uncontended, this single atomic op is all we need to do to
-  // release it.
-  if (!CompareExchange(state, 1, 0)) {
+  // release it. Releasing only needs release semantics, so nothing from the
+  // critical section can be moved after it.
+  if (!CompareExchange(state, 1, 0, ::std::memory_order_release)) {
     // It can only go up while this function is running, so if the above failed,
     // it must be 2, and we have to wake up someone.
-    const int cas_ret = CompareExchange(state, 2, 0);
+    const int cas_ret =
+        CompareExchange(state, 2, 0, ::std::memory_order_release);
     assert(cas_ret && "Double-releasing lock?");
     _UNUSED(cas_ret);
 
@@ -0,0 +1,205 @@
+#ifndef TACHYON_LIB_OFFSET_PTR_H_
+#define TACHYON_LIB_OFFSET_PTR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <iterator>
+#include <limits>
+#include <type_traits>
+
+#include "pool.h"
+
+namespace tachyon {
+
+// A "fancy pointer" that can be stored in shared memory. Instead of an absolute
+// address, which is only meaningful in the process that created it, it stores
+// the offset of the pointee in the pool, and converts it to an address in the
+// current process whenever it is dereferenced. It is trivially copyable, so it
+// is also safe to send through a Queue.
+//
+// It satisfies the requirements for a random-access iterator and a
+// NullablePointer, so it can be used as the pointer type of an STL allocator.
+// See SharedAllocator.
+//
+// NOTE: Obviously, it can only point to things that are in the pool.
+template <class T>
+class OffsetPtr {
+ public:
+  typedef T element_type;
+  typedef T value_type;
+  typedef ptrdiff_t difference_type;
+  typedef T *pointer;
+  typedef typename ::std::add_lvalue_reference<T>::type reference;
+  typedef ::std::random_access_iterator_tag iterator_category;
+
+  // Allows us to rebind to a different pointee type, like std::pointer_traits
+  // expects.
+  template <class U>
+  using rebind = OffsetPtr<U>;
+
+  OffsetPtr() : offset_(kNullOffset) {}
+  OffsetPtr(::std::nullptr_t) : offset_(kNullOffset) {}
+  OffsetPtr(T *raw) { Set(raw); }
+  // Implicit conversion between pointers to compatible types.
+  template <class U, typename ::std::enable_if<
+                         ::std::is_convertible<U *, T *>::value, int>::type = 0>
+  OffsetPtr(const OffsetPtr<U> &other) : offset_(other.get_offset()) {}
+  // Explicit conversion for anything that requires a static_cast, such as from
+  // OffsetPtr<void>.
+  template <class U, typename ::std::enable_if<
+                         !::std::is_convertible<U *, T *>::value, int>::type = 0>
+  explicit OffsetPtr(const OffsetPtr<U> &other) : offset_(other.get_offset()) {}
+
+  OffsetPtr &operator=(T *raw) {
+    Set(raw);
+    return *this;
+  }
+
+  // Gets the raw pointer in this process's address space.
+  // Returns:
+  //  The raw pointer, or nullptr if this pointer is null.
+  T *get() const {
+    if (offset_ == kNullOffset) {
+      return nullptr;
+    }
+    // We go from the start of the pool instead of using AtOffset() directly,
+    // because it's perfectly legal to have a pointer to one past the end of
+    // the pool.
+    uint8_t *base = Pool::GetPool()->AtOffset<uint8_t>(0);
+    return reinterpret_cast<T *>(base + offset_);
+  }
+  // Returns:
+  //  The offset in the pool that this pointer refers to.
+  uintptr_t get_offset() const { return offset_; }
+
+  // Creates a pointer to an object. This is what std::pointer_traits uses.
+  // Args:
+  //  object: The object to point to.
+  // Returns:
+  //  A new pointer to the object.
+  template <class U = T>
+  static OffsetPtr pointer_to(U &object) {
+    return OffsetPtr(&object);
+  }
+
+  template <class U = T>
+  U &operator*() const {
+    return *get();
+  }
+  T *operator->() const { return get(); }
+  template <class U = T>
+  U &operator[](difference_type index) const {
+    return get()[index];
+  }
+
+  explicit operator bool() const { return offset_ != kNullOffset; }
+
+  OffsetPtr &operator++() {
+    offset_ += sizeof(T);
+    return *this;
+  }
+  OffsetPtr operator++(int) {
+    OffsetPtr old(*this);
+    ++(*this);
+    return old;
+  }
+  OffsetPtr &operator--() {
+    offset_ -= sizeof(T);
+    return *this;
+  }
+  OffsetPtr operator--(int) {
+    OffsetPtr old(*this);
+    --(*this);
+    return old;
+  }
+  OffsetPtr &operator+=(difference_type delta) {
+    offset_ += delta * static_cast<difference_type>(sizeof(T));
+    return *this;
+  }
+  OffsetPtr &operator-=(difference_type delta) {
+    offset_ -= delta * static_cast<difference_type>(sizeof(T));
+    return *this;
+  }
+  OffsetPtr operator+(difference_type delta) const {
+    OffsetPtr result(*this);
+    result += delta;
+    return result;
+  }
+  OffsetPtr operator-(difference_type delta) const {
+    OffsetPtr result(*this);
+    result -= delta;
+    return result;
+  }
+  difference_type operator-(const OffsetPtr &other) const {
+    return (static_cast<difference_type>(offset_) -
+            static_cast<difference_type>(other.offset_)) /
+           static_cast<difference_type>(sizeof(T));
+  }
+
+  // Since everything is in the same pool, we can compare offsets directly.
+  bool operator==(const OffsetPtr &other) const {
+    return offset_ == other.offset_;
+  }
+  bool operator!=(const OffsetPtr &other) const {
+    return offset_ != other.offset_;
+  }
+  bool operator<(const OffsetPtr &other) const {
+    return offset_ < other.offset_;
+  }
+  bool operator<=(const OffsetPtr &other) const {
+    return offset_ <= other.offset_;
+  }
+  bool operator>(const OffsetPtr &other) const {
+    return offset_ > other.offset_;
+  }
+  bool operator>=(const OffsetPtr &other) const {
+    return offset_ >= other.offset_;
+  }
+
+ private:
+  // The pool can never be this big, so we use it to represent null. (Zero is a
+  // perfectly valid offset.)
+  static constexpr uintptr_t kNullOffset =
+      ::std::numeric_limits<uintptr_t>::max();
+
+  // Points this pointer at a new object.
+  // Args:
+  //  raw: The raw address of the new object, which must be in the pool.
+  void Set(const T *raw) {
+    if (!raw) {
+      offset_ = kNullOffset;
+      return;
+    }
+    offset_ = Pool::GetPool()->GetOffset(raw);
+  }
+
+  // The offset of the pointee in the pool.
+  uintptr_t offset_;
+};
+
+template <class T>
+OffsetPtr<T> operator+(ptrdiff_t delta, const OffsetPtr<T> &pointer) {
+  return pointer + delta;
+}
+
+template <class T>
+bool operator==(const OffsetPtr<T> &pointer, ::std::nullptr_t) {
+  return !pointer;
+}
+template <class T>
+bool operator==(::std::nullptr_t, const OffsetPtr<T> &pointer) {
+  return !pointer;
+}
+template <class T>
+bool operator!=(const OffsetPtr<T> &pointer, ::std::nullptr_t) {
+  return static_cast<bool>(pointer);
+}
+template <class T>
+bool operator!=(::std::nullptr_t, const OffsetPtr<T> &pointer) {
+  return static_cast<bool>(pointer);
+}
+
+}  // namespace tachyon
+
+#endif  // TACHYON_LIB_OFFSET_PTR_H_
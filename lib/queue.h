@@ -4,16 +4,18 @@
 #include <assert.h>
 #include <stdint.h>
 
+#include <algorithm>
+#include <chrono>
+#include <limits>
 #include <memory>
+#include <thread>
 #include <utility>
-#include <vector>
 
 #include "atomics.h"
 #include "constants.h"
 #include "mpsc_queue.h"
-#include "pool.h"
+#include "queue_base.h"
 #include "queue_interface.h"
-#include "shared_hashmap.h"
 
 namespace tachyon {
 
@@ -36,20 +38,60 @@ namespace tachyon {
 // memory, and then copied out again at the other end.
 // * This queue is slightly nonstandard in that all consumers will always read
 // every single item on the queue. (I personally find this feature very useful.)
+// * By default, a consumer that falls behind holds everyone back, since
+// producers can't enqueue anything until there's room for it in every
+// subqueue. Consumers that can live with missing items should pick a different
+// OverflowPolicy with SetOverflowPolicy().
 // * Two different threads should never touch the same queue instance. If you
 // want to give both threads access to the queue, make two different queue
 // instances with the same queue_offset parameter.
 template <class T>
-class Queue : public QueueInterface<T> {
+class Queue : public QueueInterface<T>, public QueueBase<MpscQueue<T>> {
  public:
-  virtual ~Queue();
-
+  // NOTE: These only fail if a consumer with kOverflowBlock doesn't have room.
+  // Consumers with other policies might not get the item, even if they return
+  // true.
   virtual bool Enqueue(const T &item);
   virtual bool EnqueueBlocking(const T &item);
+  virtual uint32_t EnqueueBatch(const T *items, uint32_t num_items);
+  // Enqueues an item for only some of the consumers, for instance the ones
+  // that handle a particular shard. Everyone else never sees it. Overflow
+  // policies work just like they do for Enqueue().
+  // Args:
+  //  consumers: The IDs of the consumers to send it to, from GetConsumerId().
+  //  item: The item to enqueue.
+  //  received: If not nullptr, set to the IDs of the consumers that actually
+  //            got the item.
+  // Returns:
+  //  False if none of the consumers exist, or if one with kOverflowBlock
+  //  didn't have room, in which case nobody gets the item. True otherwise.
+  bool EnqueueTo(const SubqueueMask &consumers, const T &item,
+                 SubqueueMask *received = nullptr);
+  // Enqueues an item for only the consumers whose filters match its key. See
+  // SetFilter().
+  // Args:
+  //  key: The key of the item.
+  //  item: The item to enqueue.
+  //  received: If not nullptr, set to the IDs of the consumers that actually
+  //            got the item.
+  // Returns:
+  //  False if the queue has no consumers, or if one with kOverflowBlock whose
+  //  filter matches didn't have room. True otherwise, even if nobody wanted
+  //  the item.
+  bool EnqueueWithKey(uint64_t key, const T &item,
+                      SubqueueMask *received = nullptr);
+  // NOTE: Every consumer has its own copy of each element, so if there is more
+  // than one consumer, Commit() still has to copy the element for all but one
+  // of them. This also returns nullptr if no consumer at all has room.
+  virtual T *Reserve();
+  virtual void Commit();
   virtual bool DequeueNext(T *item);
   virtual void DequeueNextBlocking(T *item);
+  virtual uint32_t DequeueBatch(T *items, uint32_t max_items);
   virtual bool PeekNext(T *item);
   virtual void PeekNextBlocking(T *item);
+  virtual const T *ReadView();
+  virtual void Release();
 
   virtual int GetOffset() const;
 
@@ -57,6 +99,51 @@ class Queue : public QueueInterface<T> {
 
   virtual uint32_t GetNumConsumers() const;
 
+  // Sets what producers should do when this consumer falls behind, and its
+  // subqueue fills up. Setting a policy also reconnects the consumer if it was
+  // disconnected.
+  // Args:
+  //  policy: The policy to use.
+  void SetOverflowPolicy(OverflowPolicy policy);
+  // Sets which items this consumer wants. This only applies to items that are
+  // enqueued with EnqueueWithKey(). The other enqueue methods don't know what
+  // the key is, so everyone gets those.
+  // Args:
+  //  filter: The filter to use.
+  void SetFilter(const SubscriptionFilter &filter);
+  // Sets how many of the items this consumer gets. A consumer that skips items
+  // never holds producers back, so if its overflow policy is kOverflowBlock,
+  // producers treat it like kOverflowDropNewest.
+  // Args:
+  //  options: The options to use.
+  void SetSubscriptionOptions(const SubscriptionOptions &options);
+  // Returns:
+  //  How many items this consumer has missed because its subqueue was full.
+  uint64_t GetNumDropped() const;
+  // Returns:
+  //  True if producers disconnected this consumer because of
+  //  kOverflowDisconnect. It can still read whatever was already in its
+  //  subqueue.
+  bool IsDisconnected() const;
+  // Gets the sequence number of the item that this consumer read most recently.
+  // Every item that producers put into this consumer's subqueue gets the next
+  // number, so with kOverflowDropOldest, a jump of more than one means that the
+  // items in between were overwritten. Items that are dropped without ever
+  // being put in the subqueue, like with kOverflowDropNewest, don't leave gaps,
+  // but GetNumDropped() counts both kinds.
+  // Returns:
+  //  The sequence number.
+  uint64_t GetSequence() const;
+  // Permanently gets rid of this durable consumer's subqueue, so that it goes
+  // away along with this handle, like a normal consumer's would.
+  void Unsubscribe();
+  // Gets the ID of this consumer, which producers can use to send items to it
+  // with EnqueueTo(). It stays the same for as long as this handle exists, but
+  // might be given to a new consumer after that.
+  // Returns:
+  //  The ID.
+  uint32_t GetConsumerId() const;
+
   // Manually creates a brand new queue. Normally, FetchQueue() should be used
   // as it handles queue creation automatically.
   // Args:
@@ -66,7 +153,18 @@ class Queue : public QueueInterface<T> {
   //            never-read subqueues from getting full and causing things to
   //            block.
   //  size: The number of items that the queue will be able to hold.
-  static ::std::unique_ptr<Queue<T>> Create(bool consumer, uint32_t size);
+  //  history_size: If not 0, the queue remembers this many of the most recent
+  //                items that were sent to every consumer, and new consumers
+  //                start out with them in their subqueues. This way, they don't
+  //                have to wait for the next item to find out what's going on.
+  //                Items sent with EnqueueTo() or EnqueueWithKey() aren't
+  //                remembered, since they weren't meant for everyone. New
+  //                consumers wait a little while for any producer that is in
+  //                the middle of sending an item, including one that is between
+  //                Reserve() and Commit(). If it takes too long, they count the
+  //                item as dropped instead.
+  static ::std::unique_ptr<Queue<T>> Create(bool consumer, uint32_t size,
+                                            uint32_t history_size = 0);
   // Manually loads an existing queue. Normally, FetchQueue() should be used as
   // it handles queue loading automatically.
   // Args:
@@ -82,6 +180,15 @@ class Queue : public QueueInterface<T> {
   // Returns:
   //  The fetched queue.
   static ::std::unique_ptr<Queue<T>> FetchQueue(const char *name);
+  // Same as the method above, but the consumer only gets some of the items.
+  // See SetSubscriptionOptions().
+  // Args:
+  //  name: The name of the queue to fetch.
+  //  options: Which items the consumer gets.
+  // Returns:
+  //  The fetched queue.
+  static ::std::unique_ptr<Queue<T>> FetchQueue(
+      const char *name, const SubscriptionOptions &options);
   // Same as the method above, but the queue that it fetches can only be used as
   // a producer.
   static ::std::unique_ptr<Queue<T>> FetchProducerQueue(const char *name);
@@ -94,118 +201,245 @@ class Queue : public QueueInterface<T> {
                                                      uint32_t size);
   static ::std::unique_ptr<Queue<T>> FetchSizedProducerQueue(const char *name,
                                                              uint32_t size);
+  // Same as FetchQueue(), but if the queue gets created, it remembers recent
+  // items for consumers that join late. See Create().
+  // Args:
+  //  name: The name of the queue to fetch.
+  //  history_size: How many items to remember.
+  //  consumer: Whether the queue should be a consumer.
+  // Returns:
+  //  The fetched queue.
+  static ::std::unique_ptr<Queue<T>> FetchQueueWithHistory(
+      const char *name, uint32_t history_size, bool consumer = true);
+  // Fetches a queue as a durable consumer. When a durable consumer's handle
+  // goes away, or its process dies, its subqueue is kept, and producers keep
+  // writing to it. The next durable consumer with the same name takes it over,
+  // and starts reading where the old one left off, so nothing is lost if it
+  // restarts quickly. While nobody owns the subqueue, it never holds producers
+  // back, so once it fills up, new items are dropped, as if its policy were
+  // kOverflowDropNewest. Only one handle can own a durable consumer at a time.
+  // If a durable consumer with kOverflowBlock crashes, producers notice once
+  // its subqueue fills up, and from then on treat it as having no owner.
+  // Producers that are waiting for room in a durable subqueue poll it every
+  // kDurablePollPeriodUs instead of sleeping until the consumer wakes them.
+  // Args:
+  //  name: The name of the queue to fetch.
+  //  consumer_name: The name of the consumer.
+  // Returns:
+  //  The fetched queue.
+  static ::std::unique_ptr<Queue<T>> FetchDurableQueue(
+      const char *name, const char *consumer_name);
 
  private:
-  // Represents a single item in the queue_offsets list.
-  struct Subqueue {
-    // The actual offset.
-    volatile int32_t offset;
-    // A flag indicating whether this subqueue is currently operational.
-    volatile uint32_t valid;
-    // A flag indicating that this subqueue will never be used again, and can be
-    // overwritten.
-    volatile uint32_t dead;
-    // Number of references to this subqueue that are floating around.
-    volatile uint32_t num_references;
-  };
-
-  // This is the underlying structure that will be located in shared memory, and
-  // contain everything that the queue needs to store in SHM. Multiple Queue
-  // classes can share one of these, and they will be different "handles" into
-  // the same queue.
-  struct RawQueue {
-    // How many subqueues we currently have. (We don't necessarily use the whole
-    // array.)
-    volatile uint32_t num_subqueues;
-    // The number of items that can be held in each subqueue. This is not
-    // volatile, because it is set once when the queue is created, and then
-    // never modified.
-    uint32_t subqueue_size;
-    // Number of times we've either created or deleted a new subqueue.
-    volatile uint32_t subqueue_updates;
-    // Offsets of all the subqueues in the pool, so we can easily find them.
-    volatile Subqueue queue_offsets[kMaxConsumers];
-  };
-
-  // A hashmap that's in charge of mapping queue names to offsets. This is how
-  // we implement fetching queues by name.
-  static SharedHashmap<const char *, int> queue_names_;
+  typedef QueueBase<MpscQueue<T>> Base;
+  using Base::pool_;
+  using Base::queue_;
+  using Base::subqueue_mask_;
+  using Base::subqueues_;
+  using Base::my_subqueue_;
+  using Base::my_subqueue_index_;
+  using Base::durable_id_;
+  using Base::writable_subqueues_;
+  using Base::IncorporateNewSubqueues;
+  using Base::ReleaseIfOrphaned;
+  using Base::GetSubqueueEntry;
 
   // Default constructor is private because it shouldn't be used. It creates an
   // improperly-initialized queue. Used Create(), Load(), or one of the Fetch()
   // methods instead.
-  Queue();
+  Queue() = default;
 
-  // Initializes a queue that has been newly created.
+  // How many times a producer tries to read a consumer's filter while the
+  // consumer is changing it before it gives up and sends it the item anyway.
+  static constexpr int kMaxFilterRetries = 64;
+  // Same thing, but for a new consumer that is working out where its history
+  // ends.
+  static constexpr int kMaxHistoryRetries = 64;
+  // How many times a new consumer checks whether a producer has filled in a
+  // place in the history before it gives up on the item, and how many times a
+  // producer tries to claim a place that another one is still writing to. They
+  // yield in between, so that a producer that got preempted can finish, but one
+  // that died or stalled can't block everyone else.
+  static constexpr int kMaxHistoryWaitRetries = 1024;
+  // A history index for items that aren't in the history.
+  static constexpr uint64_t kNotInHistory =
+      ::std::numeric_limits<uint64_t>::max();
+  // The history_start of a new subqueue until its consumer knows it.
+  static constexpr uint64_t kUnknownHistoryStart =
+      ::std::numeric_limits<uint64_t>::max();
+
+  // Reserves a space in a set of subqueues, and adds the ones it reserved in to
+  // writable_subqueues_. For consumers with kOverflowBlock, it's all or
+  // nothing, so if any of those reservations fail, it cancels all the others.
   // Args:
-  //  consumer: Whether the queue is a consumer.
-  //  size: The number of elements that the queue will be able to hold.
-  void DoCreate(bool consumer, uint32_t size);
-  // Initializes a queue that has been loaded from an existing one.
+  //  targets: The subqueues to reserve space in. Ones that don't exist are
+  //           ignored.
+  //  first_space: Set to the space that it reserved in the first subqueue, or
+  //               nullptr if no consumer has room.
+  //  first_index: Set to the index of that subqueue.
+  //  history_index: The item's index in the history, from ClaimHistory(), or
+  //                 kNotInHistory. Consumers that get it from the history
+  //                 are left out.
+  // Returns:
+  //  False if it failed, or if none of the targets exist, true otherwise.
+  bool ReserveAll(const SubqueueMask &targets, T **first_space,
+                  uint32_t *first_index,
+                  uint64_t history_index = kNotInHistory);
+  // Adds an item to a subqueue whose consumer has kOverflowBlock, and waits for
+  // room if it's full. If the subqueue is durable, and its owner crashes while
+  // we wait, it drops the item instead.
   // Args:
-  //  consumer: Whether the queue is a consumer.
-  //  queue_offset: The offset of the queue in SHM.
-  void DoLoad(bool consumer, uintptr_t queue_offset);
-
-  // Contains common initialization code that initializes the local state.
+  //  index: The index of the subqueue.
+  //  item: The item.
+  void EnqueueBlockingTo(uint32_t index, const T &item);
+  // Common back-end for Enqueue() and EnqueueTo().
   // Args:
-  //  consumer: Whether this queue is a consumer.
-  void InitializeLocalState(bool consumer);
-  // If this is a consumer queue, creates that subqueue that it will read from.
-  void MakeOwnSubqueue();
-  // Checks for any new existing subqueues that were created by other processes,
-  // and adds appropriate entries to our subqueues_ array.
-  void IncorporateNewSubqueues();
-
-  // Adds a subqueue that exists in shared memory to this queue.
+  //  targets: The subqueues to send the item to.
+  //  item: The item.
+  //  history_index: The item's index in the history, or kNotInHistory.
+  //  received: Set to the subqueues that the item went to, if not nullptr.
+  // Returns:
+  //  True if it succeeded, false otherwise.
+  bool DoEnqueue(const SubqueueMask &targets, const T &item,
+                 uint64_t history_index, SubqueueMask *received);
+  // Gets the overflow policy of a subqueue.
+  // Args:
+  //  index: The index of the subqueue.
+  // Returns:
+  //  The policy.
+  OverflowPolicy GetPolicy(uint32_t index) const {
+    const OverflowPolicy policy = static_cast<OverflowPolicy>(
+        AtomicLoad(&(GetSubqueueEntry(index)->overflow_policy),
+                   ::std::memory_order_acquire));
+    if (policy == kOverflowBlock &&
+        (IsSampled(index) ||
+         !AtomicLoad(&(GetSubqueueEntry(index)->owner_pid),
+                     ::std::memory_order_relaxed))) {
+      // Consumers that skip items, and durable consumers that are gone, don't
+      // get to hold us back.
+      return kOverflowDropNewest;
+    }
+    return policy;
+  }
+  // Args:
+  //  index: The index of a subqueue.
+  // Returns:
+  //  True if its consumer doesn't want every item.
+  bool IsSampled(uint32_t index) const {
+    volatile auto *entry = GetSubqueueEntry(index);
+    return AtomicLoad(&(entry->every_nth), ::std::memory_order_relaxed) > 1 ||
+           AtomicLoadQuad(&(entry->min_period_ns),
+                          ::std::memory_order_relaxed);
+  }
+  // Decides whether a subqueue whose consumer doesn't want every item gets the
+  // current one.
+  // Args:
+  //  index: The index of the subqueue.
+  // Returns:
+  //  True if it does.
+  bool Sample(uint32_t index);
+  // Reserves a space in a subqueue whose consumer doesn't block producers, and
+  // applies its policy if it's full.
+  // Args:
+  //  index: The index of the subqueue.
+  //  policy: The policy of the subqueue.
+  // Returns:
+  //  The space, or nullptr if the consumer won't get the item.
+  T *ReserveWithPolicy(uint32_t index, OverflowPolicy policy);
+  // Same as ReserveWithPolicy(), but enqueues a batch of items.
+  // Args:
+  //  index: The index of the subqueue.
+  //  policy: The policy of the subqueue.
+  //  items: The items to enqueue.
+  //  num_items: How many items there are.
+  void EnqueueBatchWithPolicy(uint32_t index, OverflowPolicy policy,
+                              const T *items, uint32_t num_items);
+  // Checks whether a subqueue's filter matches a key. If the consumer is in the
+  // middle of changing its filter for too long, the item counts as matching,
+  // because a consumer that died in SetFilter() mustn't hold producers up.
   // Args:
-  //  index: The index in the queue_offsets array at which to add an entry for
-  //         it.
+  //  index: The index of the subqueue.
+  //  key: The key to check.
   // Returns:
-  //  True if adding the subqueue succeeded, false if the queue was deleted in
-  //  another thread and can't be added.
-  bool AddSubqueue(uint32_t index);
-  // Removes a subqueue, possibly also deleting it from shared memory if this is
-  // the last remaining reference to it.
+  //  True if it does.
+  bool MatchesFilter(uint32_t index, uint64_t key) const;
+  // Records that a consumer missed some items.
   // Args:
-  //  index: The index in the queue_offsets array at which the queue to remove
-  //         is located.
-  void RemoveSubqueue(uint32_t index);
+  //  index: The index of the consumer's subqueue.
+  //  num_items: How many items it missed.
+  void CountDropped(uint32_t index, uint32_t num_items);
 
-  // Common back-end for FetchQueue and FetchProducerQueue.
+  // An item that the queue remembers for consumers that join late.
+  struct HistorySlot {
+    // This is 2 * i + 2 once item number i is in the slot, and odd while a
+    // producer is writing to it.
+    volatile uint64_t sequence;
+    // Set if the producer that had item number i didn't send it after all.
+    volatile uint32_t empty;
+    volatile T item;
+  };
+  // The history of recent items, which is located in shared memory.
+  struct RawHistory {
+    // The number of slots.
+    uint32_t num_slots;
+    // The offset of the slots in the pool.
+    uint32_t slots_offset;
+    // The number of items that have ever been added to the history.
+    volatile uint64_t head;
+  };
+
+  // Sets up the history for a new queue.
   // Args:
-  //  name: The name of the queue to fetch.
-  //  consumer: Whether or not the queue should be a consumer queue.
-  //  size: The number of elements that the queue will be able to hold, if a new
-  //        queue is created. Otherwise, it is ignored.
-  static ::std::unique_ptr<Queue<T>> DoFetchQueue(const char *name,
-                                                  bool consumer, uint32_t size);
-
-  RawQueue *queue_;
-  // This is the shared memory pool that we will use to construct queue objects.
-  Pool *pool_;
-  // The last value of queue_->num_subqueues we saw.
-  uint32_t last_num_subqueues_ = 0;
-  // The last value of queue_->subqueue_updates we saw.
-  uint32_t last_subqueue_updates_ = 0;
-
-  // This is the underlying array of MPSC queues that we use to implement this
-  // MPMC queue.
-  ::std::unique_ptr<MpscQueue<T>> *subqueues_;
-  // The particular subqueue that we read off of.
-  MpscQueue<T> *my_subqueue_ = nullptr;
-  // The index in queue_->queue_offsets of our subqueue.
-  uint32_t my_subqueue_index_;
-
-  // Stores indices of subqueues that are ready to be written to in order to
-  // speed up the enqueue operation.
-  ::std::vector<uint32_t> writable_subqueues_;
-};
+  //  history_size: How many items to remember.
+  // Returns:
+  //  True if it succeeded, false if it ran out of shared memory.
+  bool CreateHistory(uint32_t history_size);
+  // Finds the history in our address space, if the queue has one.
+  void LoadHistory();
+  // Claims places in the history for items that are about to be sent to
+  // everyone. This has to happen before we look for consumers, so that any
+  // consumer that we don't see knows to get the items from the history.
+  // Args:
+  //  num_items: How many places to claim.
+  // Returns:
+  //  The index of the first one.
+  uint64_t ClaimHistory(uint32_t num_items);
+  // Fills in a place that was claimed with ClaimHistory(). This has to happen
+  // before the item is sent to any consumer, because new consumers wait for it.
+  // If another producer is taking too long to write an older item to the same
+  // place, this gives up without writing anything.
+  // Args:
+  //  index: The index of the place.
+  //  item: The item, or nullptr if it didn't get sent after all.
+  void WriteHistory(uint64_t index, const T *item);
+  // Checks whether a subqueue's consumer gets an item from the history instead
+  // of from the producer.
+  // Args:
+  //  index: The index of the subqueue.
+  //  history_index: The item's index in the history, or kNotInHistory.
+  // Returns:
+  //  True if it does.
+  bool Replays(uint32_t index, uint64_t history_index) const;
+  // Reserves space for the remembered items in our new subqueue, ahead of
+  // anything that producers send it.
+  virtual void InitOwnSubqueue(MpscQueue<T> *subqueue);
+  // Puts the remembered items that producers won't send us in our new
+  // subqueue.
+  virtual void FinishOwnSubqueue(MpscQueue<T> *subqueue);
 
-// Initialize the queue_names_ member.
-template <class T>
-SharedHashmap<const char *, int> Queue<T>::queue_names_(kNameMapOffset,
-                                                        kNameMapSize);
+  // The history, in our address space, or nullptr if there isn't one.
+  RawHistory *history_ = nullptr;
+  volatile HistorySlot *history_slots_ = nullptr;
+  // How many spaces InitOwnSubqueue() reserved for remembered items.
+  uint32_t num_replay_spaces_ = 0;
+
+  // The space that was returned by the last call to Reserve().
+  T *reserved_space_ = nullptr;
+  // The index of the subqueue that reserved_space_ is in.
+  uint32_t reserved_index_ = 0;
+  // The history index of the item in reserved_space_, or kNotInHistory.
+  uint64_t reserved_history_index_ = kNotInHistory;
+};
 
 #include "queue_impl.h"
 
@@ -0,0 +1,459 @@
+#ifndef TACHYON_LIB_QUEUE_BASE_H_
+#define TACHYON_LIB_QUEUE_BASE_H_
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <memory>
+#include <vector>
+
+#include "atomics.h"
+#include "constants.h"
+#include "macros.h"
+#include "pool.h"
+#include "shared_hashmap.h"
+
+namespace tachyon {
+
+// What producers do when a consumer falls behind, and its subqueue is full.
+// Each consumer picks its own, so that one slow consumer doesn't have to hold
+// everyone else back.
+enum OverflowPolicy : uint32_t {
+  // Producers wait for the consumer, or fail to enqueue the item for everyone
+  // if they're not willing to wait. This is the default.
+  kOverflowBlock = 0,
+  // The consumer doesn't get the new item.
+  kOverflowDropNewest = 1,
+  // The oldest item in the subqueue gets dropped to make room for the new one,
+  // so producers never have to wait for the consumer. If the consumer happens
+  // to be reading that item right now, the new one is dropped instead. The
+  // consumer can find the gaps that this leaves with Queue::GetSequence().
+  kOverflowDropOldest = 2,
+  // The consumer gets disconnected, and doesn't get anything else at all.
+  kOverflowDisconnect = 3,
+};
+
+// Describes which items a consumer wants. Producers that enqueue items with a
+// key only give them to consumers whose filters match that key, which saves
+// them from copying the item into everyone else's subqueue. The key can be
+// anything that the producers and consumers agree on, like a topic ID, or some
+// header field. The default filter matches everything.
+struct SubscriptionFilter {
+  // The smallest key that matches.
+  uint64_t min_key = 0;
+  // The largest key that matches.
+  uint64_t max_key = UINT64_MAX;
+  // Keys only match if the bits that are set here are the same as in value.
+  uint64_t mask = 0;
+  uint64_t value = 0;
+
+  // Args:
+  //  key: The key to check.
+  // Returns:
+  //  True if the key matches the filter.
+  bool Matches(uint64_t key) const {
+    return key >= min_key && key <= max_key && (key & mask) == value;
+  }
+};
+
+// Lets consumers that don't need every item, like visualizations, ask for fewer
+// of them. Producers do the skipping, so the consumer's subqueue never sees the
+// items that it doesn't want.
+struct SubscriptionOptions {
+  // The consumer only gets every nth item. 1 means that it gets all of them.
+  uint32_t every_nth = 1;
+  // The consumer gets at most one item every this many nanoseconds, or as many
+  // as it wants if this is 0.
+  uint64_t min_period_ns = 0;
+};
+
+// A set of subqueue indices, stored as a bitmask with one bit per index. Only
+// the words that have ever had bits set in them are looked at, so small queues
+// don't pay for the maximum number of consumers. Iterate over one like this:
+//   for (uint32_t i = mask.First(); i != SubqueueMask::kEnd;
+//        i = mask.Next(i)) {
+//     ...
+//   }
+class SubqueueMask {
+ public:
+  // The number of 64-bit words in the mask.
+  static constexpr uint32_t kNumWords = kMaxQueueConsumers / 64;
+  // What First() and Next() return when there are no more indices.
+  static constexpr uint32_t kEnd = UINT32_MAX;
+
+  // Adds an index to the set.
+  // Args:
+  //  index: The index to add.
+  void Set(uint32_t index) {
+    const uint32_t word = index / 64;
+    words_[word] |= 1ull << (index % 64);
+    if (word >= num_words_) {
+      num_words_ = word + 1;
+    }
+  }
+  // Args:
+  //  index: The index to look for.
+  // Returns:
+  //  True if the index is in the set.
+  bool Contains(uint32_t index) const {
+    return words_[index / 64] & (1ull << (index % 64));
+  }
+  // Removes an index from the set.
+  // Args:
+  //  index: The index to remove.
+  void Clear(uint32_t index) { words_[index / 64] &= ~(1ull << (index % 64)); }
+  // Removes everything from the set.
+  void ClearAll() {
+    for (uint32_t i = 0; i < num_words_; ++i) {
+      words_[i] = 0;
+    }
+    num_words_ = 0;
+  }
+  // Returns:
+  //  True if the set is empty.
+  bool Empty() const {
+    for (uint32_t i = 0; i < num_words_; ++i) {
+      if (words_[i]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Returns:
+  //  The lowest index in the set, or kEnd if it is empty.
+  uint32_t First() const { return num_words_ ? Find(0, words_[0]) : kEnd; }
+  // Args:
+  //  index: An index that is in the set.
+  // Returns:
+  //  The next index in the set after that one, or kEnd if there isn't one.
+  uint32_t Next(uint32_t index) const {
+    const uint32_t word = index / 64;
+    return Find(word, words_[word] & (~1ull << (index % 64)));
+  }
+
+  // Args:
+  //  word: Which word to get.
+  // Returns:
+  //  The bits for indices word * 64 through word * 64 + 63.
+  uint64_t GetWord(uint32_t word) const { return words_[word]; }
+
+ private:
+  // Finds the lowest set bit, starting at a particular word.
+  // Args:
+  //  word: The word to start at.
+  //  bits: The bits from that word that we still care about.
+  // Returns:
+  //  The index of the bit, or kEnd if there aren't any.
+  uint32_t Find(uint32_t word, uint64_t bits) const {
+    while (!bits) {
+      if (++word >= num_words_) {
+        return kEnd;
+      }
+      bits = words_[word];
+    }
+    return word * 64 + __builtin_ctzll(bits);
+  }
+
+  uint64_t words_[kNumWords] = {};
+  // All the words at or after this one are zero.
+  uint32_t num_words_ = 0;
+};
+
+// Contains the machinery that all broadcast queues share. A broadcast queue is
+// built out of one MPSC subqueue for every consumer, and producers write every
+// item into all of them. This class keeps track of the subqueues in shared
+// memory, and makes sure that every handle to the queue sees all of them.
+// Derived classes implement the actual enqueue and dequeue operations.
+// SubqueueType must provide the following:
+// * static ::std::unique_ptr<SubqueueType> Create(uint32_t size);
+// * static ::std::unique_ptr<SubqueueType> Load(uintptr_t offset);
+// * int GetOffset() const;
+// * void FreeQueue();
+template <class SubqueueType>
+class QueueBase {
+  static_assert(kMaxQueueConsumers % 64 == 0,
+                "Subqueues are tracked with 64-bit bitmasks.");
+
+ public:
+  virtual ~QueueBase();
+
+  // Returns:
+  //  The offset of the queue in SHM.
+  int GetOffset() const;
+
+  // Frees the SHM that this queue and all its subqueues are using. No other
+  // handles to the queue can be used after this is called.
+  void FreeQueue();
+
+  // Returns:
+  //  The number of consumers that this queue currently has.
+  uint32_t GetNumConsumers() const;
+
+ protected:
+  // Represents a single entry in the table of subqueues.
+  struct Subqueue {
+    // The actual offset.
+    volatile int32_t offset;
+    // A flag indicating that this subqueue will never be used again, and can be
+    // overwritten.
+    volatile uint32_t dead;
+    // Number of references to this subqueue that are floating around.
+    volatile uint32_t num_references;
+    // These are for derived classes that let consumers choose what happens
+    // when they fall behind. They are set up by MakeOwnSubqueue(), but this
+    // class doesn't use them otherwise.
+    //
+    // What producers should do when this subqueue is full. One of the values
+    // in OverflowPolicy.
+    volatile uint32_t overflow_policy;
+    // Set once producers stop writing to this subqueue.
+    volatile uint32_t disconnected;
+    // How many items the consumer missed because this subqueue was full.
+    volatile uint64_t num_dropped;
+    // Which items the consumer wants. Only the consumer writes it, and it uses
+    // filter_sequence like a seqlock, so that producers never see half of an
+    // old filter and half of a new one.
+    volatile uint32_t filter_sequence;
+    volatile SubscriptionFilter filter;
+    // These come from SubscriptionOptions.
+    volatile uint32_t every_nth;
+    volatile uint64_t min_period_ns;
+    // How many items producers have decided whether to give to this subqueue.
+    volatile uint32_t num_sampled;
+    // When this subqueue last got an item, if it is rate-limited, in
+    // nanoseconds since some arbitrary point.
+    volatile uint64_t last_sample_ns;
+    // A hash of the name of a durable consumer, or 0 if this subqueue's
+    // consumer isn't durable. Durable subqueues are kept around while their
+    // consumer is gone, and given back to it when it comes back.
+    volatile uint64_t durable_id;
+    // The PID of the process that is currently reading from this subqueue, or
+    // 0 if a durable consumer went away, and nobody has taken it over yet.
+    volatile uint32_t owner_pid;
+    // For derived classes that replay recent items to consumers that join
+    // late. Items that come before this in the history are replayed, so
+    // producers don't have to send them to this subqueue.
+    volatile uint64_t history_start;
+  };
+
+  // This is the underlying structure that will be located in shared memory, and
+  // contain everything that the queue needs to store in SHM. Multiple Queue
+  // classes can share one of these, and they will be different "handles" into
+  // the same queue.
+  struct RawQueue {
+    // Bit i of this is set if subqueue i is currently operational. This is the
+    // only thing that producers have to look at to find out whether any
+    // subqueues were created or deleted, and they only have to visit the
+    // entries that have their bits set.
+    volatile uint64_t valid_subqueues[SubqueueMask::kNumWords];
+    // How many words of valid_subqueues are covered by chunks that exist.
+    // Producers don't bother looking at the rest.
+    volatile uint32_t num_valid_words;
+    // The size of each subqueue. This is not volatile, because it is set once
+    // when the queue is created, and then never modified.
+    uint32_t subqueue_size;
+    // Offsets of the chunks of the subqueue table in the pool, or 0 for chunks
+    // that haven't been allocated yet. (The name map lives at offset 0, so no
+    // chunk can.) Chunk 0 has entries 0 through kFirstSubqueueChunkSize - 1,
+    // and every chunk after that has as many entries as all the ones before it.
+    volatile uint32_t chunk_offsets[kNumSubqueueChunks];
+    // Offset of whatever derived classes keep to catch up consumers that join
+    // late, or 0 if there isn't anything.
+    volatile uint32_t history_offset;
+  };
+
+  // A hashmap that's in charge of mapping queue names to offsets. This is how
+  // we implement fetching queues by name.
+  static SharedHashmap<const char *, int> queue_names_;
+
+  // The default constructor creates an improperly-initialized queue. Derived
+  // classes must call either DoCreate() or DoLoad() before using it.
+  QueueBase();
+
+  // Initializes a queue that has been newly created.
+  // Args:
+  //  consumer: Whether the queue is a consumer.
+  //  size: The size of each subqueue, as passed to SubqueueType::Create().
+  void DoCreate(bool consumer, uint32_t size);
+  // Initializes a queue that has been loaded from an existing one.
+  // Args:
+  //  consumer: Whether the queue is a consumer.
+  //  queue_offset: The offset of the queue in SHM.
+  void DoLoad(bool consumer, uintptr_t queue_offset);
+
+  // Contains common initialization code that initializes the local state.
+  // Args:
+  //  consumer: Whether this queue is a consumer.
+  void InitializeLocalState(bool consumer);
+  // If this is a consumer queue, creates that subqueue that it will read from.
+  void MakeOwnSubqueue();
+  // Makes this queue into a durable consumer. If a subqueue for a consumer with
+  // the same name already exists, and whoever had it is gone, it takes it
+  // over, along with everything in it. Otherwise, it creates a new one.
+  // Args:
+  //  consumer_name: The name of the consumer.
+  void MakeDurableSubqueue(const char *consumer_name);
+  // Takes over an existing durable subqueue.
+  // Returns:
+  //  True if it found one to take over, false otherwise.
+  bool AdoptDurableSubqueue();
+  // Checks whether the process that owns a durable subqueue died, and if so,
+  // marks the subqueue as having no owner, so that it stops holding producers
+  // back.
+  // Args:
+  //  index: The index of the subqueue.
+  // Returns:
+  //  True if the subqueue is durable, and has no owner now.
+  bool ReleaseIfOrphaned(uint32_t index);
+  // Args:
+  //  pid: The ID of a process.
+  // Returns:
+  //  True if the process is still running.
+  static bool IsRunning(uint32_t pid) {
+    return kill(pid, 0) == 0 || errno != ESRCH;
+  }
+  // Called by MakeOwnSubqueue() once our subqueue exists, but before producers
+  // know about it, so that derived classes can put things in it first.
+  // Args:
+  //  subqueue: Our subqueue.
+  virtual void InitOwnSubqueue(SubqueueType *subqueue) { _UNUSED(subqueue); }
+  // Called by MakeOwnSubqueue() right after producers can see our subqueue.
+  // Args:
+  //  subqueue: Our subqueue.
+  virtual void FinishOwnSubqueue(SubqueueType *subqueue) {
+    _UNUSED(subqueue);
+  }
+  // Checks for any new existing subqueues that were created by other processes,
+  // and adds appropriate entries to our subqueues_ array.
+  void IncorporateNewSubqueues() {
+    const uint32_t num_words = AtomicLoad(&(queue_->num_valid_words),
+                                          ::std::memory_order_acquire);
+    for (uint32_t i = 0; i < num_words; ++i) {
+      // The acquire synchronizes with the release in MakeOwnSubqueue(), so that
+      // we see the new subqueue's entry.
+      const uint64_t valid_subqueues = AtomicLoadQuad(
+          &(queue_->valid_subqueues[i]), ::std::memory_order_acquire);
+      if (valid_subqueues != subqueue_mask_.GetWord(i)) {
+        UpdateSubqueues(i, valid_subqueues);
+      }
+    }
+  }
+  // Does the actual work for IncorporateNewSubqueues(), when something
+  // changed.
+  // Args:
+  //  word: Which word of queue_->valid_subqueues changed.
+  //  valid_subqueues: The current value of that word.
+  void UpdateSubqueues(uint32_t word, uint64_t valid_subqueues);
+
+  // Gets the entry for a subqueue in the shared table. The chunk that it is in
+  // has to be loaded already, which it always is for subqueues in
+  // subqueue_mask_.
+  // Args:
+  //  index: The index of the subqueue.
+  // Returns:
+  //  The entry.
+  volatile Subqueue *GetSubqueueEntry(uint32_t index) const {
+    const uint32_t chunk = ChunkOf(index);
+    return chunks_[chunk] + (index - ChunkStart(chunk));
+  }
+  // Args:
+  //  index: The index of a subqueue.
+  // Returns:
+  //  The chunk of the subqueue table that the entry for it is in.
+  static uint32_t ChunkOf(uint32_t index) {
+    return index < kFirstSubqueueChunkSize
+               ? 0
+               : 32 - __builtin_clz(index / kFirstSubqueueChunkSize);
+  }
+  // Args:
+  //  chunk: The chunk.
+  // Returns:
+  //  The index of the first entry in the chunk.
+  static uint32_t ChunkStart(uint32_t chunk) {
+    return chunk ? kFirstSubqueueChunkSize << (chunk - 1) : 0;
+  }
+  // Args:
+  //  chunk: The chunk.
+  // Returns:
+  //  The number of entries in the chunk.
+  static uint32_t ChunkSize(uint32_t chunk) {
+    return chunk ? ChunkStart(chunk) : kFirstSubqueueChunkSize;
+  }
+  // Finds a chunk of the subqueue table in our address space, and makes room
+  // for its subqueues in subqueues_.
+  // Args:
+  //  chunk: The chunk to load.
+  //  create: Whether to allocate the chunk if nobody has yet.
+  // Returns:
+  //  True if it succeeded, false if the chunk doesn't exist, and either we
+  //  weren't supposed to create it, or we ran out of shared memory.
+  bool LoadChunk(uint32_t chunk, bool create);
+
+  // Adds a subqueue that exists in shared memory to this queue.
+  // Args:
+  //  index: The index in the subqueue table at which to add an entry for it.
+  // Returns:
+  //  True if adding the subqueue succeeded, false if the queue was deleted in
+  //  another thread and can't be added.
+  bool AddSubqueue(uint32_t index);
+  // Removes a subqueue, possibly also deleting it from shared memory if this is
+  // the last remaining reference to it.
+  // Args:
+  //  index: The index in the subqueue table at which the queue to remove is
+  //         located.
+  void RemoveSubqueue(uint32_t index);
+
+  // Common back-end for the Fetch methods of derived classes.
+  // Args:
+  //  name: The name of the queue to fetch.
+  //  consumer: Whether or not the queue should be a consumer queue.
+  //  size: The size of each subqueue, if a new queue is created. Otherwise, it
+  //        is ignored.
+  //  create_args: Any extra arguments to pass to QueueType::Create(), if a new
+  //               queue is created.
+  // Returns:
+  //  The fetched queue.
+  template <class QueueType, class... CreateArgs>
+  static ::std::unique_ptr<QueueType> DoFetchQueue(const char *name,
+                                                   bool consumer,
+                                                   uint32_t size,
+                                                   CreateArgs... create_args);
+
+  RawQueue *queue_;
+  // This is the shared memory pool that we will use to construct queue objects.
+  Pool *pool_;
+  // Contains i if subqueues_[i] is loaded. Once we're caught up, it is the same
+  // as queue_->valid_subqueues.
+  SubqueueMask subqueue_mask_;
+  // The chunks of the subqueue table that we've loaded, in our address space.
+  Subqueue *chunks_[kNumSubqueueChunks] = {};
+
+  // This is the underlying array of MPSC queues that we use to implement this
+  // MPMC queue. It only has room for the chunks that we've loaded.
+  ::std::vector<::std::unique_ptr<SubqueueType>> subqueues_;
+  // The particular subqueue that we read off of.
+  SubqueueType *my_subqueue_ = nullptr;
+  // The index in the subqueue table of our subqueue.
+  uint32_t my_subqueue_index_;
+  // The durable_id of our subqueue, if we're a durable consumer. Otherwise 0.
+  uint64_t durable_id_ = 0;
+
+  // Subqueues that are ready to be written to in order to speed up the enqueue
+  // operation.
+  SubqueueMask writable_subqueues_;
+};
+
+// Initialize the queue_names_ member.
+template <class SubqueueType>
+SharedHashmap<const char *, int> QueueBase<SubqueueType>::queue_names_(
+    kNameMapOffset, kNameMapSize);
+
+#include "queue_base_impl.h"
+
+}  // namespace tachyon
+
+#endif  // TACHYON_LIB_QUEUE_BASE_H_
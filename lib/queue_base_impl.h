@@ -0,0 +1,430 @@
+// NOTE: This file is not meant to be #included directly. Use queue_base.h
+// instead.
+
+template <class SubqueueType>
+QueueBase<SubqueueType>::QueueBase() : pool_(Pool::GetPool()) {}
+
+template <class SubqueueType>
+QueueBase<SubqueueType>::~QueueBase() {
+  if (my_subqueue_ && durable_id_) {
+    // Durable subqueues stay around, so we just let someone else take it over.
+    // The release makes sure that we're done with it before they start.
+    AtomicStore(&(GetSubqueueEntry(my_subqueue_index_)->owner_pid), 0,
+                ::std::memory_order_release);
+  } else if (my_subqueue_) {
+    // If this queue is a consumer, the subqueue that was created specifically
+    // for it to read from will never be used again, so mark it as invalid so
+    // nobody will try to do anything with it again.
+    BitwiseAndQuad(&(queue_->valid_subqueues[my_subqueue_index_ / 64]),
+                   ~(1ull << (my_subqueue_index_ % 64)),
+                   ::std::memory_order_release);
+  }
+
+  // Delete any subqueues that we're still holding references to.
+  for (uint32_t i = subqueue_mask_.First(); i != SubqueueMask::kEnd;
+       i = subqueue_mask_.Next(i)) {
+    RemoveSubqueue(i);
+  }
+}
+
+template <class SubqueueType>
+void QueueBase<SubqueueType>::DoCreate(bool consumer, uint32_t size) {
+  // Allocate the shared memory we need.
+  queue_ = pool_->AllocateForType<RawQueue>();
+  assert(queue_ != nullptr && "Out of shared memory?");
+
+  // Initialize the shared state.
+  queue_->subqueue_size = size;
+
+  // Initially, there are no subqueues, and no table to put them in. Consumers
+  // allocate it as they need it.
+  for (uint32_t i = 0; i < SubqueueMask::kNumWords; ++i) {
+    queue_->valid_subqueues[i] = 0;
+  }
+  queue_->num_valid_words = 0;
+  for (uint32_t i = 0; i < kNumSubqueueChunks; ++i) {
+    queue_->chunk_offsets[i] = 0;
+  }
+  queue_->history_offset = 0;
+
+  InitializeLocalState(consumer);
+}
+
+template <class SubqueueType>
+void QueueBase<SubqueueType>::DoLoad(bool consumer, uintptr_t queue_offset) {
+  // Find the SHM portion of the queue.
+  queue_ = pool_->AtOffset<RawQueue>(queue_offset);
+
+  InitializeLocalState(consumer);
+}
+
+template <class SubqueueType>
+void QueueBase<SubqueueType>::InitializeLocalState(bool consumer) {
+  // This is the principal way in which we make get a new "handle" to the same
+  // queue, so we're going to need to make another subqueue for us to read off
+  // of.
+  if (consumer) {
+    MakeOwnSubqueue();
+  }
+}
+
+template <class SubqueueType>
+void QueueBase<SubqueueType>::MakeDurableSubqueue(const char *consumer_name) {
+  assert(!my_subqueue_ && "This queue is already a consumer.");
+
+  // Use the 64-bit FNV-1a hash of the name, which is good enough that we don't
+  // have to worry about collisions.
+  uint64_t hash = 14695981039346656037ull;
+  for (const char *c = consumer_name; *c; ++c) {
+    hash = (hash ^ static_cast<uint8_t>(*c)) * 1099511628211ull;
+  }
+  // 0 means that a subqueue isn't durable.
+  durable_id_ = hash ? hash : 1;
+
+  if (!AdoptDurableSubqueue()) {
+    MakeOwnSubqueue();
+  }
+}
+
+template <class SubqueueType>
+bool QueueBase<SubqueueType>::AdoptDurableSubqueue() {
+  // Durable subqueues are always valid, so we'll have them all after this.
+  IncorporateNewSubqueues();
+
+  for (uint32_t i = subqueue_mask_.First(); i != SubqueueMask::kEnd;
+       i = subqueue_mask_.Next(i)) {
+    volatile Subqueue *entry = GetSubqueueEntry(i);
+    if (AtomicLoadQuad(&(entry->durable_id), ::std::memory_order_relaxed) !=
+        durable_id_) {
+      continue;
+    }
+
+    // The acquire synchronizes with the release in the destructor, so the old
+    // owner is done with it.
+    uint32_t pid = AtomicLoad(&(entry->owner_pid), ::std::memory_order_acquire);
+    bool adopted = false;
+    while (!pid || !IsRunning(pid)) {
+      if (CompareExchange(&(entry->owner_pid), pid, getpid(),
+                          ::std::memory_order_acquire)) {
+        adopted = true;
+        break;
+      }
+      // Either somebody else took it over first, or a producer noticed that
+      // the old owner crashed. (See ReleaseIfOrphaned().)
+      pid = AtomicLoad(&(entry->owner_pid), ::std::memory_order_acquire);
+    }
+    if (!adopted) {
+      // Somebody who is still alive is using it.
+      continue;
+    }
+
+    if (pid) {
+      // The old owner crashed, so it never gave up its reference. We already
+      // have one from when we loaded the subqueue, so we drop the old one
+      // instead.
+      ExchangeAdd(&(entry->num_references), -1, ::std::memory_order_relaxed);
+    }
+
+    my_subqueue_ = subqueues_[i].get();
+    my_subqueue_index_ = i;
+    return true;
+  }
+
+  return false;
+}
+
+template <class SubqueueType>
+bool QueueBase<SubqueueType>::ReleaseIfOrphaned(uint32_t index) {
+  volatile Subqueue *entry = GetSubqueueEntry(index);
+  if (!AtomicLoadQuad(&(entry->durable_id), ::std::memory_order_relaxed)) {
+    return false;
+  }
+
+  const uint32_t pid =
+      AtomicLoad(&(entry->owner_pid), ::std::memory_order_relaxed);
+  if (pid && IsRunning(pid)) {
+    return false;
+  }
+  if (pid && CompareExchange(&(entry->owner_pid), pid, 0,
+                             ::std::memory_order_relaxed)) {
+    // The owner crashed, so it never gave up its reference. Whoever notices
+    // first drops it for it, just like in AdoptDurableSubqueue(). We still
+    // have our own, so this never frees it.
+    ExchangeAdd(&(entry->num_references), -1, ::std::memory_order_relaxed);
+    return true;
+  }
+
+  // Somebody else got here first. They might have taken it over, though.
+  return !AtomicLoad(&(entry->owner_pid), ::std::memory_order_relaxed);
+}
+
+template <class SubqueueType>
+void QueueBase<SubqueueType>::MakeOwnSubqueue() {
+  // Look for any dead spaces that we can write over. We only grow the table if
+  // all of the chunks that already exist are full.
+  uint32_t queue_index = kMaxQueueConsumers;
+  bool found_dead = false;
+  for (uint32_t chunk = 0; chunk < kNumSubqueueChunks && !found_dead;
+       ++chunk) {
+    if (!chunks_[chunk] && !LoadChunk(chunk, true)) {
+      break;
+    }
+
+    const uint32_t chunk_end = ChunkStart(chunk) + ChunkSize(chunk);
+    for (uint32_t i = ChunkStart(chunk); i < chunk_end; ++i) {
+      // Read the dead flag. If the space is available, grab it now. This
+      // synchronizes with RemoveSubqueue(), so we know that whoever had it last
+      // is done with it.
+      const bool was_dead =
+          CompareExchange(&(GetSubqueueEntry(i)->dead), 1, 0,
+                          ::std::memory_order_acquire);
+
+      if (was_dead) {
+        // We can overwrite this space.
+        queue_index = i;
+        found_dead = true;
+        break;
+      }
+    }
+  }
+
+  // If there were no new slots available, this constitutes a serious error.
+  assert(found_dead && "Exceeded maximum number of consumers.");
+  _UNUSED(found_dead);
+
+  // Create a new queue at that index.
+  auto new_queue = SubqueueType::Create(queue_->subqueue_size);
+  // TODO (danielp): Error handling for case when queue creation fails.
+  subqueues_[queue_index] = ::std::move(new_queue);
+  my_subqueue_ = subqueues_[queue_index].get();
+  my_subqueue_index_ = queue_index;
+
+  volatile Subqueue *entry = GetSubqueueEntry(queue_index);
+  // Record the offset so we can find it later.
+  entry->offset = my_subqueue_->GetOffset();
+  // Mark that we have one reference. Durable subqueues have an extra one, so
+  // that they stick around while their consumer is gone.
+  entry->num_references = durable_id_ ? 2 : 1;
+  entry->durable_id = durable_id_;
+  entry->owner_pid = getpid();
+  // Producers block on new subqueues until told otherwise.
+  entry->overflow_policy = kOverflowBlock;
+  entry->disconnected = 0;
+  entry->num_dropped = 0;
+  // New consumers want everything.
+  const SubscriptionFilter match_all;
+  entry->filter_sequence = 0;
+  entry->filter.min_key = match_all.min_key;
+  entry->filter.max_key = match_all.max_key;
+  entry->filter.mask = match_all.mask;
+  entry->filter.value = match_all.value;
+  entry->every_nth = 1;
+  entry->min_period_ns = 0;
+  entry->num_sampled = 0;
+  entry->last_sample_ns = 0;
+  entry->history_start = 0;
+
+  InitOwnSubqueue(my_subqueue_);
+
+  // Only once we're done messing with it can we make it valid. The release
+  // publishes everything above to producers.
+  subqueue_mask_.Set(queue_index);
+  BitwiseOrQuad(&(queue_->valid_subqueues[queue_index / 64]),
+                1ull << (queue_index % 64), ::std::memory_order_release);
+
+  FinishOwnSubqueue(my_subqueue_);
+}
+
+template <class SubqueueType>
+bool QueueBase<SubqueueType>::LoadChunk(uint32_t chunk, bool create) {
+  // The acquire synchronizes with the release below, so we see the dead flags.
+  uint32_t offset =
+      AtomicLoad(&(queue_->chunk_offsets[chunk]), ::std::memory_order_acquire);
+
+  if (!offset) {
+    if (!create) {
+      return false;
+    }
+
+    // Nobody has needed this chunk yet, so allocate it.
+    const uint32_t size = ChunkSize(chunk);
+    Subqueue *entries = pool_->AllocateForArray<Subqueue>(size);
+    assert(entries != nullptr && "Out of shared memory?");
+    if (!entries) {
+      return false;
+    }
+    for (uint32_t i = 0; i < size; ++i) {
+      entries[i].dead = 1;
+    }
+
+    offset = pool_->GetOffset(entries);
+    if (!CompareExchange(&(queue_->chunk_offsets[chunk]), 0, offset,
+                         ::std::memory_order_acq_rel)) {
+      // Another consumer beat us to it, so use theirs instead.
+      pool_->FreeArray<Subqueue>(entries, size);
+      offset = AtomicLoad(&(queue_->chunk_offsets[chunk]),
+                          ::std::memory_order_acquire);
+    } else {
+      // Tell producers to start looking at the bits for this chunk.
+      const uint32_t num_words = (ChunkStart(chunk) + size + 63) / 64;
+      uint32_t old_num_words;
+      do {
+        old_num_words = AtomicLoad(&(queue_->num_valid_words),
+                                   ::std::memory_order_relaxed);
+      } while (old_num_words < num_words &&
+               !CompareExchange(&(queue_->num_valid_words), old_num_words,
+                                num_words, ::std::memory_order_release));
+    }
+  }
+
+  chunks_[chunk] = pool_->AtOffset<Subqueue>(offset);
+  subqueues_.resize(ChunkStart(chunk) + ChunkSize(chunk));
+
+  return true;
+}
+
+template <class SubqueueType>
+bool QueueBase<SubqueueType>::AddSubqueue(uint32_t index) {
+  // The subqueue's bit is only set once its chunk exists.
+  if (!chunks_[ChunkOf(index)]) {
+    LoadChunk(ChunkOf(index), false);
+  }
+
+  bool incremented = false;
+  do {
+    // Snapshot the value of the reference counter.
+    const uint32_t references =
+        AtomicLoad(&(GetSubqueueEntry(index)->num_references),
+                   ::std::memory_order_relaxed);
+
+    if (references == 0) {
+      // The queue was already freed in another thread. Adding it would be
+      // invalid.
+      return false;
+    }
+
+    // Now, try to safely increment the counter.
+    incremented =
+        CompareExchange(&(GetSubqueueEntry(index)->num_references),
+                        references, references + 1,
+                        ::std::memory_order_acquire);
+
+    // This might fail if the reference counter does not have the expected
+    // value, in which case it's not safe to increment and we need to try again.
+  } while (!incremented);
+
+  // Go ahead and create the queue.
+  const int32_t offset = GetSubqueueEntry(index)->offset;
+  subqueues_[index] = SubqueueType::Load(offset);
+
+  return true;
+}
+
+template <class SubqueueType>
+void QueueBase<SubqueueType>::RemoveSubqueue(uint32_t index) {
+  // Decrement the reference counter.
+  // This is the standard reference-counting pattern: The release makes sure
+  // that everyone is done using the subqueue before the count can hit zero, and
+  // the acquire makes sure that whoever frees it sees all of that.
+  const uint32_t references =
+      ExchangeAdd(&(GetSubqueueEntry(index)->num_references), -1,
+                  ::std::memory_order_acq_rel);
+
+  if (references == 1) {
+    // The reference counter just hit zero, which means we need to free the SHM.
+    subqueues_[index]->FreeQueue();
+
+    // Only now when we're done is it safe to mark this space as reusable.
+    AtomicStore(&(GetSubqueueEntry(index)->dead), 1,
+                ::std::memory_order_release);
+  }
+
+  // Delete the local portion of the queue.
+  subqueues_[index].reset();
+}
+
+template <class SubqueueType>
+void QueueBase<SubqueueType>::UpdateSubqueues(uint32_t word,
+                                              uint64_t valid_subqueues) {
+  // We only have to look at the subqueues whose bits changed. A slot can't be
+  // reused while we still hold a reference to the subqueue in it, so if a bit
+  // is set in both masks, it's still the same subqueue.
+  for (uint64_t changed = valid_subqueues ^ subqueue_mask_.GetWord(word);
+       changed; changed &= changed - 1) {
+    const uint32_t bit = __builtin_ctzll(changed);
+    const uint32_t i = word * 64 + bit;
+
+    if (valid_subqueues & (1ull << bit)) {
+      // This subqueue is now valid, but not reflected in our subqueues array.
+      if (AddSubqueue(i)) {
+        subqueue_mask_.Set(i);
+      }
+    } else {
+      // This subqueue is now invalid, but not reflected in our subqueues
+      // array.
+      RemoveSubqueue(i);
+      subqueue_mask_.Clear(i);
+    }
+  }
+}
+
+template <class SubqueueType>
+int QueueBase<SubqueueType>::GetOffset() const {
+  return pool_->GetOffset(queue_);
+}
+
+template <class SubqueueType>
+void QueueBase<SubqueueType>::FreeQueue() {
+  // We want to make sure we free everything, so we need all the subqueues
+  // locally.
+  IncorporateNewSubqueues();
+
+  // Free shared memory for the underlying subqueues.
+  for (uint32_t i = subqueue_mask_.First(); i != SubqueueMask::kEnd;
+       i = subqueue_mask_.Next(i)) {
+    subqueues_[i]->FreeQueue();
+  }
+  // Free the subqueue table.
+  for (uint32_t i = 0; i < kNumSubqueueChunks; ++i) {
+    if (queue_->chunk_offsets[i]) {
+      pool_->FreeArray<Subqueue>(
+          pool_->AtOffset<Subqueue>(queue_->chunk_offsets[i]), ChunkSize(i));
+    }
+  }
+
+  // Now free our underlying shared memory.
+  pool_->FreeType<RawQueue>(queue_);
+}
+
+template <class SubqueueType>
+uint32_t QueueBase<SubqueueType>::GetNumConsumers() const {
+  const uint32_t num_words = AtomicLoad(&(queue_->num_valid_words),
+                                        ::std::memory_order_acquire);
+
+  uint32_t num_consumers = 0;
+  for (uint32_t i = 0; i < num_words; ++i) {
+    num_consumers += __builtin_popcountll(AtomicLoadQuad(
+        &(queue_->valid_subqueues[i]), ::std::memory_order_acquire));
+  }
+  return num_consumers;
+}
+
+template <class SubqueueType>
+template <class QueueType, class... CreateArgs>
+::std::unique_ptr<QueueType> QueueBase<SubqueueType>::DoFetchQueue(
+    const char *name, bool consumer, uint32_t size,
+    CreateArgs... create_args) {
+  // First, see if a queue exists.
+  int offset;
+  if (queue_names_.Fetch(name, &offset)) {
+    // We have a queue, so just make a new handle to it.
+    return QueueType::Load(consumer, offset);
+  }
+
+  // Create a new queue.
+  auto queue_handle = QueueType::Create(consumer, size, create_args...);
+  // Save the offset.
+  queue_names_.AddOrSet(name, queue_handle->GetOffset());
+
+  return queue_handle;
+}
@@ -0,0 +1,447 @@
+// Simple throughput benchmarks for the queue implementations. These are not
+// run as part of the tests. Run with:
+//  bazel run -c opt //lib:queue_benchmark [-- <benchmark name substring>]
+// Recorded results are in queue_benchmark_results.txt.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "byte_mpsc_queue.h"
+#include "constants.h"
+#include "mpsc_queue.h"
+#include "pool.h"
+#include "queue.h"
+#include "ring_queue.h"
+#include "spsc_queue.h"
+
+namespace tachyon {
+namespace {
+
+// How many items each benchmark pushes through the queue.
+constexpr int kNumItems = 1000000;
+
+// Represents a single benchmark.
+struct Benchmark {
+  // The name to print.
+  const char *name;
+  // Runs the benchmark.
+  // Returns:
+  //  The total number of operations that were performed.
+  ::std::function<int64_t()> run;
+};
+
+// Runs a benchmark and prints the results.
+// Args:
+//  benchmark: The benchmark to run.
+void RunBenchmark(const Benchmark &benchmark) {
+  // Start every benchmark with a clean slate.
+  Pool::GetPool()->Clear();
+
+  const auto start = ::std::chrono::steady_clock::now();
+  const int64_t num_ops = benchmark.run();
+  const auto end = ::std::chrono::steady_clock::now();
+
+  const double nanos =
+      ::std::chrono::duration_cast<::std::chrono::nanoseconds>(end - start)
+          .count();
+  printf("%-56s %10.1f ns/op %12.0f ops/s\n", benchmark.name,
+         nanos / num_ops, num_ops / (nanos * 1e-9));
+  fflush(stdout);
+}
+
+// Enqueues and then immediately dequeues items in the same thread. This
+// measures the uncontended cost of a single trip through the queue.
+template <class T>
+int64_t MpscRoundTrip() {
+  auto queue = MpscQueue<T>::Create(kQueueCapacity);
+
+  T item;
+  for (int i = 0; i < kNumItems; ++i) {
+    queue->Enqueue(static_cast<T>(i));
+    queue->DequeueNext(&item);
+  }
+
+  queue->FreeQueue();
+  return kNumItems;
+}
+
+// Same as above, but uses the blocking operations.
+int64_t MpscBlockingRoundTrip() {
+  auto queue = MpscQueue<int>::Create(kQueueCapacity);
+
+  int item;
+  for (int i = 0; i < kNumItems; ++i) {
+    queue->EnqueueBlocking(i);
+    queue->DequeueNextBlocking(&item);
+  }
+
+  queue->FreeQueue();
+  return kNumItems;
+}
+
+// Same as MpscThroughput(), but moves items in batches.
+// Args:
+//  num_producers: How many producer threads to use.
+//  batch_size: How many items to move at once.
+// Returns:
+//  The number of items that were transferred.
+int64_t MpscBatchThroughput(int num_producers, int batch_size) {
+  auto queue = MpscQueue<int>::Create(kQueueCapacity);
+  const int per_producer = kNumItems / num_producers;
+
+  ::std::vector<::std::thread> producers;
+  for (int i = 0; i < num_producers; ++i) {
+    producers.emplace_back([&queue, per_producer, batch_size]() {
+      ::std::vector<int> items(batch_size);
+      for (int j = 0; j < per_producer;) {
+        const int num_items = ::std::min(batch_size, per_producer - j);
+        const uint32_t num_written = queue->EnqueueBatch(items.data(), num_items);
+        if (!num_written) {
+          ::std::this_thread::yield();
+        }
+        j += num_written;
+      }
+    });
+  }
+
+  ::std::vector<int> items(batch_size);
+  for (int i = 0; i < per_producer * num_producers;) {
+    const uint32_t num_read = queue->DequeueBatch(items.data(), batch_size);
+    if (!num_read) {
+      ::std::this_thread::yield();
+    }
+    i += num_read;
+  }
+
+  for (auto &producer : producers) {
+    producer.join();
+  }
+
+  queue->FreeQueue();
+  return per_producer * num_producers;
+}
+
+// A big item, for comparing copying with in-place operations.
+struct Frame {
+  uint8_t data[2048];
+};
+// Big items use a smaller queue so that they fit in the pool.
+constexpr uint32_t kFrameQueueCapacity = 8;
+// Consumers write what they read here, so that the compiler can't optimize the
+// reads out.
+volatile uint8_t g_frame_sink;
+
+// Fills a frame with data, like a producer serializing something.
+// Args:
+//  frame: The frame to fill.
+//  value: The value to fill it with.
+void FillFrame(Frame *frame, int value) {
+  memset(frame->data, value, sizeof(frame->data));
+}
+
+// Enqueues and dequeues big items by copying them.
+int64_t MpscFrameCopyRoundTrip() {
+  auto queue = MpscQueue<Frame>::Create(kFrameQueueCapacity);
+
+  Frame frame;
+  for (int i = 0; i < kNumItems / 10; ++i) {
+    FillFrame(&frame, i);
+    queue->Enqueue(frame);
+    queue->DequeueNext(&frame);
+    g_frame_sink = frame.data[i % sizeof(frame.data)];
+  }
+
+  queue->FreeQueue();
+  return kNumItems / 10;
+}
+
+// Same as above, but builds and reads items in place.
+int64_t MpscFrameZeroCopyRoundTrip() {
+  auto queue = MpscQueue<Frame>::Create(kFrameQueueCapacity);
+
+  for (int i = 0; i < kNumItems / 10; ++i) {
+    FillFrame(queue->Reserve(), i);
+    queue->Commit();
+    g_frame_sink = queue->ReadView()->data[i % sizeof(Frame::data)];
+    queue->Release();
+  }
+
+  queue->FreeQueue();
+  return kNumItems / 10;
+}
+
+// Copies a buffer into and back out of "shared" memory with the same functions
+// that the queues use, to measure copy bandwidth for a particular payload size.
+// Args:
+//  size: The size of the payload, in bytes.
+//  use_memcpy: Use plain memcpy() instead, for comparison.
+// Returns:
+//  The number of kilobytes that were copied, so that ops/s is in KB/s.
+int64_t CopyBandwidth(uint32_t size, bool use_memcpy) {
+  // Copy the same total amount for every size.
+  constexpr int64_t kTotalBytes = 1ll << 30;
+  ::std::vector<uint8_t> source(size, 1), shared(size), dest(size);
+
+  const int64_t num_copies = kTotalBytes / 2 / size;
+  for (int64_t i = 0; i < num_copies; ++i) {
+    if (use_memcpy) {
+      memcpy(shared.data(), source.data(), size);
+      memcpy(dest.data(), shared.data(), size);
+    } else {
+      mpsc_queue::VolatileCopy(shared.data(), source.data(), size);
+      mpsc_queue::VolatileRead(dest.data(), shared.data(), size);
+    }
+    g_frame_sink = dest[i % size];
+  }
+
+  return num_copies * size * 2 / 1024;
+}
+
+// Pushes items from a number of producer threads to a single consumer. Threads
+// yield whenever the queue is full or empty, so that this still gives
+// meaningful results when there are more threads than cores.
+// Args:
+//  num_producers: How many producer threads to use.
+//  pad_nodes: Whether to pad the queue nodes out to a full cache line.
+// Returns:
+//  The number of items that were transferred.
+int64_t MpscThroughput(int num_producers, bool pad_nodes = false) {
+  auto queue = MpscQueue<int>::Create(kQueueCapacity, pad_nodes);
+  const int per_producer = kNumItems / num_producers;
+
+  ::std::vector<::std::thread> producers;
+  for (int i = 0; i < num_producers; ++i) {
+    producers.emplace_back([&queue, per_producer]() {
+      for (int j = 0; j < per_producer; ++j) {
+        while (!queue->Enqueue(j)) {
+          ::std::this_thread::yield();
+        }
+      }
+    });
+  }
+
+  int item;
+  for (int i = 0; i < per_producer * num_producers; ++i) {
+    while (!queue->DequeueNext(&item)) {
+      ::std::this_thread::yield();
+    }
+  }
+
+  for (auto &producer : producers) {
+    producer.join();
+  }
+
+  queue->FreeQueue();
+  return per_producer * num_producers;
+}
+
+// Same as MpscRoundTrip(), but uses an SpscQueue.
+int64_t SpscRoundTrip() {
+  auto queue = SpscQueue<int>::Create(kQueueCapacity);
+
+  int item;
+  for (int i = 0; i < kNumItems; ++i) {
+    queue->Enqueue(i);
+    queue->DequeueNext(&item);
+  }
+
+  queue->FreeQueue();
+  return kNumItems;
+}
+
+// Same as MpscThroughput() with one producer, but uses an SpscQueue.
+int64_t SpscThroughput() {
+  auto queue = SpscQueue<int>::Create(kQueueCapacity);
+
+  ::std::thread producer([&queue]() {
+    // Use a separate handle, like a real producer would.
+    auto producer_queue = SpscQueue<int>::Load(queue->GetOffset());
+    for (int i = 0; i < kNumItems; ++i) {
+      while (!producer_queue->Enqueue(i)) {
+        ::std::this_thread::yield();
+      }
+    }
+  });
+
+  int item;
+  for (int i = 0; i < kNumItems; ++i) {
+    while (!queue->DequeueNext(&item)) {
+      ::std::this_thread::yield();
+    }
+  }
+
+  producer.join();
+  queue->FreeQueue();
+  return kNumItems;
+}
+
+// Enqueues and then immediately dequeues variable-length messages.
+// Args:
+//  max_size: The size of the largest message. Sizes cycle from 1 up to this.
+int64_t ByteMpscRoundTrip(uint32_t max_size) {
+  auto queue = ByteMpscQueue::Create(kByteQueueCapacity);
+
+  uint8_t message[kByteQueueCapacity / 2] = {0};
+  uint32_t size;
+  for (int i = 0; i < kNumItems; ++i) {
+    queue->Enqueue(message, i % max_size + 1);
+    queue->DequeueNext(message, sizeof(message), &size);
+  }
+
+  queue->FreeQueue();
+  return kNumItems;
+}
+
+// Enqueues and then immediately dequeues items on a Queue with a single
+// consumer.
+int64_t QueueRoundTrip() {
+  auto queue = Queue<int>::Create(true, kQueueCapacity);
+
+  int item;
+  for (int i = 0; i < kNumItems; ++i) {
+    queue->Enqueue(i);
+    queue->DequeueNext(&item);
+  }
+
+  queue->FreeQueue();
+  return kNumItems;
+}
+
+// A medium-sized item, like a robot pose.
+struct Pose {
+  double position[3];
+  double orientation[4];
+};
+// The queues in the fan-out benchmarks are small, so that even Queue can fit
+// lots of consumers in the pool.
+constexpr uint32_t kFanOutQueueCapacity = 16;
+
+// Sends items to a number of consumers, which all read them in the same thread.
+// This measures how the cost of sending one item grows with the number of
+// consumers.
+// Args:
+//  num_consumers: How many consumers to use.
+// Returns:
+//  The number of items that were sent.
+template <class QueueType>
+int64_t FanOut(int num_consumers) {
+  auto producer = QueueType::Create(false, kFanOutQueueCapacity);
+  ::std::vector<::std::unique_ptr<QueueType>> consumers;
+  for (int i = 0; i < num_consumers; ++i) {
+    consumers.push_back(QueueType::Load(true, producer->GetOffset()));
+  }
+
+  Pose pose = {{1.0, 2.0, 3.0}, {0.0, 0.0, 0.0, 1.0}};
+  for (int i = 0; i < kNumItems / 10; ++i) {
+    pose.position[0] = i;
+    producer->Enqueue(pose);
+    for (auto &consumer : consumers) {
+      consumer->DequeueNext(&pose);
+    }
+  }
+
+  consumers.clear();
+  producer->FreeQueue();
+  return kNumItems / 10;
+}
+
+}  // namespace
+}  // namespace tachyon
+
+int main(int argc, char **argv) {
+  using tachyon::Benchmark;
+
+  const ::std::vector<Benchmark> benchmarks = {
+      {"MpscQueue round trip", tachyon::MpscRoundTrip<int>},
+      // Items of up to 4 bytes are written with a single atomic store, but
+      // bigger ones have to be copied.
+      {"MpscQueue round trip, 8-byte items", tachyon::MpscRoundTrip<int64_t>},
+      {"MpscQueue blocking round trip", tachyon::MpscBlockingRoundTrip},
+      {"MpscQueue throughput, 1 producer",
+       []() { return tachyon::MpscThroughput(1); }},
+      {"MpscQueue throughput, 4 producers",
+       []() { return tachyon::MpscThroughput(4); }},
+      {"MpscQueue throughput, 16 producers",
+       []() { return tachyon::MpscThroughput(16); }},
+      {"MpscQueue throughput, 64 producers",
+       []() { return tachyon::MpscThroughput(64); }},
+      // Since the items are so small, these show the effect of false sharing
+      // between adjacent nodes.
+      {"MpscQueue throughput, 1 producer, padded",
+       []() { return tachyon::MpscThroughput(1, true); }},
+      {"MpscQueue throughput, 4 producers, padded",
+       []() { return tachyon::MpscThroughput(4, true); }},
+      {"MpscQueue throughput, 16 producers, padded",
+       []() { return tachyon::MpscThroughput(16, true); }},
+      {"MpscQueue batch throughput, 1 producer, batches of 16",
+       []() { return tachyon::MpscBatchThroughput(1, 16); }},
+      {"MpscQueue batch throughput, 4 producers, batches of 16",
+       []() { return tachyon::MpscBatchThroughput(4, 16); }},
+      {"MpscQueue 2 KB round trip, copying",
+       tachyon::MpscFrameCopyRoundTrip},
+      {"MpscQueue 2 KB round trip, in place",
+       tachyon::MpscFrameZeroCopyRoundTrip},
+      // For these, an "op" is one kilobyte copied. Sizes of at least
+      // kNonTemporalCopyThreshold bypass the cache.
+      {"VolatileCopy bandwidth, 256 B",
+       []() { return tachyon::CopyBandwidth(256, false); }},
+      {"VolatileCopy bandwidth, 4 KB",
+       []() { return tachyon::CopyBandwidth(4 << 10, false); }},
+      {"VolatileCopy bandwidth, 64 KB",
+       []() { return tachyon::CopyBandwidth(64 << 10, false); }},
+      {"VolatileCopy bandwidth, 512 KB",
+       []() { return tachyon::CopyBandwidth(512 << 10, false); }},
+      {"VolatileCopy bandwidth, 16 MB",
+       []() { return tachyon::CopyBandwidth(16 << 20, false); }},
+      {"memcpy bandwidth, 256 B",
+       []() { return tachyon::CopyBandwidth(256, true); }},
+      {"memcpy bandwidth, 4 KB",
+       []() { return tachyon::CopyBandwidth(4 << 10, true); }},
+      {"memcpy bandwidth, 64 KB",
+       []() { return tachyon::CopyBandwidth(64 << 10, true); }},
+      {"memcpy bandwidth, 512 KB",
+       []() { return tachyon::CopyBandwidth(512 << 10, true); }},
+      {"memcpy bandwidth, 16 MB",
+       []() { return tachyon::CopyBandwidth(16 << 20, true); }},
+      {"SpscQueue round trip", tachyon::SpscRoundTrip},
+      {"SpscQueue throughput", tachyon::SpscThroughput},
+      {"ByteMpscQueue round trip, up to 64 bytes",
+       []() { return tachyon::ByteMpscRoundTrip(64); }},
+      {"ByteMpscQueue round trip, up to 1 KB",
+       []() { return tachyon::ByteMpscRoundTrip(1024); }},
+      {"Queue round trip", tachyon::QueueRoundTrip},
+      // Queue copies every item once per consumer, but RingQueue only writes
+      // it once.
+      {"Queue fan-out, 2 consumers",
+       []() { return tachyon::FanOut<tachyon::Queue<tachyon::Pose>>(2); }},
+      {"Queue fan-out, 8 consumers",
+       []() { return tachyon::FanOut<tachyon::Queue<tachyon::Pose>>(8); }},
+      {"Queue fan-out, 40 consumers",
+       []() { return tachyon::FanOut<tachyon::Queue<tachyon::Pose>>(40); }},
+      {"RingQueue fan-out, 2 consumers",
+       []() { return tachyon::FanOut<tachyon::RingQueue<tachyon::Pose>>(2); }},
+      {"RingQueue fan-out, 8 consumers",
+       []() { return tachyon::FanOut<tachyon::RingQueue<tachyon::Pose>>(8); }},
+      {"RingQueue fan-out, 40 consumers",
+       []() { return tachyon::FanOut<tachyon::RingQueue<tachyon::Pose>>(40); }},
+  };
+
+  // An optional argument selects only benchmarks containing that string.
+  const char *filter = argc > 1 ? argv[1] : "";
+  for (const auto &benchmark : benchmarks) {
+    if (strstr(benchmark.name, filter)) {
+      tachyon::RunBenchmark(benchmark);
+    }
+  }
+
+  tachyon::Pool::Unlink();
+  return 0;
+}
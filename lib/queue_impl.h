@@ -1,295 +1,461 @@
 // NOTE: This file is not meant to be #included directly. Use queue.h instead.
 
 template <class T>
-Queue<T>::Queue() : pool_(Pool::GetPool()) {}
+bool Queue<T>::ReserveAll(const SubqueueMask &targets, T **first_space,
+                          uint32_t *first_index, uint64_t history_index) {
+  // First, add any new subqueues that might have been created since we last ran
+  // this.
+  IncorporateNewSubqueues();
 
-template <class T>
-Queue<T>::~Queue() {
-  if (my_subqueue_) {
-    // If this queue is a consumer, the subqueue that was created specifically
-    // for it to read from will never be used again. First, mark it as invalid
-    // so nobody will try to do anything with it again.
-    Exchange(&(queue_->queue_offsets[my_subqueue_index_].valid), 0);
-    Fence();
+  writable_subqueues_.ClearAll();
+  *first_space = nullptr;
 
-    // Decrement the total number of subqueues.
-    Decrement(&(queue_->num_subqueues));
-    // Still an increment for the update counter, because this counts as an
-    // update.
-    Fence();
-    Increment(&(queue_->subqueue_updates));
+  // If we have no consumers, we'd basically just be sending this message out
+  // into the void.
+  if (subqueue_mask_.Empty()) {
+    return false;
   }
+  bool found_target = false;
 
-  // Get rid of subqueues.
-  for (uint32_t i = 0; i < kMaxConsumers; ++i) {
-    if (subqueues_[i]) {
-      // Delete any subqueues that we're still holding references to.
-      RemoveSubqueue(i);
+  // Consumers that block go first, so that if any of them are full, we don't
+  // drop anything for the others, since we're not sending it after all.
+  // Since the subqueues support multiple producers, we can just write to all of
+  // them in a pretty straightforward fashion.
+  for (uint32_t i = targets.First(); i != SubqueueMask::kEnd;
+       i = targets.Next(i)) {
+    if (!subqueue_mask_.Contains(i)) {
+      continue;
+    }
+    found_target = true;
+    if (GetPolicy(i) != kOverflowBlock || Replays(i, history_index)) {
+      continue;
+    }
+
+    T *space = subqueues_[i]->Reserve();
+    if (!space && ReleaseIfOrphaned(i)) {
+      // Its owner crashed, so now it gets treated like it has
+      // kOverflowDropNewest, below.
+      continue;
+    }
+    if (!space) {
+      // If they're not all going to work, we're going to cancel all our
+      // reservations, not enqueue anything, and return false.
+      for (uint32_t j = writable_subqueues_.First(); j != SubqueueMask::kEnd;
+           j = writable_subqueues_.Next(j)) {
+        subqueues_[j]->CancelReservation();
+      }
+      writable_subqueues_.ClearAll();
+      return false;
+    }
+    if (!*first_space) {
+      *first_space = space;
+      *first_index = i;
     }
+
+    writable_subqueues_.Set(i);
   }
-  // Delete the array.
-  delete[] subqueues_;
-}
 
-template <class T>
-void Queue<T>::DoCreate(bool consumer, uint32_t size) {
-  // Allocate the shared memory we need.
-  queue_ = pool_->AllocateForType<RawQueue>();
-  assert(queue_ != nullptr && "Out of shared memory?");
+  // Now everyone else gets the item if they have room.
+  for (uint32_t i = targets.First(); i != SubqueueMask::kEnd;
+       i = targets.Next(i)) {
+    if (!subqueue_mask_.Contains(i)) {
+      continue;
+    }
+    const OverflowPolicy policy = GetPolicy(i);
+    if (policy == kOverflowBlock || Replays(i, history_index)) {
+      continue;
+    }
 
-  // Initialize the shared state.
-  queue_->num_subqueues = 0;
-  queue_->subqueue_size = size;
-  queue_->subqueue_updates = 0;
+    T *space = ReserveWithPolicy(i, policy);
+    if (!space) {
+      continue;
+    }
+    if (!*first_space) {
+      *first_space = space;
+      *first_index = i;
+    }
 
-  // Initially, mark everything in the queue_offsets array as invalid and dead.
-  for (int i = 0; i < kMaxConsumers; ++i) {
-    queue_->queue_offsets[i].valid = 0;
-    queue_->queue_offsets[i].dead = 1;
+    writable_subqueues_.Set(i);
   }
 
-  InitializeLocalState(consumer);
+  return found_target;
 }
 
 template <class T>
-void Queue<T>::DoLoad(bool consumer, uintptr_t queue_offset) {
-  // Find the SHM portion of the queue.
-  queue_ = pool_->AtOffset<RawQueue>(queue_offset);
+T *Queue<T>::ReserveWithPolicy(uint32_t index, OverflowPolicy policy) {
+  if (AtomicLoad(&(GetSubqueueEntry(index)->disconnected),
+                 ::std::memory_order_relaxed)) {
+    // This consumer doesn't get anything anymore.
+    return nullptr;
+  }
+  if (!Sample(index)) {
+    // This consumer doesn't want this item.
+    return nullptr;
+  }
 
-  InitializeLocalState(consumer);
+  T *space;
+  if (policy == kOverflowDropOldest) {
+    uint32_t num_overwritten;
+    space = subqueues_[index]->ReserveOverwriting(&num_overwritten);
+    if (num_overwritten) {
+      CountDropped(index, num_overwritten);
+    }
+  } else {
+    space = subqueues_[index]->Reserve();
+  }
+
+  if (!space) {
+    if (policy == kOverflowDisconnect) {
+      AtomicStore(&(GetSubqueueEntry(index)->disconnected), 1,
+                  ::std::memory_order_relaxed);
+    }
+    CountDropped(index, 1);
+  }
+
+  return space;
 }
 
 template <class T>
-void Queue<T>::InitializeLocalState(bool consumer) {
-  // Allocate the subqueues array.
-  subqueues_ = new ::std::unique_ptr<MpscQueue<T>>[kMaxConsumers];
-  assert(subqueues_ && "Failed to allocate subqueues.");
+void Queue<T>::EnqueueBatchWithPolicy(uint32_t index, OverflowPolicy policy,
+                                      const T *items, uint32_t num_items) {
+  if (policy == kOverflowDropOldest || IsSampled(index)) {
+    // Overwriting and skipping items only work one item at a time.
+    for (uint32_t i = 0; i < num_items; ++i) {
+      if (ReserveWithPolicy(index, policy)) {
+        subqueues_[index]->EnqueueAt(items[i]);
+      }
+    }
+    return;
+  }
 
-  // We'll go ahead and reserve as much space as we could possibly need here to
-  // make the enqueue operation more realtime.
-  writable_subqueues_.reserve(kMaxConsumers);
+  if (AtomicLoad(&(GetSubqueueEntry(index)->disconnected),
+                 ::std::memory_order_relaxed)) {
+    return;
+  }
 
-  // This is the principal way in which we make get a new "handle" to the same
-  // queue, so we're going to need to make another subqueue for us to read off
-  // of.
-  if (consumer) {
-    MakeOwnSubqueue();
+  const uint32_t num_written =
+      subqueues_[index]->EnqueueBatch(items, num_items);
+  if (num_written < num_items) {
+    if (policy == kOverflowDisconnect) {
+      AtomicStore(&(GetSubqueueEntry(index)->disconnected), 1,
+                  ::std::memory_order_relaxed);
+    }
+    CountDropped(index, num_items - num_written);
   }
 }
 
 template <class T>
-void Queue<T>::MakeOwnSubqueue() {
-  // Look for any dead spaces that we can write over.
-  uint32_t queue_index = kMaxConsumers;
-  bool found_dead = false;
-  for (uint32_t i = 0; i < kMaxConsumers; ++i) {
-    // Read the dead flag. If the space is available, grab it now.
-    const bool was_dead =
-        CompareExchange(&(queue_->queue_offsets[i].dead), 1, 0);
-    Fence();
+bool Queue<T>::Sample(uint32_t index) {
+  volatile auto *entry = GetSubqueueEntry(index);
+
+  const uint32_t every_nth =
+      AtomicLoad(&(entry->every_nth), ::std::memory_order_relaxed);
+  if (every_nth > 1 &&
+      ExchangeAdd(&(entry->num_sampled), 1, ::std::memory_order_relaxed) %
+          every_nth) {
+    return false;
+  }
 
-    if (was_dead) {
-      // We can overwrite this space.
-      queue_index = i;
-      found_dead = true;
-      break;
+  const uint64_t min_period_ns =
+      AtomicLoadQuad(&(entry->min_period_ns), ::std::memory_order_relaxed);
+  if (min_period_ns) {
+    const uint64_t now_ns =
+        ::std::chrono::duration_cast<::std::chrono::nanoseconds>(
+            ::std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    const uint64_t last_sample_ns =
+        AtomicLoadQuad(&(entry->last_sample_ns), ::std::memory_order_relaxed);
+    if (now_ns - last_sample_ns < min_period_ns) {
+      return false;
+    }
+    // If another producer got here first, it gets to send its item instead.
+    if (!CompareExchangeQuad(&(entry->last_sample_ns), last_sample_ns, now_ns,
+                             ::std::memory_order_relaxed)) {
+      return false;
     }
   }
 
-  // If there were no new slots available, this constitutes a serious error.
-  assert(found_dead && "Exceeded maximum number of consumers.");
-  _UNUSED(found_dead);
-
-  // Create a new queue at that index.
-  auto new_queue = MpscQueue<T>::Create(queue_->subqueue_size);
-  // TODO (danielp): Error handling for case when queue creation fails.
-  subqueues_[queue_index] = ::std::move(new_queue);
-  my_subqueue_ = subqueues_[queue_index].get();
-  my_subqueue_index_ = queue_index;
+  return true;
+}
 
-  // Record the offset so we can find it later.
-  queue_->queue_offsets[queue_index].offset = my_subqueue_->GetOffset();
-  // Mark that we have one reference.
-  queue_->queue_offsets[queue_index].num_references = 1;
+template <class T>
+bool Queue<T>::MatchesFilter(uint32_t index, uint64_t key) const {
+  volatile auto *entry = GetSubqueueEntry(index);
+
+  for (int i = 0; i < kMaxFilterRetries; ++i) {
+    // The acquire synchronizes with the release at the end of SetFilter(), so
+    // we see the whole filter if the sequence number doesn't change.
+    const uint32_t sequence =
+        AtomicLoad(&(entry->filter_sequence), ::std::memory_order_acquire);
+    if (sequence & 1) {
+      // The consumer is changing it right now.
+      continue;
+    }
 
-  // Only once we're done messing with it can we make it valid.
-  Fence();
-  Exchange(&(queue_->queue_offsets[queue_index].valid), 1);
+    SubscriptionFilter filter;
+    filter.min_key =
+        AtomicLoadQuad(&(entry->filter.min_key), ::std::memory_order_relaxed);
+    filter.max_key =
+        AtomicLoadQuad(&(entry->filter.max_key), ::std::memory_order_relaxed);
+    filter.mask =
+        AtomicLoadQuad(&(entry->filter.mask), ::std::memory_order_relaxed);
+    filter.value =
+        AtomicLoadQuad(&(entry->filter.value), ::std::memory_order_relaxed);
+
+    Fence(::std::memory_order_acquire);
+    if (AtomicLoad(&(entry->filter_sequence), ::std::memory_order_relaxed) ==
+        sequence) {
+      return filter.Matches(key);
+    }
+  }
 
-  // Mark that we have an additional subqueue.
-  ++last_num_subqueues_;
-  ++last_subqueue_updates_;
-  Fence();
-  Increment(&(queue_->subqueue_updates));
-  Fence();
-  Increment(&(queue_->num_subqueues));
+  // We couldn't get a stable filter. Sending the consumer something that it
+  // doesn't want is better than waiting on it.
+  return true;
 }
 
 template <class T>
-bool Queue<T>::AddSubqueue(uint32_t index) {
-  bool incremented = false;
-  do {
-    // Snapshot the value of the reference counter.
-    const uint32_t references =
-        ExchangeAdd(&(queue_->queue_offsets[index].num_references), 0);
-    Fence();
+void Queue<T>::CountDropped(uint32_t index, uint32_t num_items) {
+  ExchangeAddQuad(&(GetSubqueueEntry(index)->num_dropped), num_items,
+                  ::std::memory_order_relaxed);
+}
 
-    if (references == 0) {
-      // The queue was already freed in another thread. Adding it would be
-      // invalid.
-      return false;
-    }
+template <class T>
+bool Queue<T>::Enqueue(const T &item) {
+  const uint64_t history_index = history_ ? ClaimHistory(1) : kNotInHistory;
+  return DoEnqueue(subqueue_mask_, item, history_index, nullptr);
+}
 
-    // Now, try to safely increment the counter.
-    incremented =
-        CompareExchange(&(queue_->queue_offsets[index].num_references),
-                        references, references + 1);
-    Fence();
+template <class T>
+bool Queue<T>::EnqueueTo(const SubqueueMask &consumers, const T &item,
+                         SubqueueMask *received) {
+  return DoEnqueue(consumers, item, kNotInHistory, received);
+}
 
-    // This might fail if the reference counter does not have the expected
-    // value, in which case it's not safe to increment and we need to try again.
-  } while (!incremented);
+template <class T>
+bool Queue<T>::DoEnqueue(const SubqueueMask &targets, const T &item,
+                         uint64_t history_index, SubqueueMask *received) {
+  T *first_space;
+  uint32_t first_index;
+  const bool reserved =
+      ReserveAll(targets, &first_space, &first_index, history_index);
+  if (received) {
+    // If it failed, this is empty.
+    *received = writable_subqueues_;
+  }
+  if (history_index != kNotInHistory) {
+    // Items that went nowhere because there aren't any consumers yet are
+    // exactly the ones that the history is for.
+    WriteHistory(history_index,
+                 reserved || subqueue_mask_.Empty() ? &item : nullptr);
+  }
+  if (!reserved) {
+    return false;
+  }
 
-  // Go ahead and create the queue.
-  const int32_t offset = queue_->queue_offsets[index].offset;
-  subqueues_[index] = MpscQueue<T>::Load(offset);
+  // If we get to here, we managed to reserve everything, so we're clear to
+  // actually enqueue stuff.
+  for (uint32_t i = writable_subqueues_.First(); i != SubqueueMask::kEnd;
+       i = writable_subqueues_.Next(i)) {
+    subqueues_[i]->EnqueueAt(item);
+  }
 
   return true;
 }
 
 template <class T>
-void Queue<T>::RemoveSubqueue(uint32_t index) {
-  // Decrement the reference counter.
-  const uint32_t references =
-      ExchangeAdd(&(queue_->queue_offsets[index].num_references), -1);
-  Fence();
+bool Queue<T>::EnqueueWithKey(uint64_t key, const T &item,
+                              SubqueueMask *received) {
+  // We have to know about all the subqueues before we can check their filters.
+  IncorporateNewSubqueues();
 
-  if (references == 1) {
-    // The reference counter just hit zero, which means we need to free the SHM.
-    subqueues_[index]->FreeQueue();
+  SubqueueMask targets;
+  for (uint32_t i = subqueue_mask_.First(); i != SubqueueMask::kEnd;
+       i = subqueue_mask_.Next(i)) {
+    if (MatchesFilter(i, key)) {
+      targets.Set(i);
+    }
+  }
 
-    // Only now when we're done is it safe to mark this space as reusable.
-    Fence();
-    Exchange(&(queue_->queue_offsets[index].dead), 1);
+  if (targets.Empty() && !subqueue_mask_.Empty()) {
+    // Nobody wants it, which isn't a failure.
+    if (received) {
+      received->ClearAll();
+    }
+    return true;
   }
 
-  // Delete the local portion of the queue.
-  subqueues_[index].reset();
+  return EnqueueTo(targets, item, received);
 }
 
 template <class T>
-void Queue<T>::IncorporateNewSubqueues() {
-  // We use a sneaky ExchangeAdd here in order to force atomic access of the
-  // num_subqueues variable.
-  const uint32_t subqueue_updates = ExchangeAdd(&(queue_->subqueue_updates), 0);
-  Fence();
-
-  if (subqueue_updates != last_subqueue_updates_) {
-    // We have queues to add or remove.
-    for (uint32_t i = 0; i < kMaxConsumers; ++i) {
-      // Another sneaky atomic access for valid...
-      const uint32_t valid = ExchangeAdd(&(queue_->queue_offsets[i].valid), 0);
-
-      if (valid && !subqueues_[i] && AddSubqueue(i)) {
-        // This subqueue is now valid, but not reflected in our subqueues array.
-        ++last_num_subqueues_;
-      } else if (!valid && subqueues_[i]) {
-        // This subqueue is now invalid, but not reflected in our subqueues
-        // array.
-        RemoveSubqueue(i);
-        --last_num_subqueues_;
-      }
+T *Queue<T>::Reserve() {
+  reserved_history_index_ = history_ ? ClaimHistory(1) : kNotInHistory;
+  if (!ReserveAll(subqueue_mask_, &reserved_space_, &reserved_index_,
+                  reserved_history_index_)) {
+    reserved_space_ = nullptr;
+    if (reserved_history_index_ != kNotInHistory) {
+      WriteHistory(reserved_history_index_, nullptr);
     }
+  }
+  return reserved_space_;
+}
 
-    last_subqueue_updates_ = subqueue_updates;
+template <class T>
+void Queue<T>::Commit() {
+  assert(reserved_space_ && "No space reserved.");
+
+  // The item was constructed in the first subqueue. We have to copy it into
+  // the rest of them before we commit that one, because once we do, its
+  // consumer is free to release the space.
+  if (reserved_history_index_ != kNotInHistory) {
+    WriteHistory(reserved_history_index_, reserved_space_);
+  }
+  writable_subqueues_.Clear(reserved_index_);
+  for (uint32_t i = writable_subqueues_.First(); i != SubqueueMask::kEnd;
+       i = writable_subqueues_.Next(i)) {
+    subqueues_[i]->EnqueueAt(*reserved_space_);
   }
+  subqueues_[reserved_index_]->Commit();
+
+  reserved_space_ = nullptr;
 }
 
 template <class T>
-bool Queue<T>::Enqueue(const T &item) {
+bool Queue<T>::EnqueueBlocking(const T &item) {
+  const uint64_t history_index = history_ ? ClaimHistory(1) : kNotInHistory;
   // First, add any new subqueues that might have been created since we last ran
   // this.
   IncorporateNewSubqueues();
 
+  // This always gets sent, so it always goes in the history.
+  if (history_) {
+    WriteHistory(history_index, &item);
+  }
   // If we have no consumers, we'd basically just be sending this message out
-  // into the void.
-  if (!last_num_subqueues_) {
+  // into the void. Consumers that join later might still want it, though.
+  if (subqueue_mask_.Empty()) {
     return false;
   }
 
-  writable_subqueues_.clear();
-
   // Since the subqueues support multiple producers, we can just write to all of
   // them in a pretty straightforward fashion.
-  for (uint32_t i = 0; i < kMaxConsumers; ++i) {
-    if (!subqueues_[i]) {
-      // No queue here.
+  for (uint32_t i = subqueue_mask_.First(); i != SubqueueMask::kEnd;
+       i = subqueue_mask_.Next(i)) {
+    if (Replays(i, history_index)) {
       continue;
     }
-
-    if (!subqueues_[i]->Reserve()) {
-      // If they're not all going to work, we're going to cancel all our
-      // reservations, not enqueue anything, and return false.
-      for (auto j : writable_subqueues_) {
-        subqueues_[j]->CancelReservation();
-      }
-      return false;
-    }
-
-    writable_subqueues_.push_back(i);
-    if (writable_subqueues_.size() == last_num_subqueues_) {
-      // We've found all the subqueues that exist, so there's no point in
-      // continuing.
-      break;
+    // Only consumers that want to block us get to.
+    const OverflowPolicy policy = GetPolicy(i);
+    if (policy == kOverflowBlock) {
+      EnqueueBlockingTo(i, item);
+    } else if (ReserveWithPolicy(i, policy)) {
+      subqueues_[i]->EnqueueAt(item);
     }
   }
-  // It should be impossible for subqueues_ to be modified without our
-  // knowledge.
-  assert(writable_subqueues_.size() == last_num_subqueues_);
 
-  // If we get to here, we managed to reserve everything, so we're clear to
-  // actually enqueue stuff.
-  for (auto i : writable_subqueues_) {
-    subqueues_[i]->EnqueueAt(item);
+  return true;
+}
+
+template <class T>
+void Queue<T>::EnqueueBlockingTo(uint32_t index, const T &item) {
+  if (!AtomicLoadQuad(&(GetSubqueueEntry(index)->durable_id),
+                      ::std::memory_order_relaxed)) {
+    subqueues_[index]->EnqueueBlocking(item);
+    return;
   }
 
-  return true;
+  // If the owner of a durable subqueue crashes while we're waiting, nobody is
+  // ever going to wake us up, so we have to keep checking on it. We can't claim
+  // a space before there is room, either, because nobody would ever free it.
+  while (!subqueues_[index]->Enqueue(item)) {
+    if (ReleaseIfOrphaned(index)) {
+      // Now it's the same as kOverflowDropNewest.
+      if (ReserveWithPolicy(index, kOverflowDropNewest)) {
+        subqueues_[index]->EnqueueAt(item);
+      }
+      return;
+    }
+    ::std::this_thread::sleep_for(
+        ::std::chrono::microseconds(kDurablePollPeriodUs));
+  }
 }
 
 template <class T>
-bool Queue<T>::EnqueueBlocking(const T &item) {
+uint32_t Queue<T>::EnqueueBatch(const T *items, uint32_t num_items) {
+  // The whole batch gets consecutive places in the history, so a consumer that
+  // joins now either gets all of it from the history, or none of it.
+  const uint64_t history_index =
+      history_ ? ClaimHistory(num_items) : kNotInHistory;
   // First, add any new subqueues that might have been created since we last ran
   // this.
   IncorporateNewSubqueues();
 
   // If we have no consumers, we'd basically just be sending this message out
-  // into the void.
-  if (!last_num_subqueues_) {
-    return false;
+  // into the void. Consumers that join later might still want it, though.
+  if (subqueue_mask_.Empty()) {
+    if (history_) {
+      for (uint32_t i = 0; i < num_items; ++i) {
+        WriteHistory(history_index + i, items + i);
+      }
+    }
+    return 0;
   }
 
-  // Since the subqueues support multiple producers, we can just write to all of
-  // them in a pretty straightforward fashion.
-  uint32_t num_written = 0;
-  for (uint32_t i = 0; i < kMaxConsumers; ++i) {
-    if (!subqueues_[i]) {
-      // No queue here.
+  writable_subqueues_.ClearAll();
+
+  // Every consumer that blocks has to get the same items, so we can only write
+  // as many as will fit in the fullest one of those subqueues.
+  uint32_t num_to_write = num_items;
+  for (uint32_t i = subqueue_mask_.First(); i != SubqueueMask::kEnd;
+       i = subqueue_mask_.Next(i)) {
+    if (GetPolicy(i) != kOverflowBlock || Replays(i, history_index)) {
       continue;
     }
 
-    subqueues_[i]->EnqueueBlocking(item);
-
-    if (++num_written == last_num_subqueues_) {
-      // We've found all the subqueues that exist, so there's no point in
-      // continuing.
+    const uint32_t num_reserved = subqueues_[i]->ReserveBatch(num_to_write);
+    if (!num_reserved && ReleaseIfOrphaned(i)) {
+      // Its owner crashed, so now it gets treated like it has
+      // kOverflowDropNewest, below.
+      continue;
+    }
+    if (!num_reserved) {
+      // Nothing is going to fit, so there's no point in continuing.
+      num_to_write = 0;
       break;
     }
+    num_to_write = ::std::min(num_to_write, num_reserved);
+
+    writable_subqueues_.Set(i);
   }
-  // It should be impossible for subqueues_ to be modified without our
-  // knowledge.
-  assert(num_written == last_num_subqueues_);
 
-  return true;
+  if (history_) {
+    // Whatever doesn't fit doesn't get sent at all.
+    for (uint32_t i = 0; i < num_items; ++i) {
+      WriteHistory(history_index + i, i < num_to_write ? items + i : nullptr);
+    }
+  }
+
+  // Now enqueue everything that fits. This automatically cancels any extra
+  // reservations we made.
+  for (uint32_t i = writable_subqueues_.First(); i != SubqueueMask::kEnd;
+       i = writable_subqueues_.Next(i)) {
+    subqueues_[i]->EnqueueBatchAt(items, num_to_write);
+  }
+  if (!num_to_write) {
+    return 0;
+  }
+
+  // Everyone else gets the same items, if they have room.
+  for (uint32_t i = subqueue_mask_.First(); i != SubqueueMask::kEnd;
+       i = subqueue_mask_.Next(i)) {
+    const OverflowPolicy policy = GetPolicy(i);
+    if (policy != kOverflowBlock && !Replays(i, history_index)) {
+      EnqueueBatchWithPolicy(i, policy, items, num_to_write);
+    }
+  }
+
+  return num_to_write;
 }
 
 template <class T>
@@ -306,6 +472,13 @@ void Queue<T>::DequeueNextBlocking(T *item) {
   my_subqueue_->DequeueNextBlocking(item);
 }
 
+template <class T>
+uint32_t Queue<T>::DequeueBatch(T *items, uint32_t max_items) {
+  // Now, read from our designated subqueue.
+  assert(my_subqueue_ && "This queue is not configured as a consumer!");
+  return my_subqueue_->DequeueBatch(items, max_items);
+}
+
 template <class T>
 bool Queue<T>::PeekNext(T *item) {
   // Now, read from our designated subqueue.
@@ -320,61 +493,340 @@ void Queue<T>::PeekNextBlocking(T *item) {
   my_subqueue_->PeekNextBlocking(item);
 }
 
+template <class T>
+const T *Queue<T>::ReadView() {
+  // Now, read from our designated subqueue.
+  assert(my_subqueue_ && "This queue is not configured as a consumer!");
+  return my_subqueue_->ReadView();
+}
+
+template <class T>
+void Queue<T>::Release() {
+  assert(my_subqueue_ && "This queue is not configured as a consumer!");
+  my_subqueue_->Release();
+}
+
 template <class T>
 int Queue<T>::GetOffset() const {
-  return pool_->GetOffset(queue_);
+  return Base::GetOffset();
 }
 
 template <class T>
 void Queue<T>::FreeQueue() {
-  // We want to make sure we free everything, so we need all the subqueues
-  // locally.
-  IncorporateNewSubqueues();
+  if (history_) {
+    pool_->template FreeArray<HistorySlot>(
+        const_cast<HistorySlot *>(history_slots_), history_->num_slots);
+    pool_->template FreeType<RawHistory>(history_);
+  }
+
+  Base::FreeQueue();
+}
+
+template <class T>
+uint32_t Queue<T>::GetNumConsumers() const {
+  return Base::GetNumConsumers();
+}
+
+template <class T>
+void Queue<T>::SetOverflowPolicy(OverflowPolicy policy) {
+  assert(my_subqueue_ && "This queue is not configured as a consumer!");
+
+  if (policy == kOverflowDropOldest) {
+    // We have to start protecting what we read before any producer can start
+    // overwriting it.
+    my_subqueue_->SetOverwritable();
+  }
+
+  volatile auto *subqueue = GetSubqueueEntry(my_subqueue_index_);
+  AtomicStore(&(subqueue->disconnected), 0);
+  // The release makes sure that producers see us reconnected if they see the
+  // new policy.
+  AtomicStore(&(subqueue->overflow_policy), policy,
+              ::std::memory_order_release);
+}
+
+template <class T>
+void Queue<T>::SetFilter(const SubscriptionFilter &filter) {
+  assert(my_subqueue_ && "This queue is not configured as a consumer!");
+
+  // We're the only one who writes the filter, so we don't have to worry about
+  // anyone else making the sequence number odd.
+  volatile auto *subqueue = GetSubqueueEntry(my_subqueue_index_);
+  const uint32_t sequence =
+      AtomicLoad(&(subqueue->filter_sequence), ::std::memory_order_relaxed);
+  AtomicStore(&(subqueue->filter_sequence), sequence + 1,
+              ::std::memory_order_relaxed);
+  // Producers have to see the odd sequence number before they can see any part
+  // of the new filter.
+  Fence(::std::memory_order_release);
+
+  AtomicStoreQuad(&(subqueue->filter.min_key), filter.min_key,
+                  ::std::memory_order_relaxed);
+  AtomicStoreQuad(&(subqueue->filter.max_key), filter.max_key,
+                  ::std::memory_order_relaxed);
+  AtomicStoreQuad(&(subqueue->filter.mask), filter.mask,
+                  ::std::memory_order_relaxed);
+  AtomicStoreQuad(&(subqueue->filter.value), filter.value,
+                  ::std::memory_order_relaxed);
+
+  AtomicStore(&(subqueue->filter_sequence), sequence + 2,
+              ::std::memory_order_release);
+}
+
+template <class T>
+void Queue<T>::SetSubscriptionOptions(const SubscriptionOptions &options) {
+  assert(my_subqueue_ && "This queue is not configured as a consumer!");
+  assert(options.every_nth && "Can't get every 0th item.");
+
+  volatile auto *subqueue = GetSubqueueEntry(my_subqueue_index_);
+  AtomicStore(&(subqueue->every_nth), options.every_nth,
+              ::std::memory_order_relaxed);
+  AtomicStoreQuad(&(subqueue->min_period_ns), options.min_period_ns,
+                  ::std::memory_order_relaxed);
+}
+
+template <class T>
+uint64_t Queue<T>::GetNumDropped() const {
+  assert(my_subqueue_ && "This queue is not configured as a consumer!");
+  return AtomicLoadQuad(
+      &(GetSubqueueEntry(my_subqueue_index_)->num_dropped),
+      ::std::memory_order_relaxed);
+}
+
+template <class T>
+bool Queue<T>::IsDisconnected() const {
+  assert(my_subqueue_ && "This queue is not configured as a consumer!");
+  return AtomicLoad(&(GetSubqueueEntry(my_subqueue_index_)->disconnected),
+                    ::std::memory_order_relaxed);
+}
+
+template <class T>
+uint64_t Queue<T>::GetSequence() const {
+  assert(my_subqueue_ && "This queue is not configured as a consumer!");
+  return my_subqueue_->GetSequence();
+}
+
+template <class T>
+void Queue<T>::Unsubscribe() {
+  assert(durable_id_ && "This queue is not a durable consumer!");
+
+  volatile auto *subqueue = GetSubqueueEntry(my_subqueue_index_);
+  // Nobody can take it over after this.
+  AtomicStoreQuad(&(subqueue->durable_id), 0, ::std::memory_order_relaxed);
+  // Drop the extra reference that kept it around. We still have our own, so
+  // this never frees it.
+  ExchangeAdd(&(subqueue->num_references), -1, ::std::memory_order_relaxed);
+
+  durable_id_ = 0;
+}
+
+template <class T>
+uint32_t Queue<T>::GetConsumerId() const {
+  assert(my_subqueue_ && "This queue is not configured as a consumer!");
+  return my_subqueue_index_;
+}
+
+template <class T>
+bool Queue<T>::CreateHistory(uint32_t history_size) {
+  RawHistory *history = pool_->template AllocateForType<RawHistory>();
+  assert(history != nullptr && "Out of shared memory?");
+  if (!history) {
+    return false;
+  }
+  HistorySlot *slots =
+      pool_->template AllocateForArray<HistorySlot>(history_size);
+  assert(slots != nullptr && "Out of shared memory?");
+  if (!slots) {
+    pool_->template FreeType<RawHistory>(history);
+    return false;
+  }
+  for (uint32_t i = 0; i < history_size; ++i) {
+    slots[i].sequence = 0;
+    slots[i].empty = 0;
+  }
+
+  history->num_slots = history_size;
+  history->slots_offset = pool_->GetOffset(slots);
+  history->head = 0;
+  // Nobody else has a handle to the queue yet, so we don't have to worry about
+  // them seeing this too early.
+  queue_->history_offset = pool_->GetOffset(history);
 
-  // Free shared memory for the underlying subqueues.
-  for (uint32_t i = 0; i < kMaxConsumers; ++i) {
-    if (subqueues_[i]) {
-      subqueues_[i]->FreeQueue();
+  LoadHistory();
+
+  return true;
+}
+
+template <class T>
+void Queue<T>::LoadHistory() {
+  if (history_ || !queue_->history_offset) {
+    // Nothing to do.
+    return;
+  }
+
+  history_ = pool_->template AtOffset<RawHistory>(queue_->history_offset);
+  history_slots_ =
+      pool_->template AtOffset<HistorySlot>(history_->slots_offset);
+}
+
+template <class T>
+uint64_t Queue<T>::ClaimHistory(uint32_t num_items) {
+  const uint64_t index = ExchangeAddQuad(&(history_->head), num_items);
+  // Either a consumer that is joining sees our claim in FinishOwnSubqueue(), or
+  // we see its subqueue when we look for consumers after this.
+  Fence();
+  return index;
+}
+
+template <class T>
+void Queue<T>::WriteHistory(uint64_t index, const T *item) {
+  volatile HistorySlot *slot = history_slots_ + index % history_->num_slots;
+
+  // Claim the slot by making its sequence number odd. If another producer
+  // already got to it with a newer item, we don't have to bother. If one is
+  // still writing an older item to it, we wait for it to finish, since new
+  // consumers might be waiting for us. If it never does, those consumers give
+  // up on our item, so we can too.
+  bool claimed = false;
+  for (int i = 0; i < kMaxHistoryWaitRetries; ++i) {
+    const uint64_t sequence =
+        AtomicLoadQuad(&(slot->sequence), ::std::memory_order_relaxed);
+    if (sequence >= index * 2 + 2) {
+      return;
+    }
+    if (!(sequence & 1) &&
+        CompareExchangeQuad(&(slot->sequence), sequence, index * 2 + 1,
+                            ::std::memory_order_relaxed)) {
+      claimed = true;
+      break;
     }
+    ::std::this_thread::yield();
+  }
+  if (!claimed) {
+    return;
+  }
+  // Readers have to see the odd sequence number before they can see any part
+  // of the new item.
+  Fence(::std::memory_order_release);
+
+  AtomicStore(&(slot->empty), !item, ::std::memory_order_relaxed);
+  if (item) {
+    mpsc_queue::VolatileCopy(&(slot->item), item, sizeof(*item));
   }
 
-  // Now free our underlying shared memory.
-  pool_->FreeType<RawQueue>(queue_);
+  AtomicStoreQuad(&(slot->sequence), index * 2 + 2,
+                  ::std::memory_order_release);
 }
 
 template <class T>
-uint32_t Queue<T>::GetNumConsumers() const {
-  // We use a sneaky ExchangeAdd here in order to force atomic access of the
-  // num_subqueues variable.
-  return ExchangeAdd(&(queue_->num_subqueues), 0);
+bool Queue<T>::Replays(uint32_t index, uint64_t history_index) const {
+  if (history_index == kNotInHistory) {
+    return false;
+  }
+
+  volatile auto *entry = GetSubqueueEntry(index);
+  for (int i = 0; i < kMaxHistoryRetries; ++i) {
+    const uint64_t history_start =
+        AtomicLoadQuad(&(entry->history_start), ::std::memory_order_relaxed);
+    if (history_start != kUnknownHistoryStart) {
+      return history_index < history_start;
+    }
+  }
+
+  // The consumer is taking too long to work out where its history ends. Giving
+  // it the item twice is better than waiting on it.
+  return false;
 }
 
 template <class T>
-::std::unique_ptr<Queue<T>> Queue<T>::DoFetchQueue(const char *name,
-                                                   bool consumer,
-                                                   uint32_t size) {
-  // First, see if a queue exists.
-  int offset;
-  if (queue_names_.Fetch(name, &offset)) {
-    // We have a queue, so just make a new handle to it.
-    return Queue<T>::Load(consumer, offset);
+void Queue<T>::InitOwnSubqueue(MpscQueue<T> *subqueue) {
+  LoadHistory();
+  if (!history_) {
+    return;
   }
 
-  // Create a new queue.
-  auto queue_handle = Queue<T>::Create(consumer, size);
-  // Save the offset.
-  queue_names_.AddOrSet(name, queue_handle->GetOffset());
+  // Producers can't tell which items we're going to replay until we know where
+  // the history ends.
+  GetSubqueueEntry(my_subqueue_index_)->history_start = kUnknownHistoryStart;
+  // Nobody else can write to the subqueue yet, so there's always room, and the
+  // replayed items end up ahead of anything that producers send us. We can
+  // only replay as many items as fit, though.
+  num_replay_spaces_ = subqueue->ReserveBatch(
+      ::std::min(history_->num_slots, queue_->subqueue_size));
+}
+
+template <class T>
+void Queue<T>::FinishOwnSubqueue(MpscQueue<T> *subqueue) {
+  if (!history_) {
+    return;
+  }
+
+  // Producers that didn't see our subqueue claimed their places in the history
+  // before we looked at it, so we get their items from there. Everyone after
+  // that sends us their items directly. This pairs with the fence in
+  // ClaimHistory().
+  Fence();
+  const uint64_t head =
+      AtomicLoadQuad(&(history_->head), ::std::memory_order_relaxed);
+  AtomicStoreQuad(&(GetSubqueueEntry(my_subqueue_index_)->history_start), head,
+                  ::std::memory_order_relaxed);
+
+  // If there are too many items, we skip the oldest ones.
+  const uint64_t num_items = ::std::min<uint64_t>(head, num_replay_spaces_);
+  ::std::unique_ptr<T[]> items(new T[num_items]);
+  uint32_t num_replayed = 0;
+  for (uint64_t index = head - num_items; index < head; ++index) {
+    volatile HistorySlot *slot = history_slots_ + index % history_->num_slots;
+
+    // The producer that claimed this place writes it before it sends the item
+    // to anyone, so it usually won't take long. If it does, it might have died
+    // or be stuck between Reserve() and Commit(), so we don't wait forever.
+    uint64_t sequence = 0;
+    for (int i = 0; i < kMaxHistoryWaitRetries; ++i) {
+      sequence = AtomicLoadQuad(&(slot->sequence), ::std::memory_order_acquire);
+      if (sequence >= index * 2 + 2) {
+        break;
+      }
+      ::std::this_thread::yield();
+    }
+    if (sequence < index * 2 + 2) {
+      CountDropped(my_subqueue_index_, 1);
+      continue;
+    }
+
+    // This works just like SharedRegister::Read(), except that if the item
+    // isn't there, we just skip it.
+    if (sequence != index * 2 + 2 ||
+        AtomicLoad(&(slot->empty), ::std::memory_order_relaxed)) {
+      continue;
+    }
+    mpsc_queue::ReadItem(&items[num_replayed], &(slot->item));
+    Fence(::std::memory_order_acquire);
+    if (AtomicLoadQuad(&(slot->sequence), ::std::memory_order_relaxed) !=
+        sequence) {
+      continue;
+    }
 
-  return queue_handle;
+    ++num_replayed;
+  }
+
+  // This cancels any spaces that we didn't need.
+  subqueue->EnqueueBatchAt(items.get(), num_replayed);
+  num_replay_spaces_ = 0;
 }
 
 template <class T>
-::std::unique_ptr<Queue<T>> Queue<T>::Create(bool consumer, uint32_t size) {
+::std::unique_ptr<Queue<T>> Queue<T>::Create(bool consumer, uint32_t size,
+                                             uint32_t history_size) {
   // Create new queue.
   Queue<T> *raw_queue = new Queue<T>();
   auto queue = ::std::unique_ptr<Queue<T>>(raw_queue);
 
   queue->DoCreate(consumer, size);
+  if (history_size && !queue->CreateHistory(history_size)) {
+    // Creation failed.
+    queue.reset();
+  }
 
   return queue;
 }
@@ -386,6 +838,8 @@ template <class T>
   auto queue = ::std::unique_ptr<Queue<T>>(raw_queue);
 
   queue->DoLoad(consumer, offset);
+  // Consumers already did this when they made their subqueues.
+  queue->LoadHistory();
 
   return queue;
 }
@@ -393,23 +847,56 @@ template <class T>
 template <class T>
 ::std::unique_ptr<Queue<T>> Queue<T>::FetchQueue(const char *name) {
   // Use default size.
-  return DoFetchQueue(name, true, kQueueCapacity);
+  return Base::template DoFetchQueue<Queue<T>>(name, true, kQueueCapacity);
+}
+
+template <class T>
+::std::unique_ptr<Queue<T>> Queue<T>::FetchQueue(
+    const char *name, const SubscriptionOptions &options) {
+  auto queue = FetchQueue(name);
+  queue->SetSubscriptionOptions(options);
+  return queue;
 }
 
 template <class T>
 ::std::unique_ptr<Queue<T>> Queue<T>::FetchProducerQueue(const char *name) {
-  return DoFetchQueue(name, false, kQueueCapacity);
+  return Base::template DoFetchQueue<Queue<T>>(name, false, kQueueCapacity);
+}
+
+template <class T>
+::std::unique_ptr<Queue<T>> Queue<T>::FetchQueueWithHistory(
+    const char *name, uint32_t history_size, bool consumer) {
+  // If the queue already exists, it keeps whatever history it was created with.
+  return Base::template DoFetchQueue<Queue<T>>(name, consumer, kQueueCapacity,
+                                               history_size);
+}
+
+template <class T>
+::std::unique_ptr<Queue<T>> Queue<T>::FetchDurableQueue(
+    const char *name, const char *consumer_name) {
+  auto queue = Base::template DoFetchQueue<Queue<T>>(name, false,
+                                                      kQueueCapacity);
+  queue->MakeDurableSubqueue(consumer_name);
+
+  // If we took over an existing subqueue, we have to pick up where the old
+  // consumer left off.
+  queue->my_subqueue_->FindTail();
+  if (queue->GetPolicy(queue->my_subqueue_index_) == kOverflowDropOldest) {
+    queue->my_subqueue_->SetOverwritable();
+  }
+
+  return queue;
 }
 
 template <class T>
 ::std::unique_ptr<Queue<T>> Queue<T>::FetchSizedQueue(const char *name,
                                                       uint32_t size) {
   // Use default size.
-  return DoFetchQueue(name, true, size);
+  return Base::template DoFetchQueue<Queue<T>>(name, true, size);
 }
 
 template <class T>
 ::std::unique_ptr<Queue<T>> Queue<T>::FetchSizedProducerQueue(const char *name,
                                                               uint32_t size) {
-  return DoFetchQueue(name, false, size);
+  return Base::template DoFetchQueue<Queue<T>>(name, false, size);
 }
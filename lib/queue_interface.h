@@ -26,6 +26,27 @@ class QueueInterface {
   //  True if writing the message succeeded, false if there were no consumers to
   //  write it to.
   virtual bool EnqueueBlocking(const T &item) = 0;
+  // Adds as many elements to the queue as will fit, without blocking. This is
+  // lock-free, stays in userspace, and is a lot cheaper than adding the
+  // elements one at a time.
+  // Args:
+  //  items: The items to add to the queue.
+  //  num_items: The number of items to add.
+  // Returns:
+  //  The number of items that were actually added. These are always the first
+  //  ones in items.
+  virtual uint32_t EnqueueBatch(const T *items, uint32_t num_items) = 0;
+  // Reserves space for a new element in the queue, so that it can be
+  // constructed in place instead of being copied in. It does not block, is
+  // lock-free, and stays in userspace.
+  // IMPORTANT: If this method succeeds, Commit() MUST be called afterwards.
+  // Returns:
+  //  A pointer to the reserved space, or nullptr if the queue was full or there
+  //  were no consumers to write to.
+  virtual T *Reserve() = 0;
+  // Adds the element that was constructed in the space returned by Reserve()
+  // to the queue.
+  virtual void Commit() = 0;
 
   // Removes an element from the queue, without blocking. It is lock-free, and
   // stays in userspace.
@@ -39,6 +60,14 @@ class QueueInterface {
   // Args:
   //  item: A place to copy the item.
   virtual void DequeueNextBlocking(T *item) = 0;
+  // Removes as many elements from the queue as are available, up to a maximum,
+  // without blocking. It is lock-free, and stays in userspace.
+  // Args:
+  //  items: A place to copy the items.
+  //  max_items: The maximum number of items to remove.
+  // Returns:
+  //  The number of items that were actually removed.
+  virtual uint32_t DequeueBatch(T *items, uint32_t max_items) = 0;
 
   // Gets the value of the next element to be removed from the queue, but does
   // not remove it. It is lock-free, and stays in userspace.
@@ -53,6 +82,14 @@ class QueueInterface {
   // Args:
   //  item: A place to copy the item.
   virtual void PeekNextBlocking(T *item) = 0;
+  // Gets the next element to be removed from the queue, without copying it.
+  // It is lock-free, and stays in userspace.
+  // Returns:
+  //  A pointer to the element, which remains valid until Release() is called,
+  //  or nullptr if the queue is empty.
+  virtual const T *ReadView() = 0;
+  // Removes the element that was returned by ReadView() from the queue.
+  virtual void Release() = 0;
 
   // Gets the offset in the pool of the shared memory portion of this queue.
   // Returns:
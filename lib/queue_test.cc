@@ -1,3 +1,9 @@
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
 #include <future>
 #include <memory>
 #include <thread>
@@ -5,6 +11,7 @@
 #include <gtest/gtest.h>
 
 #include "constants.h"
+#include "macros.h"
 #include "pool.h"
 #include "queue.h"
 
@@ -174,6 +181,53 @@ bool ReInitializingConsumerThread(int offset, int exit_offset) {
   return valid;
 }
 
+// A consumer thread for a queue that drops the oldest items. It reads until the
+// producer is done and the queue is empty, and makes sure that everything it
+// reads is in order.
+// Args:
+//  offset: The SHM offset of the queue to use.
+//  ready: Set once the consumer is subscribed.
+//  done: Set once the producer is done.
+// Returns:
+//  The number of items that it read and that it missed, added together, or -1
+//  if anything was out of order, or if the sequence numbers show more gaps than
+//  it missed.
+int DroppingConsumerThread(int offset, ::std::promise<void> *ready,
+                           const ::std::atomic<bool> *done) {
+  auto queue = Queue<int>::Load(true, offset);
+  queue->SetOverflowPolicy(kOverflowDropOldest);
+  ready->set_value();
+
+  int num_read = 0;
+  int last = -3001;
+  uint64_t num_skipped = 0;
+  while (true) {
+    // We have to check this before we try to read, or we could miss the last
+    // few items.
+    const bool producer_done = done->load();
+    int item;
+    if (!queue->DequeueNext(&item)) {
+      if (producer_done) {
+        break;
+      }
+      ::std::this_thread::yield();
+      continue;
+    }
+
+    if (item <= last) {
+      return -1;
+    }
+    last = item;
+    num_skipped += queue->GetSequence() - num_read - num_skipped;
+    ++num_read;
+  }
+
+  if (num_skipped > queue->GetNumDropped()) {
+    return -1;
+  }
+  return num_read + queue->GetNumDropped();
+}
+
 }  // namespace
 
 // Tests for the queue.
@@ -229,6 +283,69 @@ TEST_F(QueueTest, DequeueTest) {
   EXPECT_FALSE(queue_->DequeueNext(&on_queue));
 }
 
+// Test that batch operations work.
+TEST_F(QueueTest, BatchTest) {
+  // Add another consumer that's partway full.
+  auto consumer = Queue<int>::Load(true, queue_->GetOffset());
+  ASSERT_EQ(2u, queue_->GetNumConsumers());
+
+  int items[kQueueCapacity];
+  for (int i = 0; i < kQueueCapacity; ++i) {
+    items[i] = i;
+  }
+  ASSERT_EQ(10u, queue_->EnqueueBatch(items, 10));
+  int on_queue[kQueueCapacity];
+  ASSERT_EQ(10u, queue_->DequeueBatch(on_queue, kQueueCapacity));
+
+  // Now, it should only write as much as fits in both.
+  EXPECT_EQ(static_cast<uint32_t>(kQueueCapacity - 10),
+            queue_->EnqueueBatch(items, kQueueCapacity));
+  EXPECT_EQ(static_cast<uint32_t>(kQueueCapacity - 10),
+            queue_->DequeueBatch(on_queue, kQueueCapacity));
+  for (int i = 0; i < kQueueCapacity - 10; ++i) {
+    EXPECT_EQ(i, on_queue[i]);
+  }
+
+  // Both consumers should see everything.
+  EXPECT_EQ(static_cast<uint32_t>(kQueueCapacity),
+            consumer->DequeueBatch(on_queue, kQueueCapacity));
+  for (int i = 0; i < kQueueCapacity; ++i) {
+    EXPECT_EQ(i < 10 ? i : i - 10, on_queue[i]);
+  }
+  EXPECT_EQ(0u, consumer->DequeueBatch(on_queue, kQueueCapacity));
+  EXPECT_EQ(0u, queue_->DequeueBatch(on_queue, kQueueCapacity));
+}
+
+// Test that we can write and read items in place.
+TEST_F(QueueTest, ZeroCopyTest) {
+  // Add another consumer.
+  auto consumer = Queue<int>::Load(true, queue_->GetOffset());
+  ASSERT_EQ(2u, queue_->GetNumConsumers());
+
+  for (int i = 0; i < kQueueCapacity; ++i) {
+    int *space = queue_->Reserve();
+    ASSERT_NE(nullptr, space);
+    *space = i;
+    queue_->Commit();
+  }
+  EXPECT_EQ(nullptr, queue_->Reserve());
+
+  // Both consumers should get everything.
+  for (int i = 0; i < kQueueCapacity; ++i) {
+    const int *item = queue_->ReadView();
+    ASSERT_NE(nullptr, item);
+    EXPECT_EQ(i, *item);
+    queue_->Release();
+
+    item = consumer->ReadView();
+    ASSERT_NE(nullptr, item);
+    EXPECT_EQ(i, *item);
+    consumer->Release();
+  }
+  EXPECT_EQ(nullptr, queue_->ReadView());
+  EXPECT_EQ(nullptr, consumer->ReadView());
+}
+
 // Test that we can use the queue normally in a single-threaded case.
 TEST_F(QueueTest, SingleThreadTest) {
   int dequeue_counter = 0;
@@ -468,6 +585,543 @@ TEST_F(QueueTest, FetchSizedQueueTest) {
   queue2->FreeQueue();
 }
 
+// Test that producers keep track of consumers that come and go.
+TEST_F(QueueTest, ConsumerChurnTest) {
+  auto producer = Queue<int>::Load(false, queue_->GetOffset());
+
+  ::std::unique_ptr<Queue<int>> consumers[10];
+  for (auto &consumer : consumers) {
+    consumer = Queue<int>::Load(true, queue_->GetOffset());
+  }
+  EXPECT_EQ(11u, queue_->GetNumConsumers());
+  ASSERT_TRUE(producer->Enqueue(1));
+
+  // Get rid of every other one, and then add some back, which should reuse
+  // their slots.
+  for (int i = 0; i < 10; i += 2) {
+    consumers[i].reset();
+  }
+  EXPECT_EQ(6u, queue_->GetNumConsumers());
+  ASSERT_TRUE(producer->Enqueue(2));
+  for (int i = 0; i < 4; i += 2) {
+    consumers[i] = Queue<int>::Load(true, queue_->GetOffset());
+  }
+  EXPECT_EQ(8u, queue_->GetNumConsumers());
+  ASSERT_TRUE(producer->Enqueue(3));
+
+  // Everyone should have gotten everything that was sent while they were
+  // around.
+  int on_queue;
+  for (int expected : {1, 2, 3}) {
+    ASSERT_TRUE(queue_->DequeueNext(&on_queue));
+    EXPECT_EQ(expected, on_queue);
+  }
+  for (int i = 0; i < 10; ++i) {
+    if (!consumers[i]) {
+      continue;
+    }
+    if (i % 2) {
+      ASSERT_TRUE(consumers[i]->DequeueNext(&on_queue));
+      EXPECT_EQ(1, on_queue);
+      ASSERT_TRUE(consumers[i]->DequeueNext(&on_queue));
+      EXPECT_EQ(2, on_queue);
+    }
+    ASSERT_TRUE(consumers[i]->DequeueNext(&on_queue));
+    EXPECT_EQ(3, on_queue);
+    EXPECT_FALSE(consumers[i]->DequeueNext(&on_queue));
+  }
+
+  // Once everyone is gone, there's nobody to send to.
+  for (auto &consumer : consumers) {
+    consumer.reset();
+  }
+  EXPECT_EQ(1u, queue_->GetNumConsumers());
+  auto lone_producer = Queue<int>::Load(false, queue_->GetOffset());
+  queue_.reset();
+  EXPECT_FALSE(producer->Enqueue(4));
+  EXPECT_FALSE(lone_producer->Enqueue(4));
+
+  // The fixture still needs something to free.
+  queue_ = ::std::move(producer);
+}
+
+// Test that queues can have more consumers than fit in the first chunk of the
+// subqueue table.
+TEST_F(QueueTest, ManyConsumersTest) {
+  // Keep the subqueues small so that we don't run out of SHM.
+  auto producer = Queue<int>::Create(false, 4);
+  ASSERT_NE(nullptr, producer);
+
+  constexpr int kNumConsumers = 100;
+  ::std::unique_ptr<Queue<int>> consumers[kNumConsumers];
+  for (auto &consumer : consumers) {
+    consumer = Queue<int>::Load(true, producer->GetOffset());
+  }
+  EXPECT_EQ(static_cast<uint32_t>(kNumConsumers),
+            producer->GetNumConsumers());
+  ASSERT_TRUE(producer->Enqueue(1));
+
+  // Free up some slots in different chunks, and fill them up again.
+  for (int i = 0; i < kNumConsumers; i += 7) {
+    consumers[i].reset();
+  }
+  ASSERT_TRUE(producer->Enqueue(2));
+  for (int i = 0; i < kNumConsumers; i += 7) {
+    consumers[i] = Queue<int>::Load(true, producer->GetOffset());
+  }
+  EXPECT_EQ(static_cast<uint32_t>(kNumConsumers),
+            producer->GetNumConsumers());
+  ASSERT_TRUE(producer->Enqueue(3));
+
+  int on_queue;
+  for (int i = 0; i < kNumConsumers; ++i) {
+    if (i % 7) {
+      ASSERT_TRUE(consumers[i]->DequeueNext(&on_queue));
+      EXPECT_EQ(1, on_queue);
+      ASSERT_TRUE(consumers[i]->DequeueNext(&on_queue));
+      EXPECT_EQ(2, on_queue);
+    }
+    ASSERT_TRUE(consumers[i]->DequeueNext(&on_queue));
+    EXPECT_EQ(3, on_queue);
+    EXPECT_FALSE(consumers[i]->DequeueNext(&on_queue));
+  }
+
+  for (auto &consumer : consumers) {
+    consumer.reset();
+  }
+  EXPECT_EQ(0u, producer->GetNumConsumers());
+  producer->FreeQueue();
+}
+
+// Test that we can send items to only some of the consumers.
+TEST_F(QueueTest, EnqueueToTest) {
+  auto consumer1 = Queue<int>::Load(true, queue_->GetOffset());
+  auto consumer2 = Queue<int>::Load(true, queue_->GetOffset());
+  EXPECT_NE(queue_->GetConsumerId(), consumer1->GetConsumerId());
+  EXPECT_NE(consumer1->GetConsumerId(), consumer2->GetConsumerId());
+
+  SubqueueMask targets;
+  targets.Set(queue_->GetConsumerId());
+  targets.Set(consumer2->GetConsumerId());
+  SubqueueMask received;
+  ASSERT_TRUE(queue_->EnqueueTo(targets, 1, &received));
+  EXPECT_TRUE(received.Contains(queue_->GetConsumerId()));
+  EXPECT_FALSE(received.Contains(consumer1->GetConsumerId()));
+  EXPECT_TRUE(received.Contains(consumer2->GetConsumerId()));
+  // Everyone gets normal items.
+  ASSERT_TRUE(queue_->Enqueue(2));
+
+  int on_queue;
+  for (Queue<int> *consumer : {queue_.get(), consumer2.get()}) {
+    ASSERT_TRUE(consumer->DequeueNext(&on_queue));
+    EXPECT_EQ(1, on_queue);
+  }
+  for (Queue<int> *consumer :
+       {queue_.get(), consumer1.get(), consumer2.get()}) {
+    ASSERT_TRUE(consumer->DequeueNext(&on_queue));
+    EXPECT_EQ(2, on_queue);
+    EXPECT_FALSE(consumer->DequeueNext(&on_queue));
+  }
+
+  // Consumers that are full and block hold up only the items sent to them.
+  for (int i = 0; i < kQueueCapacity; ++i) {
+    SubqueueMask only_consumer1;
+    only_consumer1.Set(consumer1->GetConsumerId());
+    ASSERT_TRUE(queue_->EnqueueTo(only_consumer1, i));
+  }
+  EXPECT_FALSE(queue_->Enqueue(-1));
+  ASSERT_TRUE(queue_->EnqueueTo(targets, -1, &received));
+  for (Queue<int> *consumer : {queue_.get(), consumer2.get()}) {
+    ASSERT_TRUE(consumer->DequeueNext(&on_queue));
+    EXPECT_EQ(-1, on_queue);
+  }
+  targets.Set(consumer1->GetConsumerId());
+  EXPECT_FALSE(queue_->EnqueueTo(targets, -1, &received));
+  EXPECT_TRUE(received.Empty());
+
+  // Ones that drop things just don't get it.
+  consumer1->SetOverflowPolicy(kOverflowDropNewest);
+  ASSERT_TRUE(queue_->EnqueueTo(targets, 3, &received));
+  EXPECT_TRUE(received.Contains(queue_->GetConsumerId()));
+  EXPECT_FALSE(received.Contains(consumer1->GetConsumerId()));
+  EXPECT_EQ(1u, consumer1->GetNumDropped());
+
+  // Sending to consumers that don't exist anymore doesn't work.
+  SubqueueMask only_consumer2;
+  only_consumer2.Set(consumer2->GetConsumerId());
+  consumer2.reset();
+  EXPECT_FALSE(queue_->EnqueueTo(only_consumer2, 4, &received));
+  EXPECT_TRUE(received.Empty());
+}
+
+// Test that producers only give keyed items to consumers that want them.
+TEST_F(QueueTest, FilterTest) {
+  auto low = Queue<int>::Load(true, queue_->GetOffset());
+  auto odd = Queue<int>::Load(true, queue_->GetOffset());
+
+  SubscriptionFilter low_filter;
+  low_filter.max_key = 9;
+  low->SetFilter(low_filter);
+  SubscriptionFilter odd_filter;
+  odd_filter.mask = 1;
+  odd_filter.value = 1;
+  odd->SetFilter(odd_filter);
+
+  SubqueueMask received;
+  for (int key = 0; key < 20; ++key) {
+    ASSERT_TRUE(queue_->EnqueueWithKey(key, key, &received));
+    // The first consumer has no filter, so it gets everything.
+    EXPECT_TRUE(received.Contains(queue_->GetConsumerId()));
+    EXPECT_EQ(key < 10, received.Contains(low->GetConsumerId()));
+    EXPECT_EQ(key % 2 == 1, received.Contains(odd->GetConsumerId()));
+  }
+  // Unkeyed items go to everyone.
+  ASSERT_TRUE(queue_->Enqueue(100));
+
+  int on_queue;
+  for (int key = 0; key < 20; ++key) {
+    ASSERT_TRUE(queue_->DequeueNext(&on_queue));
+    EXPECT_EQ(key, on_queue);
+  }
+  for (int key = 0; key < 10; ++key) {
+    ASSERT_TRUE(low->DequeueNext(&on_queue));
+    EXPECT_EQ(key, on_queue);
+  }
+  for (int key = 1; key < 20; key += 2) {
+    ASSERT_TRUE(odd->DequeueNext(&on_queue));
+    EXPECT_EQ(key, on_queue);
+  }
+  for (Queue<int> *consumer : {queue_.get(), low.get(), odd.get()}) {
+    ASSERT_TRUE(consumer->DequeueNext(&on_queue));
+    EXPECT_EQ(100, on_queue);
+    EXPECT_FALSE(consumer->DequeueNext(&on_queue));
+  }
+
+  // If nobody wants it, it still counts as being sent.
+  SubscriptionFilter nothing_filter;
+  nothing_filter.min_key = 1;
+  nothing_filter.max_key = 0;
+  queue_->SetFilter(nothing_filter);
+  EXPECT_TRUE(queue_->EnqueueWithKey(10, 10, &received));
+  EXPECT_TRUE(received.Empty());
+
+  // Filters can be changed.
+  queue_->SetFilter(SubscriptionFilter());
+  ASSERT_TRUE(queue_->EnqueueWithKey(10, 10, &received));
+  EXPECT_TRUE(received.Contains(queue_->GetConsumerId()));
+  ASSERT_TRUE(queue_->DequeueNext(&on_queue));
+  EXPECT_EQ(10, on_queue);
+}
+
+// Test that consumers can get only some of the items.
+TEST_F(QueueTest, DecimationTest) {
+  SubscriptionOptions every_third;
+  every_third.every_nth = 3;
+  auto decimated = Queue<int>::FetchQueue("decimated_queue", every_third);
+  SubscriptionOptions rate_limited_options;
+  // Nothing this test does will take an hour.
+  rate_limited_options.min_period_ns = 3600ull * 1000000000;
+  auto rate_limited = Queue<int>::FetchQueue("decimated_queue",
+                                             rate_limited_options);
+  auto producer = Queue<int>::FetchProducerQueue("decimated_queue");
+
+  // They shouldn't hold anyone back, even though they don't read anything.
+  for (int i = 0; i < kQueueCapacity * 4; ++i) {
+    ASSERT_TRUE(producer->Enqueue(i));
+  }
+  int items[kQueueCapacity];
+  for (int i = 0; i < kQueueCapacity; ++i) {
+    items[i] = kQueueCapacity * 4 + i;
+  }
+  ASSERT_EQ(static_cast<uint32_t>(kQueueCapacity),
+            producer->EnqueueBatch(items, kQueueCapacity));
+
+  int on_queue;
+  for (int i = 0; i < kQueueCapacity; ++i) {
+    ASSERT_TRUE(decimated->DequeueNext(&on_queue));
+    EXPECT_EQ(i * 3, on_queue);
+  }
+  EXPECT_FALSE(decimated->DequeueNext(&on_queue));
+  // Only the ones that it had room for count as dropped.
+  EXPECT_EQ(static_cast<uint64_t>(kQueueCapacity * 5 / 3 - kQueueCapacity + 1),
+            decimated->GetNumDropped());
+
+  ASSERT_TRUE(rate_limited->DequeueNext(&on_queue));
+  EXPECT_EQ(0, on_queue);
+  EXPECT_FALSE(rate_limited->DequeueNext(&on_queue));
+  EXPECT_EQ(0u, rate_limited->GetNumDropped());
+
+  // Going back to getting everything should work.
+  decimated->SetSubscriptionOptions(SubscriptionOptions());
+  ASSERT_TRUE(producer->Enqueue(-1));
+  ASSERT_TRUE(decimated->DequeueNext(&on_queue));
+  EXPECT_EQ(-1, on_queue);
+
+  producer->FreeQueue();
+}
+
+// Test that consumers that join late get recent items.
+TEST_F(QueueTest, HistoryTest) {
+  auto producer = Queue<int>::FetchQueueWithHistory("history_queue", 4, false);
+  ASSERT_NE(nullptr, producer);
+
+  // Items sent before there were any consumers should still be remembered.
+  EXPECT_FALSE(producer->Enqueue(1));
+  auto consumer1 = Queue<int>::FetchQueue("history_queue");
+  int on_queue;
+  ASSERT_TRUE(consumer1->DequeueNext(&on_queue));
+  EXPECT_EQ(1, on_queue);
+  EXPECT_FALSE(consumer1->DequeueNext(&on_queue));
+
+  // Only the most recent ones are remembered.
+  int items[] = {2, 3, 4};
+  ASSERT_EQ(3u, producer->EnqueueBatch(items, 3));
+  ASSERT_TRUE(producer->EnqueueBlocking(5));
+  int *space = producer->Reserve();
+  ASSERT_NE(nullptr, space);
+  *space = 6;
+  producer->Commit();
+  // Items for only some consumers don't count.
+  SubqueueMask targets;
+  targets.Set(consumer1->GetConsumerId());
+  ASSERT_TRUE(producer->EnqueueTo(targets, -1));
+
+  auto consumer2 = Queue<int>::FetchQueue("history_queue");
+  for (int expected = 3; expected <= 6; ++expected) {
+    ASSERT_TRUE(consumer2->DequeueNext(&on_queue));
+    EXPECT_EQ(expected, on_queue);
+  }
+  EXPECT_FALSE(consumer2->DequeueNext(&on_queue));
+
+  // New items come after the old ones, and the first consumer shouldn't get
+  // anything twice.
+  ASSERT_TRUE(producer->Enqueue(7));
+  ASSERT_TRUE(consumer2->DequeueNext(&on_queue));
+  EXPECT_EQ(7, on_queue);
+  for (int expected : {2, 3, 4, 5, 6, -1, 7}) {
+    ASSERT_TRUE(consumer1->DequeueNext(&on_queue));
+    EXPECT_EQ(expected, on_queue);
+  }
+  EXPECT_FALSE(consumer1->DequeueNext(&on_queue));
+
+  // Queues without a history shouldn't replay anything.
+  auto consumer3 = Queue<int>::Load(true, queue_->GetOffset());
+  ASSERT_TRUE(queue_->Enqueue(1));
+  auto consumer4 = Queue<int>::Load(true, queue_->GetOffset());
+  EXPECT_FALSE(consumer4->DequeueNext(&on_queue));
+
+  producer->FreeQueue();
+}
+
+// Test that consumers that join while producers are sending never miss an item,
+// or get one twice.
+TEST_F(QueueTest, HistoryJoinTest) {
+  auto producer = Queue<int>::Create(false, 16, 1);
+  ASSERT_NE(nullptr, producer);
+  const int offset = producer->GetOffset();
+
+  ::std::atomic<bool> done(false);
+  ::std::thread producer_thread([&]() {
+    int next = 0;
+    while (!done.load()) {
+      if (producer->Enqueue(next)) {
+        ++next;
+      }
+    }
+  });
+
+  bool in_order = true;
+  for (int i = 0; i < 200 && in_order; ++i) {
+    auto consumer = Queue<int>::Load(true, offset);
+    int last, on_queue;
+    while (!consumer->DequeueNext(&last))
+      ;
+    for (int j = 0; j < 10 && in_order; ++j) {
+      while (!consumer->DequeueNext(&on_queue))
+        ;
+      in_order = on_queue == last + 1;
+      last = on_queue;
+    }
+  }
+
+  done.store(true);
+  producer_thread.join();
+  EXPECT_TRUE(in_order);
+
+  producer->FreeQueue();
+}
+
+// Test that a new consumer doesn't wait forever for a producer that is stuck
+// between Reserve() and Commit().
+TEST_F(QueueTest, HistoryStalledProducerTest) {
+  auto producer = Queue<int>::Create(false, kQueueCapacity, 4);
+  ASSERT_NE(nullptr, producer);
+  auto consumer1 = Queue<int>::Load(true, producer->GetOffset());
+  ASSERT_TRUE(producer->Enqueue(1));
+  int *space = producer->Reserve();
+  ASSERT_NE(nullptr, space);
+
+  // It should still get the item before, and count the stuck one as dropped.
+  auto consumer2 = Queue<int>::Load(true, producer->GetOffset());
+  int on_queue;
+  ASSERT_TRUE(consumer2->DequeueNext(&on_queue));
+  EXPECT_EQ(1, on_queue);
+  EXPECT_FALSE(consumer2->DequeueNext(&on_queue));
+  EXPECT_EQ(1u, consumer2->GetNumDropped());
+
+  // The stuck item shouldn't show up later, and nothing after it is affected.
+  *space = 2;
+  producer->Commit();
+  ASSERT_TRUE(producer->Enqueue(3));
+  ASSERT_TRUE(consumer2->DequeueNext(&on_queue));
+  EXPECT_EQ(3, on_queue);
+  EXPECT_FALSE(consumer2->DequeueNext(&on_queue));
+  for (int expected = 1; expected <= 3; ++expected) {
+    ASSERT_TRUE(consumer1->DequeueNext(&on_queue));
+    EXPECT_EQ(expected, on_queue);
+  }
+  EXPECT_EQ(0u, consumer1->GetNumDropped());
+
+  producer->FreeQueue();
+}
+
+// Test that durable consumers keep their subqueues when they go away.
+TEST_F(QueueTest, DurableTest) {
+  auto producer = Queue<int>::FetchProducerQueue("durable_queue");
+  auto consumer = Queue<int>::FetchDurableQueue("durable_queue", "logger");
+  ASSERT_TRUE(producer->Enqueue(1));
+  ASSERT_TRUE(producer->Enqueue(2));
+  int on_queue;
+  ASSERT_TRUE(consumer->DequeueNext(&on_queue));
+  EXPECT_EQ(1, on_queue);
+  const uint32_t consumer_id = consumer->GetConsumerId();
+
+  // Its subqueue should stick around, but not hold anyone back once it's full.
+  consumer.reset();
+  EXPECT_EQ(1u, producer->GetNumConsumers());
+  for (int i = 3; i < 3 + kQueueCapacity; ++i) {
+    ASSERT_TRUE(producer->Enqueue(i));
+  }
+
+  // Coming back should get everything that fit.
+  consumer = Queue<int>::FetchDurableQueue("durable_queue", "logger");
+  EXPECT_EQ(consumer_id, consumer->GetConsumerId());
+  EXPECT_EQ(1u, producer->GetNumConsumers());
+  for (int i = 2; i < 2 + kQueueCapacity; ++i) {
+    ASSERT_TRUE(consumer->DequeueNext(&on_queue));
+    EXPECT_EQ(i, on_queue);
+  }
+  EXPECT_FALSE(consumer->DequeueNext(&on_queue));
+  EXPECT_EQ(1u, consumer->GetNumDropped());
+
+  // Once it's owned again, it blocks like normal.
+  for (int i = 0; i < kQueueCapacity; ++i) {
+    ASSERT_TRUE(producer->Enqueue(i));
+  }
+  EXPECT_FALSE(producer->Enqueue(-1));
+  consumer->Unsubscribe();
+  consumer.reset();
+  EXPECT_EQ(0u, producer->GetNumConsumers());
+
+  // It should also survive its process crashing.
+  const pid_t child = fork();
+  ASSERT_NE(-1, child);
+  if (!child) {
+    auto crasher = Queue<int>::FetchDurableQueue("durable_queue", "crasher");
+    // Don't clean anything up.
+    crasher.release();
+    _exit(0);
+  }
+  ASSERT_EQ(child, waitpid(child, nullptr, 0));
+  EXPECT_EQ(1u, producer->GetNumConsumers());
+  ASSERT_TRUE(producer->Enqueue(42));
+
+  consumer = Queue<int>::FetchDurableQueue("durable_queue", "crasher");
+  ASSERT_TRUE(consumer->DequeueNext(&on_queue));
+  EXPECT_EQ(42, on_queue);
+  consumer->Unsubscribe();
+  consumer.reset();
+  EXPECT_EQ(0u, producer->GetNumConsumers());
+
+  producer->FreeQueue();
+}
+
+// Test that producers stop waiting for a durable consumer once its process
+// crashes.
+TEST_F(QueueTest, DurableCrashTest) {
+  auto producer = Queue<int>::FetchProducerQueue("crash_queue");
+
+  // The child tells us when it's done with each step.
+  int steps[2];
+  ASSERT_EQ(0, pipe(steps));
+  const pid_t child = fork();
+  ASSERT_NE(-1, child);
+  if (!child) {
+    auto crasher = Queue<int>::FetchDurableQueue("crash_queue", "crasher");
+    const char step = 0;
+    _UNUSED(write(steps[1], &step, 1));
+    int on_queue;
+    crasher->DequeueNextBlocking(&on_queue);
+    crasher->DequeueNextBlocking(&on_queue);
+    _UNUSED(write(steps[1], &step, 1));
+    // Wait to get killed.
+    while (true) {
+      pause();
+    }
+  }
+
+  char step;
+  ASSERT_EQ(1, read(steps[0], &step, 1));
+  ASSERT_TRUE(producer->Enqueue(0));
+  ASSERT_TRUE(producer->Enqueue(1));
+  ASSERT_EQ(1, read(steps[0], &step, 1));
+  for (int i = 2; i < kQueueCapacity + 2; ++i) {
+    EXPECT_TRUE(producer->Enqueue(i));
+  }
+  // The consumer is still alive, so it holds us back.
+  EXPECT_FALSE(producer->Enqueue(-1));
+
+  ::std::atomic<bool> enqueued(false);
+  ::std::thread blocked([&]() {
+    producer->EnqueueBlocking(-1);
+    enqueued.store(true);
+  });
+  ::std::this_thread::sleep_for(::std::chrono::milliseconds(20));
+  EXPECT_FALSE(enqueued.load());
+
+  // Once it crashes, the blocked producer should give up, and nobody should be
+  // held back after that.
+  kill(child, SIGKILL);
+  ASSERT_EQ(child, waitpid(child, nullptr, 0));
+  blocked.join();
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_TRUE(producer->Enqueue(-1));
+  }
+
+  // Taking it over should get everything that the old consumer didn't read.
+  auto consumer = Queue<int>::FetchDurableQueue("crash_queue", "crasher");
+  int on_queue;
+  for (int i = 2; i < kQueueCapacity + 2; ++i) {
+    ASSERT_TRUE(consumer->DequeueNext(&on_queue));
+    EXPECT_EQ(i, on_queue);
+  }
+  EXPECT_FALSE(consumer->DequeueNext(&on_queue));
+  EXPECT_EQ(4u, consumer->GetNumDropped());
+
+  // It holds producers back again.
+  for (int i = 0; i < kQueueCapacity; ++i) {
+    ASSERT_TRUE(producer->Enqueue(i));
+  }
+  EXPECT_FALSE(producer->Enqueue(-1));
+
+  consumer->Unsubscribe();
+  consumer.reset();
+  EXPECT_EQ(0u, producer->GetNumConsumers());
+  close(steps[0]);
+  close(steps[1]);
+  producer->FreeQueue();
+}
+
 // Stress test for creating and deleting subqueues.
 TEST_F(QueueTest, SubqueueStressTest) {
   auto queue = Queue<int>::Create(false, kQueueCapacity);
@@ -491,5 +1145,182 @@ TEST_F(QueueTest, SubqueueStressTest) {
   exit_queue->FreeQueue();
 }
 
+// Test that a consumer that drops the newest items doesn't slow anyone else
+// down.
+TEST_F(QueueTest, DropNewestTest) {
+  auto slow = Queue<int>::Load(true, queue_->GetOffset());
+  slow->SetOverflowPolicy(kOverflowDropNewest);
+
+  // The fast consumer keeps up, so we should never have to stop.
+  int on_queue;
+  for (int i = 0; i < kQueueCapacity * 2; ++i) {
+    ASSERT_TRUE(queue_->Enqueue(i));
+    ASSERT_TRUE(queue_->DequeueNext(&on_queue));
+    EXPECT_EQ(i, on_queue);
+  }
+  EXPECT_EQ(0u, queue_->GetNumDropped());
+  EXPECT_EQ(static_cast<uint64_t>(kQueueCapacity), slow->GetNumDropped());
+  EXPECT_FALSE(slow->IsDisconnected());
+
+  // The slow one should have the first items.
+  for (int i = 0; i < kQueueCapacity; ++i) {
+    ASSERT_TRUE(slow->DequeueNext(&on_queue));
+    EXPECT_EQ(i, on_queue);
+  }
+  EXPECT_FALSE(slow->DequeueNext(&on_queue));
+
+  // Batches work the same way.
+  int items[kQueueCapacity * 2];
+  for (int i = 0; i < kQueueCapacity * 2; ++i) {
+    items[i] = i;
+  }
+  ASSERT_EQ(10u, slow->EnqueueBatch(items, 10));
+  ASSERT_EQ(10u, queue_->DequeueBatch(items + kQueueCapacity, 10));
+  EXPECT_EQ(static_cast<uint32_t>(kQueueCapacity),
+            queue_->EnqueueBatch(items, kQueueCapacity));
+  EXPECT_EQ(static_cast<uint64_t>(kQueueCapacity + 10),
+            slow->GetNumDropped());
+
+  // If everyone is dropping things, it shouldn't fail either.
+  queue_->SetOverflowPolicy(kOverflowDropNewest);
+  EXPECT_TRUE(queue_->Enqueue(-1));
+  EXPECT_TRUE(queue_->EnqueueBlocking(-1));
+  EXPECT_EQ(nullptr, queue_->Reserve());
+  EXPECT_EQ(3u, queue_->GetNumDropped());
+}
+
+// Test that a consumer that drops the oldest items always gets the latest
+// ones.
+TEST_F(QueueTest, DropOldestTest) {
+  auto slow = Queue<int>::Load(true, queue_->GetOffset());
+  slow->SetOverflowPolicy(kOverflowDropOldest);
+
+  int on_queue;
+  for (int i = 0; i < kQueueCapacity * 2 + 5; ++i) {
+    ASSERT_TRUE(queue_->Enqueue(i));
+    ASSERT_TRUE(queue_->DequeueNext(&on_queue));
+    EXPECT_EQ(i, on_queue);
+  }
+  EXPECT_EQ(static_cast<uint64_t>(kQueueCapacity + 5), slow->GetNumDropped());
+
+  // Start reading in place. The item we're looking at shouldn't get
+  // overwritten.
+  const int *item = slow->ReadView();
+  ASSERT_NE(nullptr, item);
+  EXPECT_EQ(kQueueCapacity + 5, *item);
+  // The sequence number should show exactly how many items it missed.
+  EXPECT_EQ(static_cast<uint64_t>(kQueueCapacity + 5), slow->GetSequence());
+  ASSERT_TRUE(queue_->Enqueue(-1));
+  ASSERT_TRUE(queue_->DequeueNext(&on_queue));
+  EXPECT_EQ(kQueueCapacity + 5, *item);
+  slow->Release();
+  EXPECT_EQ(static_cast<uint64_t>(kQueueCapacity + 6), slow->GetNumDropped());
+
+  // It should read the rest in order.
+  for (int i = kQueueCapacity + 6; i < kQueueCapacity * 2 + 5; ++i) {
+    ASSERT_TRUE(slow->PeekNext(&on_queue));
+    EXPECT_EQ(i, on_queue);
+    ASSERT_TRUE(slow->DequeueNext(&on_queue));
+    EXPECT_EQ(i, on_queue);
+    // The item that got dropped instead of being put in the subqueue doesn't
+    // leave a gap.
+    EXPECT_EQ(static_cast<uint64_t>(i), slow->GetSequence());
+  }
+  EXPECT_FALSE(slow->DequeueNext(&on_queue));
+
+  // Batches should get the latest items too.
+  int items[kQueueCapacity * 2];
+  for (int i = 0; i < kQueueCapacity * 2; ++i) {
+    items[i] = i;
+  }
+  ASSERT_EQ(static_cast<uint32_t>(kQueueCapacity),
+            queue_->EnqueueBatch(items, kQueueCapacity));
+  ASSERT_EQ(static_cast<uint32_t>(kQueueCapacity),
+            queue_->DequeueBatch(items, kQueueCapacity));
+  ASSERT_EQ(10u, queue_->EnqueueBatch(items + kQueueCapacity, 10));
+  ASSERT_EQ(10u, queue_->DequeueBatch(items, 10));
+  EXPECT_EQ(static_cast<uint32_t>(kQueueCapacity),
+            slow->DequeueBatch(items, kQueueCapacity * 2));
+  for (int i = 0; i < kQueueCapacity; ++i) {
+    EXPECT_EQ(i + 10, items[i]);
+  }
+
+  // Blocking reads should work as well.
+  ASSERT_TRUE(queue_->EnqueueBlocking(42));
+  slow->DequeueNextBlocking(&on_queue);
+  EXPECT_EQ(42, on_queue);
+}
+
+// Test that a consumer that falls behind can get disconnected.
+TEST_F(QueueTest, DisconnectTest) {
+  auto slow = Queue<int>::Load(true, queue_->GetOffset());
+  slow->SetOverflowPolicy(kOverflowDisconnect);
+
+  int on_queue;
+  for (int i = 0; i < kQueueCapacity + 1; ++i) {
+    ASSERT_TRUE(queue_->Enqueue(i));
+    ASSERT_TRUE(queue_->DequeueNext(&on_queue));
+  }
+  EXPECT_TRUE(slow->IsDisconnected());
+  EXPECT_FALSE(queue_->IsDisconnected());
+
+  // Once it's disconnected, it shouldn't get anything, even if it has room.
+  ASSERT_TRUE(slow->DequeueNext(&on_queue));
+  EXPECT_EQ(0, on_queue);
+  ASSERT_TRUE(queue_->Enqueue(-1));
+  ASSERT_TRUE(queue_->DequeueNext(&on_queue));
+  for (int i = 1; i < kQueueCapacity; ++i) {
+    ASSERT_TRUE(slow->DequeueNext(&on_queue));
+    EXPECT_EQ(i, on_queue);
+  }
+  EXPECT_FALSE(slow->DequeueNext(&on_queue));
+
+  // Setting the policy again should reconnect it.
+  slow->SetOverflowPolicy(kOverflowDisconnect);
+  EXPECT_FALSE(slow->IsDisconnected());
+  ASSERT_TRUE(queue_->Enqueue(42));
+  ASSERT_TRUE(slow->DequeueNext(&on_queue));
+  EXPECT_EQ(42, on_queue);
+}
+
+// Test that consumers that block still hold everyone up.
+TEST_F(QueueTest, BlockPolicyTest) {
+  auto dropping = Queue<int>::Load(true, queue_->GetOffset());
+  dropping->SetOverflowPolicy(kOverflowDropNewest);
+
+  for (int i = 0; i < kQueueCapacity; ++i) {
+    ASSERT_TRUE(queue_->Enqueue(i));
+  }
+  EXPECT_FALSE(queue_->Enqueue(-1));
+  EXPECT_EQ(nullptr, queue_->Reserve());
+  int items[1] = {-1};
+  EXPECT_EQ(0u, queue_->EnqueueBatch(items, 1));
+
+  // Nothing was actually sent, so nothing was dropped.
+  EXPECT_EQ(0u, dropping->GetNumDropped());
+}
+
+// Test that dropping the oldest items works with multiple threads.
+TEST_F(QueueTest, DropOldestThreadTest) {
+  auto queue = Queue<int>::Create(false, kQueueCapacity);
+  const int offset = queue->GetOffset();
+
+  ::std::promise<void> ready;
+  ::std::future<void> ready_future = ready.get_future();
+  ::std::atomic<bool> done(false);
+  ::std::future<int> consumer =
+      ::std::async(::std::launch::async, &DroppingConsumerThread, offset,
+                   &ready, &done);
+  ready_future.wait();
+
+  ::std::thread producer(ProducerThread, offset);
+  producer.join();
+  done.store(true);
+
+  EXPECT_EQ(6001, consumer.get());
+
+  queue->FreeQueue();
+}
+
 }  // namespace testing
 }  // namespace tachyon
@@ -0,0 +1,391 @@
+#ifndef TACHYON_LIB_RING_QUEUE_H_
+#define TACHYON_LIB_RING_QUEUE_H_
+
+#include <assert.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+
+#include "atomics.h"
+#include "constants.h"
+#include "mpsc_queue_internal.h"
+#include "mutex.h"
+#include "pool.h"
+#include "queue_interface.h"
+#include "shared_hashmap.h"
+
+namespace tachyon {
+
+// A broadcast queue, just like Queue, but built the way the LMAX Disruptor is:
+// there is a single ring that all the producers write into, and each consumer
+// just has its own read cursor into that ring. This means that an item is only
+// ever written once, no matter how many consumers there are, whereas Queue has
+// to copy it into a separate subqueue for each one. The price is that producers
+// are gated by the slowest consumer: nobody can write over an item until every
+// consumer has read it.
+//
+// Producers claim tickets (positions in the ring) with a compare-and-swap, so
+// all non-blocking operations are lock-free, and they stay in userspace. The
+// consumer side doesn't do any atomic read-modify-write operations at all.
+//
+// Like with Queue, every consumer normally reads every item. A queue can also
+// be created in load-balanced mode, which turns it into a work queue: each item
+// is read by exactly one consumer, whichever one gets to it first. Consumers
+// then share a single read position, which they claim items from with a
+// compare-and-swap. A consumer only holds producers back while it actually has
+// an item claimed, so a worker that is busy with an item that it already
+// dequeued doesn't get in anyone's way. Peeking at an item also claims it, so
+// the next dequeue returns the same one. Unlike in broadcast mode, items that
+// nobody has claimed yet stay in the ring when every consumer goes away, and
+// the next consumer to join picks them up.
+//
+// The two can also be combined, with consumer groups: every group gets every
+// item, like broadcast consumers do, but within a group, each item only goes to
+// one member. Each group has its own claim ticket, so a one-member logging
+// group and an eight-member worker group can share a single write. Groups are
+// identified by a number that consumers pass when they join, and they go away
+// when their last member leaves. In a load-balanced queue, consumers that don't
+// ask for a group are members of kDefaultGroup, which is permanent.
+//
+// In either mode, producers fail if there are no consumers, and two different
+// threads should never touch the same queue instance.
+template <class T>
+class RingQueue : public QueueInterface<T> {
+ public:
+  // The group that consumers of a load-balanced queue are in by default.
+  static constexpr uint32_t kDefaultGroup = 0;
+
+  virtual ~RingQueue();
+
+  virtual bool Enqueue(const T &item);
+  virtual bool EnqueueBlocking(const T &item);
+  virtual uint32_t EnqueueBatch(const T *items, uint32_t num_items);
+  virtual T *Reserve();
+  virtual void Commit();
+  virtual bool DequeueNext(T *item);
+  virtual void DequeueNextBlocking(T *item);
+  virtual uint32_t DequeueBatch(T *items, uint32_t max_items);
+  virtual bool PeekNext(T *item);
+  virtual void PeekNextBlocking(T *item);
+  virtual const T *ReadView();
+  virtual void Release();
+
+  virtual int GetOffset() const;
+
+  virtual void FreeQueue();
+
+  virtual uint32_t GetNumConsumers() const;
+
+  // Manually creates a brand new queue. Normally, FetchQueue() should be used
+  // as it handles queue creation automatically.
+  // Args:
+  //  consumer: Whether this queue allows elements to be consumed.
+  //  size: The number of items that the ring will be able to hold. Must be a
+  //        power of 2.
+  //  load_balanced: If true, each item goes to only one consumer.
+  // Returns:
+  //  The queue it created, or nullptr if queue creation failed.
+  static ::std::unique_ptr<RingQueue<T>> Create(bool consumer, uint32_t size,
+                                                bool load_balanced = false);
+  // Manually loads an existing queue. Normally, FetchQueue() should be used as
+  // it handles queue loading automatically.
+  // Args:
+  //  consumer: Whether this queue allows elements to be consumed.
+  //  offset: The offset of the queue in SHM.
+  // Returns:
+  //  The queue it loaded.
+  static ::std::unique_ptr<RingQueue<T>> Load(bool consumer, uintptr_t offset);
+  // Same as Load(), but the loaded queue is a consumer in a consumer group.
+  // Args:
+  //  group: The ID of the group to join. It gets created if it doesn't exist.
+  //  offset: The offset of the queue in SHM.
+  // Returns:
+  //  The queue it loaded.
+  static ::std::unique_ptr<RingQueue<T>> LoadGroupConsumer(uint32_t group,
+                                                           uintptr_t offset);
+
+  // These work just like the ones in Queue. Note that ring queues share the
+  // same namespace as other queues.
+  static ::std::unique_ptr<RingQueue<T>> FetchQueue(const char *name);
+  static ::std::unique_ptr<RingQueue<T>> FetchProducerQueue(const char *name);
+  static ::std::unique_ptr<RingQueue<T>> FetchSizedQueue(const char *name,
+                                                         uint32_t size);
+  static ::std::unique_ptr<RingQueue<T>> FetchSizedProducerQueue(
+      const char *name, uint32_t size);
+  // Same as FetchQueue() and FetchProducerQueue(), but if the queue has to be
+  // created, it is created in load-balanced mode. If it already exists, it
+  // keeps whatever mode it was created with.
+  static ::std::unique_ptr<RingQueue<T>> FetchLoadBalancedQueue(
+      const char *name);
+  static ::std::unique_ptr<RingQueue<T>> FetchLoadBalancedProducerQueue(
+      const char *name);
+  // Same as FetchQueue(), but the fetched queue is a consumer in a consumer
+  // group.
+  // Args:
+  //  name: The name of the queue to fetch.
+  //  group: The ID of the group to join.
+  // Returns:
+  //  The fetched queue.
+  static ::std::unique_ptr<RingQueue<T>> FetchGroupQueue(const char *name,
+                                                         uint32_t group);
+
+  // Returns:
+  //  True if this queue was created in load-balanced mode.
+  bool IsLoadBalanced() const;
+
+ private:
+  // Possible states of a cursor or group slot.
+  enum CursorState : uint32_t {
+    // Nobody is using this slot.
+    kCursorFree = 0,
+    // A consumer is using this slot.
+    kCursorActive = 1,
+  };
+
+  // Represents an item in the ring.
+  struct Node {
+    // The actual item.
+    volatile T value;
+    // One more than the ticket of the item that was last published in this
+    // node. Consumers know that the item they are looking for is ready when
+    // this matches.
+    volatile uint64_t published;
+  };
+
+  // The read position of a single consumer. Each one is on its own cache line,
+  // because it gets written every time the consumer reads something.
+  struct Cursor {
+    // The ticket of the next item that this consumer will read. The consumer is
+    // done with everything before it. For group members, this is kIdleTicket
+    // when the consumer doesn't have anything claimed.
+    volatile uint64_t next_ticket;
+    // One of the values in CursorState.
+    volatile uint32_t state;
+  } __attribute__((aligned(kCacheLineSize)));
+
+  // A consumer group. These are on their own cache lines too, because members
+  // write the claim ticket every time they claim something.
+  struct Group {
+    // The ticket of the next item that any member will claim. Nobody in the
+    // group is done with it yet, so it holds producers back just like a
+    // cursor.
+    volatile uint64_t claim_ticket;
+    // One of the values in CursorState.
+    volatile uint32_t state;
+    // The rest of these are protected by group_lock.
+    // The ID that consumers use to join the group.
+    uint32_t id;
+    // How many consumers are in the group.
+    uint32_t num_members;
+    // Whether the group stays around when it has no members.
+    bool permanent;
+  } __attribute__((aligned(kCacheLineSize)));
+
+  // This is the underlying structure that will be located in shared memory.
+  struct RawQueue {
+    // Offset of the node array in the SHM segment.
+    uintptr_t array_offset;
+    // The length of the node array.
+    uint32_t array_length;
+    // Whether the queue is in load-balanced mode. This is set once when the
+    // queue is created, and then never modified.
+    uint32_t load_balanced;
+    // How many consumers we currently have.
+    volatile uint32_t num_consumers;
+    // One past the highest cursor slot that has ever been used. Producers don't
+    // have to look at any slots beyond this.
+    volatile uint32_t num_cursor_slots;
+    // Same as num_cursor_slots, but for group slots.
+    volatile uint32_t num_group_slots;
+    // Protects consumers joining and leaving groups.
+    Mutex group_lock;
+
+    // How many threads are waiting for an item to be published.
+    volatile uint32_t publish_waiters;
+    // Gets incremented when an item is published and someone is waiting, so
+    // that they can wait on it.
+    Futex publish_count;
+    // How many producers are waiting for consumers to catch up.
+    volatile uint32_t release_waiters;
+    // Same as publish_count, but for consumers advancing their cursors.
+    Futex release_count;
+
+    // The ticket that the next producer will claim. Like in MpscQueue, these
+    // never wrap.
+    volatile uint64_t head_ticket __attribute__((aligned(kCacheLineSize)));
+    // All the consumer groups.
+    Group groups[kMaxConsumerGroups];
+    // The read positions of all the consumers.
+    Cursor cursors[kMaxConsumers];
+  };
+
+  // A hashmap that's in charge of mapping queue names to offsets.
+  static SharedHashmap<const char *, int> queue_names_;
+
+  // The default constructor is private to force users to use the static
+  // creation methods.
+  RingQueue();
+
+  // A cursor value that doesn't hold producers back at all.
+  static constexpr uint64_t kIdleTicket =
+      ::std::numeric_limits<uint64_t>::max();
+  // A group ID that means that a consumer isn't in any group.
+  static constexpr uint32_t kNoGroup = ::std::numeric_limits<uint32_t>::max();
+
+  // Creates a new queue.
+  // Args:
+  //  consumer: Whether the queue is a consumer.
+  //  size: The number of items that the ring should be able to hold.
+  //  load_balanced: Whether the queue is in load-balanced mode.
+  // Returns:
+  //  True if creating the queue succeeded, false otherwise.
+  bool DoCreate(bool consumer, uint32_t size, bool load_balanced);
+  // Loads an existing queue.
+  // Args:
+  //  consumer: Whether the queue is a consumer.
+  //  offset: The offset of the shared portion of the queue in SHM.
+  //  group: The group that the consumer should join, or kNoGroup.
+  void DoLoad(bool consumer, uintptr_t offset, uint32_t group);
+  // Encapsulates initialization that is common to both queue creation and
+  // loading.
+  // Args:
+  //  consumer: Whether the queue is a consumer.
+  //  group: The group that the consumer should join, or kNoGroup.
+  void InitCommon(bool consumer, uint32_t group);
+  // Common back-end for the Fetch methods.
+  // Args:
+  //  name: The name of the queue to fetch.
+  //  consumer: Whether or not the queue should be a consumer queue.
+  //  size: The size of the ring, if a new queue is created.
+  //  load_balanced: Whether to use load-balanced mode, if a new queue is
+  //                 created.
+  // Returns:
+  //  The fetched queue.
+  static ::std::unique_ptr<RingQueue<T>> DoFetchQueue(const char *name,
+                                                      bool consumer,
+                                                      uint32_t size,
+                                                      bool load_balanced);
+
+  // Finds a free cursor slot, and starts reading from the current head, or from
+  // our group's claim ticket if we're in one.
+  void AddConsumer();
+  // Gives up our cursor slot, and leaves our group if we're in one.
+  void RemoveConsumer();
+  // Joins a consumer group, creating it if it doesn't exist yet. A new group
+  // starts reading from the current head.
+  // Args:
+  //  group: The ID of the group.
+  void JoinGroup(uint32_t group);
+  // Leaves our consumer group, and frees it if we were the last member.
+  void LeaveGroup();
+
+  // Gets the node that a particular ticket refers to.
+  // Args:
+  //  ticket: The ticket.
+  // Returns:
+  //  The node.
+  volatile Node *NodeFor(uint64_t ticket) const {
+    return nodes_ + (ticket & wrapping_mask_);
+  }
+
+  // Looks at all the consumer cursors to figure out how far producers can
+  // write, and updates gate_ticket_.
+  void UpdateGate();
+  // Claims tickets for writing, without blocking.
+  // Args:
+  //  num_tickets: The number of tickets we'd like.
+  //  first_ticket: Set to the first ticket we claimed.
+  // Returns:
+  //  The number of consecutive tickets that were claimed, which is at most
+  //  num_tickets. It is zero if the ring is full or there are no consumers.
+  uint32_t ClaimTickets(uint32_t num_tickets, uint64_t *first_ticket);
+  // Waits until a node has a particular published value.
+  // Args:
+  //  node: The node.
+  //  published: The value to wait for.
+  void WaitForPublished(volatile Node *node, uint64_t published);
+  // Waits until every consumer is far enough along that a ticket can be
+  // written.
+  // Args:
+  //  ticket: The ticket.
+  void WaitForGate(uint64_t ticket);
+  // Makes sure that the previous lap is done with the node for a ticket that
+  // we just claimed. This only ever has to wait if another producer is still
+  // writing that node and there are no consumers to hold us back.
+  // Args:
+  //  ticket: The ticket.
+  void WaitForPreviousLap(uint64_t ticket) {
+    WaitForPublished(NodeFor(ticket), ticket + 1 - (wrapping_mask_ + 1));
+  }
+  // Hands nodes that were written off to the consumers, and wakes up anyone
+  // who was waiting for them.
+  // Args:
+  //  first_ticket: The ticket of the first node.
+  //  num_tickets: The number of consecutive nodes to publish.
+  void Publish(uint64_t first_ticket, uint32_t num_tickets);
+  // Sets our cursor, and wakes up any producers that were waiting for us.
+  // Args:
+  //  ticket: The new value of the cursor.
+  void SetCursor(uint64_t ticket);
+
+  // Finds items that this consumer can read, starting at next_ticket_, without
+  // blocking. For group members, it claims them, unless we already have some
+  // claimed.
+  // Args:
+  //  max_items: The maximum number of items we want.
+  // Returns:
+  //  How many items we can read, which is at most max_items.
+  uint32_t ClaimForReading(uint32_t max_items);
+  // Claims items from our group, without blocking.
+  // Args:
+  //  max_items: The maximum number of items we want.
+  // Returns:
+  //  How many items we claimed, starting at next_ticket_.
+  uint32_t ClaimShared(uint32_t max_items);
+  // Same as ClaimForReading(1), but blocks until an item is available.
+  void WaitForReading();
+  // Lets go of items that we're done reading.
+  // Args:
+  //  num_items: How many items, starting at next_ticket_.
+  void FinishReading(uint32_t num_items);
+
+  RawQueue *queue_;
+  // This is the shared memory pool that we will use to construct queue objects.
+  Pool *pool_;
+  // The node array, in our address space.
+  volatile Node *nodes_;
+  // The bitmask to use for wrapping tickets.
+  uint64_t wrapping_mask_;
+
+  // Producers can write any ticket below this without looking at the cursors
+  // again.
+  uint64_t gate_ticket_ = 0;
+  // The ticket that was claimed by Reserve().
+  uint64_t reserved_ticket_;
+  // Whether we have a reserved ticket.
+  bool have_reservation_ = false;
+
+  // Our consumer group, or nullptr if we're not in one.
+  volatile Group *my_group_ = nullptr;
+  // Our cursor, or nullptr if we're not a consumer.
+  volatile Cursor *my_cursor_ = nullptr;
+  // The next ticket that we will read. If we're not in a group, this is a local
+  // copy of the one in our cursor.
+  uint64_t next_ticket_ = 0;
+  // If we're in a group, the number of items that we have claimed, starting at
+  // next_ticket_.
+  uint32_t num_claimed_ = 0;
+};
+
+// Initialize the queue_names_ member.
+template <class T>
+SharedHashmap<const char *, int> RingQueue<T>::queue_names_(kNameMapOffset,
+                                                            kNameMapSize);
+
+#include "ring_queue_impl.h"
+
+}  // namespace tachyon
+
+#endif  // TACHYON_LIB_RING_QUEUE_H_
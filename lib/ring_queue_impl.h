@@ -0,0 +1,782 @@
+// NOTE: This file is not meant to be #included directly. Use ring_queue.h
+// instead.
+
+template <class T>
+RingQueue<T>::RingQueue() : pool_(Pool::GetPool()) {}
+
+template <class T>
+RingQueue<T>::~RingQueue() {
+  if (my_cursor_) {
+    RemoveConsumer();
+  }
+}
+
+template <class T>
+::std::unique_ptr<RingQueue<T>> RingQueue<T>::Create(bool consumer,
+                                                     uint32_t size,
+                                                     bool load_balanced) {
+  // Create a new queue object.
+  RingQueue<T> *raw_queue = new RingQueue<T>();
+  auto queue = ::std::unique_ptr<RingQueue<T>>(raw_queue);
+
+  if (!queue->DoCreate(consumer, size, load_balanced)) {
+    // Creation failed.
+    queue.reset();
+  }
+
+  return queue;
+}
+
+template <class T>
+::std::unique_ptr<RingQueue<T>> RingQueue<T>::Load(bool consumer,
+                                                   uintptr_t offset) {
+  // Create a new queue object.
+  RingQueue<T> *raw_queue = new RingQueue<T>();
+  auto queue = ::std::unique_ptr<RingQueue<T>>(raw_queue);
+
+  queue->DoLoad(consumer, offset, kNoGroup);
+
+  return queue;
+}
+
+template <class T>
+::std::unique_ptr<RingQueue<T>> RingQueue<T>::LoadGroupConsumer(
+    uint32_t group, uintptr_t offset) {
+  // Create a new queue object.
+  RingQueue<T> *raw_queue = new RingQueue<T>();
+  auto queue = ::std::unique_ptr<RingQueue<T>>(raw_queue);
+
+  queue->DoLoad(true, offset, group);
+
+  return queue;
+}
+
+template <class T>
+bool RingQueue<T>::DoCreate(bool consumer, uint32_t size, bool load_balanced) {
+  uint8_t size_shifts;
+  const bool is_power_2 = mpsc_queue::IntLog2(size, &size_shifts);
+  assert(is_power_2 && "Queue size should be a power of 2.");
+  if (!is_power_2) {
+    return false;
+  }
+
+  // Allocate the shared memory we need.
+  queue_ = pool_->AllocateForType<RawQueue>();
+  assert(queue_ != nullptr && "Out of shared memory?");
+  if (!queue_) {
+    return false;
+  }
+
+  Node *nodes = pool_->AllocateForArray<Node>(size);
+  assert(nodes != nullptr && "Out of shared memory?");
+  if (!nodes) {
+    pool_->FreeType<RawQueue>(queue_);
+    return false;
+  }
+
+  // Initially, every node looks like it was published on the lap before the
+  // first one, so that producers on the first lap don't have to wait for it.
+  for (uint32_t i = 0; i < size; ++i) {
+    nodes[i].published = i + 1 - static_cast<uint64_t>(size);
+  }
+
+  queue_->array_offset = pool_->GetOffset(nodes);
+  queue_->array_length = size;
+  queue_->load_balanced = load_balanced;
+  queue_->num_consumers = 0;
+  queue_->num_cursor_slots = 0;
+  queue_->num_group_slots = 0;
+  MutexInit(&(queue_->group_lock));
+  queue_->publish_waiters = 0;
+  queue_->publish_count = 0;
+  queue_->release_waiters = 0;
+  queue_->release_count = 0;
+  queue_->head_ticket = 0;
+  for (uint32_t i = 0; i < kMaxConsumerGroups; ++i) {
+    queue_->groups[i].claim_ticket = 0;
+    queue_->groups[i].state = kCursorFree;
+  }
+  for (uint32_t i = 0; i < kMaxConsumers; ++i) {
+    queue_->cursors[i].next_ticket = 0;
+    queue_->cursors[i].state = kCursorFree;
+  }
+
+  if (load_balanced) {
+    // The default group exists from the start, so that nothing written before
+    // the first consumer joins gets lost.
+    volatile Group *group = queue_->groups;
+    group->id = kDefaultGroup;
+    group->num_members = 0;
+    group->permanent = true;
+    group->state = kCursorActive;
+    queue_->num_group_slots = 1;
+  }
+
+  InitCommon(consumer, kNoGroup);
+
+  return true;
+}
+
+template <class T>
+void RingQueue<T>::DoLoad(bool consumer, uintptr_t offset, uint32_t group) {
+  // Initialize queue with an existing one.
+  queue_ = pool_->AtOffset<RawQueue>(offset);
+
+  InitCommon(consumer, group);
+}
+
+template <class T>
+void RingQueue<T>::InitCommon(bool consumer, uint32_t group) {
+  // Find the node array in our address space.
+  nodes_ = pool_->AtOffset<Node>(queue_->array_offset);
+  wrapping_mask_ = queue_->array_length - 1;
+
+  if (!consumer) {
+    return;
+  }
+
+  if (group == kNoGroup && queue_->load_balanced) {
+    group = kDefaultGroup;
+  }
+  if (group != kNoGroup) {
+    JoinGroup(group);
+  }
+  AddConsumer();
+}
+
+template <class T>
+void RingQueue<T>::AddConsumer() {
+  // Look for a free cursor slot that we can take.
+  uint32_t index = kMaxConsumers;
+  for (uint32_t i = 0; i < kMaxConsumers; ++i) {
+    if (CompareExchange(&(queue_->cursors[i].state), kCursorFree,
+                        kCursorActive)) {
+      index = i;
+      break;
+    }
+  }
+
+  // If there were no slots available, this constitutes a serious error.
+  assert(index < kMaxConsumers && "Exceeded maximum number of consumers.");
+  my_cursor_ = queue_->cursors + index;
+
+  // Make sure that producers look at our slot.
+  uint32_t num_slots = AtomicLoad(&(queue_->num_cursor_slots));
+  while (num_slots <= index &&
+         !CompareExchange(&(queue_->num_cursor_slots), num_slots, index + 1)) {
+    num_slots = AtomicLoad(&(queue_->num_cursor_slots));
+  }
+
+  if (my_group_) {
+    // We don't read anything until we claim it, so there's nothing to hold
+    // producers back for yet.
+    AtomicStoreQuad(&(my_cursor_->next_ticket), kIdleTicket);
+    Increment(&(queue_->num_consumers), ::std::memory_order_release);
+    return;
+  }
+
+  // Until we write our cursor, it still has whatever the last consumer to use
+  // the slot left there, which is behind the head, so it can only hold
+  // producers back. We have to read the head after we're visible to
+  // producers: if a producer didn't see us, it also didn't let anyone write
+  // past this head on the next lap, so everything from here on is safe to
+  // read.
+  next_ticket_ = AtomicLoadQuad(&(queue_->head_ticket));
+  AtomicStoreQuad(&(my_cursor_->next_ticket), next_ticket_);
+
+  Increment(&(queue_->num_consumers), ::std::memory_order_release);
+}
+
+template <class T>
+void RingQueue<T>::RemoveConsumer() {
+  Decrement(&(queue_->num_consumers), ::std::memory_order_relaxed);
+  // Whoever takes this slot next is visible to producers before it writes its
+  // own cursor, so we can't leave kIdleTicket here, or they'd write right over
+  // the place where it starts reading. The head is never ahead of that place,
+  // so it only holds them back.
+  AtomicStoreQuad(&(my_cursor_->next_ticket),
+                  AtomicLoadQuad(&(queue_->head_ticket)));
+  // The release makes sure that we're done reading before producers can
+  // ignore our cursor.
+  AtomicStore(&(my_cursor_->state), kCursorFree);
+  my_cursor_ = nullptr;
+  if (my_group_) {
+    LeaveGroup();
+  }
+
+  // Producers might have been waiting for us specifically.
+  if (AtomicLoad(&(queue_->release_waiters))) {
+    Increment(&(queue_->release_count));
+    FutexWake(&(queue_->release_count), ::std::numeric_limits<int>::max());
+  }
+}
+
+template <class T>
+void RingQueue<T>::JoinGroup(uint32_t group) {
+  MutexGrab(&(queue_->group_lock));
+
+  // Look for the group, and remember the first free slot on the way, in case
+  // it doesn't exist.
+  const uint32_t num_slots = queue_->num_group_slots;
+  volatile Group *free_slot = nullptr;
+  for (uint32_t i = 0; i < num_slots; ++i) {
+    volatile Group *slot = queue_->groups + i;
+    if (slot->state == kCursorFree) {
+      if (!free_slot) {
+        free_slot = slot;
+      }
+    } else if (slot->id == group) {
+      my_group_ = slot;
+      break;
+    }
+  }
+
+  if (!my_group_) {
+    if (!free_slot) {
+      // If there are no slots left, this constitutes a serious error.
+      assert(num_slots < kMaxConsumerGroups &&
+             "Exceeded maximum number of consumer groups.");
+      if (num_slots >= kMaxConsumerGroups) {
+        // Fall back on reading everything, which is at least not going to
+        // break anything.
+        MutexRelease(&(queue_->group_lock));
+        return;
+      }
+      free_slot = queue_->groups + num_slots;
+    }
+
+    free_slot->id = group;
+    free_slot->num_members = 0;
+    free_slot->permanent = false;
+    // Same as in AddConsumer(), the slot has to be visible to producers before
+    // we read the head. Until then, the claim ticket is left over from the last
+    // group in the slot, so it can only hold them back.
+    AtomicStore(&(free_slot->state), kCursorActive);
+    if (free_slot == queue_->groups + num_slots) {
+      AtomicStore(&(queue_->num_group_slots), num_slots + 1);
+    }
+    AtomicStoreQuad(&(free_slot->claim_ticket),
+                    AtomicLoadQuad(&(queue_->head_ticket)));
+    my_group_ = free_slot;
+  }
+
+  ++my_group_->num_members;
+  MutexRelease(&(queue_->group_lock));
+}
+
+template <class T>
+void RingQueue<T>::LeaveGroup() {
+  MutexGrab(&(queue_->group_lock));
+
+  if (!--my_group_->num_members && !my_group_->permanent) {
+    // Nobody is left to read what the group hasn't claimed, so producers can
+    // stop waiting for it. RemoveConsumer() wakes them up.
+    AtomicStore(&(my_group_->state), kCursorFree);
+  }
+  my_group_ = nullptr;
+
+  MutexRelease(&(queue_->group_lock));
+}
+
+template <class T>
+void RingQueue<T>::UpdateGate() {
+  // Nobody can be past the head, so it's the upper bound. It also has to be
+  // read before the cursors, so that consumers that are joining right now and
+  // that we don't see start reading after it. (See AddConsumer().)
+  uint64_t min_ticket = AtomicLoadQuad(&(queue_->head_ticket));
+
+  // Nobody in a group has claimed anything past its claim ticket, so those are
+  // bounds too. They have to be read before the cursors, because consumers set
+  // their cursor before they move the claim ticket. (See ClaimShared().)
+  const uint32_t num_groups = AtomicLoad(&(queue_->num_group_slots));
+  for (uint32_t i = 0; i < num_groups; ++i) {
+    volatile Group *group = queue_->groups + i;
+    if (AtomicLoad(&(group->state)) != kCursorActive) {
+      continue;
+    }
+
+    min_ticket =
+        ::std::min(min_ticket, AtomicLoadQuad(&(group->claim_ticket)));
+  }
+
+  const uint32_t num_slots = AtomicLoad(&(queue_->num_cursor_slots));
+  for (uint32_t i = 0; i < num_slots; ++i) {
+    volatile Cursor *cursor = queue_->cursors + i;
+    if (AtomicLoad(&(cursor->state)) != kCursorActive) {
+      continue;
+    }
+
+    // This synchronizes with the store in SetCursor(), so the consumer is done
+    // reading everything that we are now allowed to write over. Idle cursors
+    // are all ones, so they never win.
+    min_ticket =
+        ::std::min(min_ticket, AtomicLoadQuad(&(cursor->next_ticket)));
+  }
+
+  gate_ticket_ = min_ticket + wrapping_mask_ + 1;
+}
+
+template <class T>
+uint32_t RingQueue<T>::ClaimTickets(uint32_t num_tickets,
+                                    uint64_t *first_ticket) {
+  // If we have no consumers, we'd basically just be sending this message out
+  // into the void.
+  if (!AtomicLoad(&(queue_->num_consumers), ::std::memory_order_relaxed)) {
+    return 0;
+  }
+
+  uint64_t head =
+      AtomicLoadQuad(&(queue_->head_ticket), ::std::memory_order_relaxed);
+  while (true) {
+    if (head + num_tickets > gate_ticket_) {
+      // Our cached gate says we don't have room, but the consumers might have
+      // moved since we last looked.
+      UpdateGate();
+    }
+
+    // Blocking producers can claim tickets past the gate, so it could be
+    // behind the head.
+    const uint64_t available = gate_ticket_ > head ? gate_ticket_ - head : 0;
+    const uint32_t num_claimed =
+        available < num_tickets ? available : num_tickets;
+    if (!num_claimed) {
+      return 0;
+    }
+
+    // Only the tickets themselves have to be claimed atomically. The gate
+    // already made sure that the nodes are free.
+    if (CompareExchangeQuad(&(queue_->head_ticket), head, head + num_claimed,
+                            ::std::memory_order_relaxed)) {
+      *first_ticket = head;
+      return num_claimed;
+    }
+    head = AtomicLoadQuad(&(queue_->head_ticket), ::std::memory_order_relaxed);
+  }
+}
+
+template <class T>
+void RingQueue<T>::WaitForPublished(volatile Node *node, uint64_t published) {
+  // The acquire synchronizes with the store in Publish(), so we're guaranteed
+  // to see everything the producer did to the node beforehand.
+  if (AtomicLoadQuad(&(node->published), ::std::memory_order_acquire) ==
+      published) {
+    // Fast path: No waiting required.
+    return;
+  }
+
+  // Before we wait, mark that this thread is waiting. This, and the subsequent
+  // loads, have to stay sequentially consistent: they pair with the store in
+  // Publish() and the subsequent read of publish_waiters, and we need to
+  // guarantee that either the producer sees us waiting, or we see the item.
+  Increment(&(queue_->publish_waiters));
+  while (true) {
+    const uint32_t count = AtomicLoad(&(queue_->publish_count));
+    if (AtomicLoadQuad(&(node->published)) == published) {
+      break;
+    }
+    FutexWait(&(queue_->publish_count), count);
+  }
+  Decrement(&(queue_->publish_waiters), ::std::memory_order_relaxed);
+}
+
+template <class T>
+void RingQueue<T>::WaitForGate(uint64_t ticket) {
+  if (ticket < gate_ticket_) {
+    // Fast path: No waiting required.
+    return;
+  }
+
+  // Same as above, but pairs with SetCursor() and RemoveConsumer().
+  Increment(&(queue_->release_waiters));
+  while (true) {
+    const uint32_t count = AtomicLoad(&(queue_->release_count));
+    UpdateGate();
+    if (ticket < gate_ticket_) {
+      break;
+    }
+    FutexWait(&(queue_->release_count), count);
+  }
+  Decrement(&(queue_->release_waiters), ::std::memory_order_relaxed);
+}
+
+template <class T>
+void RingQueue<T>::Publish(uint64_t first_ticket, uint32_t num_tickets) {
+  // This has to be a release, so that the items are visible to consumers by
+  // the time they see them published, but it also can't be reordered with the
+  // read of publish_waiters below. (See WaitForPublished().)
+  if (num_tickets == 1) {
+    AtomicStoreQuad(&(NodeFor(first_ticket)->published), first_ticket + 1);
+  } else {
+    for (uint32_t i = 0; i < num_tickets; ++i) {
+      AtomicStoreQuad(&(NodeFor(first_ticket + i)->published),
+                      first_ticket + i + 1, ::std::memory_order_release);
+    }
+    Fence();
+  }
+
+  if (AtomicLoad(&(queue_->publish_waiters))) {
+    // We don't know who is waiting for what, so wake everyone up, and let them
+    // sort it out.
+    Increment(&(queue_->publish_count));
+    FutexWake(&(queue_->publish_count), ::std::numeric_limits<int>::max());
+  }
+}
+
+template <class T>
+void RingQueue<T>::SetCursor(uint64_t ticket) {
+  // Like in Publish(), this is a release, so that we're done reading before
+  // anyone can write over the nodes, and it can't be reordered with the read of
+  // release_waiters.
+  AtomicStoreQuad(&(my_cursor_->next_ticket), ticket);
+
+  if (AtomicLoad(&(queue_->release_waiters))) {
+    Increment(&(queue_->release_count));
+    FutexWake(&(queue_->release_count), ::std::numeric_limits<int>::max());
+  }
+}
+
+template <class T>
+uint32_t RingQueue<T>::ClaimForReading(uint32_t max_items) {
+  assert(my_cursor_ && "This queue is not configured as a consumer!");
+
+  if (my_group_) {
+    if (num_claimed_) {
+      // We still have items from last time, so use those first.
+      return num_claimed_ < max_items ? num_claimed_ : max_items;
+    }
+    return ClaimShared(max_items);
+  }
+
+  uint32_t num_available = 0;
+  for (; num_available < max_items; ++num_available) {
+    // The acquire synchronizes with the release in Publish(), so we're
+    // guaranteed to see the whole item.
+    const uint64_t ticket = next_ticket_ + num_available;
+    if (AtomicLoadQuad(&(NodeFor(ticket)->published),
+                       ::std::memory_order_acquire) != ticket + 1) {
+      // We've found everything that's available.
+      break;
+    }
+  }
+
+  return num_available;
+}
+
+template <class T>
+uint32_t RingQueue<T>::ClaimShared(uint32_t max_items) {
+  volatile uint64_t *claim_ticket = &(my_group_->claim_ticket);
+  uint64_t claim = AtomicLoadQuad(claim_ticket);
+  while (true) {
+    uint32_t num_available = 0;
+    for (; num_available < max_items; ++num_available) {
+      // Same as in ClaimForReading().
+      const uint64_t ticket = claim + num_available;
+      if (AtomicLoadQuad(&(NodeFor(ticket)->published),
+                         ::std::memory_order_acquire) != ticket + 1) {
+        break;
+      }
+    }
+
+    if (!num_available) {
+      // Either nothing has been written yet, or our claim ticket is so stale
+      // that the node has since been overwritten.
+      const uint64_t new_claim = AtomicLoadQuad(claim_ticket);
+      if (new_claim == claim) {
+        return 0;
+      }
+      claim = new_claim;
+      continue;
+    }
+
+    // Our cursor has to cover these items before they're ours, so that
+    // producers can't write over them between the claim and the read.
+    AtomicStoreQuad(&(my_cursor_->next_ticket), claim);
+    if (CompareExchangeQuad(claim_ticket, claim, claim + num_available)) {
+      next_ticket_ = claim;
+      num_claimed_ = num_available;
+      return num_available;
+    }
+
+    // Someone else got there first. Our cursor is now behind the claim ticket,
+    // and we might end up going to sleep without ever moving it, so it has to
+    // go back to idle, or we could hold producers back forever.
+    SetCursor(kIdleTicket);
+    claim = AtomicLoadQuad(claim_ticket);
+  }
+}
+
+template <class T>
+void RingQueue<T>::WaitForReading() {
+  assert(my_cursor_ && "This queue is not configured as a consumer!");
+
+  if (!my_group_) {
+    WaitForPublished(NodeFor(next_ticket_), next_ticket_ + 1);
+    return;
+  }
+
+  if (ClaimForReading(1)) {
+    // Fast path: No waiting required.
+    return;
+  }
+
+  // Same as in WaitForPublished(), but we don't know which node we'll get until
+  // we actually claim it.
+  Increment(&(queue_->publish_waiters));
+  while (true) {
+    const uint32_t count = AtomicLoad(&(queue_->publish_count));
+    if (ClaimShared(1)) {
+      break;
+    }
+    FutexWait(&(queue_->publish_count), count);
+  }
+  Decrement(&(queue_->publish_waiters), ::std::memory_order_relaxed);
+}
+
+template <class T>
+void RingQueue<T>::FinishReading(uint32_t num_items) {
+  next_ticket_ += num_items;
+
+  if (my_group_) {
+    num_claimed_ -= num_items;
+    // Once we're out of items, we shouldn't hold anyone back while we process
+    // them.
+    SetCursor(num_claimed_ ? next_ticket_ : kIdleTicket);
+  } else {
+    SetCursor(next_ticket_);
+  }
+}
+
+template <class T>
+bool RingQueue<T>::Enqueue(const T &item) {
+  uint64_t ticket;
+  if (!ClaimTickets(1, &ticket)) {
+    return false;
+  }
+
+  WaitForPreviousLap(ticket);
+  mpsc_queue::VolatileCopy(&(NodeFor(ticket)->value), &item, sizeof(item));
+  Publish(ticket, 1);
+
+  return true;
+}
+
+template <class T>
+bool RingQueue<T>::EnqueueBlocking(const T &item) {
+  // If we have no consumers, we'd basically just be sending this message out
+  // into the void.
+  if (!AtomicLoad(&(queue_->num_consumers), ::std::memory_order_relaxed)) {
+    return false;
+  }
+
+  // Since we're willing to wait for our space, we can claim it
+  // unconditionally.
+  const uint64_t ticket =
+      ExchangeAddQuad(&(queue_->head_ticket), 1, ::std::memory_order_relaxed);
+  WaitForGate(ticket);
+  WaitForPreviousLap(ticket);
+
+  mpsc_queue::VolatileCopy(&(NodeFor(ticket)->value), &item, sizeof(item));
+  Publish(ticket, 1);
+
+  return true;
+}
+
+template <class T>
+uint32_t RingQueue<T>::EnqueueBatch(const T *items, uint32_t num_items) {
+  uint64_t first_ticket;
+  const uint32_t num_claimed = ClaimTickets(num_items, &first_ticket);
+  if (!num_claimed) {
+    return 0;
+  }
+
+  for (uint32_t i = 0; i < num_claimed; ++i) {
+    WaitForPreviousLap(first_ticket + i);
+    mpsc_queue::VolatileCopy(&(NodeFor(first_ticket + i)->value), items + i,
+                             sizeof(T));
+  }
+  // Consumers see the whole batch at once.
+  Publish(first_ticket, num_claimed);
+
+  return num_claimed;
+}
+
+template <class T>
+T *RingQueue<T>::Reserve() {
+  assert(!have_reservation_ && "Already have a reservation.");
+
+  if (!ClaimTickets(1, &reserved_ticket_)) {
+    return nullptr;
+  }
+  WaitForPreviousLap(reserved_ticket_);
+  have_reservation_ = true;
+
+  // Nobody else will touch this node until we publish it, so it's safe to cast
+  // away the volatile.
+  return const_cast<T *>(&(NodeFor(reserved_ticket_)->value));
+}
+
+template <class T>
+void RingQueue<T>::Commit() {
+  assert(have_reservation_ && "No space reserved.");
+
+  Publish(reserved_ticket_, 1);
+  have_reservation_ = false;
+}
+
+template <class T>
+bool RingQueue<T>::DequeueNext(T *item) {
+  if (!PeekNext(item)) {
+    return false;
+  }
+  FinishReading(1);
+
+  return true;
+}
+
+template <class T>
+void RingQueue<T>::DequeueNextBlocking(T *item) {
+  PeekNextBlocking(item);
+  FinishReading(1);
+}
+
+template <class T>
+uint32_t RingQueue<T>::DequeueBatch(T *items, uint32_t max_items) {
+  const uint32_t num_read = ClaimForReading(max_items);
+  for (uint32_t i = 0; i < num_read; ++i) {
+    mpsc_queue::ReadItem(items + i, &(NodeFor(next_ticket_ + i)->value));
+  }
+
+  // We only have to move our cursor once for the whole batch.
+  if (num_read) {
+    FinishReading(num_read);
+  }
+
+  return num_read;
+}
+
+template <class T>
+bool RingQueue<T>::PeekNext(T *item) {
+  const T *view = ReadView();
+  if (!view) {
+    return false;
+  }
+
+  mpsc_queue::ReadItem(item, view);
+
+  return true;
+}
+
+template <class T>
+void RingQueue<T>::PeekNextBlocking(T *item) {
+  WaitForReading();
+  mpsc_queue::ReadItem(item, &(NodeFor(next_ticket_)->value));
+}
+
+template <class T>
+const T *RingQueue<T>::ReadView() {
+  // In load-balanced mode, this claims the item, so that we keep getting the
+  // same one until we release it.
+  if (!ClaimForReading(1)) {
+    return nullptr;
+  }
+
+  // Producers won't touch this node until we move our cursor past it, so it's
+  // safe to cast away the volatile.
+  return const_cast<const T *>(&(NodeFor(next_ticket_)->value));
+}
+
+template <class T>
+void RingQueue<T>::Release() {
+  FinishReading(1);
+}
+
+template <class T>
+int RingQueue<T>::GetOffset() const {
+  return pool_->GetOffset(queue_);
+}
+
+template <class T>
+void RingQueue<T>::FreeQueue() {
+  // We just do pointer arithmetic with the freed blocks, so it's okay to cast
+  // away the volatile.
+  pool_->FreeArray<Node>(const_cast<Node *>(nodes_), queue_->array_length);
+  // Now free the rest of the queue data.
+  pool_->FreeType<RawQueue>(queue_);
+
+  // There's nothing left for the destructor to remove us from.
+  my_cursor_ = nullptr;
+}
+
+template <class T>
+uint32_t RingQueue<T>::GetNumConsumers() const {
+  return AtomicLoad(&(queue_->num_consumers), ::std::memory_order_acquire);
+}
+
+template <class T>
+bool RingQueue<T>::IsLoadBalanced() const {
+  return queue_->load_balanced;
+}
+
+template <class T>
+::std::unique_ptr<RingQueue<T>> RingQueue<T>::DoFetchQueue(const char *name,
+                                                           bool consumer,
+                                                           uint32_t size,
+                                                           bool load_balanced) {
+  // First, see if a queue exists.
+  int offset;
+  if (queue_names_.Fetch(name, &offset)) {
+    // We have a queue, so just make a new handle to it.
+    return Load(consumer, offset);
+  }
+
+  // Create a new queue.
+  auto queue_handle = Create(consumer, size, load_balanced);
+  // Save the offset.
+  queue_names_.AddOrSet(name, queue_handle->GetOffset());
+
+  return queue_handle;
+}
+
+template <class T>
+::std::unique_ptr<RingQueue<T>> RingQueue<T>::FetchQueue(const char *name) {
+  // Use default size.
+  return DoFetchQueue(name, true, kQueueCapacity, false);
+}
+
+template <class T>
+::std::unique_ptr<RingQueue<T>> RingQueue<T>::FetchProducerQueue(
+    const char *name) {
+  return DoFetchQueue(name, false, kQueueCapacity, false);
+}
+
+template <class T>
+::std::unique_ptr<RingQueue<T>> RingQueue<T>::FetchSizedQueue(
+    const char *name, uint32_t size) {
+  return DoFetchQueue(name, true, size, false);
+}
+
+template <class T>
+::std::unique_ptr<RingQueue<T>> RingQueue<T>::FetchSizedProducerQueue(
+    const char *name, uint32_t size) {
+  return DoFetchQueue(name, false, size, false);
+}
+
+template <class T>
+::std::unique_ptr<RingQueue<T>> RingQueue<T>::FetchLoadBalancedQueue(
+    const char *name) {
+  return DoFetchQueue(name, true, kQueueCapacity, true);
+}
+
+template <class T>
+::std::unique_ptr<RingQueue<T>> RingQueue<T>::FetchLoadBalancedProducerQueue(
+    const char *name) {
+  return DoFetchQueue(name, false, kQueueCapacity, true);
+}
+
+template <class T>
+::std::unique_ptr<RingQueue<T>> RingQueue<T>::FetchGroupQueue(const char *name,
+                                                              uint32_t group) {
+  // Make sure that the queue exists, and then join it separately.
+  auto producer = DoFetchQueue(name, false, kQueueCapacity, false);
+  return LoadGroupConsumer(group, producer->GetOffset());
+}
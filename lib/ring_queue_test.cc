@@ -0,0 +1,577 @@
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "constants.h"
+#include "pool.h"
+#include "ring_queue.h"
+
+namespace tachyon {
+namespace testing {
+namespace {
+
+// How many items each producer thread sends.
+constexpr int kNumItems = 20000;
+
+// A queue producer thread. It sends an increasing sequence of numbers, tagged
+// with the producer that sent them. It yields when the queue is full, so that
+// tests don't take forever on machines without many cores.
+// Args:
+//  offset: The SHM offset of the queue to use.
+//  producer: The number of this producer.
+//  blocking: Whether to use blocking writes.
+void ProducerThread(int offset, int producer, bool blocking) {
+  auto queue = RingQueue<int>::Load(false, offset);
+
+  for (int i = 0; i < kNumItems; ++i) {
+    const int item = producer * kNumItems + i;
+    if (blocking) {
+      ASSERT_TRUE(queue->EnqueueBlocking(item));
+    } else {
+      while (!queue->Enqueue(item)) {
+        ::std::this_thread::yield();
+      }
+    }
+  }
+}
+
+// A queue consumer thread. It reads everything that the producers send, and
+// checks that each producer's items come out in order.
+// Args:
+//  queue: The queue to read from.
+//  num_producers: How many producers there are.
+//  blocking: Whether to use blocking reads.
+void ConsumerThread(RingQueue<int> *queue, int num_producers, bool blocking) {
+  ::std::vector<int> next_items(num_producers, 0);
+  for (int i = 0; i < kNumItems * num_producers; ++i) {
+    int item;
+    if (blocking) {
+      queue->DequeueNextBlocking(&item);
+    } else {
+      while (!queue->DequeueNext(&item)) {
+        ::std::this_thread::yield();
+      }
+    }
+
+    const int producer = item / kNumItems;
+    ASSERT_LT(producer, num_producers);
+    ASSERT_EQ(next_items[producer]++, item % kNumItems);
+  }
+
+  int item;
+  EXPECT_FALSE(queue->DequeueNext(&item));
+}
+
+// A worker thread for a load-balanced queue. It reads items until it gets a
+// negative one, and checks that each producer's items come out in order.
+// Args:
+//  queue: The queue to read from.
+//  blocking: Whether to use blocking reads.
+//  items: Gets filled with everything that this worker read.
+void WorkerThread(RingQueue<int> *queue, bool blocking,
+                  ::std::vector<int> *items) {
+  ::std::vector<int> last_items;
+  while (true) {
+    int item;
+    if (blocking) {
+      queue->DequeueNextBlocking(&item);
+    } else {
+      while (!queue->DequeueNext(&item)) {
+        ::std::this_thread::yield();
+      }
+    }
+    if (item < 0) {
+      break;
+    }
+
+    const uint32_t producer = item / kNumItems;
+    if (producer >= last_items.size()) {
+      last_items.resize(producer + 1, -1);
+    }
+    ASSERT_LT(last_items[producer], item);
+    last_items[producer] = item;
+    items->push_back(item);
+  }
+}
+
+}  // namespace
+
+// Tests for the ring queue.
+class RingQueueTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    queue_ = RingQueue<int>::Create(true, kQueueCapacity);
+    ASSERT_NE(nullptr, queue_);
+  }
+
+  virtual void TearDown() {
+    // Free queue SHM.
+    queue_->FreeQueue();
+  }
+
+  static void TearDownTestCase() {
+    // Unlink SHM.
+    ASSERT_TRUE(Pool::Unlink());
+  }
+
+  // Runs some producers and consumers at the same time.
+  // Args:
+  //  num_producers: How many producer threads to use.
+  //  num_consumers: How many consumer threads to use, besides queue_.
+  //  blocking: Whether to use blocking operations.
+  void RunThreads(int num_producers, int num_consumers, bool blocking) {
+    // The consumers have to exist before anyone starts producing, or they'll
+    // miss things.
+    ::std::vector<::std::unique_ptr<RingQueue<int>>> consumers;
+    for (int i = 0; i < num_consumers; ++i) {
+      consumers.push_back(RingQueue<int>::Load(true, queue_->GetOffset()));
+    }
+
+    ::std::vector<::std::thread> threads;
+    for (int i = 0; i < num_producers; ++i) {
+      threads.emplace_back(ProducerThread, queue_->GetOffset(), i, blocking);
+    }
+    for (auto &consumer : consumers) {
+      threads.emplace_back(ConsumerThread, consumer.get(), num_producers,
+                           blocking);
+    }
+    ConsumerThread(queue_.get(), num_producers, blocking);
+
+    for (auto &thread : threads) {
+      thread.join();
+    }
+  }
+
+  // Runs some producers and workers on a load-balanced queue, and checks that
+  // every item is read exactly once by each group.
+  // Args:
+  //  num_producers: How many producer threads to use.
+  //  num_workers: How many worker threads to use in each group.
+  //  blocking: Whether to use blocking operations.
+  //  num_groups: How many consumer groups to use. If this is zero, it uses the
+  //              default group of a load-balanced queue.
+  void RunWorkers(int num_producers, int num_workers, bool blocking,
+                  int num_groups = 0) {
+    auto queue = RingQueue<int>::Create(false, kQueueCapacity, !num_groups);
+    ASSERT_NE(nullptr, queue);
+
+    ::std::vector<::std::unique_ptr<RingQueue<int>>> workers;
+    for (int i = 0; i < num_workers; ++i) {
+      if (!num_groups) {
+        workers.push_back(RingQueue<int>::Load(true, queue->GetOffset()));
+      }
+      for (int group = 1; group <= num_groups; ++group) {
+        workers.push_back(
+            RingQueue<int>::LoadGroupConsumer(group, queue->GetOffset()));
+      }
+    }
+
+    ::std::vector<::std::vector<int>> items(workers.size());
+    ::std::vector<::std::thread> worker_threads;
+    for (uint32_t i = 0; i < workers.size(); ++i) {
+      worker_threads.emplace_back(WorkerThread, workers[i].get(), blocking,
+                                  &items[i]);
+    }
+    ::std::vector<::std::thread> producer_threads;
+    for (int i = 0; i < num_producers; ++i) {
+      producer_threads.emplace_back(ProducerThread, queue->GetOffset(), i,
+                                    blocking);
+    }
+    for (auto &thread : producer_threads) {
+      thread.join();
+    }
+
+    // Tell every worker to stop. Every group gets all of these.
+    for (int i = 0; i < num_workers; ++i) {
+      ASSERT_TRUE(queue->EnqueueBlocking(-1));
+    }
+    for (auto &thread : worker_threads) {
+      thread.join();
+    }
+
+    const int num_reads_per_item = num_groups ? num_groups : 1;
+    ::std::vector<int> num_reads(num_producers * kNumItems, 0);
+    for (const auto &worker_items : items) {
+      for (int item : worker_items) {
+        ++num_reads[item];
+      }
+    }
+    for (int i = 0; i < num_producers * kNumItems; ++i) {
+      ASSERT_EQ(num_reads_per_item, num_reads[i]) << "Item " << i;
+    }
+
+    workers.clear();
+    queue->FreeQueue();
+  }
+
+  // The queue we are testing with.
+  ::std::unique_ptr<RingQueue<int>> queue_;
+};
+
+// Test that we can enqueue items properly.
+TEST_F(RingQueueTest, EnqueueTest) {
+  // Fill up the entire queue.
+  for (int i = 0; i < kQueueCapacity; ++i) {
+    EXPECT_TRUE(queue_->Enqueue(i));
+  }
+
+  // Now it shouldn't let us do any more.
+  EXPECT_FALSE(queue_->Enqueue(kQueueCapacity));
+  EXPECT_EQ(nullptr, queue_->Reserve());
+
+  // Once we read something, there should be space for one more.
+  int on_queue;
+  ASSERT_TRUE(queue_->DequeueNext(&on_queue));
+  EXPECT_EQ(0, on_queue);
+  EXPECT_TRUE(queue_->Enqueue(kQueueCapacity));
+  EXPECT_FALSE(queue_->Enqueue(kQueueCapacity + 1));
+}
+
+// Test that we can dequeue items properly.
+TEST_F(RingQueueTest, DequeueTest) {
+  // Go around the ring a few times.
+  int on_queue;
+  for (int i = 0; i < kQueueCapacity * 3; ++i) {
+    ASSERT_TRUE(queue_->Enqueue(i));
+
+    EXPECT_TRUE(queue_->PeekNext(&on_queue));
+    EXPECT_EQ(i, on_queue);
+    EXPECT_TRUE(queue_->DequeueNext(&on_queue));
+    EXPECT_EQ(i, on_queue);
+  }
+
+  // There should be nothing else.
+  EXPECT_FALSE(queue_->DequeueNext(&on_queue));
+  EXPECT_FALSE(queue_->PeekNext(&on_queue));
+}
+
+// Test that every consumer gets every item, and that the slowest one holds the
+// producers back.
+TEST_F(RingQueueTest, BroadcastTest) {
+  auto consumer = RingQueue<int>::Load(true, queue_->GetOffset());
+  auto producer = RingQueue<int>::Load(false, queue_->GetOffset());
+  EXPECT_EQ(2u, queue_->GetNumConsumers());
+
+  for (int i = 0; i < kQueueCapacity; ++i) {
+    ASSERT_TRUE(producer->Enqueue(i));
+  }
+  EXPECT_FALSE(producer->Enqueue(kQueueCapacity));
+
+  // Reading everything from one consumer doesn't help.
+  int on_queue;
+  for (int i = 0; i < kQueueCapacity; ++i) {
+    ASSERT_TRUE(queue_->DequeueNext(&on_queue));
+    EXPECT_EQ(i, on_queue);
+  }
+  EXPECT_FALSE(queue_->DequeueNext(&on_queue));
+  EXPECT_FALSE(producer->Enqueue(kQueueCapacity));
+
+  // Once the other one catches up a little, we can write again.
+  ASSERT_TRUE(consumer->DequeueNext(&on_queue));
+  EXPECT_EQ(0, on_queue);
+  EXPECT_TRUE(producer->Enqueue(kQueueCapacity));
+  EXPECT_FALSE(producer->Enqueue(kQueueCapacity + 1));
+
+  for (int i = 1; i <= kQueueCapacity; ++i) {
+    ASSERT_TRUE(consumer->DequeueNext(&on_queue));
+    EXPECT_EQ(i, on_queue);
+  }
+  ASSERT_TRUE(queue_->DequeueNext(&on_queue));
+  EXPECT_EQ(kQueueCapacity, on_queue);
+}
+
+// Test that consumers come and go properly.
+TEST_F(RingQueueTest, ConsumerChurnTest) {
+  auto producer = RingQueue<int>::Load(false, queue_->GetOffset());
+
+  // Once everyone is gone, there's nobody to write to.
+  queue_.reset();
+  EXPECT_FALSE(producer->Enqueue(1));
+  EXPECT_EQ(nullptr, producer->Reserve());
+  EXPECT_FALSE(producer->EnqueueBlocking(1));
+
+  // A new consumer only sees things that were written after it joined.
+  queue_ = RingQueue<int>::Load(true, producer->GetOffset());
+  ASSERT_TRUE(producer->Enqueue(1));
+  auto late_consumer = RingQueue<int>::Load(true, producer->GetOffset());
+  ASSERT_TRUE(producer->Enqueue(2));
+
+  int on_queue;
+  ASSERT_TRUE(queue_->DequeueNext(&on_queue));
+  EXPECT_EQ(1, on_queue);
+  ASSERT_TRUE(late_consumer->DequeueNext(&on_queue));
+  EXPECT_EQ(2, on_queue);
+  EXPECT_FALSE(late_consumer->DequeueNext(&on_queue));
+
+  // A consumer that stops reading stops holding us back when it goes away.
+  ASSERT_TRUE(queue_->DequeueNext(&on_queue));
+  EXPECT_EQ(2, on_queue);
+  while (producer->Enqueue(3))
+    ;
+  while (queue_->DequeueNext(&on_queue))
+    ;
+  EXPECT_FALSE(producer->Enqueue(3));
+  late_consumer.reset();
+  EXPECT_EQ(1u, producer->GetNumConsumers());
+  EXPECT_TRUE(producer->Enqueue(3));
+}
+
+// Test that batch operations work.
+TEST_F(RingQueueTest, BatchTest) {
+  int items[kQueueCapacity * 2];
+  for (int i = 0; i < kQueueCapacity * 2; ++i) {
+    items[i] = i;
+  }
+
+  // It should only add as many as will fit.
+  ASSERT_TRUE(queue_->Enqueue(-1));
+  EXPECT_EQ(static_cast<uint32_t>(kQueueCapacity - 1),
+            queue_->EnqueueBatch(items, kQueueCapacity * 2));
+  EXPECT_EQ(0u, queue_->EnqueueBatch(items, 1));
+
+  int on_queue[kQueueCapacity * 2];
+  EXPECT_EQ(1u, queue_->DequeueBatch(on_queue, 1));
+  EXPECT_EQ(-1, on_queue[0]);
+  EXPECT_EQ(static_cast<uint32_t>(kQueueCapacity - 1),
+            queue_->DequeueBatch(on_queue, kQueueCapacity * 2));
+  for (int i = 0; i < kQueueCapacity - 1; ++i) {
+    EXPECT_EQ(i, on_queue[i]);
+  }
+  EXPECT_EQ(0u, queue_->DequeueBatch(on_queue, 1));
+}
+
+// Test that we can write and read items in place.
+TEST_F(RingQueueTest, ZeroCopyTest) {
+  auto consumer = RingQueue<int>::Load(true, queue_->GetOffset());
+
+  for (int i = 0; i < kQueueCapacity * 3; ++i) {
+    int *space = queue_->Reserve();
+    ASSERT_NE(nullptr, space);
+    // Nothing should be visible until we commit.
+    EXPECT_EQ(nullptr, consumer->ReadView());
+    *space = i;
+    queue_->Commit();
+
+    // Both consumers read the same copy.
+    const int *item = queue_->ReadView();
+    ASSERT_NE(nullptr, item);
+    EXPECT_EQ(item, consumer->ReadView());
+    EXPECT_EQ(i, *item);
+    queue_->Release();
+    consumer->Release();
+  }
+  EXPECT_EQ(nullptr, queue_->ReadView());
+}
+
+// Test that we can fetch ring queues by name.
+TEST_F(RingQueueTest, FetchQueueTest) {
+  auto queue1 = RingQueue<int>::FetchQueue("ring_queue");
+  auto queue2 = RingQueue<int>::FetchProducerQueue("ring_queue");
+  EXPECT_EQ(queue1->GetOffset(), queue2->GetOffset());
+  EXPECT_EQ(1u, queue2->GetNumConsumers());
+
+  ASSERT_TRUE(queue2->Enqueue(42));
+  int on_queue;
+  ASSERT_TRUE(queue1->DequeueNext(&on_queue));
+  EXPECT_EQ(42, on_queue);
+
+  queue1->FreeQueue();
+}
+
+// Test that each item goes to only one consumer in load-balanced mode.
+TEST_F(RingQueueTest, LoadBalancedTest) {
+  auto worker1 = RingQueue<int>::Create(true, kQueueCapacity, true);
+  ASSERT_NE(nullptr, worker1);
+  auto worker2 = RingQueue<int>::Load(true, worker1->GetOffset());
+  auto producer = RingQueue<int>::Load(false, worker1->GetOffset());
+  EXPECT_TRUE(producer->IsLoadBalanced());
+  EXPECT_FALSE(queue_->IsLoadBalanced());
+
+  for (int i = 0; i < 4; ++i) {
+    ASSERT_TRUE(producer->Enqueue(i));
+  }
+
+  // Peeking claims the item, so the other worker can't get it.
+  int on_queue;
+  ASSERT_TRUE(worker1->PeekNext(&on_queue));
+  EXPECT_EQ(0, on_queue);
+  ASSERT_TRUE(worker2->DequeueNext(&on_queue));
+  EXPECT_EQ(1, on_queue);
+  ASSERT_TRUE(worker1->DequeueNext(&on_queue));
+  EXPECT_EQ(0, on_queue);
+
+  int items[4];
+  ASSERT_EQ(2u, worker1->DequeueBatch(items, 4));
+  EXPECT_EQ(2, items[0]);
+  EXPECT_EQ(3, items[1]);
+  EXPECT_FALSE(worker2->DequeueNext(&on_queue));
+
+  // A worker that isn't reading anything doesn't hold producers back.
+  for (int i = 0; i < kQueueCapacity * 3; ++i) {
+    ASSERT_TRUE(producer->Enqueue(i));
+    ASSERT_TRUE(worker1->DequeueNext(&on_queue));
+    EXPECT_EQ(i, on_queue);
+  }
+
+  // Items that nobody has claimed are still there for the next worker.
+  ASSERT_TRUE(producer->Enqueue(42));
+  worker1.reset();
+  worker2.reset();
+  EXPECT_FALSE(producer->Enqueue(43));
+  auto worker3 = RingQueue<int>::Load(true, producer->GetOffset());
+  ASSERT_TRUE(worker3->DequeueNext(&on_queue));
+  EXPECT_EQ(42, on_queue);
+
+  worker3->FreeQueue();
+}
+
+// Test that we can fetch load-balanced queues by name.
+TEST_F(RingQueueTest, FetchLoadBalancedQueueTest) {
+  auto producer = RingQueue<int>::FetchLoadBalancedProducerQueue("work_queue");
+  auto worker = RingQueue<int>::FetchQueue("work_queue");
+  EXPECT_TRUE(producer->IsLoadBalanced());
+  EXPECT_TRUE(worker->IsLoadBalanced());
+
+  ASSERT_TRUE(producer->Enqueue(42));
+  int on_queue;
+  ASSERT_TRUE(worker->DequeueNext(&on_queue));
+  EXPECT_EQ(42, on_queue);
+
+  worker->FreeQueue();
+}
+
+// Test that every group gets every item, and that each item only goes to one
+// member of a group.
+TEST_F(RingQueueTest, ConsumerGroupTest) {
+  auto logger = RingQueue<int>::LoadGroupConsumer(1, queue_->GetOffset());
+  auto worker1 = RingQueue<int>::LoadGroupConsumer(2, queue_->GetOffset());
+  auto worker2 = RingQueue<int>::LoadGroupConsumer(2, queue_->GetOffset());
+  EXPECT_EQ(4u, queue_->GetNumConsumers());
+
+  for (int i = 0; i < 4; ++i) {
+    ASSERT_TRUE(queue_->Enqueue(i));
+  }
+
+  // Broadcast consumers and single-member groups see everything.
+  int on_queue;
+  for (int i = 0; i < 4; ++i) {
+    ASSERT_TRUE(queue_->DequeueNext(&on_queue));
+    EXPECT_EQ(i, on_queue);
+    ASSERT_TRUE(logger->DequeueNext(&on_queue));
+    EXPECT_EQ(i, on_queue);
+  }
+
+  // The workers split everything between them.
+  int items[4];
+  ASSERT_EQ(2u, worker1->DequeueBatch(items, 2));
+  EXPECT_EQ(0, items[0]);
+  EXPECT_EQ(1, items[1]);
+  ASSERT_EQ(2u, worker2->DequeueBatch(items, 4));
+  EXPECT_EQ(2, items[0]);
+  EXPECT_EQ(3, items[1]);
+  EXPECT_FALSE(worker1->DequeueNext(&on_queue));
+
+  // A group that isn't reading holds producers back, until it goes away.
+  for (int i = 0; i < kQueueCapacity; ++i) {
+    ASSERT_TRUE(queue_->Enqueue(i));
+    ASSERT_TRUE(queue_->DequeueNext(&on_queue));
+    ASSERT_TRUE(logger->DequeueNext(&on_queue));
+  }
+  EXPECT_FALSE(queue_->Enqueue(kQueueCapacity));
+  worker1.reset();
+  EXPECT_FALSE(queue_->Enqueue(kQueueCapacity));
+  worker2.reset();
+  EXPECT_TRUE(queue_->Enqueue(kQueueCapacity));
+
+  // A group that is created again starts from the current head.
+  auto worker3 = RingQueue<int>::LoadGroupConsumer(2, queue_->GetOffset());
+  ASSERT_TRUE(queue_->Enqueue(42));
+  ASSERT_TRUE(worker3->DequeueNext(&on_queue));
+  EXPECT_EQ(42, on_queue);
+}
+
+// Test that a broadcast consumer that takes over a group member's cursor slot
+// doesn't miss anything while producers are writing.
+TEST_F(RingQueueTest, CursorReuseTest) {
+  const uintptr_t offset = queue_->GetOffset();
+  queue_.reset();
+
+  ::std::atomic<bool> done(false);
+  ::std::thread producer_thread([&]() {
+    auto producer = RingQueue<int>::Load(false, offset);
+    int next = 0;
+    while (!done.load()) {
+      if (producer->Enqueue(next)) {
+        ++next;
+      }
+    }
+  });
+
+  bool in_order = true;
+  for (int i = 0; i < 200 && in_order; ++i) {
+    // The worker leaves its cursor idle when it goes away.
+    RingQueue<int>::LoadGroupConsumer(1, offset).reset();
+
+    auto consumer = RingQueue<int>::Load(true, offset);
+    int last, on_queue;
+    while (!consumer->DequeueNext(&last))
+      ;
+    for (int j = 0; j < 10 && in_order; ++j) {
+      while (!consumer->DequeueNext(&on_queue))
+        ;
+      in_order = on_queue == last + 1;
+      last = on_queue;
+    }
+  }
+
+  done.store(true);
+  producer_thread.join();
+  EXPECT_TRUE(in_order);
+  queue_ = RingQueue<int>::Load(false, offset);
+}
+
+// Test that we can fetch queues by name as part of a group.
+TEST_F(RingQueueTest, FetchGroupQueueTest) {
+  auto worker1 = RingQueue<int>::FetchGroupQueue("group_queue", 1);
+  auto worker2 = RingQueue<int>::FetchGroupQueue("group_queue", 1);
+  auto producer = RingQueue<int>::FetchProducerQueue("group_queue");
+  EXPECT_EQ(2u, producer->GetNumConsumers());
+
+  ASSERT_TRUE(producer->Enqueue(1));
+  ASSERT_TRUE(producer->Enqueue(2));
+  int on_queue;
+  ASSERT_TRUE(worker2->DequeueNext(&on_queue));
+  EXPECT_EQ(1, on_queue);
+  ASSERT_TRUE(worker1->DequeueNext(&on_queue));
+  EXPECT_EQ(2, on_queue);
+
+  worker1->FreeQueue();
+}
+
+// Test that it works with multiple producers and consumers.
+TEST_F(RingQueueTest, MpmcTest) { RunThreads(3, 2, false); }
+
+// Same as above, but with blocking operations.
+TEST_F(RingQueueTest, MpmcBlockingTest) { RunThreads(3, 2, true); }
+
+// Test that load-balanced mode works with multiple producers and workers.
+TEST_F(RingQueueTest, WorkQueueTest) { RunWorkers(3, 3, false); }
+
+// Same as above, but with blocking operations.
+TEST_F(RingQueueTest, WorkQueueBlockingTest) { RunWorkers(3, 3, true); }
+
+// Test that consumer groups work with multiple producers and workers.
+TEST_F(RingQueueTest, ConsumerGroupThreadTest) { RunWorkers(2, 2, false, 2); }
+
+// Same as above, but with blocking operations.
+TEST_F(RingQueueTest, ConsumerGroupBlockingTest) {
+  RunWorkers(2, 2, true, 2);
+}
+
+}  // namespace testing
+}  // namespace tachyon
@@ -0,0 +1,105 @@
+#ifndef TACHYON_LIB_SHARED_ALLOCATOR_H_
+#define TACHYON_LIB_SHARED_ALLOCATOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <limits>
+#include <new>
+#include <vector>
+
+#include "offset_ptr.h"
+#include "pool.h"
+
+namespace tachyon {
+
+// An STL-compatible allocator that gets its memory from the shared memory
+// pool. Because it hands out OffsetPtrs instead of raw pointers, containers
+// that use it can themselves be placed in shared memory, and then used from
+// any process that has the pool mapped.
+//
+// For instance, to share a lookup table between processes:
+//  Pool *pool = Pool::GetPool();
+//  SharedVector<int> *table = new (pool->AllocateForType<SharedVector<int>>())
+//      SharedVector<int>();
+//  table->push_back(42);
+//  // Other processes can now find the table with
+//  // pool->AtOffset<SharedVector<int>>(pool->GetOffset(table)).
+//
+// The allocator itself has no state, since there is only ever one pool per
+// process, so any two instances are interchangeable. This is also important
+// because the allocator gets embedded in the container, which might be in
+// shared memory, so it can't hold any process-local pointers.
+//
+// NOTE: Elements stored in these containers are subject to the same rules as
+// anything sent through a Queue. Don't store raw pointers or anything that
+// allocates from the normal heap. (Nested shared containers are fine.)
+template <class T>
+class SharedAllocator {
+ public:
+  typedef T value_type;
+  typedef OffsetPtr<T> pointer;
+  typedef OffsetPtr<const T> const_pointer;
+  typedef OffsetPtr<void> void_pointer;
+  typedef OffsetPtr<const void> const_void_pointer;
+  typedef size_t size_type;
+  typedef ptrdiff_t difference_type;
+
+  template <class U>
+  struct rebind {
+    typedef SharedAllocator<U> other;
+  };
+
+  SharedAllocator() = default;
+  template <class U>
+  SharedAllocator(const SharedAllocator<U> &) {}
+
+  // Allocates space for a number of objects from the pool.
+  // Args:
+  //  length: The number of objects to allocate space for.
+  // Returns:
+  //  A pointer to the allocated space. If there is not enough shared memory
+  //  left, it throws std::bad_alloc, as required by the standard library.
+  pointer allocate(size_type length) {
+    if (length > max_size()) {
+      throw ::std::bad_alloc();
+    }
+    T *raw = Pool::GetPool()->AllocateForArray<T>(length);
+    if (!raw) {
+      throw ::std::bad_alloc();
+    }
+    return pointer(raw);
+  }
+  // Returns space to the pool.
+  // Args:
+  //  block: The block to free, as returned by allocate().
+  //  length: The same length that was passed to allocate().
+  void deallocate(pointer block, size_type length) {
+    Pool::GetPool()->FreeArray<T>(block.get(), length);
+  }
+
+  // Returns:
+  //  The largest number of objects that could possibly be allocated at once.
+  size_type max_size() const {
+    return ::std::numeric_limits<int32_t>::max() / sizeof(T);
+  }
+};
+
+template <class T, class U>
+bool operator==(const SharedAllocator<T> &, const SharedAllocator<U> &) {
+  return true;
+}
+template <class T, class U>
+bool operator!=(const SharedAllocator<T> &, const SharedAllocator<U> &) {
+  return false;
+}
+
+// Convenience alias for a vector that lives in shared memory. (Note that this
+// doesn't work for std::basic_string, because libstdc++ doesn't support fancy
+// pointers there. Use SharedString instead.)
+template <class T>
+using SharedVector = ::std::vector<T, SharedAllocator<T>>;
+
+}  // namespace tachyon
+
+#endif  // TACHYON_LIB_SHARED_ALLOCATOR_H_
@@ -0,0 +1,243 @@
+#include <stdint.h>
+
+#include <new>
+
+#include "gtest/gtest.h"
+
+#include "offset_ptr.h"
+#include "pool.h"
+#include "shared_allocator.h"
+#include "shared_flat_map.h"
+#include "shared_string.h"
+
+namespace tachyon {
+namespace testing {
+
+// Test fixture for testing SharedAllocator and the things built on top of it.
+class SharedAllocatorTest : public ::testing::Test {
+ protected:
+  SharedAllocatorTest() : pool_(Pool::GetPool()) {}
+
+  virtual void SetUp() {
+    // Clear the pool in between, so tests don't affect each-other.
+    pool_->Clear();
+  }
+
+  static void TearDownTestCase() {
+    // Unlink SHM.
+    ASSERT_TRUE(Pool::Unlink());
+  }
+
+  // Checks whether a pointer points into the pool.
+  // Args:
+  //  pointer: The pointer to check.
+  // Returns:
+  //  True if the pointer is inside the pool.
+  bool InPool(const void *pointer) {
+    return pool_->GetOffset(pointer) <
+           static_cast<uintptr_t>(pool_->get_size());
+  }
+
+  // Constructs an object of a particular type in the pool.
+  // Returns:
+  //  The constructed object.
+  template <class T>
+  T *MakeShared() {
+    T *raw = pool_->AllocateForType<T>();
+    EXPECT_NE(nullptr, raw);
+    return new (raw) T();
+  }
+
+  // Pool instance to use for testing.
+  Pool *pool_;
+};
+
+// Make sure that OffsetPtr behaves like a normal pointer.
+TEST_F(SharedAllocatorTest, OffsetPtrTest) {
+  // It can only point to things in the pool.
+  int *array = pool_->AllocateForArray<int>(4);
+  ASSERT_NE(nullptr, array);
+  for (int i = 0; i < 4; ++i) {
+    array[i] = i;
+  }
+
+  OffsetPtr<int> pointer(array);
+  EXPECT_EQ(array, pointer.get());
+  EXPECT_EQ(0, *pointer);
+  EXPECT_EQ(2, pointer[2]);
+
+  ++pointer;
+  EXPECT_EQ(1, *pointer);
+  pointer += 2;
+  EXPECT_EQ(3, *pointer);
+  EXPECT_EQ(3, pointer - OffsetPtr<int>(array));
+
+  // Copies should point at the same thing.
+  OffsetPtr<int> copy(pointer);
+  EXPECT_EQ(pointer, copy);
+  EXPECT_EQ(array + 3, copy.get());
+
+  // Check null pointers.
+  OffsetPtr<int> null;
+  EXPECT_FALSE(null);
+  EXPECT_EQ(nullptr, null.get());
+  EXPECT_TRUE(null == nullptr);
+  EXPECT_TRUE(pointer != nullptr);
+
+  pool_->FreeArray(array, 4);
+}
+
+// Make sure we can use a vector that lives in the pool.
+TEST_F(SharedAllocatorTest, VectorTest) {
+  SharedVector<int> *vector = MakeShared<SharedVector<int>>();
+
+  for (int i = 0; i < 1000; ++i) {
+    vector->push_back(i);
+  }
+
+  // Both the vector and its contents should be in SHM.
+  EXPECT_TRUE(InPool(vector));
+  EXPECT_TRUE(InPool(vector->data()));
+
+  // If we find it again by offset, like another process would, it should still
+  // work.
+  auto *found = pool_->AtOffset<SharedVector<int>>(pool_->GetOffset(vector));
+  ASSERT_EQ(1000u, found->size());
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_EQ(i, (*found)[i]);
+  }
+
+  vector->~SharedVector<int>();
+  pool_->FreeType(vector);
+}
+
+// Make sure that the allocator returns memory to the pool.
+TEST_F(SharedAllocatorTest, FreeTest) {
+  SharedVector<int> *vector = MakeShared<SharedVector<int>>();
+  vector->resize(100);
+  const uintptr_t data_offset = pool_->GetOffset(vector->data());
+  EXPECT_TRUE(pool_->IsMemoryUsed(data_offset));
+
+  // Destroying it should free the storage.
+  vector->~SharedVector<int>();
+  EXPECT_FALSE(pool_->IsMemoryUsed(data_offset));
+
+  pool_->FreeType(vector);
+}
+
+// Make sure we get an exception when the pool runs out of memory.
+TEST_F(SharedAllocatorTest, OutOfMemoryTest) {
+  SharedVector<uint8_t> vector;
+  EXPECT_THROW(vector.resize(pool_->get_size() * 2), ::std::bad_alloc);
+}
+
+// Make sure we can use strings that live in the pool.
+TEST_F(SharedAllocatorTest, StringTest) {
+  SharedString *string = MakeShared<SharedString>();
+
+  // Try a short one first.
+  *string = "correct";
+  EXPECT_STREQ("correct", string->c_str());
+
+  // Now, try one that won't fit in the small string buffer.
+  string->Append(" horse battery staple");
+  EXPECT_STREQ("correct horse battery staple", string->c_str());
+  EXPECT_EQ(28u, string->size());
+  EXPECT_TRUE(InPool(string->c_str()));
+
+  // Copying it should work too.
+  SharedString copy = *string;
+  EXPECT_TRUE(copy == *string);
+  EXPECT_TRUE(copy == "correct horse battery staple");
+  EXPECT_EQ("correct horse battery staple", copy.ToString());
+
+  string->~SharedString();
+  pool_->FreeType(string);
+}
+
+// Make sure we can nest shared containers.
+TEST_F(SharedAllocatorTest, NestedTest) {
+  SharedVector<SharedString> *vector =
+      MakeShared<SharedVector<SharedString>>();
+
+  for (int i = 0; i < 20; ++i) {
+    vector->emplace_back(40, 'a' + i);
+  }
+
+  for (int i = 0; i < 20; ++i) {
+    EXPECT_TRUE(SharedString(40, 'a' + i) == (*vector)[i]);
+    EXPECT_TRUE(InPool((*vector)[i].c_str()));
+  }
+
+  vector->~SharedVector<SharedString>();
+  pool_->FreeType(vector);
+}
+
+// Make sure we can add and find items in a SharedFlatMap.
+TEST_F(SharedAllocatorTest, FlatMapTest) {
+  typedef SharedFlatMap<int, double> Map;
+  Map *map = MakeShared<Map>();
+
+  // Add stuff out of order.
+  for (int i = 99; i >= 0; --i) {
+    map->AddOrSet(i * 2, i / 2.0);
+  }
+  EXPECT_EQ(100u, map->GetSize());
+
+  double value;
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_TRUE(map->Fetch(i * 2, &value));
+    EXPECT_EQ(i / 2.0, value);
+    // Odd keys don't exist.
+    EXPECT_FALSE(map->Fetch(i * 2 + 1, &value));
+  }
+
+  // It should iterate in order.
+  int last_key = -1;
+  for (const auto &entry : *map) {
+    EXPECT_LT(last_key, entry.first);
+    last_key = entry.first;
+  }
+
+  // Try changing and removing things.
+  map->AddOrSet(4, 42.0);
+  ASSERT_NE(nullptr, map->Find(4));
+  EXPECT_EQ(42.0, *map->Find(4));
+  EXPECT_EQ(100u, map->GetSize());
+
+  EXPECT_TRUE(map->Remove(4));
+  EXPECT_FALSE(map->Remove(4));
+  EXPECT_EQ(nullptr, map->Find(4));
+  EXPECT_EQ(99u, map->GetSize());
+
+  map->Clear();
+  EXPECT_EQ(0u, map->GetSize());
+
+  map->~Map();
+  pool_->FreeType(map);
+}
+
+// Make sure we can use strings as keys in a SharedFlatMap.
+TEST_F(SharedAllocatorTest, StringFlatMapTest) {
+  typedef SharedFlatMap<SharedString, int> Map;
+  Map *map = MakeShared<Map>();
+
+  map->AddOrSet("correct", 0);
+  map->AddOrSet("horse", 1);
+  map->AddOrSet("battery", 2);
+
+  int result;
+  ASSERT_TRUE(map->Fetch("correct", &result));
+  EXPECT_EQ(0, result);
+  ASSERT_TRUE(map->Fetch("horse", &result));
+  EXPECT_EQ(1, result);
+  ASSERT_TRUE(map->Fetch("battery", &result));
+  EXPECT_EQ(2, result);
+  EXPECT_FALSE(map->Fetch("staple", &result));
+
+  map->~Map();
+  pool_->FreeType(map);
+}
+
+}  // namespace testing
+}  // namespace tachyon
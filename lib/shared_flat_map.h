@@ -0,0 +1,96 @@
+#ifndef TACHYON_LIB_SHARED_FLAT_MAP_H_
+#define TACHYON_LIB_SHARED_FLAT_MAP_H_
+
+#include <stdint.h>
+
+#include <functional>
+#include <utility>
+
+#include "shared_allocator.h"
+
+namespace tachyon {
+
+// An ordered map that is stored as a sorted array in shared memory. Unlike
+// SharedHashmap, the whole map, including the object itself, can be placed in
+// the pool, so a large lookup table can be built once and then read in place by
+// every process that needs it, without making any copies.
+//
+// Lookups are O(log n), and since everything is contiguous, they are very cache
+// friendly. Insertions and removals are O(n), so this is best suited to tables
+// that are built once and then mostly read.
+//
+// NOTE: This class does no locking of its own. If it is going to be modified
+// while other threads or processes are reading it, the user must provide
+// synchronization. Also, keys and values are subject to the same restrictions
+// as the elements of a SharedVector.
+template <class KeyType, class ValueType,
+          class Compare = ::std::less<KeyType>>
+class SharedFlatMap {
+ public:
+  typedef ::std::pair<KeyType, ValueType> Entry;
+  typedef typename SharedVector<Entry>::const_iterator ConstIterator;
+
+  // Add a new item to the map, or modify an existing item.
+  // Args:
+  //  key: The key of the item to add.
+  //  value: The value of the item to add.
+  void AddOrSet(const KeyType &key, const ValueType &value);
+
+  // Gets the current value of an item in the map.
+  // Args:
+  //  key: The key of the item to fetch.
+  //  value: Will be set to the fetched value.
+  // Returns:
+  //  True if the item exists, false otherwise.
+  bool Fetch(const KeyType &key, ValueType *value) const;
+  // Gets a pointer to the value of an item in the map, so it can be read in
+  // place.
+  // Args:
+  //  key: The key of the item to find.
+  // Returns:
+  //  A pointer to the value, or nullptr if the item does not exist. The pointer
+  //  is invalidated by any modification of the map.
+  const ValueType *Find(const KeyType &key) const;
+
+  // Removes an item from the map.
+  // Args:
+  //  key: The key of the item to remove.
+  // Returns:
+  //  True if the item was removed, false if it did not exist.
+  bool Remove(const KeyType &key);
+
+  // Reserves space for a number of items ahead of time, so that building a
+  // large table doesn't have to reallocate repeatedly.
+  // Args:
+  //  num_items: The number of items to reserve space for.
+  void Reserve(uint32_t num_items);
+
+  // Removes all the items from the map, and returns the underlying storage to
+  // the pool.
+  void Clear();
+
+  // Returns:
+  //  The number of items in the map.
+  uint32_t GetSize() const;
+
+  // Iterators over the items in the map, in key order.
+  ConstIterator begin() const;
+  ConstIterator end() const;
+
+ private:
+  // Finds the first entry whose key is not less than a given key.
+  // Args:
+  //  key: The key to search for.
+  // Returns:
+  //  The index of the entry.
+  uint32_t LowerBound(const KeyType &key) const;
+
+  // The sorted array of all our entries.
+  SharedVector<Entry> entries_;
+};
+
+#include "shared_flat_map_impl.h"
+
+}  // namespace tachyon
+
+#endif  // TACHYON_LIB_SHARED_FLAT_MAP_H_
@@ -0,0 +1,99 @@
+// NOTE: This file is not meant to be #included directly. Use shared_flat_map.h
+// instead.
+
+template <class KeyType, class ValueType, class Compare>
+uint32_t SharedFlatMap<KeyType, ValueType, Compare>::LowerBound(
+    const KeyType &key) const {
+  // Standard binary search. We do it with indices instead of iterators,
+  // because indices stay valid regardless of where the pool is mapped.
+  uint32_t low = 0;
+  uint32_t high = entries_.size();
+  while (low < high) {
+    const uint32_t middle = low + ((high - low) >> 1);
+    if (Compare()(entries_[middle].first, key)) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  return low;
+}
+
+template <class KeyType, class ValueType, class Compare>
+void SharedFlatMap<KeyType, ValueType, Compare>::AddOrSet(
+    const KeyType &key, const ValueType &value) {
+  const uint32_t index = LowerBound(key);
+  if (index < entries_.size() && !Compare()(key, entries_[index].first)) {
+    // It already exists, so we just have to modify it.
+    entries_[index].second = value;
+    return;
+  }
+
+  // Otherwise, insert it in order.
+  entries_.insert(entries_.begin() + index, Entry(key, value));
+}
+
+template <class KeyType, class ValueType, class Compare>
+bool SharedFlatMap<KeyType, ValueType, Compare>::Fetch(const KeyType &key,
+                                                       ValueType *value) const {
+  const ValueType *found = Find(key);
+  if (!found) {
+    return false;
+  }
+
+  *value = *found;
+  return true;
+}
+
+template <class KeyType, class ValueType, class Compare>
+const ValueType *SharedFlatMap<KeyType, ValueType, Compare>::Find(
+    const KeyType &key) const {
+  const uint32_t index = LowerBound(key);
+  if (index >= entries_.size() || Compare()(key, entries_[index].first)) {
+    // It's not there.
+    return nullptr;
+  }
+
+  return &(entries_[index].second);
+}
+
+template <class KeyType, class ValueType, class Compare>
+bool SharedFlatMap<KeyType, ValueType, Compare>::Remove(const KeyType &key) {
+  const uint32_t index = LowerBound(key);
+  if (index >= entries_.size() || Compare()(key, entries_[index].first)) {
+    return false;
+  }
+
+  entries_.erase(entries_.begin() + index);
+  return true;
+}
+
+template <class KeyType, class ValueType, class Compare>
+void SharedFlatMap<KeyType, ValueType, Compare>::Reserve(uint32_t num_items) {
+  entries_.reserve(num_items);
+}
+
+template <class KeyType, class ValueType, class Compare>
+void SharedFlatMap<KeyType, ValueType, Compare>::Clear() {
+  // Swapping with an empty vector is the only way to guarantee that the storage
+  // actually gets freed.
+  SharedVector<Entry>().swap(entries_);
+}
+
+template <class KeyType, class ValueType, class Compare>
+uint32_t SharedFlatMap<KeyType, ValueType, Compare>::GetSize() const {
+  return entries_.size();
+}
+
+template <class KeyType, class ValueType, class Compare>
+typename SharedFlatMap<KeyType, ValueType, Compare>::ConstIterator
+SharedFlatMap<KeyType, ValueType, Compare>::begin() const {
+  return entries_.begin();
+}
+
+template <class KeyType, class ValueType, class Compare>
+typename SharedFlatMap<KeyType, ValueType, Compare>::ConstIterator
+SharedFlatMap<KeyType, ValueType, Compare>::end() const {
+  return entries_.end();
+}
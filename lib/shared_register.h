@@ -0,0 +1,126 @@
+#ifndef TACHYON_LIB_SHARED_REGISTER_H_
+#define TACHYON_LIB_SHARED_REGISTER_H_
+
+#include <assert.h>
+#include <stdint.h>
+
+#include <memory>
+#include <type_traits>
+
+#include "atomics.h"
+#include "constants.h"
+#include "mpsc_queue_internal.h"
+#include "pool.h"
+#include "shared_hashmap.h"
+
+namespace tachyon {
+
+// A single value in shared memory that any number of processes can read, for
+// state where only the latest value matters, like a robot's pose. Unlike a
+// Queue, readers don't need anything of their own, so it costs the same with
+// one reader as with a hundred, and the value is only ever written once.
+//
+// It is implemented as a seqlock: the writer makes a sequence number odd while
+// it is writing, and even again when it is done. Readers just copy the value,
+// and then check that the sequence number is the same even number that it was
+// when they started. If it isn't, they try again. This means that readers
+// never hold up the writer, and never modify shared memory at all. Writing is
+// wait-free when there is only one writer. Several writers are allowed, but
+// they take turns.
+//
+// Since readers can copy a value that is in the middle of being written (and
+// then throw it away), T has to be trivially copyable.
+template <class T>
+class SharedRegister {
+  static_assert(::std::is_trivially_copyable<T>::value,
+                "SharedRegister can only hold trivially copyable types.");
+
+ public:
+  // Creates a brand-new register, which doesn't have a value yet.
+  // Returns:
+  //  The register it created, or nullptr if creation failed.
+  static ::std::unique_ptr<SharedRegister<T>> Create();
+  // Loads an existing register from SHM.
+  // Args:
+  //  offset: The SHM offset of the register.
+  // Returns:
+  //  The register it loaded.
+  static ::std::unique_ptr<SharedRegister<T>> Load(uintptr_t offset);
+  // Fetches a register with the given name. If the register does not exist, it
+  // creates it. Otherwise, it fetches a new handle to the existing register.
+  // Registers share the same namespace as queues.
+  // Args:
+  //  name: The name of the register to fetch.
+  // Returns:
+  //  The fetched register.
+  static ::std::unique_ptr<SharedRegister<T>> FetchRegister(const char *name);
+
+  // Sets the value of the register.
+  // Args:
+  //  value: The new value.
+  void Write(const T &value);
+  // Gets the current value of the register. It never blocks, but it has to try
+  // again if a writer changes the value while it is being copied.
+  // Args:
+  //  value: A place to copy the value.
+  // Returns:
+  //  True if it got the value, false if nothing has been written yet.
+  bool Read(T *value) const;
+  // Gets the number of times that the register was written. Readers that poll
+  // can use this to find out whether there is a new value before copying it.
+  // Returns:
+  //  The number of writes so far.
+  uint32_t GetVersion() const;
+
+  // Gets the offset of the shared part of the register in the shared memory
+  // pool.
+  // Returns:
+  //  The offset.
+  int GetOffset() const;
+
+  // Frees the underlying shared memory that the register uses. Only call it
+  // when you're sure that this register will no longer be used.
+  void FreeRegister();
+
+ private:
+  // The default constructor is private to force users to use the static
+  // creation methods.
+  SharedRegister();
+
+  // This is the underlying structure that will be located in shared memory.
+  struct RawRegister {
+    // Incremented at the start and at the end of every write, so it is odd
+    // while a write is in progress. Half of it is the number of writes.
+    volatile uint32_t sequence __attribute__((aligned(kCacheLineSize)));
+    // The value itself.
+    volatile T value;
+  };
+
+  // A hashmap that's in charge of mapping names to offsets. This is the same
+  // map that the queues use.
+  static SharedHashmap<const char *, int> queue_names_;
+
+  // Creates a new register.
+  // Returns:
+  //  True if creating the register succeeded, false otherwise.
+  bool DoCreate();
+  // Loads an existing register.
+  // Args:
+  //  offset: The offset of the shared portion of the register in SHM.
+  void DoLoad(uintptr_t offset);
+
+  RawRegister *register_;
+  // This is the shared memory pool that we will use to construct registers.
+  Pool *pool_;
+};
+
+// Initialize the queue_names_ member.
+template <class T>
+SharedHashmap<const char *, int> SharedRegister<T>::queue_names_(
+    kNameMapOffset, kNameMapSize);
+
+#include "shared_register_impl.h"
+
+}  // namespace tachyon
+
+#endif  // TACHYON_LIB_SHARED_REGISTER_H_
@@ -0,0 +1,134 @@
+// NOTE: This file is not meant to be #included directly. Use shared_register.h
+// instead.
+
+template <class T>
+::std::unique_ptr<SharedRegister<T>> SharedRegister<T>::Create() {
+  // Create a new register object.
+  SharedRegister<T> *raw_register = new SharedRegister<T>();
+  auto shared_register = ::std::unique_ptr<SharedRegister<T>>(raw_register);
+
+  if (!shared_register->DoCreate()) {
+    // Creation failed.
+    shared_register.reset();
+  }
+
+  return shared_register;
+}
+
+template <class T>
+::std::unique_ptr<SharedRegister<T>> SharedRegister<T>::Load(
+    uintptr_t offset) {
+  // Create a new register object.
+  SharedRegister<T> *raw_register = new SharedRegister<T>();
+  auto shared_register = ::std::unique_ptr<SharedRegister<T>>(raw_register);
+
+  shared_register->DoLoad(offset);
+
+  return shared_register;
+}
+
+template <class T>
+::std::unique_ptr<SharedRegister<T>> SharedRegister<T>::FetchRegister(
+    const char *name) {
+  // First, see if a register exists.
+  int offset;
+  if (queue_names_.Fetch(name, &offset)) {
+    // We have a register, so just make a new handle to it.
+    return Load(offset);
+  }
+
+  // Create a new register.
+  auto shared_register = Create();
+  // Save the offset.
+  queue_names_.AddOrSet(name, shared_register->GetOffset());
+
+  return shared_register;
+}
+
+template <class T>
+SharedRegister<T>::SharedRegister() : pool_(Pool::GetPool()) {}
+
+template <class T>
+bool SharedRegister<T>::DoCreate() {
+  // Allocate the shared memory we need.
+  register_ = pool_->AllocateForType<RawRegister>();
+  assert(register_ != nullptr && "Out of shared memory?");
+  if (!register_) {
+    return false;
+  }
+
+  register_->sequence = 0;
+
+  return true;
+}
+
+template <class T>
+void SharedRegister<T>::DoLoad(uintptr_t offset) {
+  // Initialize register with an existing one.
+  register_ = pool_->AtOffset<RawRegister>(offset);
+}
+
+template <class T>
+void SharedRegister<T>::Write(const T &value) {
+  // Make the sequence number odd, which tells readers (and other writers) that
+  // we're writing.
+  uint32_t sequence;
+  do {
+    sequence =
+        AtomicLoad(&(register_->sequence), ::std::memory_order_relaxed);
+  } while ((sequence & 1) ||
+           !CompareExchange(&(register_->sequence), sequence, sequence + 1,
+                            ::std::memory_order_relaxed));
+  // Readers have to see the odd sequence number before they can see any part
+  // of the new value.
+  Fence(::std::memory_order_release);
+
+  mpsc_queue::VolatileCopy(&(register_->value), &value, sizeof(value));
+
+  // The release makes sure that the whole value is visible to readers by the
+  // time that they see the new sequence number.
+  AtomicStore(&(register_->sequence), sequence + 2,
+              ::std::memory_order_release);
+}
+
+template <class T>
+bool SharedRegister<T>::Read(T *value) const {
+  while (true) {
+    // The acquire synchronizes with the release at the end of Write(), so we're
+    // guaranteed to see the whole value if nothing changes while we copy it.
+    const uint32_t sequence =
+        AtomicLoad(&(register_->sequence), ::std::memory_order_acquire);
+    if (!sequence) {
+      // Nothing has been written yet.
+      return false;
+    }
+    if (sequence & 1) {
+      // A write is in progress, so whatever we copy would be garbage.
+      continue;
+    }
+
+    mpsc_queue::ReadItem(value, &(register_->value));
+
+    // The copy has to be done before we check the sequence number again.
+    Fence(::std::memory_order_acquire);
+    if (AtomicLoad(&(register_->sequence), ::std::memory_order_relaxed) ==
+        sequence) {
+      return true;
+    }
+  }
+}
+
+template <class T>
+uint32_t SharedRegister<T>::GetVersion() const {
+  return AtomicLoad(&(register_->sequence), ::std::memory_order_acquire) >> 1;
+}
+
+template <class T>
+int SharedRegister<T>::GetOffset() const {
+  return pool_->GetOffset(register_);
+}
+
+template <class T>
+void SharedRegister<T>::FreeRegister() {
+  pool_->FreeType<RawRegister>(register_);
+}
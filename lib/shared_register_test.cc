@@ -0,0 +1,175 @@
+#include <stdint.h>
+
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "pool.h"
+#include "shared_register.h"
+
+namespace tachyon {
+namespace testing {
+namespace {
+
+// How many values the threaded test writes.
+constexpr int kNumWrites = 20000;
+
+// A value that is too big to be written atomically, so that readers can catch
+// the writer in the middle of writing it.
+struct BigValue {
+  // Every word is always set to the same thing.
+  int words[32];
+};
+
+// Writes an increasing sequence of values to a register.
+// Args:
+//  offset: The SHM offset of the register to use.
+void WriterThread(int offset) {
+  auto shared_register = SharedRegister<BigValue>::Load(offset);
+
+  BigValue value;
+  for (int i = 1; i <= kNumWrites; ++i) {
+    for (int &word : value.words) {
+      word = i;
+    }
+    shared_register->Write(value);
+  }
+}
+
+// Reads a register until it sees the last value that WriterThread() writes.
+// Args:
+//  offset: The SHM offset of the register to use.
+// Returns:
+//  True if every value that it read was complete, and the values never went
+//  backwards.
+bool ReaderThread(int offset) {
+  auto shared_register = SharedRegister<BigValue>::Load(offset);
+
+  int last = 0;
+  while (last != kNumWrites) {
+    BigValue value;
+    if (!shared_register->Read(&value)) {
+      ::std::this_thread::yield();
+      continue;
+    }
+
+    for (int word : value.words) {
+      if (word != value.words[0]) {
+        return false;
+      }
+    }
+    if (value.words[0] < last) {
+      return false;
+    }
+    last = value.words[0];
+    ::std::this_thread::yield();
+  }
+
+  return true;
+}
+
+}  // namespace
+
+// Tests for the shared register.
+class SharedRegisterTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    register_ = SharedRegister<int>::Create();
+    ASSERT_NE(nullptr, register_);
+  }
+
+  virtual void TearDown() {
+    // Free register SHM.
+    register_->FreeRegister();
+  }
+
+  static void TearDownTestCase() {
+    // Unlink SHM.
+    ASSERT_TRUE(Pool::Unlink());
+  }
+
+  // The register we are testing with.
+  ::std::unique_ptr<SharedRegister<int>> register_;
+};
+
+// Test that we can write and read values.
+TEST_F(SharedRegisterTest, ReadWriteTest) {
+  // There's nothing to read at first.
+  int value;
+  EXPECT_FALSE(register_->Read(&value));
+  EXPECT_EQ(0u, register_->GetVersion());
+
+  for (int i = 0; i < 10; ++i) {
+    register_->Write(i);
+    ASSERT_TRUE(register_->Read(&value));
+    EXPECT_EQ(i, value);
+    EXPECT_EQ(static_cast<uint32_t>(i + 1), register_->GetVersion());
+  }
+
+  // Reading shouldn't change anything.
+  ASSERT_TRUE(register_->Read(&value));
+  EXPECT_EQ(9, value);
+  EXPECT_EQ(10u, register_->GetVersion());
+}
+
+// Test that separate handles see the same value.
+TEST_F(SharedRegisterTest, LoadTest) {
+  auto writer = SharedRegister<int>::Load(register_->GetOffset());
+  auto reader = SharedRegister<int>::Load(register_->GetOffset());
+
+  writer->Write(42);
+  int value;
+  ASSERT_TRUE(reader->Read(&value));
+  EXPECT_EQ(42, value);
+  ASSERT_TRUE(register_->Read(&value));
+  EXPECT_EQ(42, value);
+
+  // Any of them can write.
+  reader->Write(43);
+  ASSERT_TRUE(writer->Read(&value));
+  EXPECT_EQ(43, value);
+}
+
+// Test that fetching registers by name works.
+TEST_F(SharedRegisterTest, FetchRegisterTest) {
+  auto register1 = SharedRegister<int>::FetchRegister("test_register");
+  auto register2 = SharedRegister<int>::FetchRegister("test_register");
+  EXPECT_EQ(register1->GetOffset(), register2->GetOffset());
+
+  register1->Write(42);
+  int value;
+  ASSERT_TRUE(register2->Read(&value));
+  EXPECT_EQ(42, value);
+
+  // A different name should get a different register.
+  auto register3 = SharedRegister<int>::FetchRegister("other_register");
+  EXPECT_NE(register1->GetOffset(), register3->GetOffset());
+  EXPECT_FALSE(register3->Read(&value));
+
+  register1->FreeRegister();
+  register3->FreeRegister();
+}
+
+// Test that readers never see a partially written value.
+TEST_F(SharedRegisterTest, ThreadTest) {
+  auto shared_register = SharedRegister<BigValue>::Create();
+  ASSERT_NE(nullptr, shared_register);
+  const int offset = shared_register->GetOffset();
+
+  ::std::thread writer(WriterThread, offset);
+  bool reader_ok[2];
+  ::std::thread reader1([&]() { reader_ok[0] = ReaderThread(offset); });
+  ::std::thread reader2([&]() { reader_ok[1] = ReaderThread(offset); });
+
+  writer.join();
+  reader1.join();
+  reader2.join();
+  EXPECT_TRUE(reader_ok[0]);
+  EXPECT_TRUE(reader_ok[1]);
+  EXPECT_EQ(static_cast<uint32_t>(kNumWrites), shared_register->GetVersion());
+
+  shared_register->FreeRegister();
+}
+
+}  // namespace testing
+}  // namespace tachyon
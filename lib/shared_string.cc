@@ -0,0 +1,77 @@
+#include "shared_string.h"
+
+#include <string.h>
+
+namespace tachyon {
+
+SharedString::SharedString() : chars_(1, '\0') {}
+
+SharedString::SharedString(const char *string) {
+  Assign(string, strlen(string));
+}
+
+SharedString::SharedString(const char *string, uint32_t length) {
+  Assign(string, length);
+}
+
+SharedString::SharedString(uint32_t length, char fill)
+    : chars_(length + 1, fill) {
+  chars_.back() = '\0';
+}
+
+SharedString &SharedString::operator=(const char *string) {
+  Assign(string, strlen(string));
+  return *this;
+}
+
+void SharedString::Assign(const char *string, uint32_t length) {
+  chars_.assign(string, string + length);
+  chars_.push_back('\0');
+}
+
+void SharedString::Append(const char *string, uint32_t length) {
+  // Insert before the null terminator.
+  chars_.insert(chars_.end() - 1, string, string + length);
+}
+
+void SharedString::Append(const char *string) {
+  Append(string, strlen(string));
+}
+
+const char *SharedString::c_str() const {
+  return chars_.data();
+}
+
+uint32_t SharedString::size() const {
+  return chars_.size() - 1;
+}
+
+bool SharedString::empty() const {
+  return size() == 0;
+}
+
+::std::string SharedString::ToString() const {
+  return ::std::string(c_str(), size());
+}
+
+bool SharedString::operator==(const SharedString &other) const {
+  return size() == other.size() && !memcmp(c_str(), other.c_str(), size());
+}
+
+bool SharedString::operator!=(const SharedString &other) const {
+  return !(*this == other);
+}
+
+bool SharedString::operator==(const char *other) const {
+  return !strcmp(c_str(), other);
+}
+
+bool SharedString::operator!=(const char *other) const {
+  return !(*this == other);
+}
+
+bool SharedString::operator<(const SharedString &other) const {
+  return strcmp(c_str(), other.c_str()) < 0;
+}
+
+}  // namespace tachyon
@@ -0,0 +1,76 @@
+#ifndef TACHYON_LIB_SHARED_STRING_H_
+#define TACHYON_LIB_SHARED_STRING_H_
+
+#include <stdint.h>
+
+#include <string>
+
+#include "shared_allocator.h"
+
+namespace tachyon {
+
+// A simple string class whose contents are stored in shared memory. Like all
+// the other shared containers, the string object itself can also be placed in
+// shared memory, and then read from any process.
+//
+// The contents are always null-terminated, so c_str() is cheap.
+class SharedString {
+ public:
+  SharedString();
+  // Args:
+  //  string: A null-terminated string to copy.
+  SharedString(const char *string);
+  // Args:
+  //  string: The characters to copy. They need not be null-terminated.
+  //  length: How many characters to copy.
+  SharedString(const char *string, uint32_t length);
+  // Args:
+  //  length: The length of the string.
+  //  fill: The character to fill the string with.
+  SharedString(uint32_t length, char fill);
+
+  SharedString &operator=(const char *string);
+
+  // Replaces the contents of the string.
+  // Args:
+  //  string: The characters to copy.
+  //  length: How many characters to copy.
+  void Assign(const char *string, uint32_t length);
+  // Adds characters to the end of the string.
+  // Args:
+  //  string: The characters to copy.
+  //  length: How many characters to copy.
+  void Append(const char *string, uint32_t length);
+  // Same as above, but for a null-terminated string.
+  void Append(const char *string);
+
+  // Returns:
+  //  The contents of the string, with a null terminator.
+  const char *c_str() const;
+  // Returns:
+  //  The length of the string, not including the null terminator.
+  uint32_t size() const;
+  // Returns:
+  //  True if the string has no characters in it.
+  bool empty() const;
+
+  // Copies the string into local memory.
+  // Returns:
+  //  A standard string with the same contents.
+  ::std::string ToString() const;
+
+  bool operator==(const SharedString &other) const;
+  bool operator!=(const SharedString &other) const;
+  bool operator==(const char *other) const;
+  bool operator!=(const char *other) const;
+  // Lexicographical ordering, so that these can be used as map keys.
+  bool operator<(const SharedString &other) const;
+
+ private:
+  // The actual characters, including the null terminator.
+  SharedVector<char> chars_;
+};
+
+}  // namespace tachyon
+
+#endif  // TACHYON_LIB_SHARED_STRING_H_
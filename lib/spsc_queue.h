@@ -0,0 +1,190 @@
+#ifndef TACHYON_LIB_SPSC_QUEUE_H_
+#define TACHYON_LIB_SPSC_QUEUE_H_
+
+#include <assert.h>
+#include <stdint.h>
+
+#include <memory>
+
+#include "atomics.h"
+#include "constants.h"
+#include "mpsc_queue_internal.h"
+#include "pool.h"
+
+namespace tachyon {
+
+// SPSC: "Single-producer, single consumer."
+//
+// This is a stripped-down version of MpscQueue for channels that only ever have
+// one producer. Since nobody is competing for either end of the queue, neither
+// side needs any atomic read-modify-write operations at all: the producer owns
+// the head, the consumer owns the tail, and each one just publishes its index
+// with a release store.
+//
+// Each side also keeps a cached copy of the other side's index, and only goes
+// back to shared memory for the real value when the cached one says that the
+// queue is full (or empty). Most of the time, this means that an operation
+// doesn't touch the other side's cache line at all.
+//
+// Like MpscQueue, there can be any number of SpscQueue instances that refer to
+// the same queue, (through Load(),) but only one of them may enqueue, and only
+// one may dequeue. All operations are lock-free and wait-free, and there are no
+// blocking variants.
+template <class T>
+class SpscQueue {
+ public:
+  // Creates a brand-new queue.
+  // Args:
+  //  size: The number of elements that the queue should be able to hold. Must
+  //        be a power of 2.
+  // Returns:
+  //  The queue it created, or nullptr if queue creation failed.
+  static ::std::unique_ptr<SpscQueue<T>> Create(uint32_t size);
+  // Loads an existing queue from SHM.
+  // Args:
+  //  offset: The SHM offset of the queue.
+  // Returns:
+  //  The queue it loaded.
+  static ::std::unique_ptr<SpscQueue<T>> Load(uintptr_t offset);
+
+  // Adds a new element to the queue.
+  // Args:
+  //  item: The item to add to the queue.
+  // Returns:
+  //  True if it succeeded in adding the item, false if the queue was full.
+  bool Enqueue(const T &item);
+  // Adds as many elements to the queue as will fit. The consumer sees them all
+  // at once.
+  // Args:
+  //  items: The items to add to the queue.
+  //  num_items: The number of items to add.
+  // Returns:
+  //  The number of items that were actually added. These are always the first
+  //  ones in items.
+  uint32_t EnqueueBatch(const T *items, uint32_t num_items);
+  // Gets the space that the next element will go in, so that it can be built
+  // in place. Nothing is visible to the consumer until Commit() is called, and
+  // it is fine to never call it if the producer changes its mind.
+  // Returns:
+  //  A pointer to the space, or nullptr if the queue is full.
+  T *Reserve();
+  // Adds the element that was built in the space returned by Reserve() to the
+  // queue.
+  // IMPORTANT: The user MUST have successfully reserved a space with Reserve(),
+  // otherwise the behavior of this method is undefined.
+  void Commit();
+
+  // Removes an element from the queue.
+  // Args:
+  //  item: A place to copy the item.
+  // Returns:
+  //  True if it succeeded in getting an item, false if the queue was empty.
+  bool DequeueNext(T *item);
+  // Removes as many elements from the queue as are available, up to a maximum.
+  // Args:
+  //  items: A place to copy the items.
+  //  max_items: The maximum number of items to remove.
+  // Returns:
+  //  The number of items that were actually removed.
+  uint32_t DequeueBatch(T *items, uint32_t max_items);
+  // Gets the next element that would be removed from the queue, but does not
+  // remove it.
+  // Args:
+  //  item: A place to copy the item.
+  // Returns:
+  //  True if it succeeded in reading an item, false if the queue was empty.
+  bool PeekNext(T *item);
+  // Gets the next element without copying it out of the queue. It stays valid
+  // until Release() is called.
+  // Returns:
+  //  A pointer to the element, or nullptr if the queue is empty.
+  const T *ReadView();
+  // Removes the element returned by ReadView() from the queue.
+  // IMPORTANT: The user MUST have gotten an element with ReadView(), otherwise
+  // the behavior of this method is undefined.
+  void Release();
+
+  // Gets the offset of the shared part of the queue in the shared memory pool.
+  // Returns:
+  //  The offset.
+  int GetOffset() const;
+
+  // Frees the underlying shared memory that the queue uses. Only call it when
+  // you're sure that this queue will no longer be used.
+  void FreeQueue();
+
+ private:
+  // The default constructor is private to force users to use the static
+  // creation methods.
+  SpscQueue();
+
+  // This is the underlying structure that will be located in shared memory.
+  struct RawQueue {
+    // Offset of array in the SHM segment.
+    uintptr_t array_offset;
+    // The length of the array.
+    uint32_t array_length;
+
+    // The index of the next element that the producer will write. Like in
+    // MpscQueue, these never wrap. Only the producer writes this.
+    volatile uint64_t head_index __attribute__((aligned(kCacheLineSize)));
+    // The index of the next element that the consumer will read. Only the
+    // consumer writes this.
+    volatile uint64_t tail_index __attribute__((aligned(kCacheLineSize)));
+  };
+
+  // Gets the element that a particular index refers to.
+  // Args:
+  //  index: The index.
+  // Returns:
+  //  The element.
+  volatile T *ItemFor(uint64_t index) const {
+    return array_ + (index & wrapping_mask_);
+  }
+  // Figures out how many elements the producer can write.
+  // Args:
+  //  num_items: How many we'd like to write.
+  // Returns:
+  //  How many we can actually write, which is at most num_items.
+  uint32_t GetFreeSpace(uint32_t num_items);
+  // Figures out how many elements the consumer can read.
+  // Args:
+  //  num_items: How many we'd like to read.
+  // Returns:
+  //  How many we can actually read, which is at most num_items.
+  uint32_t GetAvailable(uint32_t num_items);
+  // Creates a new queue.
+  // Args:
+  //  size: The number of elements that the queue should be able to hold.
+  // Returns:
+  //  True if creating the queue succeeded, false otherwise.
+  bool DoCreate(uint32_t size);
+  // Loads an existing queue.
+  // Args:
+  //  offset: The offset of the shared portion of the queue in SHM.
+  void DoLoad(uintptr_t offset);
+  // Encapsulates initialization that is common to both queue creation and
+  // loading.
+  void InitCommon();
+
+  // Local copies of the head and the tail. Each side keeps its own index
+  // locally, since it is the only one that changes it, and only uses the other
+  // one as a cached copy of the value in shared memory. (Which is always
+  // behind, but that's fine.)
+  uint64_t head_index_;
+  uint64_t tail_index_;
+  // The bitmask to use for wrapping indices.
+  uint64_t wrapping_mask_;
+  // The underlying array, in our address space.
+  volatile T *array_;
+
+  RawQueue *queue_;
+  // This is the shared memory pool that we will use to construct queue objects.
+  Pool *pool_;
+};
+
+#include "spsc_queue_impl.h"
+
+}  // namespace tachyon
+
+#endif  // TACHYON_LIB_SPSC_QUEUE_H_
@@ -0,0 +1,230 @@
+// NOTE: This file is not meant to be #included directly. Use spsc_queue.h
+// instead.
+
+template <class T>
+::std::unique_ptr<SpscQueue<T>> SpscQueue<T>::Create(uint32_t size) {
+  // Create a new queue object.
+  SpscQueue<T> *raw_queue = new SpscQueue<T>();
+  auto queue = ::std::unique_ptr<SpscQueue<T>>(raw_queue);
+
+  if (!queue->DoCreate(size)) {
+    // Creation failed.
+    queue.reset();
+  }
+
+  return queue;
+}
+
+template <class T>
+::std::unique_ptr<SpscQueue<T>> SpscQueue<T>::Load(uintptr_t offset) {
+  // Create a new queue object.
+  SpscQueue<T> *raw_queue = new SpscQueue<T>();
+  auto queue = ::std::unique_ptr<SpscQueue<T>>(raw_queue);
+
+  queue->DoLoad(offset);
+
+  return queue;
+}
+
+template <class T>
+SpscQueue<T>::SpscQueue() : pool_(Pool::GetPool()) {}
+
+template <class T>
+bool SpscQueue<T>::DoCreate(uint32_t size) {
+  uint8_t size_shifts;
+  const bool is_power_2 = mpsc_queue::IntLog2(size, &size_shifts);
+  assert(is_power_2 && "Queue size should be a power of 2.");
+  if (!is_power_2) {
+    return false;
+  }
+
+  // Allocate the shared memory we need.
+  queue_ = pool_->AllocateForType<RawQueue>();
+  assert(queue_ != nullptr && "Out of shared memory?");
+  if (!queue_) {
+    return false;
+  }
+
+  T *array = pool_->AllocateForArray<T>(size);
+  assert(array != nullptr && "Out of shared memory?");
+  if (!array) {
+    pool_->FreeType<RawQueue>(queue_);
+    return false;
+  }
+
+  queue_->array_offset = pool_->GetOffset(array);
+  queue_->array_length = size;
+  queue_->head_index = 0;
+  queue_->tail_index = 0;
+
+  InitCommon();
+
+  return true;
+}
+
+template <class T>
+void SpscQueue<T>::DoLoad(uintptr_t offset) {
+  // Initialize queue with an existing one.
+  queue_ = pool_->AtOffset<RawQueue>(offset);
+
+  InitCommon();
+}
+
+template <class T>
+void SpscQueue<T>::InitCommon() {
+  // Find the array in our address space.
+  array_ = pool_->AtOffset<T>(queue_->array_offset);
+  wrapping_mask_ = queue_->array_length - 1;
+
+  // Whichever side we end up being, we start where the queue currently is.
+  head_index_ =
+      AtomicLoadQuad(&(queue_->head_index), ::std::memory_order_acquire);
+  tail_index_ =
+      AtomicLoadQuad(&(queue_->tail_index), ::std::memory_order_acquire);
+}
+
+template <class T>
+uint32_t SpscQueue<T>::GetFreeSpace(uint32_t num_items) {
+  uint64_t free = wrapping_mask_ + 1 - (head_index_ - tail_index_);
+  if (free < num_items) {
+    // Our cached tail might be out of date, so check the real one. The acquire
+    // synchronizes with the release in the consumer, so that it's guaranteed to
+    // be done reading anything that we're about to overwrite.
+    tail_index_ =
+        AtomicLoadQuad(&(queue_->tail_index), ::std::memory_order_acquire);
+    free = wrapping_mask_ + 1 - (head_index_ - tail_index_);
+  }
+
+  return free < num_items ? free : num_items;
+}
+
+template <class T>
+uint32_t SpscQueue<T>::GetAvailable(uint32_t num_items) {
+  uint64_t available = head_index_ - tail_index_;
+  if (available < num_items) {
+    // Same as above. Here, the acquire guarantees that we see the whole item.
+    head_index_ =
+        AtomicLoadQuad(&(queue_->head_index), ::std::memory_order_acquire);
+    available = head_index_ - tail_index_;
+  }
+
+  return available < num_items ? available : num_items;
+}
+
+template <class T>
+bool SpscQueue<T>::Enqueue(const T &item) {
+  if (!GetFreeSpace(1)) {
+    return false;
+  }
+
+  mpsc_queue::VolatileCopy(ItemFor(head_index_), &item, sizeof(item));
+  Commit();
+
+  return true;
+}
+
+template <class T>
+uint32_t SpscQueue<T>::EnqueueBatch(const T *items, uint32_t num_items) {
+  const uint32_t num_free = GetFreeSpace(num_items);
+  for (uint32_t i = 0; i < num_free; ++i) {
+    mpsc_queue::VolatileCopy(ItemFor(head_index_ + i), items + i, sizeof(T));
+  }
+
+  // We only have to publish the head once for the whole batch.
+  if (num_free) {
+    head_index_ += num_free;
+    AtomicStoreQuad(&(queue_->head_index), head_index_,
+                    ::std::memory_order_release);
+  }
+
+  return num_free;
+}
+
+template <class T>
+T *SpscQueue<T>::Reserve() {
+  if (!GetFreeSpace(1)) {
+    return nullptr;
+  }
+
+  // The consumer won't touch this space until we commit it, so it's safe to
+  // cast away the volatile.
+  return const_cast<T *>(ItemFor(head_index_));
+}
+
+template <class T>
+void SpscQueue<T>::Commit() {
+  // The release makes sure that the item is visible to the consumer by the
+  // time it sees the new head.
+  AtomicStoreQuad(&(queue_->head_index), ++head_index_,
+                  ::std::memory_order_release);
+}
+
+template <class T>
+bool SpscQueue<T>::DequeueNext(T *item) {
+  if (!PeekNext(item)) {
+    return false;
+  }
+  Release();
+
+  return true;
+}
+
+template <class T>
+uint32_t SpscQueue<T>::DequeueBatch(T *items, uint32_t max_items) {
+  const uint32_t num_available = GetAvailable(max_items);
+  for (uint32_t i = 0; i < num_available; ++i) {
+    mpsc_queue::ReadItem(items + i, ItemFor(tail_index_ + i));
+  }
+
+  if (num_available) {
+    tail_index_ += num_available;
+    AtomicStoreQuad(&(queue_->tail_index), tail_index_,
+                    ::std::memory_order_release);
+  }
+
+  return num_available;
+}
+
+template <class T>
+bool SpscQueue<T>::PeekNext(T *item) {
+  if (!GetAvailable(1)) {
+    return false;
+  }
+
+  mpsc_queue::ReadItem(item, ItemFor(tail_index_));
+
+  return true;
+}
+
+template <class T>
+const T *SpscQueue<T>::ReadView() {
+  if (!GetAvailable(1)) {
+    return nullptr;
+  }
+
+  // The producer won't touch this space until we release it, so it's safe to
+  // cast away the volatile.
+  return const_cast<const T *>(ItemFor(tail_index_));
+}
+
+template <class T>
+void SpscQueue<T>::Release() {
+  // The release makes sure that we're done reading the item before the
+  // producer can write over it.
+  AtomicStoreQuad(&(queue_->tail_index), ++tail_index_,
+                  ::std::memory_order_release);
+}
+
+template <class T>
+int SpscQueue<T>::GetOffset() const {
+  return pool_->GetOffset(queue_);
+}
+
+template <class T>
+void SpscQueue<T>::FreeQueue() {
+  // We just do pointer arithmetic with the freed blocks, so it's okay to cast
+  // away the volatile.
+  pool_->FreeArray<T>(const_cast<T *>(array_), queue_->array_length);
+  // Now free the rest of the queue data.
+  pool_->FreeType<RawQueue>(queue_);
+}
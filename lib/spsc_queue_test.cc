@@ -0,0 +1,213 @@
+#include <future>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "constants.h"
+#include "pool.h"
+#include "spsc_queue.h"
+
+namespace tachyon {
+namespace testing {
+namespace {
+
+// How many items the threaded tests send.
+constexpr int kNumItems = 100000;
+
+// A queue producer thread. It loads its own handle to the queue, and sends a
+// sequence of numbers. It yields when the queue is full, so that tests don't
+// take forever on machines without many cores.
+// Args:
+//  offset: The SHM offset of the queue to use.
+void ProducerThread(int offset) {
+  auto queue = SpscQueue<int>::Load(offset);
+
+  for (int i = 0; i < kNumItems; ++i) {
+    while (!queue->Enqueue(i)) {
+      ::std::this_thread::yield();
+    }
+  }
+}
+
+// Same as above, but uses batches.
+void BatchProducerThread(int offset) {
+  auto queue = SpscQueue<int>::Load(offset);
+
+  int items[7];
+  for (int i = 0; i < kNumItems;) {
+    uint32_t num_items = 0;
+    for (; num_items < 7 && i + num_items < kNumItems; ++num_items) {
+      items[num_items] = i + num_items;
+    }
+
+    const uint32_t num_written = queue->EnqueueBatch(items, num_items);
+    if (!num_written) {
+      ::std::this_thread::yield();
+    }
+    i += num_written;
+  }
+}
+
+}  // namespace
+
+// Tests for the queue.
+class SpscQueueTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    // Clear the pool for this process, so that tests don't affect each-other.
+    Pool::GetPool()->Clear();
+
+    queue_ = SpscQueue<int>::Create(kQueueCapacity);
+    ASSERT_NE(nullptr, queue_);
+  }
+
+  static void TearDownTestCase() {
+    // Unlink SHM.
+    ASSERT_TRUE(Pool::Unlink());
+  }
+
+  // The queue we are testing with.
+  ::std::unique_ptr<SpscQueue<int>> queue_;
+};
+
+// Test that we can enqueue items properly.
+TEST_F(SpscQueueTest, EnqueueTest) {
+  // Fill up the entire queue.
+  for (int i = 0; i < kQueueCapacity; ++i) {
+    EXPECT_TRUE(queue_->Enqueue(i));
+  }
+
+  // Now it shouldn't let us do any more.
+  EXPECT_FALSE(queue_->Enqueue(51));
+  EXPECT_EQ(nullptr, queue_->Reserve());
+}
+
+// Test that we can dequeue items properly.
+TEST_F(SpscQueueTest, DequeueTest) {
+  // Put some items on the queue.
+  for (int i = 0; i < 10; ++i) {
+    ASSERT_TRUE(queue_->Enqueue(i));
+  }
+
+  int on_queue;
+  for (int i = 0; i < 10; ++i) {
+    EXPECT_TRUE(queue_->PeekNext(&on_queue));
+    EXPECT_EQ(i, on_queue);
+    EXPECT_TRUE(queue_->DequeueNext(&on_queue));
+    EXPECT_EQ(i, on_queue);
+  }
+
+  // There should be nothing else.
+  EXPECT_FALSE(queue_->DequeueNext(&on_queue));
+  EXPECT_FALSE(queue_->PeekNext(&on_queue));
+}
+
+// Test that separate producer and consumer handles see each-other's updates.
+TEST_F(SpscQueueTest, LoadTest) {
+  auto producer = SpscQueue<int>::Load(queue_->GetOffset());
+  auto consumer = SpscQueue<int>::Load(queue_->GetOffset());
+
+  // Fill it all the way, so that both sides have to refresh their cached
+  // indices.
+  for (int lap = 0; lap < 3; ++lap) {
+    for (int i = 0; i < kQueueCapacity; ++i) {
+      ASSERT_TRUE(producer->Enqueue(i));
+    }
+    EXPECT_FALSE(producer->Enqueue(kQueueCapacity));
+
+    int on_queue;
+    for (int i = 0; i < kQueueCapacity; ++i) {
+      ASSERT_TRUE(consumer->DequeueNext(&on_queue));
+      EXPECT_EQ(i, on_queue);
+    }
+    EXPECT_FALSE(consumer->DequeueNext(&on_queue));
+  }
+
+  // A handle loaded now should start where the queue currently is.
+  auto late_consumer = SpscQueue<int>::Load(queue_->GetOffset());
+  ASSERT_TRUE(producer->Enqueue(42));
+  int on_queue;
+  ASSERT_TRUE(late_consumer->DequeueNext(&on_queue));
+  EXPECT_EQ(42, on_queue);
+}
+
+// Test that batch operations work.
+TEST_F(SpscQueueTest, BatchTest) {
+  int items[kQueueCapacity * 2];
+  for (int i = 0; i < kQueueCapacity * 2; ++i) {
+    items[i] = i;
+  }
+
+  // It should only add as many as will fit.
+  ASSERT_TRUE(queue_->Enqueue(-1));
+  EXPECT_EQ(static_cast<uint32_t>(kQueueCapacity - 1),
+            queue_->EnqueueBatch(items, kQueueCapacity * 2));
+  EXPECT_EQ(0u, queue_->EnqueueBatch(items, 1));
+
+  int on_queue[kQueueCapacity * 2];
+  EXPECT_EQ(1u, queue_->DequeueBatch(on_queue, 1));
+  EXPECT_EQ(-1, on_queue[0]);
+  EXPECT_EQ(static_cast<uint32_t>(kQueueCapacity - 1),
+            queue_->DequeueBatch(on_queue, kQueueCapacity * 2));
+  for (int i = 0; i < kQueueCapacity - 1; ++i) {
+    EXPECT_EQ(i, on_queue[i]);
+  }
+  EXPECT_EQ(0u, queue_->DequeueBatch(on_queue, 1));
+}
+
+// Test that we can write and read items in place.
+TEST_F(SpscQueueTest, ZeroCopyTest) {
+  for (int i = 0; i < kQueueCapacity * 3; ++i) {
+    int *space = queue_->Reserve();
+    ASSERT_NE(nullptr, space);
+    *space = i;
+    queue_->Commit();
+
+    const int *item = queue_->ReadView();
+    ASSERT_NE(nullptr, item);
+    EXPECT_EQ(i, *item);
+    queue_->Release();
+  }
+  EXPECT_EQ(nullptr, queue_->ReadView());
+
+  // Reserving without committing shouldn't do anything.
+  ASSERT_NE(nullptr, queue_->Reserve());
+  EXPECT_EQ(nullptr, queue_->ReadView());
+}
+
+// Test that it works with the producer and consumer in different threads.
+TEST_F(SpscQueueTest, SpscTest) {
+  ::std::thread producer(ProducerThread, queue_->GetOffset());
+
+  int on_queue;
+  for (int i = 0; i < kNumItems; ++i) {
+    while (!queue_->DequeueNext(&on_queue)) {
+      ::std::this_thread::yield();
+    }
+    ASSERT_EQ(i, on_queue);
+  }
+  EXPECT_FALSE(queue_->DequeueNext(&on_queue));
+
+  producer.join();
+}
+
+// Same as above, but with batches.
+TEST_F(SpscQueueTest, BatchSpscTest) {
+  ::std::thread producer(BatchProducerThread, queue_->GetOffset());
+
+  int on_queue[5];
+  for (int i = 0; i < kNumItems;) {
+    const uint32_t num_read = queue_->DequeueBatch(on_queue, 5);
+    if (!num_read) {
+      ::std::this_thread::yield();
+    }
+    for (uint32_t j = 0; j < num_read; ++j) {
+      ASSERT_EQ(i++, on_queue[j]);
+    }
+  }
+
+  producer.join();
+}
+
+}  // namespace testing
+}  // namespace tachyon
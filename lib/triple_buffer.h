@@ -0,0 +1,171 @@
+#ifndef TACHYON_LIB_TRIPLE_BUFFER_H_
+#define TACHYON_LIB_TRIPLE_BUFFER_H_
+
+#include <assert.h>
+#include <stdint.h>
+
+#include <memory>
+
+#include "atomics.h"
+#include "constants.h"
+#include "pool.h"
+#include "shared_hashmap.h"
+
+namespace tachyon {
+
+// A channel in shared memory for big snapshots of state, like occupancy grids,
+// where readers only care about the newest one, and copying it is expensive.
+// Like SharedRegister, readers always get the latest complete value, but they
+// read it in place, and they never have to retry because the writer changed it
+// while they were reading.
+//
+// It works by keeping several copies of the value. One of them is the "front"
+// buffer, which is the newest complete value. Readers pin the front buffer
+// while they read it, and the writer always writes into a buffer that is
+// neither the front buffer nor pinned, and then makes it the new front buffer
+// with a single atomic store. Nothing is ever copied between buffers.
+//
+// With the default of three buffers, the writer is guaranteed to have a free
+// buffer as long as there is only one reader. In general, if up to n readers
+// can be reading at the same time, n + 2 buffers are needed for that guarantee.
+// There can only be one writer.
+template <class T>
+class TripleBuffer {
+ public:
+  // Creates a brand-new buffer, which doesn't have a value yet.
+  // Args:
+  //  num_buffers: The number of copies of the value to keep. Must be at least
+  //               2.
+  // Returns:
+  //  The buffer it created, or nullptr if creation failed.
+  static ::std::unique_ptr<TripleBuffer<T>> Create(uint32_t num_buffers = 3);
+  // Loads an existing buffer from SHM.
+  // Args:
+  //  offset: The SHM offset of the buffer.
+  // Returns:
+  //  The buffer it loaded.
+  static ::std::unique_ptr<TripleBuffer<T>> Load(uintptr_t offset);
+  // Fetches a buffer with the given name. If the buffer does not exist, it
+  // creates it, with the default number of buffers. Otherwise, it fetches a new
+  // handle to the existing buffer. Buffers share the same namespace as queues.
+  // Args:
+  //  name: The name of the buffer to fetch.
+  // Returns:
+  //  The fetched buffer.
+  static ::std::unique_ptr<TripleBuffer<T>> FetchBuffer(const char *name);
+
+  ~TripleBuffer();
+
+  // Gets a buffer to write a new value into. Nothing is visible to readers
+  // until Publish() is called, and it is fine to never call it if the writer
+  // changes its mind.
+  // Returns:
+  //  A pointer to the buffer, or nullptr if every buffer is being read.
+  T *BeginWrite();
+  // Makes the value that was written into the buffer from BeginWrite() the
+  // newest one.
+  // IMPORTANT: The user MUST have successfully gotten a buffer with
+  // BeginWrite(), otherwise the behavior of this method is undefined.
+  void Publish();
+  // Writes and publishes a new value in one go.
+  // Args:
+  //  value: The new value.
+  // Returns:
+  //  True if it succeeded, false if every buffer is being read.
+  bool Write(const T &value);
+
+  // Gets the newest value, without copying it. It stays valid, and the writer
+  // won't change it, until EndRead() is called.
+  // Returns:
+  //  A pointer to the value, or nullptr if nothing has been published yet.
+  const T *BeginRead();
+  // Lets the writer use the buffer returned by BeginRead() again.
+  // IMPORTANT: The user MUST have gotten a value with BeginRead(), otherwise
+  // the behavior of this method is undefined.
+  void EndRead();
+  // Copies out the newest value.
+  // Args:
+  //  value: A place to copy the value.
+  // Returns:
+  //  True if it got the value, false if nothing has been published yet.
+  bool Read(T *value);
+
+  // Gets the offset of the shared part of the buffer in the shared memory pool.
+  // Returns:
+  //  The offset.
+  int GetOffset() const;
+
+  // Frees the underlying shared memory that the buffer uses. Only call it when
+  // you're sure that this buffer will no longer be used.
+  void FreeBuffer();
+
+ private:
+  // The default constructor is private to force users to use the static
+  // creation methods.
+  TripleBuffer();
+
+  // Keeps track of how many readers are using one of the buffers.
+  struct Slot {
+    // The number of readers. Each one is on its own cache line, so that readers
+    // of one buffer don't slow down readers of another.
+    volatile uint32_t num_readers __attribute__((aligned(kCacheLineSize)));
+  };
+
+  // This is the underlying structure that will be located in shared memory.
+  struct RawBuffer {
+    // Offset of the buffers in the SHM segment.
+    uintptr_t buffers_offset;
+    // Offset of the slots for the buffers in the SHM segment.
+    uintptr_t slots_offset;
+    // The number of buffers.
+    uint32_t num_buffers;
+
+    // One more than the index of the front buffer, or 0 if nothing has been
+    // published yet. Only the writer writes this.
+    volatile uint32_t front __attribute__((aligned(kCacheLineSize)));
+  };
+
+  // A value of reading_ that means that we're not reading anything.
+  static constexpr uint32_t kNotReading = UINT32_MAX;
+
+  // A hashmap that's in charge of mapping names to offsets. This is the same
+  // map that the queues use.
+  static SharedHashmap<const char *, int> queue_names_;
+
+  // Creates a new buffer.
+  // Args:
+  //  num_buffers: The number of copies of the value to keep.
+  // Returns:
+  //  True if creating the buffer succeeded, false otherwise.
+  bool DoCreate(uint32_t num_buffers);
+  // Loads an existing buffer.
+  // Args:
+  //  offset: The offset of the shared portion of the buffer in SHM.
+  void DoLoad(uintptr_t offset);
+  // Encapsulates initialization that is common to both creation and loading.
+  void InitCommon();
+
+  // The buffers, in our address space.
+  T *buffers_;
+  // The slots for the buffers, in our address space.
+  volatile Slot *slots_;
+  // The index of the buffer that BeginWrite() returned.
+  uint32_t writing_ = 0;
+  // The index of the buffer that BeginRead() returned, or kNotReading.
+  uint32_t reading_ = kNotReading;
+
+  RawBuffer *buffer_;
+  // This is the shared memory pool that we will use to construct buffers.
+  Pool *pool_;
+};
+
+// Initialize the queue_names_ member.
+template <class T>
+SharedHashmap<const char *, int> TripleBuffer<T>::queue_names_(kNameMapOffset,
+                                                               kNameMapSize);
+
+#include "triple_buffer_impl.h"
+
+}  // namespace tachyon
+
+#endif  // TACHYON_LIB_TRIPLE_BUFFER_H_
@@ -0,0 +1,221 @@
+// NOTE: This file is not meant to be #included directly. Use triple_buffer.h
+// instead.
+
+template <class T>
+::std::unique_ptr<TripleBuffer<T>> TripleBuffer<T>::Create(
+    uint32_t num_buffers) {
+  // Create a new buffer object.
+  TripleBuffer<T> *raw_buffer = new TripleBuffer<T>();
+  auto buffer = ::std::unique_ptr<TripleBuffer<T>>(raw_buffer);
+
+  if (!buffer->DoCreate(num_buffers)) {
+    // Creation failed.
+    buffer.reset();
+  }
+
+  return buffer;
+}
+
+template <class T>
+::std::unique_ptr<TripleBuffer<T>> TripleBuffer<T>::Load(uintptr_t offset) {
+  // Create a new buffer object.
+  TripleBuffer<T> *raw_buffer = new TripleBuffer<T>();
+  auto buffer = ::std::unique_ptr<TripleBuffer<T>>(raw_buffer);
+
+  buffer->DoLoad(offset);
+
+  return buffer;
+}
+
+template <class T>
+::std::unique_ptr<TripleBuffer<T>> TripleBuffer<T>::FetchBuffer(
+    const char *name) {
+  // First, see if a buffer exists.
+  int offset;
+  if (queue_names_.Fetch(name, &offset)) {
+    // We have a buffer, so just make a new handle to it.
+    return Load(offset);
+  }
+
+  // Create a new buffer.
+  auto buffer = Create();
+  // Save the offset.
+  queue_names_.AddOrSet(name, buffer->GetOffset());
+
+  return buffer;
+}
+
+template <class T>
+TripleBuffer<T>::TripleBuffer() : pool_(Pool::GetPool()) {}
+
+template <class T>
+TripleBuffer<T>::~TripleBuffer() {
+  if (reading_ != kNotReading) {
+    // Don't leave the buffer pinned forever.
+    EndRead();
+  }
+}
+
+template <class T>
+bool TripleBuffer<T>::DoCreate(uint32_t num_buffers) {
+  assert(num_buffers >= 2 && "Need at least two buffers.");
+  if (num_buffers < 2) {
+    return false;
+  }
+
+  // Allocate the shared memory we need.
+  buffer_ = pool_->AllocateForType<RawBuffer>();
+  assert(buffer_ != nullptr && "Out of shared memory?");
+  if (!buffer_) {
+    return false;
+  }
+
+  T *buffers = pool_->AllocateForArray<T>(num_buffers);
+  assert(buffers != nullptr && "Out of shared memory?");
+  if (!buffers) {
+    pool_->FreeType<RawBuffer>(buffer_);
+    return false;
+  }
+  Slot *slots = pool_->AllocateForArray<Slot>(num_buffers);
+  assert(slots != nullptr && "Out of shared memory?");
+  if (!slots) {
+    pool_->FreeArray<T>(buffers, num_buffers);
+    pool_->FreeType<RawBuffer>(buffer_);
+    return false;
+  }
+  for (uint32_t i = 0; i < num_buffers; ++i) {
+    slots[i].num_readers = 0;
+  }
+
+  buffer_->buffers_offset = pool_->GetOffset(buffers);
+  buffer_->slots_offset = pool_->GetOffset(slots);
+  buffer_->num_buffers = num_buffers;
+  buffer_->front = 0;
+
+  InitCommon();
+
+  return true;
+}
+
+template <class T>
+void TripleBuffer<T>::DoLoad(uintptr_t offset) {
+  // Initialize buffer with an existing one.
+  buffer_ = pool_->AtOffset<RawBuffer>(offset);
+
+  InitCommon();
+}
+
+template <class T>
+void TripleBuffer<T>::InitCommon() {
+  // Find the buffers in our address space.
+  buffers_ = pool_->AtOffset<T>(buffer_->buffers_offset);
+  slots_ = pool_->AtOffset<Slot>(buffer_->slots_offset);
+}
+
+template <class T>
+T *TripleBuffer<T>::BeginWrite() {
+  // We're the only writer, so the front buffer can't change under us.
+  const uint32_t front =
+      AtomicLoad(&(buffer_->front), ::std::memory_order_relaxed);
+
+  for (uint32_t i = 0; i < buffer_->num_buffers; ++i) {
+    if (i + 1 == front) {
+      continue;
+    }
+    // This has to be sequentially consistent with the store in Publish() and
+    // the increment in BeginRead(), so that either a reader sees that the
+    // buffer isn't the front one anymore, or we see the reader. (It also makes
+    // sure that the reader is done before we write over anything.)
+    if (!AtomicLoad(&(slots_[i].num_readers))) {
+      writing_ = i;
+      return buffers_ + i;
+    }
+  }
+
+  // Everything is being read.
+  return nullptr;
+}
+
+template <class T>
+void TripleBuffer<T>::Publish() {
+  // This makes the whole value visible to readers by the time they see the new
+  // front buffer.
+  AtomicStore(&(buffer_->front), writing_ + 1);
+}
+
+template <class T>
+bool TripleBuffer<T>::Write(const T &value) {
+  T *space = BeginWrite();
+  if (!space) {
+    return false;
+  }
+
+  *space = value;
+  Publish();
+
+  return true;
+}
+
+template <class T>
+const T *TripleBuffer<T>::BeginRead() {
+  assert(reading_ == kNotReading && "Already reading something.");
+
+  while (true) {
+    const uint32_t front = AtomicLoad(&(buffer_->front));
+    if (!front) {
+      // Nothing has been published yet.
+      return nullptr;
+    }
+
+    // Pin the buffer. If it is still the front one after that, the writer can't
+    // start writing to it until we unpin it. Otherwise, the writer might
+    // already be writing to it, so we try again.
+    Increment(&(slots_[front - 1].num_readers));
+    if (AtomicLoad(&(buffer_->front)) == front) {
+      reading_ = front - 1;
+      return buffers_ + reading_;
+    }
+    Decrement(&(slots_[front - 1].num_readers), ::std::memory_order_relaxed);
+  }
+}
+
+template <class T>
+void TripleBuffer<T>::EndRead() {
+  assert(reading_ != kNotReading && "Not reading anything.");
+
+  // The release makes sure that we're done reading before the writer can reuse
+  // the buffer.
+  Decrement(&(slots_[reading_].num_readers), ::std::memory_order_release);
+  reading_ = kNotReading;
+}
+
+template <class T>
+bool TripleBuffer<T>::Read(T *value) {
+  const T *front = BeginRead();
+  if (!front) {
+    return false;
+  }
+
+  *value = *front;
+  EndRead();
+
+  return true;
+}
+
+template <class T>
+int TripleBuffer<T>::GetOffset() const {
+  return pool_->GetOffset(buffer_);
+}
+
+template <class T>
+void TripleBuffer<T>::FreeBuffer() {
+  pool_->FreeArray<T>(buffers_, buffer_->num_buffers);
+  // We just do pointer arithmetic with the freed blocks, so it's okay to cast
+  // away the volatile.
+  pool_->FreeArray<Slot>(const_cast<Slot *>(slots_), buffer_->num_buffers);
+  // Now free the rest of the buffer data.
+  pool_->FreeType<RawBuffer>(buffer_);
+
+  // There's nothing left for the destructor to unpin.
+  reading_ = kNotReading;
+}
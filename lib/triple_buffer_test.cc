@@ -0,0 +1,218 @@
+#include <stdint.h>
+
+#include <thread>
+
+#include <gtest/gtest.h>
+
+#include "pool.h"
+#include "triple_buffer.h"
+
+namespace tachyon {
+namespace testing {
+namespace {
+
+// How many values the threaded test writes.
+constexpr int kNumWrites = 20000;
+
+// A stand-in for a big snapshot.
+struct Snapshot {
+  // Every word is always set to the same thing.
+  int words[64];
+};
+
+// Writes an increasing sequence of snapshots to a buffer.
+// Args:
+//  offset: The SHM offset of the buffer to use.
+// Returns:
+//  True if it always had a free buffer to write to.
+bool WriterThread(int offset) {
+  auto buffer = TripleBuffer<Snapshot>::Load(offset);
+
+  for (int i = 1; i <= kNumWrites; ++i) {
+    Snapshot *snapshot = buffer->BeginWrite();
+    if (!snapshot) {
+      return false;
+    }
+    for (int &word : snapshot->words) {
+      word = i;
+    }
+    buffer->Publish();
+  }
+
+  return true;
+}
+
+// Reads snapshots in place until it sees the last one that WriterThread()
+// writes.
+// Args:
+//  offset: The SHM offset of the buffer to use.
+// Returns:
+//  True if every snapshot that it read was complete, didn't change while it
+//  was reading it, and the snapshots never went backwards.
+bool ReaderThread(int offset) {
+  auto buffer = TripleBuffer<Snapshot>::Load(offset);
+
+  int last = 0;
+  while (last != kNumWrites) {
+    const Snapshot *snapshot = buffer->BeginRead();
+    if (!snapshot) {
+      ::std::this_thread::yield();
+      continue;
+    }
+
+    const int first = snapshot->words[0];
+    // Give the writer a chance to write over it, if it's going to.
+    ::std::this_thread::yield();
+    for (int word : snapshot->words) {
+      if (word != first) {
+        return false;
+      }
+    }
+    buffer->EndRead();
+
+    if (first < last) {
+      return false;
+    }
+    last = first;
+  }
+
+  return true;
+}
+
+}  // namespace
+
+// Tests for the triple buffer.
+class TripleBufferTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    buffer_ = TripleBuffer<int>::Create();
+    ASSERT_NE(nullptr, buffer_);
+  }
+
+  virtual void TearDown() {
+    // Free buffer SHM.
+    buffer_->FreeBuffer();
+  }
+
+  static void TearDownTestCase() {
+    // Unlink SHM.
+    ASSERT_TRUE(Pool::Unlink());
+  }
+
+  // The buffer we are testing with.
+  ::std::unique_ptr<TripleBuffer<int>> buffer_;
+};
+
+// Test that we can write and read values.
+TEST_F(TripleBufferTest, ReadWriteTest) {
+  // There's nothing to read at first.
+  int value;
+  EXPECT_FALSE(buffer_->Read(&value));
+  EXPECT_EQ(nullptr, buffer_->BeginRead());
+
+  for (int i = 0; i < 10; ++i) {
+    ASSERT_TRUE(buffer_->Write(i));
+    ASSERT_TRUE(buffer_->Read(&value));
+    EXPECT_EQ(i, value);
+  }
+
+  // Nothing should be visible until it's published.
+  int *space = buffer_->BeginWrite();
+  ASSERT_NE(nullptr, space);
+  *space = 42;
+  ASSERT_TRUE(buffer_->Read(&value));
+  EXPECT_EQ(9, value);
+  buffer_->Publish();
+  ASSERT_TRUE(buffer_->Read(&value));
+  EXPECT_EQ(42, value);
+}
+
+// Test that the writer never touches a buffer that is being read.
+TEST_F(TripleBufferTest, InPlaceTest) {
+  auto reader1 = TripleBuffer<int>::Load(buffer_->GetOffset());
+  auto reader2 = TripleBuffer<int>::Load(buffer_->GetOffset());
+
+  ASSERT_TRUE(buffer_->Write(1));
+  const int *value1 = reader1->BeginRead();
+  ASSERT_NE(nullptr, value1);
+  EXPECT_EQ(1, *value1);
+
+  // With one reader, the writer should always have somewhere to write.
+  for (int i = 2; i < 10; ++i) {
+    ASSERT_TRUE(buffer_->Write(i));
+  }
+  EXPECT_EQ(1, *value1);
+
+  // A second reader pins the newest one, and then there's nowhere left.
+  const int *value2 = reader2->BeginRead();
+  ASSERT_NE(nullptr, value2);
+  EXPECT_EQ(9, *value2);
+  ASSERT_TRUE(buffer_->Write(10));
+  EXPECT_EQ(nullptr, buffer_->BeginWrite());
+  EXPECT_FALSE(buffer_->Write(11));
+  EXPECT_EQ(1, *value1);
+  EXPECT_EQ(9, *value2);
+
+  // Once they're done, it should work again.
+  reader1->EndRead();
+  ASSERT_TRUE(buffer_->Write(11));
+  reader2->EndRead();
+  int value;
+  ASSERT_TRUE(reader1->Read(&value));
+  EXPECT_EQ(11, value);
+}
+
+// Test that destroying a reader unpins its buffer.
+TEST_F(TripleBufferTest, DestructorTest) {
+  auto reader1 = TripleBuffer<int>::Load(buffer_->GetOffset());
+  auto reader2 = TripleBuffer<int>::Load(buffer_->GetOffset());
+
+  ASSERT_TRUE(buffer_->Write(1));
+  ASSERT_NE(nullptr, reader1->BeginRead());
+  ASSERT_TRUE(buffer_->Write(2));
+  ASSERT_NE(nullptr, reader2->BeginRead());
+  ASSERT_TRUE(buffer_->Write(3));
+  EXPECT_FALSE(buffer_->Write(4));
+
+  reader1.reset();
+  EXPECT_TRUE(buffer_->Write(4));
+}
+
+// Test that fetching buffers by name works.
+TEST_F(TripleBufferTest, FetchBufferTest) {
+  auto buffer1 = TripleBuffer<int>::FetchBuffer("test_buffer");
+  auto buffer2 = TripleBuffer<int>::FetchBuffer("test_buffer");
+  EXPECT_EQ(buffer1->GetOffset(), buffer2->GetOffset());
+
+  ASSERT_TRUE(buffer1->Write(42));
+  int value;
+  ASSERT_TRUE(buffer2->Read(&value));
+  EXPECT_EQ(42, value);
+
+  buffer1->FreeBuffer();
+}
+
+// Test that readers never see a snapshot change under them.
+TEST_F(TripleBufferTest, ThreadTest) {
+  // Two readers need four buffers for the writer to never get stuck.
+  auto buffer = TripleBuffer<Snapshot>::Create(4);
+  ASSERT_NE(nullptr, buffer);
+  const int offset = buffer->GetOffset();
+
+  bool writer_ok, reader_ok[2];
+  ::std::thread writer([&]() { writer_ok = WriterThread(offset); });
+  ::std::thread reader1([&]() { reader_ok[0] = ReaderThread(offset); });
+  ::std::thread reader2([&]() { reader_ok[1] = ReaderThread(offset); });
+
+  writer.join();
+  reader1.join();
+  reader2.join();
+  EXPECT_TRUE(writer_ok);
+  EXPECT_TRUE(reader_ok[0]);
+  EXPECT_TRUE(reader_ok[1]);
+
+  buffer->FreeBuffer();
+}
+
+}  // namespace testing
+}  // namespace tachyon
@@ -16,12 +16,18 @@ class MockQueue : public QueueInterface<T> {
  public:
   MOCK_METHOD1_T(Enqueue, bool(const T &item));
   MOCK_METHOD1_T(EnqueueBlocking, bool(const T &item));
+  MOCK_METHOD2_T(EnqueueBatch, uint32_t(const T *items, uint32_t num_items));
+  MOCK_METHOD0_T(Reserve, T *());
+  MOCK_METHOD0_T(Commit, void());
 
   MOCK_METHOD1_T(DequeueNext, bool(T *item));
   MOCK_METHOD1_T(DequeueNextBlocking, void(T *item));
+  MOCK_METHOD2_T(DequeueBatch, uint32_t(T *items, uint32_t max_items));
 
   MOCK_METHOD1_T(PeekNext, bool(T *item));
   MOCK_METHOD1_T(PeekNextBlocking, void(T *item));
+  MOCK_METHOD0_T(ReadView, const T *());
+  MOCK_METHOD0_T(Release, void());
 
   MOCK_CONST_METHOD0_T(GetOffset, int());
   MOCK_METHOD0_T(FreeQueue, void());